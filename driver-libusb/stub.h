@@ -8,6 +8,7 @@
 
 #include "usbip_config.h"
 
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <time.h>
@@ -16,6 +17,9 @@
 #endif
 #include <libusb.h>
 #include "usbip_host_driver.h"
+#include "usbip_sockopt.h"
+#include "usbip_capture.h"
+#include "usbip_prefetch.h"
 #include "stub_common.h"
 #include "list.h"
 
@@ -25,10 +29,46 @@ struct stub_interface {
 	uint8_t claimed;
 };
 
+/* see stub_compress.c */
+struct stub_compress_stat {
+	unsigned int ratio;	/* moving average of compressed/raw * 256 */
+	unsigned int skip;	/* payloads left to send as is */
+	unsigned int backoff;
+};
+
+/* spinning for work before parking, see stub_wait.c */
+struct stub_waiter {
+	unsigned int max_us;	/* of the spin window, 0 parks at once */
+	unsigned int gap_us;	/* moving average between pieces of work */
+	uint64_t last;		/* us, of the last work found */
+	atomic_int parked;	/* tx, in libusb */
+};
+
+#define STUB_WAIT_PARK_US	100000	/* at most, for the heartbeat */
+#define STUB_WAIT_HELD_US	100	/* for shaping to let results go */
+
+/*
+ * Completed transfers wait to be sent in one queue per kind, served in
+ * this order, so that a small control or interrupt result does not wait
+ * behind megabytes of bulk data. Each endpoint has a single kind, so its
+ * results still leave in order.
+ */
+enum stub_txq {
+	STUB_TXQ_CONTROL,	/* and interrupt */
+	STUB_TXQ_ISO,
+	STUB_TXQ_BULK,
+	STUB_TXQ_NUM
+};
+
 struct stub_endpoint {
 	uint8_t nr;
 	uint8_t dir; /* LIBUSB_ENDPOINT_IN || LIBUSB_ENDPOINT_OUT */
 	uint8_t type; /* LIBUSB_TRANSFER_TYPE_ */
+	uint32_t max_streams; /* of a SuperSpeed bulk endpoint, else 0 */
+	uint16_t max_packet;
+	uint8_t ifclass; /* of its interface */
+	uint8_t ifnum; /* its interface */
+	struct stub_compress_stat zs;
 };
 
 struct stub_device {
@@ -37,8 +77,10 @@ struct stub_device {
 	struct usbip_usb_device udev;
 	struct usbip_device ud;
 	uint32_t devid;
+	uint32_t caps;		/* granted protocol extensions, USBIP_CAP_* */
 	int num_eps;
 	struct stub_endpoint *eps;
+	uint32_t num_streams;	/* allocated on every stream endpoint */
 
 	pthread_t tx, rx;
 
@@ -48,23 +90,51 @@ struct stub_device {
 	 *
 	 * stub_priv is always linked to any one of 3 lists;
 	 *	priv_init: linked to this until the comletion of a urb.
-	 *	priv_tx  : linked to this after the completion of a urb.
+	 *	priv_tx  : linked to one of these after the completion of a
+	 *		   urb, by its stub_txq.
 	 *	priv_free: linked to this after the sending of the result.
 	 *
 	 * Any of these list operations should be locked by priv_lock.
 	 */
 	pthread_mutex_t priv_lock;
 	struct list_head priv_init;
-	struct list_head priv_tx;
+	struct list_head priv_tx[STUB_TXQ_NUM];
 	struct list_head priv_free;
 
 	/* see comments for unlinking in stub_rx.c */
 	struct list_head unlink_tx;
 	struct list_head unlink_free;
 
-	pthread_mutex_t tx_waitq;
+	/* how tx waits for completions and rx for requests */
+	struct stub_waiter tx_wait;
+	struct stub_waiter rx_wait;
 	int should_stop;
 
+	/* answers to standard ep0 requests, see stub_desc.c */
+	struct stub_desc_cache *desc_cache;
+
+	/*
+	 * With USBIP_CAP_MUX, the first device of a connection keeps the
+	 * others imported onto it in mux_devs and the USBIP_RET_IMPORTs
+	 * still to send in mux_replies, both under mux_lock. The others are
+	 * linked by mux_node and own the device list they came from.
+	 */
+	pthread_mutex_t mux_lock;
+	struct list_head mux_devs;
+	struct list_head mux_replies;
+	int mux_num;
+	struct list_head mux_node;
+	struct usbip_exported_devices *mux_edevs;
+
+	/* limit and share of what it sends, see stub_shape.c */
+	struct stub_shape *shape;
+
+	/* usbmon events of its transfers, see stub_capture.c */
+	struct usbip_capture *capture;
+
+	/* IN endpoints read ahead of the client, see stub_prefetch.c */
+	struct stub_prefetch *prefetch;
+
 	struct stub_interface ifs[];
 };
 
@@ -74,15 +144,28 @@ struct stub_priv {
 	struct list_head list;
 	struct stub_device *sdev;
 	struct libusb_transfer *trx;
+	unsigned char *zbuf;	/* compressed IN payload */
 
 	uint8_t dir;
 	uint8_t unlinking;
+	uint8_t submitted;	/* at the device, until stub_complete() */
+	uint8_t waiting;	/* for a prefetch, see stub_prefetch.c */
 };
 
 struct stub_unlink {
 	unsigned long seqnum;
 	struct list_head list;
 	enum libusb_transfer_status status;
+	uint32_t after;		/* seqnum whose RET_SUBMIT goes first, or 0 */
+};
+
+/* devices on one connection, the first included */
+#define STUB_MUX_MAX	32
+
+struct stub_mux_reply {
+	struct list_head list;
+	struct usbip_header hdr;
+	struct usbip_usb_device udev;	/* sent with ST_OK only */
 };
 
 struct stub_edev_data {
@@ -92,13 +175,69 @@ struct stub_edev_data {
 	struct stub_endpoint eps[];
 };
 
+/* stub_capture.c */
+void stub_capture_attach(struct stub_device *sdev);
+void stub_capture_detach(struct stub_device *sdev);
+void stub_capture_submit(struct stub_device *sdev,
+			 struct libusb_transfer *trx, struct usbip_header *pdu);
+void stub_capture_complete(struct stub_device *sdev,
+			   struct libusb_transfer *trx);
+
+/* stub_compress.c */
+int stub_compress_framed(struct stub_device *sdev, uint8_t type, int len);
+int stub_compress_payload(struct stub_device *sdev, struct stub_priv *priv,
+			  const unsigned char *buf, int len);
+int stub_decompress_recv(struct stub_device *sdev,
+			 struct libusb_transfer *trx, int offset);
+
+/* stub_desc.c */
+int stub_desc_cache_fill(struct stub_device *sdev);
+void stub_desc_cache_free(struct stub_desc_cache *cache);
+int stub_desc_cache_lookup(struct stub_device *sdev,
+			   struct libusb_control_setup *setup,
+			   unsigned char *buf, int size);
+void stub_desc_cache_invalidate(struct stub_device *sdev,
+				struct libusb_control_setup *setup);
+
+/* stub_prefetch.c */
+void stub_prefetch_attach(struct stub_device *sdev);
+void stub_prefetch_detach(struct stub_device *sdev);
+int stub_prefetch_submit(struct stub_device *sdev, struct stub_priv *priv);
+int stub_prefetch_cancel(struct stub_device *sdev);
+void stub_prefetch_reset(struct stub_device *sdev, int ifnum);
+int stub_prefetch_pending(struct stub_device *sdev);
+int stub_prefetch_orphan(struct stub_device *sdev);
+
 /* stub_rx.c */
+struct stub_priv *stub_priv_alloc(struct stub_device *sdev,
+				  struct usbip_header *pdu);
+struct stub_priv *stub_priv_lookup(struct stub_device *sdev, uint32_t seqnum);
 void *stub_rx_loop(void *data);
 
+/* stub_shape.c */
+void stub_shape_attach(struct stub_device *sdev, enum usbip_traffic_class tc);
+void stub_shape_detach(struct stub_device *sdev);
+int stub_shape_admit(struct stub_device *sdev, size_t len);
+
+/* stub_wait.c */
+void stub_wait_attach(struct stub_device *sdev, enum usbip_traffic_class tc);
+unsigned int stub_wait_window(struct stub_waiter *w, uint64_t now,
+			      unsigned int *doze);
+void stub_wait_found(struct stub_waiter *w, uint64_t now, uint64_t spun);
+void stub_wait_parking(uint64_t now, uint64_t spun);
+void stub_wait_relax(void);
+void stub_wake_tx(struct stub_device *sdev);
+
 /* stub_tx.c */
 void stub_enqueue_ret_unlink(struct stub_device *sdev, uint32_t seqnum,
-			     enum libusb_transfer_status status);
+			     enum libusb_transfer_status status,
+			     uint32_t after);
 void LIBUSB_CALL stub_complete(struct libusb_transfer *trx);
+void stub_queue_priv_tx(struct stub_device *sdev, struct stub_priv *priv);
+struct stub_priv *stub_dequeue_priv_tx(struct stub_device *sdev);
+void stub_free_priv_and_trx(struct stub_priv *priv);
+void stub_enqueue_ret_import(struct stub_device *lead, uint32_t seqnum,
+			     uint32_t status, struct stub_device *sdev);
 void *stub_tx_loop(void *data);
 
 /* for libusb */
@@ -107,8 +246,17 @@ uint8_t stub_get_transfer_type(struct stub_device *sdev, uint8_t ep);
 uint8_t stub_endpoint_dir(struct stub_device *sdev, uint8_t ep);
 int stub_endpoint_dir_out(struct stub_device *sdev, uint8_t ep);
 uint8_t stub_get_transfer_flags(uint32_t in);
+int stub_streams_alloc(struct stub_device *sdev);
+void stub_streams_free(struct stub_device *sdev);
+int stub_stream_valid(struct stub_device *sdev, uint8_t ep,
+		      uint32_t stream_id);
+
+/* usbip_host_driver.c */
+void stub_mux_import(struct stub_device *lead, struct usbip_header *pdu);
+struct stub_device *stub_mux_lookup(struct stub_device *lead, uint32_t devid);
 
 /* from stub_main.c */
+int stub_device_cancel_transfers(struct stub_device *sdev);
 void stub_device_cleanup_transfers(struct stub_device *sdev);
 void stub_device_cleanup_unlinks(struct stub_device *sdev);
 
@@ -0,0 +1,116 @@
+/*
+ * usbmon events of an exported device, see src/usbip_capture.c
+ *
+ * A transfer is recorded as an S event once its CMD_SUBMIT and OUT data
+ * are in, before it goes to the device, and as a C event when it
+ * completes, at the device or answered locally. An unlinked transfer
+ * completes with -ECONNRESET, as in usbmon. The transfer is the id that
+ * pairs both.
+ */
+
+#include <errno.h>
+
+#include "stub.h"
+#include <usbip_debug.h>
+
+static const uint8_t stub_capture_xfer_type[] = {
+	[LIBUSB_TRANSFER_TYPE_CONTROL]		= 2,
+	[LIBUSB_TRANSFER_TYPE_ISOCHRONOUS]	= 0,
+	[LIBUSB_TRANSFER_TYPE_BULK]		= 3,
+	[LIBUSB_TRANSFER_TYPE_INTERRUPT]	= 1,
+	[LIBUSB_TRANSFER_TYPE_BULK_STREAM]	= 3,
+};
+
+void stub_capture_attach(struct stub_device *sdev)
+{
+	sdev->capture = usbip_capture_open(sdev->udev.busid);
+}
+
+void stub_capture_detach(struct stub_device *sdev)
+{
+	usbip_capture_close(sdev->capture);
+	sdev->capture = NULL;
+}
+
+static void stub_capture(struct stub_device *sdev,
+			 struct libusb_transfer *trx, uint8_t type,
+			 struct usbip_header *pdu)
+{
+	struct usbip_usbmon_packet pkt;
+	struct usbip_usbmon_iso iso[trx->num_iso_packets + 1];
+	int in = trx->endpoint & USB_DIR_IN;
+	int offset = 0, len = 0, i;
+	uint32_t iso_off = 0;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.id = (uintptr_t)trx;
+	pkt.type = type;
+	pkt.xfer_type = trx->type < sizeof(stub_capture_xfer_type) ?
+		stub_capture_xfer_type[trx->type] : 3;
+	pkt.epnum = trx->endpoint;
+	pkt.devnum = sdev->udev.devnum;
+	pkt.busnum = sdev->udev.busnum;
+	pkt.flag_setup = '-';
+
+	if (trx->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		offset = 8;
+		if (type == 'S') {
+			memcpy(pkt.s.setup, trx->buffer, 8);
+			pkt.flag_setup = 0;
+		}
+	}
+
+	for (i = 0; i < trx->num_iso_packets; i++) {
+		iso[i].status = type == 'S' ? 0 :
+			trxstat2error(trx->iso_packet_desc[i].status);
+		iso[i].offset = iso_off;
+		iso[i].length = type == 'S' ? trx->iso_packet_desc[i].length :
+			trx->iso_packet_desc[i].actual_length;
+		iso[i].pad = 0;
+		iso_off += trx->iso_packet_desc[i].length;
+	}
+
+	if (type == 'S') {
+		pkt.status = -EINPROGRESS;
+		pkt.length = trx->length - offset;
+		pkt.interval = pdu->u.cmd_submit.interval;
+		pkt.start_frame = pdu->u.cmd_submit.start_frame;
+		pkt.xfer_flags = pdu->u.cmd_submit.transfer_flags;
+		if (!in)
+			len = pkt.length;
+	} else {
+		pkt.status = trxstat2error(trx->status);
+		pkt.length = trx->num_iso_packets ? iso_off :
+			(uint32_t)trx->actual_length;
+		if (in)
+			len = pkt.length;
+	}
+	if (trx->num_iso_packets) {
+		pkt.s.iso.error_count = 0;
+		pkt.s.iso.numdesc = trx->num_iso_packets;
+	}
+
+	if (len)
+		pkt.flag_data = 0;
+	else if (pkt.length == 0)
+		pkt.flag_data = '=';
+	else
+		pkt.flag_data = type == 'S' ? '<' : '>';
+
+	usbip_capture_record(sdev->capture, &pkt, iso, trx->num_iso_packets,
+			     trx->buffer + offset, len);
+}
+
+void stub_capture_submit(struct stub_device *sdev,
+			 struct libusb_transfer *trx, struct usbip_header *pdu)
+{
+	if (sdev->capture)
+		stub_capture(sdev, trx, 'S', pdu);
+}
+
+void stub_capture_complete(struct stub_device *sdev,
+			   struct libusb_transfer *trx)
+{
+	if (sdev->capture)
+		stub_capture(sdev, trx, 'C', NULL);
+}
@@ -20,6 +20,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <string.h>
 
 #include "stub.h"
 
@@ -308,6 +309,14 @@ void usbip_dump_header(struct usbip_header *pdu)
 		dbg("USBIP_RET_UNLINK: status %d",
 			 pdu->u.ret_unlink.status);
 		break;
+	case USBIP_CMD_BATCH:
+	case USBIP_RET_BATCH:
+		dbg("%s: count %u length %u",
+			 pdu->base.command == USBIP_CMD_BATCH ?
+				"USBIP_CMD_BATCH" : "USBIP_RET_BATCH",
+			 pdu->u.batch.count,
+			 pdu->u.batch.length);
+		break;
 	case USBIP_NOP:
 		dbg("USBIP_NOP");
 		break;
@@ -320,6 +329,9 @@ void usbip_dump_header(struct usbip_header *pdu)
 
 /* Send data over TCP/IP. */
 int usbip_sendmsg(struct usbip_device *ud, struct iovec *vec, size_t num) {
+    struct msghdr msg;
+    ssize_t ret;
+
     if (usbip_dbg_flag_xmit) {
         size_t i;
         for (i = 0; i < num; i++) {
@@ -327,7 +339,42 @@ int usbip_sendmsg(struct usbip_device *ud, struct iovec *vec, size_t num) {
             usbip_dump_buffer(vec[i].iov_base, vec[i].iov_len);
         }
     }
-    return writev(ud->sock_fd, vec, num);
+
+    if (ud->shm)
+        ret = usbip_shm_writev(ud->shm, vec, num);
+    else {
+        /* a client gone mid-write must not take the daemon with it */
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = num;
+        ret = sendmsg(ud->sock_fd, &msg,
+                      MSG_NOSIGNAL | (ud->tx_more ? MSG_MORE : 0));
+    }
+    if (ret < 0 && errno == ETIMEDOUT)
+        usbip_dead_peer(ud, USBIP_M_dead_peer_keepalive);
+    ud->tx_time = usbip_now_us();
+    if (ud->lead)
+        ud->lead->tx_time = ud->tx_time;
+    return ret;
+}
+
+/* count a connection given up on, once */
+void usbip_dead_peer(struct usbip_device *ud, enum usbip_metric how)
+{
+	int first;
+
+	if (ud->lead)
+		ud = ud->lead;
+
+	pthread_mutex_lock(&ud->lock);
+	first = !ud->dead_peer;
+	ud->dead_peer = 1;
+	pthread_mutex_unlock(&ud->lock);
+
+	if (first) {
+		usbip_metric_add(USBIP_M_dead_peers, 1);
+		usbip_metric_add(how, 1);
+	}
 }
 
 /* Receive data over TCP/IP. */
@@ -348,12 +395,17 @@ int usbip_recv(struct usbip_device *ud, void *buf, int size) {
 
 	do {
 		usbip_dbg_xmit("receiving %d", size);
-        result = recv(ud->sock_fd, bp, size, 0);
+        if (ud->shm)
+            result = usbip_shm_read(ud->shm, bp, size);
+        else
+            result = recv(ud->sock_fd, bp, size, 0);
 
 		if (result < 0) {
 		    if (errno == EAGAIN ||  errno == EINTR) {
 		        result = 0; // Try more
 		    } else {
+                if (errno == ETIMEDOUT)
+                    usbip_dead_peer(ud, USBIP_M_dead_peer_keepalive);
                 err("receive error %d (errno %d)", result, errno);
                 goto out;
             }
@@ -367,6 +419,11 @@ int usbip_recv(struct usbip_device *ud, void *buf, int size) {
 		total += result;
 	} while (size > 0);
 
+	ud->rx_bytes += total;
+	ud->rx_time = usbip_now_us();
+	if (ud->lead)
+		ud->lead->rx_time = ud->rx_time;
+
 	if (usbip_dbg_flag_xmit) {
 		dbg("received, osize %d ret %d size %d total %d",
 			 osize, result, size, total);
@@ -379,7 +436,7 @@ out:
 	return result;
 }
 
-static int trxstat2error(enum libusb_transfer_status trxstat)
+int trxstat2error(enum libusb_transfer_status trxstat)
 {
 	switch (trxstat) {
 	case LIBUSB_TRANSFER_COMPLETED:
@@ -513,6 +570,33 @@ static void correct_endian_ret_unlink(struct usbip_header_ret_unlink *pdu,
 		pdu->status = ntohl(pdu->status);
 }
 
+static void correct_endian_batch(struct usbip_header_batch *pdu, int send)
+{
+	if (send) {
+		pdu->count = htonl(pdu->count);
+		pdu->length = htonl(pdu->length);
+	} else {
+		pdu->count = ntohl(pdu->count);
+		pdu->length = ntohl(pdu->length);
+	}
+}
+
+void usbip_batch_entry_correct_endian(struct usbip_batch_entry *ent,
+				      int send)
+{
+	if (send) {
+		ent->seqnum = htonl(ent->seqnum);
+		ent->stream_id = htons(ent->stream_id);
+		ent->length = (int32_t)htonl(ent->length);
+		ent->value = (int32_t)htonl(ent->value);
+	} else {
+		ent->seqnum = ntohl(ent->seqnum);
+		ent->stream_id = ntohs(ent->stream_id);
+		ent->length = (int32_t)ntohl(ent->length);
+		ent->value = (int32_t)ntohl(ent->value);
+	}
+}
+
 void usbip_header_correct_endian(struct usbip_header *pdu, int send)
 {
 	uint32_t cmd = 0;
@@ -538,6 +622,20 @@ void usbip_header_correct_endian(struct usbip_header *pdu, int send)
 	case USBIP_RET_UNLINK:
 		correct_endian_ret_unlink(&pdu->u.ret_unlink, send);
 		break;
+	case USBIP_CMD_BATCH:
+	case USBIP_RET_BATCH:
+		correct_endian_batch(&pdu->u.batch, send);
+		break;
+	case USBIP_CMD_IMPORT:
+		break;
+	case USBIP_RET_IMPORT:
+		if (send)
+			pdu->u.ret_import.status =
+				htonl(pdu->u.ret_import.status);
+		else
+			pdu->u.ret_import.status =
+				ntohl(pdu->u.ret_import.status);
+		break;
 	case USBIP_NOP:
 		break;
 	default:
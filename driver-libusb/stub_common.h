@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <sys/uio.h>
+#include "usbip_shm.h"
+#include "usbip_metrics.h"
 
 
 /* alternate of kthread_should_stop */
@@ -36,6 +38,7 @@
 
 #define USB_ENDPOINT_NUMBER_MASK	0x0f /* in bEndpointAddress */
 #define USB_ENDPOINT_DIR_MASK		0x80
+#define USB_MAXENDPOINTS		30 /* besides ep0 */
 
 #define USB_DIR_OUT             0	/* to device */
 #define USB_DIR_IN              0x80	/* to host */
@@ -139,6 +142,52 @@ static inline uint8_t get_recipient(uint8_t rt)
 #define USBIP_RET_SUBMIT	0x0003
 #define USBIP_RET_UNLINK	0x0004
 
+/*
+ * Batches, only with USBIP_CAP_BATCH:
+ *
+ *  - USBIP_CMD_BATCH: several non-isochronous USBIP_CMD_SUBMITs
+ *    (client to server)
+ *
+ *  - USBIP_RET_BATCH: several non-isochronous USBIP_RET_SUBMITs
+ *    (server to client)
+ *
+ * A batch is a usbip_header with u.batch, followed by u.batch.count
+ * entries of a usbip_batch_entry, the setup packet if USBIP_BATCH_SETUP
+ * is set, and the transfer buffer of an OUT submit or an IN result.
+ * Classic pdus may still be sent in between.
+ *
+ * With USBIP_CAP_COMPRESS, bulk transfer buffers are framed as described
+ * in stub_compress.c, also within a batch.
+ *
+ * With USBIP_CAP_STREAMS, a bulk USBIP_CMD_SUBMIT carries the stream id
+ * in start_frame, which is otherwise meaningless for bulk, and a batch
+ * entry in stream_id. 0 is an ordinary bulk transfer.
+ */
+#define USBIP_CMD_BATCH		0x8001
+#define USBIP_RET_BATCH		0x8003
+
+/*
+ * Devices sharing a connection, only with USBIP_CAP_MUX:
+ *
+ *  - USBIP_CMD_IMPORT: import one more device onto this connection,
+ *    followed by a struct op_import_request
+ *    (client to server)
+ *
+ *  - USBIP_RET_IMPORT: the result of USBIP_CMD_IMPORT with the seqnum of
+ *    the request, a ST_* code in u.ret_import.status and, when that is
+ *    ST_OK, the devid of the device in base.devid, followed by its
+ *    struct usbip_usb_device as in OP_REP_IMPORT
+ *    (server to client)
+ *
+ * The first device is imported with OP_REQ_IMPORT as usual. Every pdu then
+ * names its device in base.devid, which is (busnum << 16) | devnum of the
+ * usbip_usb_device, including the results the server sends. A device
+ * stays imported until the connection closes, and an error on any of them
+ * closes the connection.
+ */
+#define USBIP_CMD_IMPORT	0x8005
+#define USBIP_RET_IMPORT	0x8007
+
 #define USBIP_DIR_OUT	0x00
 #define USBIP_DIR_IN	0x01
 
@@ -213,6 +262,45 @@ struct usbip_header_ret_unlink {
 	uint32_t status;
 } __attribute__((packed));
 
+/**
+ * struct usbip_header_batch - USBIP_CMD_BATCH/USBIP_RET_BATCH packet header
+ * @count: number of entries
+ * @length: bytes following this header
+ */
+struct usbip_header_batch {
+	uint32_t count;
+	uint32_t length;
+} __attribute__((packed));
+
+/**
+ * struct usbip_header_ret_import - USBIP_RET_IMPORT packet header
+ * @status: ST_OK or the reason the device was not imported
+ */
+struct usbip_header_ret_import {
+	uint32_t status;
+} __attribute__((packed));
+
+#define USBIP_BATCH_IN		0x01	/* direction is USBIP_DIR_IN */
+#define USBIP_BATCH_SETUP	0x02	/* followed by 8 bytes of setup */
+
+/**
+ * struct usbip_batch_entry - a submit or its result within a batch
+ * @seqnum: as in usbip_header_basic
+ * @ep: endpoint number
+ * @flags: USBIP_BATCH_*
+ * @stream_id: bulk stream of a submit, with USBIP_CAP_STREAMS
+ * @length: transfer_buffer_length of a submit, actual_length of a result
+ * @value: transfer_flags of a submit, status of a result
+ */
+struct usbip_batch_entry {
+	uint32_t seqnum;
+	uint8_t ep;
+	uint8_t flags;
+	uint16_t stream_id;
+	int32_t length;
+	int32_t value;
+} __attribute__((packed));
+
 /**
  * struct usbip_header - common header for all usbip packets
  * @base: the basic header
@@ -226,6 +314,8 @@ struct usbip_header {
 		struct usbip_header_ret_submit	ret_submit;
 		struct usbip_header_cmd_unlink	cmd_unlink;
 		struct usbip_header_ret_unlink	ret_unlink;
+		struct usbip_header_batch	batch;
+		struct usbip_header_ret_import	ret_import;
 	} u;
 } __attribute__((packed));
 
@@ -259,6 +349,19 @@ struct usbip_device {
 	pthread_mutex_t lock;
 
 	int sock_fd;
+	struct usbip_shm *shm;	/* USBIP_CAP_SHM rings, else sock_fd */
+	uint64_t rx_bytes;	/* by usbip_recv() */
+	uint64_t rx_time;	/* us, of the last usbip_recv() */
+	uint64_t tx_time;	/* us, of the last usbip_sendmsg() */
+	uint64_t down_time;	/* us, when the connection was shut down */
+	int dead_peer;		/* dropped as unreachable */
+	int tx_more;		/* more to send right after, see stub_tx_mux() */
+
+	/*
+	 * With USBIP_CAP_MUX, the device whose connection and threads this
+	 * one shares. It takes the events and keeps the times of both.
+	 */
+	struct usbip_device *lead;
 
 	unsigned long event;
 	pthread_t eh;
@@ -278,14 +381,18 @@ void usbip_dump_header(struct usbip_header *pdu);
 
 int usbip_sendmsg(struct usbip_device *ud, struct iovec *vec, size_t num);
 int usbip_recv(struct usbip_device *ud, void *buf, int size);
+void usbip_dead_peer(struct usbip_device *ud, enum usbip_metric how);
 
 struct stub_unlink;
 
+int trxstat2error(enum libusb_transfer_status trxstat);
 void usbip_pack_ret_submit(struct usbip_header *pdu,
 				struct libusb_transfer *trx);
 void usbip_pack_ret_unlink(struct usbip_header *pdu,
 				struct stub_unlink *unlink);
 void usbip_header_correct_endian(struct usbip_header *pdu, int send);
+void usbip_batch_entry_correct_endian(struct usbip_batch_entry *ent,
+				      int send);
 
 struct usbip_iso_packet_descriptor*
 usbip_alloc_iso_desc_pdu(struct libusb_transfer *trx, ssize_t *bufflen);
@@ -0,0 +1,169 @@
+/*
+ * LZ4 compression of bulk payloads, with USBIP_CAP_COMPRESS
+ *
+ * Once a connection negotiated compression, the transfer buffer of every
+ * bulk USBIP_CMD_SUBMIT OUT and USBIP_RET_SUBMIT IN that has one, batched
+ * or not, is preceded by a 32-bit compressed length in network byte
+ * order. 0 means the buffer follows as is, otherwise that many bytes of
+ * an LZ4 block follow which inflate to exactly transfer_buffer_length or
+ * actual_length bytes. The sender decides per payload; the reader never
+ * has to guess.
+ *
+ * The server compresses IN payloads of at least STUB_COMPRESS_MIN bytes.
+ * Each endpoint keeps a moving average of the ratio it achieves; while
+ * that is too poor (already compressed images, encrypted volumes) the
+ * endpoint stops trying for an exponentially growing number of payloads
+ * and then probes again.
+ */
+
+#include <arpa/inet.h>
+
+#include "stub.h"
+#include <usbip_debug.h>
+#include <usbip_metrics.h>
+
+#ifdef USBIP_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#define STUB_COMPRESS_MIN	512	/* bytes, smaller ones are not worth it */
+#define STUB_COMPRESS_GOOD	224	/* compressed/raw * 256 worth sending */
+#define STUB_COMPRESS_BACKOFF_MAX 256	/* payloads skipped at most */
+
+int stub_compress_framed(struct stub_device *sdev, uint8_t type, int len)
+{
+	return (sdev->caps & USBIP_CAP_COMPRESS) &&
+		(type == LIBUSB_TRANSFER_TYPE_BULK ||
+		 type == LIBUSB_TRANSFER_TYPE_BULK_STREAM) && len > 0;
+}
+
+#ifdef USBIP_HAVE_LZ4
+static struct stub_endpoint *stub_compress_ep(struct stub_device *sdev,
+					      uint8_t ep)
+{
+	uint8_t nr = ep & USB_ENDPOINT_NUMBER_MASK;
+	int i;
+
+	for (i = 0; i < sdev->num_eps; i++) {
+		if (sdev->eps[i].nr == nr &&
+		    sdev->eps[i].dir == (ep & USB_ENDPOINT_DIR_MASK))
+			return sdev->eps + i;
+	}
+	return NULL;
+}
+
+static void stub_compress_account(struct stub_endpoint *epp, int len,
+				  int zlen)
+{
+	struct stub_compress_stat *zs = &epp->zs;
+	unsigned int ratio = zlen ? ((uint64_t)zlen << 8) / len : 256;
+
+	zs->ratio = (zs->ratio * 7 + ratio) / 8;
+	if (zs->ratio < STUB_COMPRESS_GOOD) {
+		zs->backoff = 0;
+		return;
+	}
+
+	zs->backoff = zs->backoff ? zs->backoff * 2 : 1;
+	if (zs->backoff > STUB_COMPRESS_BACKOFF_MAX)
+		zs->backoff = STUB_COMPRESS_BACKOFF_MAX;
+	zs->skip = zs->backoff;
+	/* start the next probe from a neutral average */
+	zs->ratio = STUB_COMPRESS_GOOD - 1;
+}
+#endif
+
+/*
+ * Compress the IN payload of priv into priv->zbuf. Returns the compressed
+ * length, or 0 if the payload is to be sent as is.
+ */
+int stub_compress_payload(struct stub_device *sdev, struct stub_priv *priv,
+			  const unsigned char *buf, int len)
+{
+#ifdef USBIP_HAVE_LZ4
+	struct stub_endpoint *epp;
+	int bound, zlen;
+
+	if (len < STUB_COMPRESS_MIN)
+		return 0;
+
+	epp = stub_compress_ep(sdev, priv->trx->endpoint);
+	if (!epp)
+		return 0;
+
+	usbip_metric_add(USBIP_M_compress_raw_bytes, len);
+	if (epp->zs.skip) {
+		epp->zs.skip--;
+		usbip_metric_add(USBIP_M_compress_wire_bytes, len);
+		return 0;
+	}
+
+	bound = LZ4_compressBound(len);
+	priv->zbuf = (unsigned char *)malloc(bound);
+	if (!priv->zbuf) {
+		usbip_metric_add(USBIP_M_compress_wire_bytes, len);
+		return 0;
+	}
+
+	zlen = LZ4_compress_default((const char *)buf, (char *)priv->zbuf,
+				    len, bound);
+	if (zlen <= 0 || zlen >= len)
+		zlen = 0;
+
+	stub_compress_account(epp, len, zlen);
+	usbip_metric_add(USBIP_M_compress_wire_bytes, zlen ? zlen : len);
+	usbip_dbg_stub_tx("compressed ep %02x: %d -> %d, ratio %u/256",
+			  priv->trx->endpoint, len, zlen, epp->zs.ratio);
+	return zlen;
+#else
+	(void)sdev;
+	(void)priv;
+	(void)buf;
+	(void)len;
+	return 0;
+#endif
+}
+
+/* read a framed OUT payload into the transfer buffer of trx past offset */
+int stub_decompress_recv(struct stub_device *sdev,
+			 struct libusb_transfer *trx, int offset)
+{
+	struct usbip_device *ud = &sdev->ud;
+	int size = trx->length - offset;
+	uint32_t zlen;
+
+	if (usbip_recv(ud, &zlen, sizeof(zlen)) != sizeof(zlen)) {
+		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+		return -1;
+	}
+	zlen = ntohl(zlen);
+
+	if (zlen == 0)
+		return usbip_recv_xbuff(ud, trx, offset);
+
+#ifdef USBIP_HAVE_LZ4
+	if (zlen < (uint32_t)LZ4_compressBound(size)) {
+		char *zbuf = (char *)malloc(zlen);
+		int ret;
+
+		if (!zbuf) {
+			usbip_event_add(ud, SDEV_EVENT_ERROR_MALLOC);
+			return -1;
+		}
+		if (usbip_recv(ud, zbuf, zlen) != (int)zlen) {
+			free(zbuf);
+			usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+			return -1;
+		}
+		ret = LZ4_decompress_safe(zbuf,
+				(char *)trx->buffer + offset, zlen, size);
+		free(zbuf);
+		if (ret == size)
+			return size;
+	}
+#endif
+	dev_err(sdev->dev, "bad compressed payload, %u bytes for %d",
+		zlen, size);
+	usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+	return -1;
+}
@@ -0,0 +1,402 @@
+/*
+ * Descriptor cache
+ *
+ * A client enumerating an imported device issues dozens of standard
+ * GET_DESCRIPTOR, GET_STATUS and GET_CONFIGURATION requests on endpoint 0.
+ * The answers are read from the device once at export time and kept here,
+ * so that stub_rx can reply to them without a round trip to the device.
+ *
+ * Entries describing device state (GET_STATUS, GET_CONFIGURATION) are
+ * dropped by any request which may change that state; descriptors are
+ * dropped when the client selects another configuration.
+ *
+ * The cache is filled before the rx thread starts and afterwards only
+ * touched by it, so it needs no locking.
+ */
+
+#include "stub.h"
+#include <usbip_debug.h>
+
+#define STUB_DESC_MAX_LEN	4096
+#define STUB_DESC_TIMEOUT	1000	/* ms */
+
+#define USB_RT_DEV_IN	(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | \
+			 LIBUSB_RECIPIENT_DEVICE)
+#define USB_RT_INTF_IN	(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | \
+			 LIBUSB_RECIPIENT_INTERFACE)
+
+struct stub_desc_entry {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint8_t state;		/* describes device state, not a descriptor */
+	int len;
+	unsigned char *data;
+};
+
+struct stub_desc_cache {
+	int num;
+	int max;
+	uint8_t config;
+	struct stub_desc_entry *entries;
+};
+
+static int desc_cache_add(struct stub_desc_cache *cache, uint8_t rt,
+			  uint8_t req, uint16_t value, uint16_t index,
+			  const unsigned char *data, int len, int state)
+{
+	struct stub_desc_entry *entry;
+
+	if (len <= 0)
+		return -1;
+
+	if (cache->num == cache->max) {
+		int max = cache->max ? cache->max * 2 : 16;
+
+		entry = (struct stub_desc_entry *)realloc(cache->entries,
+				max * sizeof(struct stub_desc_entry));
+		if (!entry)
+			return -1;
+		cache->entries = entry;
+		cache->max = max;
+	}
+
+	entry = cache->entries + cache->num;
+	entry->data = (unsigned char *)malloc(len);
+	if (!entry->data)
+		return -1;
+	memcpy(entry->data, data, len);
+	entry->bmRequestType = rt;
+	entry->bRequest = req;
+	entry->wValue = value;
+	entry->wIndex = index;
+	entry->state = state;
+	entry->len = len;
+	cache->num++;
+	return 0;
+}
+
+static void desc_cache_drop(struct stub_desc_cache *cache, int state_only)
+{
+	int i, n = 0;
+
+	for (i = 0; i < cache->num; i++) {
+		struct stub_desc_entry *entry = cache->entries + i;
+
+		if (state_only && !entry->state)
+			cache->entries[n++] = *entry;
+		else
+			free(entry->data);
+	}
+	cache->num = n;
+}
+
+/* same as libusb_get_descriptor() but for any request type and index */
+static int desc_read(libusb_device_handle *dev_handle, uint8_t rt,
+		     uint16_t value, uint16_t index, unsigned char *buf, int len)
+{
+	return libusb_control_transfer(dev_handle, rt,
+				       LIBUSB_REQUEST_GET_DESCRIPTOR,
+				       value, index, buf, len,
+				       STUB_DESC_TIMEOUT);
+}
+
+static void desc_cache_add_device(struct stub_desc_cache *cache,
+				  libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	unsigned char raw[LIBUSB_DT_DEVICE_SIZE];
+
+	/* libusb keeps the device descriptor, no need to ask the device */
+	if (libusb_get_device_descriptor(dev, &desc))
+		return;
+
+	raw[0] = LIBUSB_DT_DEVICE_SIZE;
+	raw[1] = LIBUSB_DT_DEVICE;
+	raw[2] = desc.bcdUSB & 0xff;
+	raw[3] = desc.bcdUSB >> 8;
+	raw[4] = desc.bDeviceClass;
+	raw[5] = desc.bDeviceSubClass;
+	raw[6] = desc.bDeviceProtocol;
+	raw[7] = desc.bMaxPacketSize0;
+	raw[8] = desc.idVendor & 0xff;
+	raw[9] = desc.idVendor >> 8;
+	raw[10] = desc.idProduct & 0xff;
+	raw[11] = desc.idProduct >> 8;
+	raw[12] = desc.bcdDevice & 0xff;
+	raw[13] = desc.bcdDevice >> 8;
+	raw[14] = desc.iManufacturer;
+	raw[15] = desc.iProduct;
+	raw[16] = desc.iSerialNumber;
+	raw[17] = desc.bNumConfigurations;
+
+	desc_cache_add(cache, USB_RT_DEV_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+		       LIBUSB_DT_DEVICE << 8, 0, raw, sizeof(raw), 0);
+}
+
+/* descriptors with a 16 bit total length at offset 2 (config, BOS) */
+static int desc_cache_add_total(struct stub_desc_cache *cache,
+				libusb_device_handle *dev_handle,
+				uint8_t type, uint8_t index, int hdrlen,
+				unsigned char *buf)
+{
+	uint16_t value = (type << 8) | index;
+	int ret, len;
+
+	ret = desc_read(dev_handle, USB_RT_DEV_IN, value, 0, buf, hdrlen);
+	if (ret < hdrlen)
+		return -1;
+
+	len = buf[2] | (buf[3] << 8);
+	if (len < hdrlen || len > STUB_DESC_MAX_LEN)
+		return -1;
+
+	ret = desc_read(dev_handle, USB_RT_DEV_IN, value, 0, buf, len);
+	if (ret < len)
+		return -1;
+
+	desc_cache_add(cache, USB_RT_DEV_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+		       value, 0, buf, len, 0);
+	return len;
+}
+
+static void desc_cache_add_string(struct stub_desc_cache *cache,
+				  libusb_device_handle *dev_handle,
+				  uint8_t index, uint16_t langid)
+{
+	unsigned char buf[255];
+	uint16_t value = (LIBUSB_DT_STRING << 8) | index;
+	int i, ret;
+
+	for (i = 0; i < cache->num; i++) {
+		if (cache->entries[i].wValue == value &&
+		    cache->entries[i].wIndex == langid)
+			return;
+	}
+
+	ret = desc_read(dev_handle, USB_RT_DEV_IN, value, langid, buf,
+			sizeof(buf));
+	if (ret >= 2 && buf[1] == LIBUSB_DT_STRING)
+		desc_cache_add(cache, USB_RT_DEV_IN,
+			       LIBUSB_REQUEST_GET_DESCRIPTOR, value, langid,
+			       buf, buf[0] < ret ? buf[0] : ret, 0);
+}
+
+/*
+ * Walk a raw configuration descriptor for string indices and HID report
+ * descriptors of its interfaces.
+ */
+static void desc_cache_add_config_extras(struct stub_desc_cache *cache,
+					 libusb_device_handle *dev_handle,
+					 const unsigned char *config, int len,
+					 uint16_t langid, unsigned char *buf)
+{
+	int pos = 0;
+	int ifnum = -1;
+	int is_hid = 0;
+
+	if (langid && config[6])
+		desc_cache_add_string(cache, dev_handle, config[6], langid);
+
+	while (pos + 2 <= len && config[pos] >= 2) {
+		const unsigned char *d = config + pos;
+
+		if (pos + d[0] > len)
+			break;
+
+		if (d[1] == LIBUSB_DT_INTERFACE && d[0] >= 9) {
+			ifnum = d[2];
+			is_hid = (d[5] == LIBUSB_CLASS_HID);
+			if (langid && d[8])
+				desc_cache_add_string(cache, dev_handle, d[8],
+						      langid);
+		} else if (d[1] == LIBUSB_DT_HID && is_hid && d[0] >= 9 &&
+			   d[6] == LIBUSB_DT_REPORT && ifnum >= 0) {
+			int rlen = d[7] | (d[8] << 8);
+			uint16_t value = LIBUSB_DT_REPORT << 8;
+			int ret;
+
+			if (rlen > 0 && rlen <= STUB_DESC_MAX_LEN) {
+				ret = desc_read(dev_handle, USB_RT_INTF_IN,
+						value, ifnum, buf, rlen);
+				if (ret == rlen)
+					desc_cache_add(cache, USB_RT_INTF_IN,
+						LIBUSB_REQUEST_GET_DESCRIPTOR,
+						value, ifnum, buf, rlen, 0);
+			}
+			is_hid = 0;
+		}
+		pos += d[0];
+	}
+}
+
+static void desc_cache_add_state(struct stub_desc_cache *cache,
+				 libusb_device_handle *dev_handle)
+{
+	unsigned char status[2];
+	unsigned char config;
+	int value;
+
+	if (libusb_control_transfer(dev_handle, USB_RT_DEV_IN,
+				    LIBUSB_REQUEST_GET_STATUS, 0, 0,
+				    status, sizeof(status),
+				    STUB_DESC_TIMEOUT) == sizeof(status))
+		desc_cache_add(cache, USB_RT_DEV_IN,
+			       LIBUSB_REQUEST_GET_STATUS, 0, 0,
+			       status, sizeof(status), 1);
+
+	if (libusb_get_configuration(dev_handle, &value) == 0 && value > 0) {
+		config = (unsigned char)value;
+		cache->config = config;
+		desc_cache_add(cache, USB_RT_DEV_IN,
+			       LIBUSB_REQUEST_GET_CONFIGURATION, 0, 0,
+			       &config, 1, 1);
+	}
+}
+
+int stub_desc_cache_fill(struct stub_device *sdev)
+{
+	struct stub_desc_cache *cache;
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *dev_handle = sdev->dev_handle;
+	unsigned char *buf;
+	uint16_t langid = 0;
+	int i, len;
+
+	if (sdev->desc_cache)
+		return 0;
+
+	if (libusb_get_device_descriptor(sdev->dev, &desc))
+		return -1;
+
+	cache = (struct stub_desc_cache *)calloc(1, sizeof(*cache));
+	buf = (unsigned char *)malloc(STUB_DESC_MAX_LEN);
+	if (!cache || !buf) {
+		free(cache);
+		free(buf);
+		return -1;
+	}
+
+	desc_cache_add_device(cache, sdev->dev);
+
+	/* string 0 is the table of supported language ids */
+	len = desc_read(dev_handle, USB_RT_DEV_IN, LIBUSB_DT_STRING << 8, 0,
+			buf, 255);
+	if (len >= 4 && buf[1] == LIBUSB_DT_STRING) {
+		desc_cache_add(cache, USB_RT_DEV_IN,
+			       LIBUSB_REQUEST_GET_DESCRIPTOR,
+			       LIBUSB_DT_STRING << 8, 0, buf,
+			       buf[0] < len ? buf[0] : len, 0);
+		langid = buf[2] | (buf[3] << 8);
+	}
+
+	if (langid) {
+		if (desc.iManufacturer)
+			desc_cache_add_string(cache, dev_handle,
+					      desc.iManufacturer, langid);
+		if (desc.iProduct)
+			desc_cache_add_string(cache, dev_handle,
+					      desc.iProduct, langid);
+		if (desc.iSerialNumber)
+			desc_cache_add_string(cache, dev_handle,
+					      desc.iSerialNumber, langid);
+	}
+
+	for (i = 0; i < desc.bNumConfigurations; i++) {
+		len = desc_cache_add_total(cache, dev_handle, LIBUSB_DT_CONFIG,
+					   i, LIBUSB_DT_CONFIG_SIZE, buf);
+		if (len <= 0)
+			continue;
+		/* buf is reused below, work on the cached copy */
+		desc_cache_add_config_extras(cache, dev_handle,
+				cache->entries[cache->num - 1].data, len,
+				langid, buf);
+	}
+
+	if (desc.bcdUSB >= 0x0201)
+		desc_cache_add_total(cache, dev_handle, LIBUSB_DT_BOS, 0,
+				     LIBUSB_DT_BOS_SIZE, buf);
+
+	desc_cache_add_state(cache, dev_handle);
+
+	free(buf);
+	sdev->desc_cache = cache;
+	dev_dbg(sdev->dev, "%d descriptors cached", cache->num);
+	return 0;
+}
+
+void stub_desc_cache_free(struct stub_desc_cache *cache)
+{
+	if (!cache)
+		return;
+	desc_cache_drop(cache, 0);
+	free(cache->entries);
+	free(cache);
+}
+
+/*
+ * Answer a control request from the cache. Returns the number of bytes
+ * copied to buf, which has room for size, or -1 if the request has to go
+ * to the device. wLength comes from the client and may exceed size.
+ */
+int stub_desc_cache_lookup(struct stub_device *sdev,
+			   struct libusb_control_setup *setup,
+			   unsigned char *buf, int size)
+{
+	struct stub_desc_cache *cache = sdev->desc_cache;
+	uint16_t value, index, length;
+	int i;
+
+	if (!cache || !(setup->bmRequestType & LIBUSB_ENDPOINT_IN) ||
+	    get_request_type(setup->bmRequestType) !=
+			LIBUSB_REQUEST_TYPE_STANDARD)
+		return -1;
+
+	value = libusb_le16_to_cpu(setup->wValue);
+	index = libusb_le16_to_cpu(setup->wIndex);
+	length = libusb_le16_to_cpu(setup->wLength);
+
+	for (i = 0; i < cache->num; i++) {
+		struct stub_desc_entry *entry = cache->entries + i;
+
+		if (entry->bRequest != setup->bRequest ||
+		    entry->bmRequestType != setup->bmRequestType ||
+		    entry->wValue != value || entry->wIndex != index)
+			continue;
+
+		if (length > entry->len)
+			length = entry->len;
+		if (length > size)
+			length = size;
+		memcpy(buf, entry->data, length);
+		return length;
+	}
+	return -1;
+}
+
+/* called for every control request on its way to the device */
+void stub_desc_cache_invalidate(struct stub_device *sdev,
+				struct libusb_control_setup *setup)
+{
+	struct stub_desc_cache *cache = sdev->desc_cache;
+
+	if (!cache || (setup->bmRequestType & LIBUSB_ENDPOINT_IN))
+		return;
+
+	switch (setup->bRequest) {
+	case LIBUSB_REQUEST_SET_CONFIGURATION:
+		if (libusb_le16_to_cpu(setup->wValue) != cache->config) {
+			dev_dbg(sdev->dev, "configuration changed, "
+				"dropping descriptor cache");
+			desc_cache_drop(cache, 0);
+			break;
+		}
+		/* FALLTHROUGH */
+	case LIBUSB_REQUEST_SET_INTERFACE:
+	case LIBUSB_REQUEST_SET_FEATURE:
+	case LIBUSB_REQUEST_CLEAR_FEATURE:
+		desc_cache_drop(cache, 1);
+		break;
+	}
+}
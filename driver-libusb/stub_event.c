@@ -108,6 +108,10 @@ void usbip_join_eh(struct usbip_device *ud)
 
 void usbip_event_add(struct usbip_device *ud, unsigned long event)
 {
+	/* the lead of a shared connection handles the events of all */
+	if (ud->lead)
+		ud = ud->lead;
+
 	pthread_mutex_lock(&ud->lock);
 	ud->event |= event;
 	pthread_mutex_unlock(&ud->lock);
@@ -118,6 +122,9 @@ int usbip_event_happened(struct usbip_device *ud)
 {
 	int happened = 0;
 
+	if (ud->lead)
+		ud = ud->lead;
+
 	pthread_mutex_lock(&ud->lock);
 	if (ud->event != 0)
 		happened = 1;
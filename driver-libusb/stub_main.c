@@ -19,60 +19,122 @@
 #include "stub.h"
 #include <usbip_debug.h>
 
-static struct stub_priv *stub_priv_pop_from_listhead(struct list_head *listhead)
+/* how long teardown waits for the device to give back cancelled transfers */
+#define STUB_TEARDOWN_TIMEOUT	2000	/* ms */
+
+/*
+ * Cancel every transfer still at the device in one go, e.g. once the client
+ * is gone. Their completions come back through stub_complete() as usual.
+ */
+int stub_device_cancel_transfers(struct stub_device *sdev)
 {
-	struct list_head *pos, *tmp;
+	struct list_head *pos;
 	struct stub_priv *priv;
+	int n = 0;
 
-	list_for_each_safe(pos, tmp, listhead) {
+	pthread_mutex_lock(&sdev->priv_lock);
+	list_for_each(pos, &sdev->priv_init) {
 		priv = list_entry(pos, struct stub_priv, list);
-		warn("Found pending trx %p.", priv->trx);
+		if (priv->submitted && !libusb_cancel_transfer(priv->trx))
+			n++;
 	}
+	n += stub_prefetch_cancel(sdev);
+	pthread_mutex_unlock(&sdev->priv_lock);
 
-	return NULL;
+	return n;
 }
 
-static struct stub_priv *stub_priv_pop(struct stub_device *sdev)
+static int stub_transfers_pending(struct stub_device *sdev)
 {
+	struct list_head *pos;
 	struct stub_priv *priv;
+	int n = 0;
 
 	pthread_mutex_lock(&sdev->priv_lock);
+	list_for_each(pos, &sdev->priv_init) {
+		priv = list_entry(pos, struct stub_priv, list);
+		if (priv->submitted)
+			n++;
+	}
+	n += stub_prefetch_pending(sdev);
+	pthread_mutex_unlock(&sdev->priv_lock);
 
-	priv = stub_priv_pop_from_listhead(&sdev->priv_init);
-	if (priv)
-		goto done;
-
-	priv = stub_priv_pop_from_listhead(&sdev->priv_tx);
-	if (priv)
-		goto done;
-
-	priv = stub_priv_pop_from_listhead(&sdev->priv_free);
+	return n;
+}
 
-done:
-	pthread_mutex_unlock(&sdev->priv_lock);
-	return priv;
+/* a transfer left behind by a device that never gave it back */
+static void LIBUSB_CALL stub_complete_orphan(struct libusb_transfer *trx)
+{
+	free(trx->buffer);
+	libusb_free_transfer(trx);
 }
 
+/*
+ * Called once rx and tx are gone. Whatever completes from here on is only
+ * freed, nothing is sent. Cancelled transfers may complete in any thread
+ * handling libusb events, so wait for them by their state, driving events
+ * meanwhile, for at most STUB_TEARDOWN_TIMEOUT. A transfer the device still
+ * holds then is handed over to stub_complete_orphan(), so that nothing
+ * refers to sdev when it completes after all, in whichever thread handles
+ * libusb events next. That happens under the event lock, with which libusb
+ * runs callbacks, so none of them is halfway through stub_complete() or
+ * stub_prefetch_complete() with the priv or prefetch freed under it.
+ */
 void stub_device_cleanup_transfers(struct stub_device *sdev)
 {
+	struct timeval tv = { 0, 10000 };
+	struct list_head *pos, *tmp;
 	struct stub_priv *priv;
-	struct libusb_transfer *trx;
+	uint64_t start, deadline;
+	int cancelled, pending, orphans = 0, q;
 
 	dev_dbg(sdev->dev, "free sdev %p", sdev);
 
-	while (1) {
-		priv = stub_priv_pop(sdev);
-		if (!priv)
-			break;
+	start = usbip_now_us();
+	deadline = start + STUB_TEARDOWN_TIMEOUT * 1000ULL;
+
+	cancelled = stub_device_cancel_transfers(sdev);
+	usbip_metric_add(USBIP_M_reclaim_cancelled, cancelled);
 
-		trx = priv->trx;
-		libusb_cancel_transfer(trx);
+	while ((pending = stub_transfers_pending(sdev)) > 0 &&
+	       usbip_now_us() < deadline)
+		libusb_handle_events_timeout(stub_libusb_ctx, &tv);
+
+	/* a handler parked in libusb holds the lock for all of its wait */
+	libusb_interrupt_event_handler(stub_libusb_ctx);
+	libusb_lock_events(stub_libusb_ctx);
+	pthread_mutex_lock(&sdev->priv_lock);
+	list_for_each_safe(pos, tmp, &sdev->priv_init) {
+		priv = list_entry(pos, struct stub_priv, list);
+		if (priv->submitted) {
+			priv->trx->callback = stub_complete_orphan;
+			priv->trx->user_data = NULL;
+			priv->trx = NULL;
+			orphans++;
+		}
+		stub_free_priv_and_trx(priv);
+	}
+	orphans += stub_prefetch_orphan(sdev);
+	for (q = 0; q < STUB_TXQ_NUM; q++) {
+		list_for_each_safe(pos, tmp, &sdev->priv_tx[q])
+			stub_free_priv_and_trx(list_entry(pos,
+						struct stub_priv, list));
+	}
+	list_for_each_safe(pos, tmp, &sdev->priv_free)
+		stub_free_priv_and_trx(list_entry(pos, struct stub_priv, list));
+	pthread_mutex_unlock(&sdev->priv_lock);
+	libusb_unlock_events(stub_libusb_ctx);
 
-		dev_dbg(sdev->dev, "free trx %p", trx);
-		free(priv);
-		free(trx->buffer);
-		libusb_free_transfer(trx);
+	if (orphans) {
+		dev_err(sdev->dev, "%d transfers not given back in %d ms",
+			orphans, STUB_TEARDOWN_TIMEOUT);
+		usbip_metric_add(USBIP_M_teardown_orphans, orphans);
 	}
+	usbip_metric_add(USBIP_M_teardowns, 1);
+	usbip_metric_max(USBIP_M_teardown_us_max, usbip_now_us() - start);
+	dev_dbg(sdev->dev, "teardown: %d cancelled, %d orphaned, %llu us",
+		cancelled, orphans,
+		(unsigned long long)(usbip_now_us() - start));
 }
 
 void stub_device_cleanup_unlinks(struct stub_device *sdev)
@@ -0,0 +1,493 @@
+/*
+ * Transfers kept at IN endpoints ahead of the client, see
+ * src/usbip_prefetch.c for the policies
+ *
+ * A client polls an interrupt IN endpoint with one request at a time and
+ * only asks again once the answer made it back, so a report costs a
+ * round trip and reports coming faster are missed over a slow link. A
+ * serial adapter streams small bulk IN transfers the same way, bounded
+ * by the round trip. With a policy, the endpoint keeps intr or bulk
+ * transfers of its own queued at the device from the first CMD_SUBMIT
+ * on. Each one completing goes into the ring and is submitted again;
+ * CMD_SUBMITs for the endpoint take from the ring, or wait in priv_init
+ * until something completes.
+ *
+ * The ring holds at most ring transfers, those at the device included.
+ * While the client does not keep up and the ring is full, completed
+ * transfers stay in it instead of going back to the device, as if the
+ * client polled less often, and count as overflows. Nothing is dropped.
+ *
+ * Answers follow what the device would have done with the request: they
+ * take data up to its length in whole packets, end at a short transfer
+ * and hand over errors as they came, so packet framing such as the
+ * status bytes of FTDI adapters survives. A transfer failing stops the
+ * endpoint; the next CMD_SUBMIT starts it again, e.g. once the client
+ * cleared a halt. SET_INTERFACE and a reset stop the endpoints they
+ * concern and drop what they read, which is stale then.
+ *
+ * All of it is under priv_lock.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stub.h"
+#include <usbip_debug.h>
+#include <usbip_metrics.h>
+
+struct stub_prefetch {
+	struct stub_prefetch *next;
+	struct stub_device *sdev;
+	uint8_t ep;		/* address, with the IN bit */
+	uint8_t ifnum;		/* its interface */
+	uint16_t max_packet;
+	int length;		/* of each transfer, whole packets */
+	uint8_t running;
+	int depth;		/* transfers kept at the device */
+	int inflight;
+	int nslot;
+	struct libusb_transfer **done;	/* ring, in completion order */
+	int head, count;
+	int offset;		/* taken of the transfer at head */
+	struct libusb_transfer **idle;
+	int nidle;
+	uint64_t hits, waits, overflows;
+	struct libusb_transfer *trx[];
+};
+
+static void LIBUSB_CALL stub_prefetch_complete(struct libusb_transfer *trx);
+
+static struct stub_prefetch *stub_prefetch_new(struct stub_device *sdev,
+					       struct stub_endpoint *epp,
+					       struct usbip_prefetch *conf)
+{
+	struct stub_prefetch *pf;
+	unsigned char *buf;
+	int i;
+
+	pf = (struct stub_prefetch *)calloc(1, sizeof(*pf) +
+			conf->ring * sizeof(pf->trx[0]));
+	if (!pf)
+		return NULL;
+	pf->sdev = sdev;
+	pf->ep = epp->nr | epp->dir;
+	pf->ifnum = epp->ifnum;
+	pf->max_packet = epp->max_packet ? epp->max_packet : 64;
+	if (epp->type == LIBUSB_TRANSFER_TYPE_BULK) {
+		pf->depth = conf->bulk;
+		pf->length = (conf->size + pf->max_packet - 1) /
+			pf->max_packet * pf->max_packet;
+	} else {
+		pf->depth = conf->intr;
+		pf->length = pf->max_packet;
+	}
+	pf->nslot = conf->ring;
+	pf->done = (struct libusb_transfer **)calloc(pf->nslot,
+						     sizeof(pf->done[0]));
+	pf->idle = (struct libusb_transfer **)calloc(pf->nslot,
+						     sizeof(pf->idle[0]));
+	if (!pf->done || !pf->idle)
+		goto err;
+
+	for (i = 0; i < pf->nslot; i++) {
+		pf->trx[i] = libusb_alloc_transfer(0);
+		if (!pf->trx[i])
+			goto err;
+		buf = (unsigned char *)malloc(pf->length);
+		if (!buf)
+			goto err;
+		if (epp->type == LIBUSB_TRANSFER_TYPE_BULK)
+			libusb_fill_bulk_transfer(pf->trx[i], sdev->dev_handle,
+					pf->ep, buf, pf->length,
+					stub_prefetch_complete, pf, 0);
+		else
+			libusb_fill_interrupt_transfer(pf->trx[i],
+					sdev->dev_handle, pf->ep, buf,
+					pf->length, stub_prefetch_complete,
+					pf, 0);
+		pf->idle[pf->nidle++] = pf->trx[i];
+	}
+	return pf;
+err:
+	for (i = 0; i < pf->nslot && pf->trx[i]; i++) {
+		free(pf->trx[i]->buffer);
+		libusb_free_transfer(pf->trx[i]);
+	}
+	free(pf->done);
+	free(pf->idle);
+	free(pf);
+	return NULL;
+}
+
+static struct stub_prefetch *stub_prefetch_find(struct stub_device *sdev,
+						uint8_t ep)
+{
+	struct stub_prefetch *pf;
+
+	for (pf = sdev->prefetch; pf; pf = pf->next) {
+		if (pf->ep == ep)
+			return pf;
+	}
+	return NULL;
+}
+
+void stub_prefetch_attach(struct stub_device *sdev)
+{
+	struct usbip_prefetch conf;
+	struct stub_endpoint *epp;
+	struct stub_prefetch *pf;
+	uint8_t ep;
+	int i;
+
+	sdev->prefetch = NULL;
+	for (i = 0; i < sdev->num_eps; i++) {
+		epp = &sdev->eps[i];
+		ep = epp->nr | epp->dir;
+		/* the client picks the streams of a bulk endpoint */
+		if (epp->dir != LIBUSB_ENDPOINT_IN ||
+		    (epp->type != LIBUSB_TRANSFER_TYPE_INTERRUPT &&
+		     (epp->type != LIBUSB_TRANSFER_TYPE_BULK ||
+		      epp->max_streams)) ||
+		    stub_prefetch_find(sdev, ep))
+			continue;
+		if (usbip_prefetch_lookup(sdev->udev.busid,
+					  sdev->udev.idVendor,
+					  sdev->udev.idProduct, epp->ifclass,
+					  ep, &conf))
+			continue;
+		if (!(epp->type == LIBUSB_TRANSFER_TYPE_BULK ?
+		      conf.bulk : conf.intr))
+			continue;
+
+		pf = stub_prefetch_new(sdev, epp, &conf);
+		if (!pf) {
+			dev_err(sdev->dev, "no prefetch on ep %02x", ep);
+			continue;
+		}
+		pf->next = sdev->prefetch;
+		sdev->prefetch = pf;
+		dbg("%s keeps %d transfers of %d bytes at ep %02x, %d held",
+		    sdev->udev.busid, pf->depth, pf->length, ep, pf->nslot);
+	}
+}
+
+/* after stub_device_cleanup_transfers(), nothing is at the device */
+void stub_prefetch_detach(struct stub_device *sdev)
+{
+	struct stub_prefetch *pf;
+	int i;
+
+	while ((pf = sdev->prefetch)) {
+		sdev->prefetch = pf->next;
+		dbg("%s ep %02x: %llu hits, %llu waits, %llu overflows",
+		    sdev->udev.busid, pf->ep, (unsigned long long)pf->hits,
+		    (unsigned long long)pf->waits,
+		    (unsigned long long)pf->overflows);
+		for (i = 0; i < pf->nslot; i++) {
+			/* orphaned, see stub_prefetch_orphan() */
+			if (!pf->trx[i]->user_data)
+				continue;
+			free(pf->trx[i]->buffer);
+			libusb_free_transfer(pf->trx[i]);
+		}
+		free(pf->done);
+		free(pf->idle);
+		free(pf);
+	}
+}
+
+/* whether trx is at the device */
+static int stub_prefetch_busy(struct stub_prefetch *pf,
+			      struct libusb_transfer *trx)
+{
+	int i;
+
+	for (i = 0; i < pf->nidle; i++) {
+		if (pf->idle[i] == trx)
+			return 0;
+	}
+	for (i = 0; i < pf->count; i++) {
+		if (pf->done[(pf->head + i) % pf->nslot] == trx)
+			return 0;
+	}
+	return 1;
+}
+
+static int stub_prefetch_stop(struct stub_prefetch *pf)
+{
+	int i, n = 0;
+
+	pf->running = 0;
+	for (i = 0; i < pf->nslot; i++) {
+		if (stub_prefetch_busy(pf, pf->trx[i]) &&
+		    !libusb_cancel_transfer(pf->trx[i]))
+			n++;
+	}
+	return n;
+}
+
+/* stop all endpoints, like stub_device_cancel_transfers() */
+int stub_prefetch_cancel(struct stub_device *sdev)
+{
+	struct stub_prefetch *pf;
+	int n = 0;
+
+	for (pf = sdev->prefetch; pf; pf = pf->next)
+		n += stub_prefetch_stop(pf);
+	return n;
+}
+
+int stub_prefetch_pending(struct stub_device *sdev)
+{
+	struct stub_prefetch *pf;
+	int n = 0;
+
+	for (pf = sdev->prefetch; pf; pf = pf->next)
+		n += pf->inflight;
+	return n;
+}
+
+static void LIBUSB_CALL stub_prefetch_free(struct libusb_transfer *trx)
+{
+	free(trx->buffer);
+	libusb_free_transfer(trx);
+}
+
+/* hand what the device still holds to stub_prefetch_free() */
+int stub_prefetch_orphan(struct stub_device *sdev)
+{
+	struct stub_prefetch *pf;
+	int i, n = 0;
+
+	for (pf = sdev->prefetch; pf; pf = pf->next) {
+		for (i = 0; i < pf->nslot; i++) {
+			if (!pf->inflight || !stub_prefetch_busy(pf, pf->trx[i]))
+				continue;
+			pf->trx[i]->callback = stub_prefetch_free;
+			pf->trx[i]->user_data = NULL;
+			pf->inflight--;
+			n++;
+		}
+	}
+	return n;
+}
+
+/* keep depth transfers at the device while the ring has room */
+static void stub_prefetch_fill(struct stub_prefetch *pf)
+{
+	struct libusb_transfer *trx;
+	int ret;
+
+	while (pf->running && pf->inflight < pf->depth && pf->nidle) {
+		trx = pf->idle[--pf->nidle];
+		ret = libusb_submit_transfer(trx);
+		if (ret) {
+			dev_err(pf->sdev->dev, "prefetch on ep %02x: %d",
+				pf->ep, ret);
+			pf->idle[pf->nidle++] = trx;
+			pf->running = 0;
+			break;
+		}
+		pf->inflight++;
+	}
+}
+
+/* done with the transfer at head */
+static void stub_prefetch_pop(struct stub_prefetch *pf)
+{
+	pf->idle[pf->nidle++] = pf->done[pf->head];
+	pf->head = (pf->head + 1) % pf->nslot;
+	pf->count--;
+	pf->offset = 0;
+}
+
+/*
+ * Stop the endpoints of interface ifnum, or all for -1, and empty their
+ * rings. What the device fails of the transfers queued goes back to idle
+ * as the endpoint is no longer running. Requests waiting meanwhile start
+ * it again once the last cancelled transfer is back.
+ */
+void stub_prefetch_reset(struct stub_device *sdev, int ifnum)
+{
+	struct stub_prefetch *pf;
+
+	pthread_mutex_lock(&sdev->priv_lock);
+	for (pf = sdev->prefetch; pf; pf = pf->next) {
+		if (ifnum >= 0 && pf->ifnum != ifnum)
+			continue;
+		stub_prefetch_stop(pf);
+		while (pf->count)
+			stub_prefetch_pop(pf);
+	}
+	pthread_mutex_unlock(&sdev->priv_lock);
+}
+
+/* answer a waiting or new request from the ring, which is not empty */
+static void stub_prefetch_answer(struct stub_prefetch *pf,
+				 struct stub_priv *priv)
+{
+	struct libusb_transfer *trx = priv->trx, *done;
+	int len = 0, avail, n, last;
+
+	trx->status = LIBUSB_TRANSFER_COMPLETED;
+	while (pf->count) {
+		done = pf->done[pf->head];
+		if (done->status != LIBUSB_TRANSFER_COMPLETED) {
+			if (!len) {
+				trx->status = done->status;
+				stub_prefetch_pop(pf);
+			}
+			break;
+		}
+
+		avail = done->actual_length - pf->offset;
+		n = trx->length - len;
+		if (avail > n) {
+			/* whole packets, or the device babbles */
+			n -= n % pf->max_packet;
+			if (!n && !len) {
+				memcpy(trx->buffer, done->buffer + pf->offset,
+				       trx->length);
+				len = trx->length;
+				trx->status = LIBUSB_TRANSFER_OVERFLOW;
+				stub_prefetch_pop(pf);
+			}
+			if (!n)
+				break;
+		} else {
+			n = avail;
+		}
+
+		memcpy(trx->buffer + len, done->buffer + pf->offset, n);
+		len += n;
+		pf->offset += n;
+		if (pf->offset < done->actual_length)
+			break;
+		/* a short transfer ends the request as its short packet */
+		last = done->actual_length < done->length;
+		stub_prefetch_pop(pf);
+		if (last || len == trx->length)
+			break;
+	}
+	trx->actual_length = len;
+
+	priv->waiting = 0;
+	stub_capture_complete(pf->sdev, trx);
+	stub_queue_priv_tx(pf->sdev, priv);
+}
+
+/* the oldest request waiting for the endpoint */
+static struct stub_priv *stub_prefetch_waiter(struct stub_prefetch *pf)
+{
+	struct list_head *pos;
+	struct stub_priv *priv;
+
+	list_for_each(pos, &pf->sdev->priv_init) {
+		priv = list_entry(pos, struct stub_priv, list);
+		if (priv->waiting && priv->trx->endpoint == pf->ep)
+			return priv;
+	}
+	return NULL;
+}
+
+static int stub_prefetch_start(struct stub_prefetch *pf)
+{
+	if (pf->running || pf->inflight || stub_should_stop(pf->sdev))
+		return 0;
+	pf->running = 1;
+	stub_prefetch_fill(pf);
+	return pf->inflight ? 0 : -1;
+}
+
+/* give requests what came, 1 if one was answered */
+static int stub_prefetch_serve(struct stub_prefetch *pf)
+{
+	struct stub_priv *priv;
+	int answered = 0;
+
+	while (pf->count && (priv = stub_prefetch_waiter(pf))) {
+		stub_prefetch_answer(pf, priv);
+		answered = 1;
+	}
+	stub_prefetch_fill(pf);
+
+	/* stopped meanwhile, with requests left */
+	if (!pf->running && !pf->inflight && stub_prefetch_waiter(pf) &&
+	    stub_prefetch_start(pf)) {
+		while ((priv = stub_prefetch_waiter(pf))) {
+			priv->waiting = 0;
+			priv->trx->status = LIBUSB_TRANSFER_ERROR;
+			priv->trx->actual_length = 0;
+			stub_capture_complete(pf->sdev, priv->trx);
+			stub_queue_priv_tx(pf->sdev, priv);
+			answered = 1;
+		}
+	}
+	return answered;
+}
+
+static void LIBUSB_CALL stub_prefetch_complete(struct libusb_transfer *trx)
+{
+	struct stub_prefetch *pf = (struct stub_prefetch *)trx->user_data;
+	struct stub_device *sdev = pf->sdev;
+
+	pthread_mutex_lock(&sdev->priv_lock);
+	pf->inflight--;
+	if (!pf->running || trx->status == LIBUSB_TRANSFER_CANCELLED) {
+		pf->idle[pf->nidle++] = trx;
+	} else {
+		pf->done[(pf->head + pf->count) % pf->nslot] = trx;
+		pf->count++;
+		if (trx->status != LIBUSB_TRANSFER_COMPLETED) {
+			dev_info(sdev->dev, "prefetch on ep %02x stops: %d",
+				 pf->ep, trx->status);
+			stub_prefetch_stop(pf);
+		}
+	}
+
+	stub_prefetch_serve(pf);
+	if (pf->running && pf->inflight < pf->depth && !pf->nidle) {
+		pf->overflows++;
+		usbip_metric_add(USBIP_M_prefetch_overflows, 1);
+	}
+	pthread_mutex_unlock(&sdev->priv_lock);
+}
+
+/*
+ * Take a CMD_SUBMIT for an endpoint with a policy: answered right away
+ * from the ring, or left waiting in priv_init. 0 if it is not for such
+ * an endpoint, 1 if taken, -1 if the endpoint does not start.
+ */
+int stub_prefetch_submit(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct stub_prefetch *pf;
+	int answered = 0, ret = 1;
+
+	if (!sdev->prefetch)
+		return 0;
+	pf = stub_prefetch_find(sdev, priv->trx->endpoint);
+	if (!pf)
+		return 0;
+
+	pthread_mutex_lock(&sdev->priv_lock);
+	if (pf->count) {
+		pf->hits++;
+		usbip_metric_add(USBIP_M_prefetch_hits, 1);
+		stub_prefetch_answer(pf, priv);
+		stub_prefetch_fill(pf);
+		answered = 1;
+	} else {
+		pf->waits++;
+		usbip_metric_add(USBIP_M_prefetch_waits, 1);
+		priv->waiting = 1;
+		if (stub_prefetch_start(pf)) {
+			priv->waiting = 0;
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&sdev->priv_lock);
+
+	if (answered)
+		stub_wake_tx(sdev);
+	return ret;
+}
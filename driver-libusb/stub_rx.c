@@ -4,9 +4,13 @@
  * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
  */
 
+#define _GNU_SOURCE
+
 #include "stub.h"
 #include <usbip_debug.h>
+#include <usbip_trace.h>
 #include <errno.h>
+#include <poll.h>
 #include <unistd.h>
 
 static int is_clear_halt_cmd(struct libusb_transfer *trx)
@@ -92,6 +96,7 @@ static int tweak_clear_halt_cmd(struct libusb_transfer *trx)
 
 static int tweak_set_interface_cmd(struct libusb_transfer *trx)
 {
+	struct stub_priv *priv = (struct stub_priv *) trx->user_data;
 	struct libusb_control_setup *req;
 	uint16_t alternate;
 	uint16_t interface;
@@ -104,6 +109,9 @@ static int tweak_set_interface_cmd(struct libusb_transfer *trx)
 	usbip_dbg_stub_rx("set_interface: inf %u alt %u",
 			  interface, alternate);
 
+	/* what was read ahead came from the setting left */
+	stub_prefetch_reset(priv->sdev, interface);
+
 	ret = libusb_set_interface_alt_setting(trx->dev_handle,
 			interface, alternate);
 	if (ret)
@@ -115,6 +123,14 @@ static int tweak_set_interface_cmd(struct libusb_transfer *trx)
 			"usb_set_interface done: inf %u alt %u",
 			interface, alternate);
 
+	/*
+	 * Switching settings drops the streams of the interface. UAS keeps
+	 * its stream endpoints in an alternate setting, so this is also where
+	 * they first become available.
+	 */
+	if (!ret)
+		stub_streams_alloc(priv->sdev);
+
 	return ret;
 }
 
@@ -156,6 +172,7 @@ static int tweak_reset_device_cmd(struct libusb_transfer *trx)
 	struct stub_device *sdev = priv->sdev;
 
 	dev_info(libusb_get_device(trx->dev_handle), "usb_queue_reset_device");
+	stub_prefetch_reset(sdev, -1);
 
 	/*
 	 * With the implementation of pre_reset and post_reset the driver no
@@ -198,6 +215,20 @@ static int tweak_special_requests(struct libusb_transfer *trx) {
     return -1;
 }
 
+/* the transfer of seqnum still at the device, be in priv_lock */
+struct stub_priv *stub_priv_lookup(struct stub_device *sdev, uint32_t seqnum)
+{
+	struct list_head *pos;
+	struct stub_priv *priv;
+
+	list_for_each(pos, &sdev->priv_init) {
+		priv = list_entry(pos, struct stub_priv, list);
+		if (priv->seqnum == seqnum)
+			return priv;
+	}
+	return NULL;
+}
+
 /*
  * stub_recv_unlink() unlinks the URB by a call to usb_unlink_urb().
  * By unlinking the urb asynchronously, stub_rx can continuously
@@ -210,15 +241,14 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 				struct usbip_header *pdu)
 {
 	int ret;
-	struct list_head *pos;
 	struct stub_priv *priv;
 
 	pthread_mutex_lock(&sdev->priv_lock);
 
-	list_for_each(pos, &sdev->priv_init) {
-		priv = list_entry(pos, struct stub_priv, list);
-		if (priv->seqnum != pdu->u.cmd_unlink.seqnum)
-			continue;
+	priv = stub_priv_lookup(sdev, pdu->u.cmd_unlink.seqnum);
+	if (priv) {
+		USBIP_PROBE5(unlink, pdu->base.seqnum, sdev->devid,
+			     pdu->base.ep, pdu->u.cmd_unlink.seqnum, 1);
 
 		dev_info(libusb_get_device(priv->trx->dev_handle), "unlink urb %p", priv->trx);
 
@@ -240,6 +270,19 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 		 */
 		priv->seqnum = pdu->base.seqnum;
 
+		/* not at the device but waiting for a prefetch */
+		if (priv->waiting) {
+			priv->trx->status = LIBUSB_TRANSFER_CANCELLED;
+			priv->trx->actual_length = 0;
+			stub_capture_complete(sdev, priv->trx);
+			stub_enqueue_ret_unlink(sdev, priv->seqnum,
+						LIBUSB_TRANSFER_CANCELLED, 0);
+			stub_free_priv_and_trx(priv);
+			pthread_mutex_unlock(&sdev->priv_lock);
+			stub_wake_tx(sdev);
+			return 0;
+		}
+
 		pthread_mutex_unlock(&sdev->priv_lock);
 
 		/*
@@ -272,21 +315,25 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 
 	usbip_dbg_stub_rx("seqnum %d is not pending",
 			  pdu->u.cmd_unlink.seqnum);
+	USBIP_PROBE5(unlink, pdu->base.seqnum, sdev->devid, pdu->base.ep,
+		     pdu->u.cmd_unlink.seqnum, 0);
 
 	/*
 	 * The urb of the unlink target is not found in priv_init queue. It was
 	 * already completed and its results is/was going to be sent by a
 	 * CMD_RET pdu. In this case, usb_unlink_urb() is not needed. We only
-	 * return the completeness of this unlink request to vhci_hcd.
+	 * return the completeness of this unlink request to vhci_hcd, after
+	 * the result if that is still queued.
 	 */
-	stub_enqueue_ret_unlink(sdev, pdu->base.seqnum, 0);
+	stub_enqueue_ret_unlink(sdev, pdu->base.seqnum, 0,
+				pdu->u.cmd_unlink.seqnum);
 
 	pthread_mutex_unlock(&sdev->priv_lock);
+	stub_wake_tx(sdev);
 
 	return 0;
 }
 
-/*
 static int valid_request(struct stub_device *sdev, struct usbip_header *pdu)
 {
 	struct usbip_device *ud = &sdev->ud;
@@ -295,9 +342,7 @@ static int valid_request(struct stub_device *sdev, struct usbip_header *pdu)
 	if (pdu->base.devid == sdev->devid) {
 		pthread_mutex_lock(&ud->lock);
 		if (ud->status == SDEV_ST_USED) {
-			*/
-/* A request is valid. *//*
-
+			/* A request is valid. */
 			valid = 1;
 		}
 		pthread_mutex_unlock(&ud->lock);
@@ -308,10 +353,9 @@ static int valid_request(struct stub_device *sdev, struct usbip_header *pdu)
 	}
 	return valid;
 }
-*/
 
-static struct stub_priv *stub_priv_alloc(struct stub_device *sdev,
-					 struct usbip_header *pdu)
+struct stub_priv *stub_priv_alloc(struct stub_device *sdev,
+				  struct usbip_header *pdu)
 {
 	struct stub_priv *priv;
 	struct usbip_device *ud = &sdev->ud;
@@ -367,6 +411,7 @@ static void masking_bogus_flags(struct libusb_transfer *trx)
 	/* enforce simple/standard policy */
 	switch (trx->type) {
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		if (is_out)
 			allowed |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
 		/* FALLTHROUGH */
@@ -381,6 +426,24 @@ static void masking_bogus_flags(struct libusb_transfer *trx)
 	trx->flags &= allowed;
 }
 
+/*
+ * Give back a request answered without the device, as if it had been
+ * completed by libusb.
+ */
+static void stub_complete_local(struct stub_device *sdev,
+				struct stub_priv *priv, int actual_length)
+{
+	priv->trx->status = LIBUSB_TRANSFER_COMPLETED;
+	priv->trx->actual_length = actual_length;
+	stub_capture_complete(sdev, priv->trx);
+
+	pthread_mutex_lock(&sdev->priv_lock);
+	stub_queue_priv_tx(sdev, priv);
+	pthread_mutex_unlock(&sdev->priv_lock);
+
+	stub_wake_tx(sdev);
+}
+
 static void stub_recv_cmd_submit(struct stub_device *sdev,
 				 struct usbip_header *pdu)
 {
@@ -451,29 +514,83 @@ static void stub_recv_cmd_submit(struct stub_device *sdev,
 	trx->user_data = priv;
 	trx->callback = stub_complete;
 
+	if (trx_type == LIBUSB_TRANSFER_TYPE_BULK &&
+	    (sdev->caps & USBIP_CAP_STREAMS) &&
+	    pdu->u.cmd_submit.start_frame) {
+		uint32_t stream_id = pdu->u.cmd_submit.start_frame;
+
+		if (!stub_stream_valid(sdev, endpoint, stream_id)) {
+			dev_err(sdev->dev, "no stream %u on ep %02x, seq %u",
+				stream_id, endpoint, pdu->base.seqnum);
+			usbip_event_add(ud, SDEV_EVENT_ERROR_SUBMIT);
+			return;
+		}
+		libusb_fill_bulk_stream_transfer(trx, dev_handle, endpoint,
+				stream_id, buf, buflen, stub_complete, priv, 0);
+	}
+
 	if (pdu->base.direction != USBIP_DIR_IN) {
-		if (usbip_recv_xbuff(ud, trx, offset) < 0)
+		if (stub_compress_framed(sdev, trx_type, buflen - offset))
+			ret = stub_decompress_recv(sdev, trx, offset);
+		else
+			ret = usbip_recv_xbuff(ud, trx, offset);
+		if (ret < 0)
 			return;
 	}
 
 	if (usbip_recv_iso(ud, trx) < 0)
 		return;
 
+	stub_capture_submit(sdev, trx, pdu);
+
+	if (trx_type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		struct libusb_control_setup *setup =
+			libusb_control_transfer_get_setup(trx);
+
+		if (pdu->base.direction == USBIP_DIR_IN) {
+			ret = stub_desc_cache_lookup(sdev, setup,
+						     buf + offset,
+						     trx->length - offset);
+			if (ret >= 0) {
+				usbip_dbg_stub_rx("cached answer seq %u",
+						  pdu->base.seqnum);
+				stub_complete_local(sdev, priv, ret);
+				return;
+			}
+		} else {
+			stub_desc_cache_invalidate(sdev, setup);
+		}
+	}
+
+	USBIP_PROBE5(submit, pdu->base.seqnum, sdev->devid, endpoint,
+		     trx->length, trx_type);
+
+	ret = stub_prefetch_submit(sdev, priv);
+	if (ret > 0)
+		return;
+	if (ret < 0) {
+		dev_err(sdev->dev, "prefetch error seq %u", pdu->base.seqnum);
+		usbip_event_add(ud, SDEV_EVENT_ERROR_SUBMIT);
+		return;
+	}
+
 	/* no need to submit an intercepted request, but harmless? */
 	ret = tweak_special_requests(trx);
     if (ret < 0) {
         masking_bogus_flags(trx);
 
         /* urb is now ready to submit */
+        pthread_mutex_lock(&sdev->priv_lock);
+        priv->submitted = 1;
+        pthread_mutex_unlock(&sdev->priv_lock);
         ret = libusb_submit_transfer(priv->trx);
+        if (ret) {
+            pthread_mutex_lock(&sdev->priv_lock);
+            priv->submitted = 0;
+            pthread_mutex_unlock(&sdev->priv_lock);
+        }
     } else {
-        priv->trx->status = LIBUSB_TRANSFER_COMPLETED;
-        priv->trx->actual_length = 0;
-        pthread_mutex_unlock(&sdev->priv_lock);
-        list_del(&priv->list);
-        list_add(&priv->list, sdev->priv_tx.prev);
-        pthread_mutex_unlock(&sdev->priv_lock);
-        pthread_mutex_unlock(&sdev->tx_waitq); //wakeup sleepy
+        stub_complete_local(sdev, priv, 0);
         ret = 0;
     }
 
@@ -484,22 +601,91 @@ static void stub_recv_cmd_submit(struct stub_device *sdev,
 		dev_err(sdev->dev, "ERRNO: %s", strerror(errno));
 		usbip_dump_header(pdu);
 		usbip_dump_trx(trx);
-		libusb_free_transfer(trx);
 
 		/*
 		 * Pessimistic.
-		 * This connection will be discarded.
+		 * This connection will be discarded, and trx freed with it.
 		 */
 		usbip_event_add(ud, SDEV_EVENT_ERROR_SUBMIT);
 	}
 }
 
+/*
+ * Unpack each entry of a USBIP_CMD_BATCH into a classic CMD_SUBMIT header
+ * and submit it; the transfer buffer of an OUT entry is read from the
+ * socket by stub_recv_cmd_submit() as usual.
+ */
+static void stub_recv_cmd_batch(struct stub_device *sdev,
+				struct usbip_header *batch)
+{
+	struct usbip_device *ud = &sdev->ud;
+	struct usbip_batch_entry ent;
+	struct usbip_header pdu;
+	uint64_t start = ud->rx_bytes;
+	uint32_t i, length;
+
+	if (!(sdev->caps & USBIP_CAP_BATCH)) {
+		dev_err(sdev->dev, "batch without negotiation");
+		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+		return;
+	}
+
+	for (i = 0; i < batch->u.batch.count; i++) {
+		if (usbip_recv(ud, &ent, sizeof(ent)) != sizeof(ent)) {
+			usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+			return;
+		}
+		usbip_batch_entry_correct_endian(&ent, 0);
+
+		memset(&pdu, 0, sizeof(pdu));
+		pdu.base.command = USBIP_CMD_SUBMIT;
+		pdu.base.seqnum = ent.seqnum;
+		pdu.base.devid = batch->base.devid;
+		pdu.base.direction = (ent.flags & USBIP_BATCH_IN) ?
+					USBIP_DIR_IN : USBIP_DIR_OUT;
+		pdu.base.ep = ent.ep;
+		pdu.u.cmd_submit.transfer_flags = ent.value;
+		pdu.u.cmd_submit.transfer_buffer_length = ent.length;
+		pdu.u.cmd_submit.start_frame = ent.stream_id;
+
+		if (ent.flags & USBIP_BATCH_SETUP) {
+			if (usbip_recv(ud, pdu.u.cmd_submit.setup, 8) != 8) {
+				usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+				return;
+			}
+		}
+
+		/* bulk buffers may be compressed, so count what was read */
+		if (stub_get_transfer_type(sdev, ent.ep) ==
+				LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ||
+		    ud->rx_bytes - start > batch->u.batch.length) {
+			dev_err(sdev->dev, "malformed batch entry %u", i);
+			usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+			return;
+		}
+
+		if (usbip_dbg_flag_stub_rx)
+			usbip_dump_header(&pdu);
+		stub_recv_cmd_submit(sdev, &pdu);
+		if (usbip_event_happened(ud))
+			return;
+	}
+
+	length = ud->rx_bytes - start;
+	if (length != batch->u.batch.length) {
+		dev_err(sdev->dev, "batch length %u, expected %u",
+			length, batch->u.batch.length);
+		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+	}
+}
+
 /* recv a pdu */
 static void stub_rx_pdu(struct usbip_device *ud)
 {
 	int ret;
 	struct usbip_header pdu;
 	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+	struct stub_device *target;
 
 again:
 	memset(&pdu, 0, sizeof(pdu));
@@ -522,18 +708,34 @@ again:
 	if (usbip_dbg_flag_stub_rx)
 		usbip_dump_header(&pdu);
 
+	USBIP_PROBE5(pdu_recv, pdu.base.seqnum, pdu.base.devid, pdu.base.ep,
+		     pdu.base.command == USBIP_CMD_SUBMIT ?
+			pdu.u.cmd_submit.transfer_buffer_length : 0,
+		     pdu.base.command);
+
 	if (pdu.base.command == USBIP_NOP) {
 		usbip_dbg_stub_rx("nop command");
 		goto again;
 	}
 
-/*
-	if (!valid_request(sdev, &pdu)) {
-		dev_err(sdev->dev, "recv invalid request");
-		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
-		return;
+	/*
+	 * Classic clients get away with any devid, so it only counts when
+	 * devices share the connection.
+	 */
+	if (sdev->caps & USBIP_CAP_MUX) {
+		if (pdu.base.command == USBIP_CMD_IMPORT) {
+			stub_mux_import(sdev, &pdu);
+			return;
+		}
+		target = stub_mux_lookup(sdev, pdu.base.devid);
+		if (!target || !valid_request(target, &pdu)) {
+			dev_err(sdev->dev, "recv request for devid %08x",
+				pdu.base.devid);
+			usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+			return;
+		}
+		sdev = target;
 	}
-*/
 
 	switch (pdu.base.command) {
 	case USBIP_CMD_UNLINK:
@@ -542,6 +744,9 @@ again:
 	case USBIP_CMD_SUBMIT:
 		stub_recv_cmd_submit(sdev, &pdu);
 		break;
+	case USBIP_CMD_BATCH:
+		stub_recv_cmd_batch(sdev, &pdu);
+		break;
 	default:
 		/* NOTREACHED */
 		dev_err(sdev->dev, "unknown pdu");
@@ -550,6 +755,57 @@ again:
 	}
 }
 
+/*
+ * Spin for the next request, see stub_wait.c. Parking is just receiving
+ * it, which sleeps in the socket; the rings of USBIP_CAP_SHM do their own
+ * waiting.
+ */
+static void stub_rx_wait(struct stub_device *sdev)
+{
+	struct stub_waiter *w = &sdev->rx_wait;
+	struct pollfd pfd = { .fd = sdev->ud.sock_fd, .events = POLLIN };
+	struct timespec ts;
+	unsigned int window, doze;
+	uint64_t now, spun = 0;
+	int ret;
+
+	if (sdev->ud.shm || !w->max_us)
+		return;
+
+	now = usbip_now_us();
+	if (poll(&pfd, 1, 0) != 0) {
+		stub_wait_found(w, now, 0);
+		return;
+	}
+
+	window = stub_wait_window(w, now, &doze);
+	if (doze) {
+		stub_wait_parking(now, 0);
+		ts.tv_sec = doze / 1000000;
+		ts.tv_nsec = doze % 1000000 * 1000;
+		ret = ppoll(&pfd, 1, &ts, NULL);
+		now = usbip_now_us();
+		if (ret != 0) {
+			stub_wait_found(w, now, 0);
+			return;
+		}
+	}
+	if (window) {
+		for (spun = now; now - spun < window; ) {
+			stub_wait_relax();
+			now = usbip_now_us();
+			if (poll(&pfd, 1, 0) != 0) {
+				stub_wait_found(w, now, spun);
+				return;
+			}
+		}
+	}
+
+	stub_wait_parking(now, spun);
+	poll(&pfd, 1, -1);
+	stub_wait_found(w, usbip_now_us(), 0);
+}
+
 void *stub_rx_loop(void *data)
 {
 	struct stub_device *sdev = (struct stub_device *)data;
@@ -559,6 +815,7 @@ void *stub_rx_loop(void *data)
 		if (usbip_event_happened(ud))
 			break;
 
+		stub_rx_wait(sdev);
 		stub_rx_pdu(ud);
 	}
 	usbip_dbg_stub_rx("end of stub_rx_loop");
@@ -0,0 +1,178 @@
+/*
+ * Shaping of the results devices send
+ *
+ * A device with a limit has a token bucket of burst bytes filled at its
+ * limit. A result leaves while the bucket is not empty and may drive it
+ * into debt, so results larger than the burst still go out, just less
+ * often.
+ *
+ * With weights, devices competing for the uplink are scheduled by virtual
+ * time: every result advances the finish time of its device by its size
+ * over the weight, and a device that got more than a window ahead of the
+ * slowest device still competing waits for it. A device competes while it
+ * asked to send within the last STUB_SHAPE_ACTIVE_US; one coming back
+ * starts from the others' virtual time instead of its old finish time, so
+ * idling earns no credit. Each device decides in its own tx thread, or in
+ * that of its connection with USBIP_CAP_MUX, and retries on the next round
+ * of the loop.
+ *
+ * Results are charged with their header and IN data, the bytes they
+ * put on the wire before compression.
+ */
+
+#include "stub.h"
+#include <usbip_debug.h>
+#include <usbip_metrics.h>
+
+#define STUB_SHAPE_BURST_MIN	(64 << 10)
+#define STUB_SHAPE_BURST_MS	10
+#define STUB_SHAPE_WINDOW	(64 << 10)	/* virtual bytes */
+#define STUB_SHAPE_ACTIVE_US	1000
+
+struct stub_shape {
+	struct list_head list;	/* in stub_shapes, with a weight */
+	uint64_t rate;		/* bytes per second, 0 for no limit */
+	int64_t burst;
+	int64_t tokens;
+	uint64_t stamp;
+	unsigned int weight;	/* 0 for no fair scheduling */
+	uint64_t vfinish;
+	uint64_t seen;
+	uint64_t bytes;
+	uint64_t limited;	/* rounds waiting on the limit */
+	uint64_t yielded;	/* rounds yielding to other devices */
+};
+
+static LIST_HEAD(stub_shapes);
+static pthread_mutex_t stub_shapes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the least finish time of competing devices but shape, under the lock */
+static int stub_shape_vtime(struct stub_shape *shape, uint64_t now,
+			    uint64_t *vtime)
+{
+	struct list_head *pos;
+	struct stub_shape *other;
+	int found = 0;
+
+	list_for_each(pos, &stub_shapes) {
+		other = list_entry(pos, struct stub_shape, list);
+		if (other == shape || now - other->seen > STUB_SHAPE_ACTIVE_US)
+			continue;
+		if (!found || other->vfinish < *vtime)
+			*vtime = other->vfinish;
+		found = 1;
+	}
+	return found;
+}
+
+void stub_shape_attach(struct stub_device *sdev, enum usbip_traffic_class tc)
+{
+	struct usbip_shaping shaping;
+	struct stub_shape *shape;
+	uint64_t vtime = 0;
+
+	usbip_sockopt_shaping(sdev->udev.busid, tc, &shaping);
+	if (!shaping.limit && !shaping.weight)
+		return;
+
+	shape = (struct stub_shape *)calloc(1, sizeof(*shape));
+	if (!shape) {
+		dev_err(sdev->dev, "no memory to shape");
+		return;
+	}
+
+	shape->rate = shaping.limit * 125000ULL;
+	shape->burst = shaping.burst;
+	if (!shape->burst) {
+		shape->burst = shape->rate * STUB_SHAPE_BURST_MS / 1000;
+		if (shape->burst < STUB_SHAPE_BURST_MIN)
+			shape->burst = STUB_SHAPE_BURST_MIN;
+	}
+	shape->tokens = shape->burst;
+	shape->stamp = usbip_now_us();
+	shape->weight = shaping.weight;
+
+	if (shape->weight) {
+		pthread_mutex_lock(&stub_shapes_lock);
+		if (stub_shape_vtime(shape, shape->stamp, &vtime))
+			shape->vfinish = vtime;
+		list_add(&shape->list, &stub_shapes);
+		pthread_mutex_unlock(&stub_shapes_lock);
+	}
+
+	sdev->shape = shape;
+	dev_info(sdev->dev, "shaped to %d Mbit/s with burst %lld, weight %u",
+		 shaping.limit, (long long)shape->burst, shape->weight);
+}
+
+void stub_shape_detach(struct stub_device *sdev)
+{
+	struct stub_shape *shape = sdev->shape;
+
+	if (!shape)
+		return;
+
+	if (shape->weight) {
+		pthread_mutex_lock(&stub_shapes_lock);
+		list_del(&shape->list);
+		pthread_mutex_unlock(&stub_shapes_lock);
+	}
+
+	info("%s shaping: %llu bytes, %llu rounds limited, %llu yielded",
+	     sdev->udev.busid, (unsigned long long)shape->bytes,
+	     (unsigned long long)shape->limited,
+	     (unsigned long long)shape->yielded);
+	free(shape);
+	sdev->shape = NULL;
+}
+
+/* whether sdev may send a result of len bytes now, charging it if so */
+int stub_shape_admit(struct stub_device *sdev, size_t len)
+{
+	struct stub_shape *shape = sdev->shape;
+	uint64_t now, vtime = 0, fill;
+	int others;
+
+	if (!shape)
+		return 1;
+
+	now = usbip_now_us();
+
+	if (shape->rate) {
+		/* a slow device may earn less than a byte per round */
+		fill = (now - shape->stamp) * shape->rate / 1000000;
+		if (fill) {
+			shape->tokens += fill;
+			if (shape->tokens > shape->burst)
+				shape->tokens = shape->burst;
+			shape->stamp = now;
+		}
+		if (shape->tokens <= 0) {
+			shape->limited++;
+			usbip_metric_add(USBIP_M_shape_limited, 1);
+			return 0;
+		}
+	}
+
+	if (shape->weight) {
+		pthread_mutex_lock(&stub_shapes_lock);
+		others = stub_shape_vtime(shape, now, &vtime);
+		if (others && now - shape->seen > STUB_SHAPE_ACTIVE_US &&
+		    shape->vfinish < vtime)
+			shape->vfinish = vtime;
+		shape->seen = now;
+		if (others && shape->vfinish > vtime + STUB_SHAPE_WINDOW) {
+			pthread_mutex_unlock(&stub_shapes_lock);
+			shape->yielded++;
+			usbip_metric_add(USBIP_M_shape_yielded, 1);
+			return 0;
+		}
+		shape->vfinish += len / shape->weight;
+		pthread_mutex_unlock(&stub_shapes_lock);
+	}
+
+	shape->tokens -= len;
+	shape->bytes += len;
+	usbip_metric_add(USBIP_M_shape_bytes, len);
+	return 1;
+}
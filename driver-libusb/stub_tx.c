@@ -4,23 +4,60 @@
  * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
  */
 
+#include <arpa/inet.h>
+
 #include "stub.h"
 #include <usbip_debug.h>
+#include <usbip_trace.h>
+
+/*
+ * Bulk results sent in a row before tx looks for completions again, which
+ * may then go out ahead of the remaining bulk results. A result itself is
+ * never split: the next pdu can only follow its whole payload.
+ */
+#define STUB_TX_SLICE	(64 << 10)
 
-static void stub_free_priv_and_trx(struct stub_priv *priv)
+void stub_free_priv_and_trx(struct stub_priv *priv)
 {
 	struct libusb_transfer *trx = priv->trx;
 
-	free(trx->buffer);
+	free(priv->zbuf);
 	list_del(&priv->list);
 	free(priv);
+	if (!trx)
+		return;
+	free(trx->buffer);
 	usbip_dbg_stub_tx("freeing trx %p", trx);
 	libusb_free_transfer(trx);
 }
 
-/* be in spin_lock_irqsave(&sdev->priv_lock, flags) */
+/* be in priv_lock, whether the result of seqnum is yet to be sent */
+static int stub_priv_tx_queued(struct stub_device *sdev, uint32_t seqnum)
+{
+	struct list_head *pos;
+	int q;
+
+	for (q = 0; q < STUB_TXQ_NUM; q++) {
+		list_for_each(pos, &sdev->priv_tx[q]) {
+			if (list_entry(pos, struct stub_priv, list)->seqnum ==
+			    seqnum)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * be in spin_lock_irqsave(&sdev->priv_lock, flags)
+ *
+ * after is the seqnum of a completed transfer the unlink came too late
+ * for. Shaping may still hold its RET_SUBMIT in priv_tx, and vhci must
+ * see that before the RET_UNLINK, or it gives the URB back without its
+ * data and drops the connection on the late result.
+ */
 void stub_enqueue_ret_unlink(struct stub_device *sdev, uint32_t seqnum,
-			     enum libusb_transfer_status status)
+			     enum libusb_transfer_status status,
+			     uint32_t after)
 {
 	struct stub_unlink *unlink;
 
@@ -32,6 +69,8 @@ void stub_enqueue_ret_unlink(struct stub_device *sdev, uint32_t seqnum,
 
 	unlink->seqnum = seqnum;
 	unlink->status = status;
+	if (after && stub_priv_tx_queued(sdev, after))
+		unlink->after = after;
 
 	list_add(&unlink->list, sdev->unlink_tx.prev);
 }
@@ -51,6 +90,8 @@ void LIBUSB_CALL stub_complete(struct libusb_transfer *trx)
 	struct stub_device *sdev = priv->sdev;
 
 	usbip_dbg_stub_tx("complete %p! status %d", trx, trx->status);
+	USBIP_PROBE5(complete, priv->seqnum, sdev->devid, trx->endpoint,
+		     trx->actual_length, trx->status);
 
 	switch (trx->status) {
 	case LIBUSB_TRANSFER_COMPLETED:
@@ -65,7 +106,10 @@ void LIBUSB_CALL stub_complete(struct libusb_transfer *trx)
 	    }
 		break;
 	case LIBUSB_TRANSFER_CANCELLED:
-		dev_info(sdev->dev, "unlinked by a call to usb_unlink_urb()");
+		/* a teardown cancels everything, which is no news */
+		if (!stub_should_stop(sdev))
+			dev_info(sdev->dev,
+				 "unlinked by a call to usb_unlink_urb()");
 		break;
 	case LIBUSB_TRANSFER_STALL:
 		dev_err(sdev->dev, "endpoint %d is stalled", trx->endpoint);
@@ -78,22 +122,21 @@ void LIBUSB_CALL stub_complete(struct libusb_transfer *trx)
 		break;
 	}
 
+	stub_capture_complete(sdev, trx);
+
 	/* link a urb to the queue of tx. */
 	pthread_mutex_lock(&sdev->priv_lock);
+	priv->submitted = 0;
 	if (!sdev->ud.sock_fd) {
 		dev_info(sdev->dev,
 			"urb discarded in closed connection");
 	} else if (priv->unlinking) {
-		stub_enqueue_ret_unlink(sdev, priv->seqnum, trx->status);
+		stub_enqueue_ret_unlink(sdev, priv->seqnum, trx->status, 0);
 		stub_free_priv_and_trx(priv);
 	} else {
-		list_del(&priv->list);
-		list_add(&priv->list, sdev->priv_tx.prev);
+		stub_queue_priv_tx(sdev, priv);
 	}
 	pthread_mutex_unlock(&sdev->priv_lock);
-
-	/* wake up tx_thread */
-	pthread_mutex_unlock(&sdev->tx_waitq);
 }
 
 static inline void setup_base_pdu(struct usbip_header_basic *base,
@@ -112,34 +155,112 @@ static void setup_ret_submit_pdu(struct usbip_header *rpdu,
 	struct stub_priv *priv = (struct stub_priv *) trx->user_data;
 
 	setup_base_pdu(&rpdu->base, USBIP_RET_SUBMIT, priv->seqnum);
+	rpdu->base.devid = priv->sdev->devid;
 	usbip_pack_ret_submit(rpdu, trx);
 }
 
-static void setup_ret_unlink_pdu(struct usbip_header *rpdu,
+static void setup_ret_unlink_pdu(struct stub_device *sdev,
+				 struct usbip_header *rpdu,
 				 struct stub_unlink *unlink)
 {
 	setup_base_pdu(&rpdu->base, USBIP_RET_UNLINK, unlink->seqnum);
+	rpdu->base.devid = sdev->devid;
 	usbip_pack_ret_unlink(rpdu, unlink);
 }
 
-static struct stub_priv *dequeue_from_priv_tx(struct stub_device *sdev)
+/*
+ * be in pthread_mutex_lock(&lead->mux_lock), sdev is the imported device
+ * or NULL if status says why there is none
+ */
+void stub_enqueue_ret_import(struct stub_device *lead, uint32_t seqnum,
+			     uint32_t status, struct stub_device *sdev)
 {
-	struct list_head *pos, *tmp;
-	struct stub_priv *priv;
+	struct stub_mux_reply *reply;
+
+	reply = (struct stub_mux_reply *)calloc(1, sizeof(*reply));
+	if (!reply) {
+		usbip_event_add(&lead->ud, SDEV_EVENT_ERROR_MALLOC);
+		return;
+	}
+
+	setup_base_pdu(&reply->hdr.base, USBIP_RET_IMPORT, seqnum);
+	reply->hdr.u.ret_import.status = status;
+	if (sdev) {
+		reply->hdr.base.devid = sdev->devid;
+		memcpy(&reply->udev, &sdev->udev, sizeof(reply->udev));
+		PACK_OP_IMPORT_REPLY(1, reply->udev);
+	}
+	usbip_header_correct_endian(&reply->hdr, 1);
+
+	list_add(&reply->list, lead->mux_replies.prev);
+}
+
+/* what the result of priv puts on the wire, uncompressed */
+static size_t stub_ret_submit_len(struct stub_priv *priv)
+{
+	struct libusb_transfer *trx = priv->trx;
+	size_t len = sizeof(struct usbip_header);
+	int i;
+
+	if (trx->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		len += trx->num_iso_packets *
+			sizeof(struct usbip_iso_packet_descriptor);
+		for (i = 0; i < trx->num_iso_packets; i++)
+			len += trx->iso_packet_desc[i].actual_length;
+	} else if (priv->dir == USBIP_DIR_IN && trx->actual_length > 0) {
+		len += trx->actual_length;
+	}
+	return len;
+}
+
+static enum stub_txq stub_txq(struct libusb_transfer *trx)
+{
+	switch (trx->type) {
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return STUB_TXQ_ISO;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+		return STUB_TXQ_BULK;
+	default:
+		return STUB_TXQ_CONTROL;
+	}
+}
+
+/* be in priv_lock, priv completed and is to be sent */
+void stub_queue_priv_tx(struct stub_device *sdev, struct stub_priv *priv)
+{
+	list_del(&priv->list);
+	list_add(&priv->list, sdev->priv_tx[stub_txq(priv->trx)].prev);
+}
+
+/* the next result to send by stub_txq, unless shaping holds it back */
+struct stub_priv *stub_dequeue_priv_tx(struct stub_device *sdev)
+{
+	struct list_head *bulk = &sdev->priv_tx[STUB_TXQ_BULK];
+	struct stub_priv *priv = NULL;
+	int q;
 
 	pthread_mutex_lock(&sdev->priv_lock);
 
-	list_for_each_safe(pos, tmp, &sdev->priv_tx) {
-		priv = list_entry(pos, struct stub_priv, list);
+	for (q = 0; q < STUB_TXQ_NUM; q++) {
+		if (sdev->priv_tx[q].next == &sdev->priv_tx[q])
+			continue;
+		priv = list_entry(sdev->priv_tx[q].next, struct stub_priv,
+				  list);
+		if (!stub_shape_admit(sdev, stub_ret_submit_len(priv))) {
+			priv = NULL;
+			break;
+		}
+		if (q != STUB_TXQ_BULK && bulk->next != bulk)
+			usbip_metric_add(USBIP_M_tx_ahead_of_bulk, 1);
 		list_del(&priv->list);
 		list_add(&priv->list, sdev->priv_free.prev);
-		pthread_mutex_unlock(&sdev->priv_lock);
-		return priv;
+		break;
 	}
 
 	pthread_mutex_unlock(&sdev->priv_lock);
 
-	return NULL;
+	return priv;
 }
 
 static void fixup_actual_length(struct libusb_transfer *trx)
@@ -152,115 +273,308 @@ static void fixup_actual_length(struct libusb_transfer *trx)
 	trx->actual_length = len;
 }
 
-static int stub_send_ret_submit(struct stub_device *sdev)
+/* send the result of priv as a classic USBIP_RET_SUBMIT */
+static ssize_t stub_send_ret_submit_one(struct stub_device *sdev,
+					struct stub_priv *priv)
 {
-	struct list_head *pos, *tmp;
-	struct stub_priv *priv;
-	size_t total_size = 0;
+	struct libusb_transfer *trx = priv->trx;
+	size_t sent;
+	struct usbip_header pdu_header;
+	struct usbip_iso_packet_descriptor *iso_buffer = NULL;
+	struct iovec iov[3 + trx->num_iso_packets];
+	int iovnum = 0;
+	int offset = 0;
+	size_t txsize = 0;
+	uint32_t zhdr;
+	int zlen;
+
+	memset(&pdu_header, 0, sizeof(pdu_header));
+
+	if (trx->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		fixup_actual_length(trx);
+	}
 
-	while ((priv = dequeue_from_priv_tx(sdev)) != NULL) {
-		size_t sent;
-		struct libusb_transfer *trx = priv->trx;
-		struct usbip_header pdu_header;
-		struct usbip_iso_packet_descriptor *iso_buffer = NULL;
-		struct iovec iov[2 + trx->num_iso_packets];
-		int iovnum = 0;
-		int offset = 0;
-		size_t txsize = 0;
+	/* 1. setup usbip_header */
+	setup_ret_submit_pdu(&pdu_header, trx);
+	usbip_dbg_stub_tx("setup txdata seqnum: %d trx: %p actl: %d",
+		  pdu_header.base.seqnum, trx, trx->actual_length);
+	usbip_header_correct_endian(&pdu_header, 1);
+
+	iov[iovnum].iov_base = &pdu_header;
+	iov[iovnum].iov_len  = sizeof(pdu_header);
+	iovnum++;
+	txsize += sizeof(pdu_header);
+
+	/* 2. setup transfer buffer */
+	if (priv->dir == USBIP_DIR_IN &&
+		trx->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
+		trx->actual_length > 0) {
+		if (trx->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			offset = 8;
+		zlen = 0;
+		if (stub_compress_framed(sdev, trx->type,
+					 trx->actual_length)) {
+			zlen = stub_compress_payload(sdev, priv,
+					trx->buffer + offset,
+					trx->actual_length);
+			zhdr = htonl(zlen);
+			iov[iovnum].iov_base = &zhdr;
+			iov[iovnum].iov_len  = sizeof(zhdr);
+			iovnum++;
+			txsize += sizeof(zhdr);
+		}
+		if (zlen) {
+			iov[iovnum].iov_base = priv->zbuf;
+			iov[iovnum].iov_len  = zlen;
+			txsize += zlen;
+		} else {
+			iov[iovnum].iov_base = trx->buffer + offset;
+			iov[iovnum].iov_len  = trx->actual_length;
+			txsize += trx->actual_length;
+		}
+		iovnum++;
+	} else if (priv->dir == USBIP_DIR_IN &&
+		trx->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		/*
+		 * For isochronous packets: actual length is the sum of
+		 * the actual length of the individual, packets, but as
+		 * the packet offsets are not changed there will be
+		 * padding between the packets. To optimally use the
+		 * bandwidth the padding is not transmitted.
+		 */
+		int i;
 
-		memset(&pdu_header, 0, sizeof(pdu_header));
+		for (i = 0; i < trx->num_iso_packets; i++) {
+			iov[iovnum].iov_base = trx->buffer + offset;
+			iov[iovnum].iov_len =
+				trx->iso_packet_desc[i].actual_length;
+			iovnum++;
+			offset += trx->iso_packet_desc[i].length;
+			txsize += trx->iso_packet_desc[i].actual_length;
+		}
 
-		if (trx->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-			fixup_actual_length(trx);
+		if (txsize != sizeof(pdu_header) + trx->actual_length) {
+			dev_err(sdev->dev,
+				"actual length of urb %d does not ",
+				trx->actual_length);
+			dev_err(sdev->dev,
+				"match iso packet sizes %zu",
+				txsize-sizeof(pdu_header));
+			usbip_event_add(&sdev->ud,
+					SDEV_EVENT_ERROR_TCP);
+			return -1;
 		}
+	}
 
-		/* 1. setup usbip_header */
-		setup_ret_submit_pdu(&pdu_header, trx);
-		usbip_dbg_stub_tx("setup txdata seqnum: %d trx: %p actl: %d",
-			  pdu_header.base.seqnum, trx, trx->actual_length);
-		usbip_header_correct_endian(&pdu_header, 1);
+	/* 3. setup iso_packet_descriptor */
+	if (trx->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		ssize_t len = 0;
 
-		iov[iovnum].iov_base = &pdu_header;
-		iov[iovnum].iov_len  = sizeof(pdu_header);
+		iso_buffer = usbip_alloc_iso_desc_pdu(trx, &len);
+		if (!iso_buffer) {
+			usbip_event_add(&sdev->ud,
+					SDEV_EVENT_ERROR_MALLOC);
+			return -1;
+		}
+
+		iov[iovnum].iov_base = iso_buffer;
+		iov[iovnum].iov_len  = len;
+		txsize += len;
 		iovnum++;
-		txsize += sizeof(pdu_header);
+	}
 
-		/* 2. setup transfer buffer */
-		if (priv->dir == USBIP_DIR_IN &&
-			trx->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
-			trx->actual_length > 0) {
-			if (trx->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-				offset = 8;
-			iov[iovnum].iov_base = trx->buffer + offset;
-			iov[iovnum].iov_len  = trx->actual_length;
-			iovnum++;
-			txsize += trx->actual_length;
-		} else if (priv->dir == USBIP_DIR_IN &&
-			trx->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-			/*
-			 * For isochronous packets: actual length is the sum of
-			 * the actual length of the individual, packets, but as
-			 * the packet offsets are not changed there will be
-			 * padding between the packets. To optimally use the
-			 * bandwidth the padding is not transmitted.
-			 */
-			int i;
-
-			for (i = 0; i < trx->num_iso_packets; i++) {
-				iov[iovnum].iov_base = trx->buffer + offset;
-				iov[iovnum].iov_len =
-					trx->iso_packet_desc[i].actual_length;
-				iovnum++;
-				offset += trx->iso_packet_desc[i].length;
-				txsize += trx->iso_packet_desc[i].actual_length;
-			}
+	sent = usbip_sendmsg(&sdev->ud, iov,  iovnum);
+	if (sent != txsize) {
+		dev_err(sdev->dev,
+			"sendmsg failed!, retval %zd for %zd",
+			sent, txsize);
+		free(iso_buffer);
+		usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
+		return -1;
+	}
 
-			if (txsize != sizeof(pdu_header) + trx->actual_length) {
-				dev_err(sdev->dev,
-					"actual length of urb %d does not ",
-					trx->actual_length);
-				dev_err(sdev->dev,
-					"match iso packet sizes %zu",
-					txsize-sizeof(pdu_header));
-				usbip_event_add(&sdev->ud,
-						SDEV_EVENT_ERROR_TCP);
-				return -1;
-			}
-		}
+	if (iso_buffer)
+		free(iso_buffer);
 
-		/* 3. setup iso_packet_descriptor */
-		if (trx->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-			ssize_t len = 0;
+	USBIP_PROBE5(ret_submit, priv->seqnum, sdev->devid, trx->endpoint,
+		     trx->actual_length, trx->status);
+	return txsize;
+}
 
-			iso_buffer = usbip_alloc_iso_desc_pdu(trx, &len);
-			if (!iso_buffer) {
-				usbip_event_add(&sdev->ud,
-						SDEV_EVENT_ERROR_MALLOC);
-				return -1;
-			}
+/*
+ * Results collected for a USBIP_RET_BATCH. Entries are only built when
+ * the batch is sent, a batch of one goes out as a classic pdu.
+ */
+#define STUB_BATCH_MAX	64
+
+struct stub_batch {
+	struct usbip_header hdr;
+	struct stub_priv *privs[STUB_BATCH_MAX];
+	struct usbip_batch_entry ent[STUB_BATCH_MAX];
+	uint32_t zhdr[STUB_BATCH_MAX];
+	struct iovec iov[1 + 3 * STUB_BATCH_MAX];
+	int count;
+};
+
+static int stub_batch_accepts(struct stub_device *sdev,
+			      struct stub_priv *priv)
+{
+	return (sdev->caps & USBIP_CAP_BATCH) &&
+		priv->trx->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+}
+
+static ssize_t stub_batch_flush(struct stub_device *sdev,
+				struct stub_batch *batch)
+{
+	struct usbip_header ret;
+	size_t txsize, sent;
+	int i, n, iovnum = 1;
+
+	if (batch->count == 0)
+		return 0;
+
+	if (batch->count == 1) {
+		batch->count = 0;
+		return stub_send_ret_submit_one(sdev, batch->privs[0]);
+	}
+
+	txsize = sizeof(batch->hdr);
+	for (i = 0; i < batch->count; i++) {
+		struct stub_priv *priv = batch->privs[i];
+		struct libusb_transfer *trx = priv->trx;
+		struct usbip_batch_entry *ent = &batch->ent[i];
+
+		usbip_pack_ret_submit(&ret, trx);
+
+		memset(ent, 0, sizeof(*ent));
+		ent->seqnum = priv->seqnum;
+		ent->ep = trx->endpoint & USB_ENDPOINT_NUMBER_MASK;
+		ent->flags = priv->dir == USBIP_DIR_IN ? USBIP_BATCH_IN : 0;
+		ent->length = trx->actual_length;
+		ent->value = ret.u.ret_submit.status;
+		usbip_batch_entry_correct_endian(ent, 1);
+
+		batch->iov[iovnum].iov_base = ent;
+		batch->iov[iovnum].iov_len = sizeof(*ent);
+		iovnum++;
+		txsize += sizeof(*ent);
 
-			iov[iovnum].iov_base = iso_buffer;
-			iov[iovnum].iov_len  = len;
-			txsize += len;
+		if (priv->dir == USBIP_DIR_IN && trx->actual_length > 0) {
+			int offset = trx->type == LIBUSB_TRANSFER_TYPE_CONTROL ?
+					8 : 0;
+
+			if (stub_compress_framed(sdev, trx->type,
+						 trx->actual_length)) {
+				int zlen = stub_compress_payload(sdev, priv,
+						trx->buffer + offset,
+						trx->actual_length);
+
+				batch->zhdr[i] = htonl(zlen);
+				batch->iov[iovnum].iov_base = &batch->zhdr[i];
+				batch->iov[iovnum].iov_len = sizeof(uint32_t);
+				iovnum++;
+				txsize += sizeof(uint32_t);
+				if (zlen) {
+					batch->iov[iovnum].iov_base =
+						priv->zbuf;
+					batch->iov[iovnum].iov_len = zlen;
+					iovnum++;
+					txsize += zlen;
+					continue;
+				}
+			}
+			batch->iov[iovnum].iov_base = trx->buffer + offset;
+			batch->iov[iovnum].iov_len = trx->actual_length;
 			iovnum++;
+			txsize += trx->actual_length;
 		}
+	}
 
-		sent = usbip_sendmsg(&sdev->ud, iov,  iovnum);
-		if (sent != txsize) {
-			dev_err(sdev->dev,
-				"sendmsg failed!, retval %zd for %zd",
-				sent, txsize);
-			free(iso_buffer);
-			usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
-			return -1;
-		}
+	memset(&batch->hdr, 0, sizeof(batch->hdr));
+	setup_base_pdu(&batch->hdr.base, USBIP_RET_BATCH, 0);
+	batch->hdr.base.devid = sdev->devid;
+	batch->hdr.u.batch.count = batch->count;
+	batch->hdr.u.batch.length = txsize - sizeof(batch->hdr);
+	usbip_dbg_stub_tx("setup batch count: %d length: %zu",
+			  batch->count, txsize);
+	usbip_header_correct_endian(&batch->hdr, 1);
+
+	batch->iov[0].iov_base = &batch->hdr;
+	batch->iov[0].iov_len = sizeof(batch->hdr);
+	n = batch->count;
+	batch->count = 0;
+
+	sent = usbip_sendmsg(&sdev->ud, batch->iov, iovnum);
+	if (sent != txsize) {
+		dev_err(sdev->dev, "sendmsg failed!, retval %zd for %zd",
+			sent, txsize);
+		usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
+		return -1;
+	}
 
-		if (iso_buffer)
-			free(iso_buffer);
+	for (i = 0; i < n; i++)
+		USBIP_PROBE5(ret_submit, batch->privs[i]->seqnum, sdev->devid,
+			     batch->privs[i]->trx->endpoint,
+			     batch->privs[i]->trx->actual_length,
+			     batch->privs[i]->trx->status);
+	return txsize;
+}
+
+static void poll_events_and_complete(struct stub_device *sdev,
+				     unsigned int timeout_us)
+{
+	struct timeval tv = {0, timeout_us};
+	int ret;
+
+	ret = libusb_handle_events_timeout(stub_libusb_ctx, &tv);
+	if (ret != 0 && ret != LIBUSB_ERROR_TIMEOUT)
+		usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_SUBMIT);
+}
 
+static int stub_send_ret_submit(struct stub_device *sdev)
+{
+	struct list_head *pos, *tmp;
+	struct stub_priv *priv;
+	struct stub_batch batch;
+	size_t total_size = 0, slice = 0;
+	ssize_t txsize;
+
+	batch.count = 0;
+
+	while ((priv = stub_dequeue_priv_tx(sdev)) != NULL) {
+		if (stub_txq(priv->trx) == STUB_TXQ_BULK)
+			slice += stub_ret_submit_len(priv);
+
+		if (stub_batch_accepts(sdev, priv)) {
+			batch.privs[batch.count++] = priv;
+			txsize = 0;
+			if (batch.count == STUB_BATCH_MAX ||
+			    slice >= STUB_TX_SLICE)
+				txsize = stub_batch_flush(sdev, &batch);
+		} else {
+			/* keep results in the order they were dequeued */
+			txsize = stub_batch_flush(sdev, &batch);
+			if (txsize >= 0) {
+				total_size += txsize;
+				txsize = stub_send_ret_submit_one(sdev, priv);
+			}
+		}
+		if (txsize < 0)
+			return -1;
 		total_size += txsize;
+
+		if (slice >= STUB_TX_SLICE) {
+			slice = 0;
+			usbip_metric_add(USBIP_M_tx_bulk_slices, 1);
+			poll_events_and_complete(sdev, 0);
+		}
 	}
 
+	txsize = stub_batch_flush(sdev, &batch);
+	if (txsize < 0)
+		return -1;
+	total_size += txsize;
+
 	pthread_mutex_lock(&sdev->priv_lock);
 	list_for_each_safe(pos, tmp, &sdev->priv_free) {
 		priv = list_entry(pos, struct stub_priv, list);
@@ -280,6 +594,8 @@ static struct stub_unlink *dequeue_from_unlink_tx(struct stub_device *sdev)
 
 	list_for_each_safe(pos, tmp, &sdev->unlink_tx) {
 		unlink = list_entry(pos, struct stub_unlink, list);
+		if (unlink->after && stub_priv_tx_queued(sdev, unlink->after))
+			continue;
 		list_del(&unlink->list);
 		list_add(&unlink->list, sdev->unlink_free.prev);
 		pthread_mutex_unlock(&sdev->priv_lock);
@@ -310,7 +626,7 @@ static int stub_send_ret_unlink(struct stub_device *sdev)
 		usbip_dbg_stub_tx("setup ret unlink %lu", unlink->seqnum);
 
 		/* 1. setup usbip_header */
-		setup_ret_unlink_pdu(&pdu_header, unlink);
+		setup_ret_unlink_pdu(sdev, &pdu_header, unlink);
 		usbip_header_correct_endian(&pdu_header, 1);
 
 		iov[0].iov_base = &pdu_header;
@@ -327,6 +643,8 @@ static int stub_send_ret_unlink(struct stub_device *sdev)
 		}
 
 		usbip_dbg_stub_tx("send txdata");
+		USBIP_PROBE5(ret_unlink, unlink->seqnum, sdev->devid, 0, 0,
+			     unlink->status);
 		total_size += txsize;
 	}
 
@@ -343,24 +661,265 @@ static int stub_send_ret_unlink(struct stub_device *sdev)
 	return total_size;
 }
 
-static void poll_events_and_complete(struct stub_device *sdev)
+/*
+ * With USBIP_CAP_HEARTBEAT the client sends USBIP_NOP while it is idle, so
+ * hearing nothing for usbip_net_dead_peer seconds means it is gone, even
+ * when TCP still looks fine, e.g. for a hung client. It hears from us the
+ * same way.
+ */
+static int stub_heartbeat(struct stub_device *sdev)
 {
-	struct timeval tv = {0, 0};
-	int ret;
+	struct usbip_device *ud = &sdev->ud;
+	struct usbip_header pdu;
+	struct iovec iov[1];
+	uint64_t now;
+
+	if (!(sdev->caps & USBIP_CAP_HEARTBEAT))
+		return 0;
+
+	now = usbip_now_us();
+	if (usbip_net_dead_peer > 0 &&
+	    now - ud->rx_time > usbip_net_dead_peer * 1000000ULL) {
+		dev_err(sdev->dev, "no heartbeat for %d s, dropping client",
+			usbip_net_dead_peer);
+		usbip_dead_peer(ud, USBIP_M_dead_peer_idle);
+		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+		return -1;
+	}
+	if (now - ud->tx_time < USBIP_HEARTBEAT_INTERVAL * 1000ULL)
+		return 0;
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.base.command = USBIP_NOP;
+	usbip_header_correct_endian(&pdu, 1);
+
+	iov[0].iov_base = &pdu;
+	iov[0].iov_len = sizeof(pdu);
+	if (usbip_sendmsg(ud, iov, 1) != sizeof(pdu)) {
+		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+		return -1;
+	}
+	return 0;
+}
 
-//	ret = libusb_handle_events(stub_libusb_ctx); //TODO redo, performance hit here
-	ret = libusb_handle_events_timeout(stub_libusb_ctx, &tv);
-	if (ret != 0 && ret != LIBUSB_ERROR_TIMEOUT)
-		usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_SUBMIT);
+static int stub_tx_pending(struct stub_device *sdev)
+{
+	int pending, q;
+
+	pthread_mutex_lock(&sdev->priv_lock);
+	pending = sdev->unlink_tx.next != &sdev->unlink_tx;
+	for (q = 0; q < STUB_TXQ_NUM && !pending; q++)
+		pending = sdev->priv_tx[q].next != &sdev->priv_tx[q];
+	pthread_mutex_unlock(&sdev->priv_lock);
+
+	return pending;
+}
+
+/* anything to send for sdev, or any device of its connection */
+static int stub_tx_ready(struct stub_device *sdev)
+{
+	struct list_head *pos;
+	int ready = stub_tx_pending(sdev);
+
+	if (ready || !(sdev->caps & USBIP_CAP_MUX))
+		return ready;
+
+	pthread_mutex_lock(&sdev->mux_lock);
+	ready = sdev->mux_replies.next != &sdev->mux_replies;
+	list_for_each(pos, &sdev->mux_devs) {
+		if (ready)
+			break;
+		ready = stub_tx_pending(list_entry(pos, struct stub_device,
+						   mux_node));
+	}
+	pthread_mutex_unlock(&sdev->mux_lock);
+
+	return ready;
+}
+
+/*
+ * Park in libusb for up to timeout_us unless something is to be sent,
+ * whether something is then. Results queued other than by a completion
+ * interrupt libusb meanwhile, see stub_wake_tx().
+ */
+static int stub_tx_park(struct stub_device *sdev, unsigned int timeout_us,
+			uint64_t now, uint64_t spun)
+{
+	struct stub_waiter *w = &sdev->tx_wait;
+	int ready;
+
+	atomic_store(&w->parked, 1);
+	ready = stub_tx_ready(sdev) || stub_should_stop(sdev);
+	if (!ready) {
+		stub_wait_parking(now, spun);
+		poll_events_and_complete(sdev, timeout_us);
+		ready = stub_tx_ready(sdev);
+	}
+	atomic_store(&w->parked, 0);
+
+	return ready;
+}
+
+/*
+ * Wait for results to send, see stub_wait.c. Results still pending after
+ * a round that sent nothing were held back by shaping, which only needs a
+ * short park before the next try.
+ */
+static void stub_tx_wait(struct stub_device *sdev, int sent)
+{
+	struct stub_waiter *w = &sdev->tx_wait;
+	unsigned int window, doze;
+	uint64_t now, spun = 0;
+
+	if (!sent && stub_tx_ready(sdev)) {
+		poll_events_and_complete(sdev, STUB_WAIT_HELD_US);
+		return;
+	}
+
+	/* without spinning, there is nothing to learn */
+	if (!w->max_us) {
+		stub_tx_park(sdev, STUB_WAIT_PARK_US, 0, 0);
+		return;
+	}
+
+	poll_events_and_complete(sdev, 0);
+	now = usbip_now_us();
+	if (stub_tx_ready(sdev)) {
+		stub_wait_found(w, now, 0);
+		return;
+	}
+
+	window = stub_wait_window(w, now, &doze);
+	if (doze) {
+		if (stub_tx_park(sdev, doze, now, 0)) {
+			stub_wait_found(w, usbip_now_us(), 0);
+			return;
+		}
+		now = usbip_now_us();
+	}
+	if (window) {
+		spun = now;
+		while (now - spun < window) {
+			stub_wait_relax();
+			poll_events_and_complete(sdev, 0);
+			now = usbip_now_us();
+			if (stub_tx_ready(sdev)) {
+				stub_wait_found(w, now, spun);
+				return;
+			}
+		}
+	}
+
+	if (stub_tx_park(sdev, STUB_WAIT_PARK_US, now, spun))
+		stub_wait_found(w, usbip_now_us(), 0);
+}
+
+static int stub_send_ret_import(struct stub_device *lead,
+				struct stub_mux_reply *reply)
+{
+	struct iovec iov[2];
+	size_t txsize = sizeof(reply->hdr);
+	int iovnum = 1;
+
+	iov[0].iov_base = &reply->hdr;
+	iov[0].iov_len = sizeof(reply->hdr);
+	if (reply->hdr.u.ret_import.status == htonl(ST_OK)) {
+		iov[1].iov_base = &reply->udev;
+		iov[1].iov_len = sizeof(reply->udev);
+		txsize += sizeof(reply->udev);
+		iovnum++;
+	}
+
+	if (usbip_sendmsg(&lead->ud, iov, iovnum) != (int)txsize) {
+		usbip_event_add(&lead->ud, SDEV_EVENT_ERROR_TCP);
+		return -1;
+	}
+	return txsize;
+}
+
+/*
+ * One round of sending for all devices of a USBIP_CAP_MUX connection.
+ * Import replies go first, so that no result of a device precedes its
+ * USBIP_RET_IMPORT. Every device still batches its own results, but all
+ * sends of the round except those of the last device with something to
+ * send carry MSG_MORE, so the results of several devices leave in shared
+ * segments instead of one small packet per device.
+ */
+static int stub_tx_mux(struct stub_device *lead)
+{
+	struct stub_device *devs[STUB_MUX_MAX];
+	int pending[STUB_MUX_MAX];
+	struct list_head replies, *pos, *tmp;
+	struct stub_mux_reply *reply;
+	int i, n = 0, last = -1, ret = 0, held = 0, unlinked, sent = 0;
+
+	INIT_LIST_HEAD(&replies);
+	devs[n++] = lead;
+
+	pthread_mutex_lock(&lead->mux_lock);
+	list_for_each_safe(pos, tmp, &lead->mux_replies) {
+		list_del(pos);
+		list_add(pos, replies.prev);
+	}
+	list_for_each(pos, &lead->mux_devs)
+		devs[n++] = list_entry(pos, struct stub_device, mux_node);
+	pthread_mutex_unlock(&lead->mux_lock);
+
+	list_for_each_safe(pos, tmp, &replies) {
+		reply = list_entry(pos, struct stub_mux_reply, list);
+		if (ret >= 0) {
+			ret = stub_send_ret_import(lead, reply);
+			sent += ret;
+		}
+		list_del(pos);
+		free(reply);
+	}
+	if (ret < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		pending[i] = stub_tx_pending(devs[i]);
+		if (pending[i])
+			last = i;
+	}
+
+	for (i = 0; i <= last && ret >= 0; i++) {
+		if (!pending[i])
+			continue;
+		if (i < last) {
+			devs[i]->ud.tx_more = 1;
+			usbip_metric_add(USBIP_M_mux_tx_merged, 1);
+		}
+		ret = stub_send_ret_submit(devs[i]);
+		if (ret >= 0) {
+			unlinked = stub_send_ret_unlink(devs[i]);
+			ret = unlinked < 0 ? -1 : ret + unlinked;
+		}
+		devs[i]->ud.tx_more = 0;
+		if (i < last && ret > 0)
+			held = 1;
+		if (ret > 0)
+			sent += ret;
+	}
+
+	/*
+	 * Shaping may have held back all results of the last device, which
+	 * leaves what the others sent corked; setting TCP_NODELAY again
+	 * pushes it out.
+	 */
+	if (ret == 0 && held)
+		usbip_net_set_nodelay(lead->ud.sock_fd);
+
+	return ret < 0 ? -1 : sent;
 }
 
 void *stub_tx_loop(void *data)
 {
 	struct stub_device *sdev = (struct stub_device *)data;
-	int ret_submit, ret_unlink;
+	int ret_submit, ret_unlink, sent = 0;
 
 	while (!stub_should_stop(sdev)) {
-		poll_events_and_complete(sdev);
+		stub_tx_wait(sdev, sent);
 
 		if (usbip_event_happened(&sdev->ud))
 			break;
@@ -378,7 +937,20 @@ void *stub_tx_loop(void *data)
 		 * usb_unlink_urb() understands the unlink was too late by
 		 * getting the status of the given-backed URB which has the
 		 * status of usb_submit_urb().
+		 *
+		 * Shaping may hold that result back for a while; the result
+		 * of the unlink then waits for it, see
+		 * stub_enqueue_ret_unlink().
 		 */
+		if (sdev->caps & USBIP_CAP_MUX) {
+			sent = stub_tx_mux(sdev);
+			if (sent < 0)
+				break;
+			if (stub_heartbeat(sdev) < 0)
+				break;
+			continue;
+		}
+
 		ret_submit = stub_send_ret_submit(sdev);
 		if (ret_submit < 0)
 			break;
@@ -386,6 +958,10 @@ void *stub_tx_loop(void *data)
 		ret_unlink = stub_send_ret_unlink(sdev);
 		if (ret_unlink < 0)
 			break;
+		sent = ret_submit + ret_unlink;
+
+		if (stub_heartbeat(sdev) < 0)
+			break;
 
 	}
 	usbip_dbg_stub_tx("end of stub_tx_loop");
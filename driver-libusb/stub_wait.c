@@ -0,0 +1,131 @@
+/*
+ * Waiting of the tx and rx threads for work
+ *
+ * Parking a thread in poll() until its device or client has something
+ * saves the CPU but pays a wakeup, tens of us, on every transfer; polling
+ * without a break, as tx used to, burns a core per device. A waiter does
+ * both: once out of work it keeps polling for a spin window, with pause
+ * instructions in between, and only parks when the window passed empty.
+ *
+ * The window tunes itself to the moving average of the gaps between the
+ * pieces of work a thread finds. When twice that fits in the spin of the
+ * device's profile, the thread spins right away, as the next piece most
+ * likely shows up meanwhile. Slower but steady traffic, such as a device
+ * polled every millisecond, is due about one gap after the last piece:
+ * the thread parks, dozing, until half the spin before then and spins
+ * from there until half the spin after, so it is awake when the work
+ * comes without burning the whole gap. Work that is overdue, or gaps
+ * too long to tell, park right away.
+ *
+ * On a single CPU nothing spins: the work a thread waits for cannot come
+ * while it holds the CPU. Without a spin, the waiter is skipped: rx
+ * sleeps in the socket and tx parks in libusb right away.
+ *
+ * tx parks in libusb, so that completions wake it, and the rx thread and
+ * the event handler interrupt it when they queue results of their own.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "stub.h"
+#include <usbip_debug.h>
+#include <usbip_metrics.h>
+
+#define STUB_WAIT_GAPS		8	/* in the moving average */
+#define STUB_WAIT_STEADY_US	20000	/* the longest gap to doze for */
+
+void stub_wait_attach(struct stub_device *sdev, enum usbip_traffic_class tc)
+{
+	unsigned int spin = usbip_sockopt_spin(sdev->udev.busid, tc);
+	uint64_t now = usbip_now_us();
+
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		spin = 0;
+
+	memset(&sdev->tx_wait, 0, sizeof(sdev->tx_wait));
+	memset(&sdev->rx_wait, 0, sizeof(sdev->rx_wait));
+	sdev->tx_wait.max_us = sdev->rx_wait.max_us = spin;
+	sdev->tx_wait.last = sdev->rx_wait.last = now;
+
+	dbg("%s spins up to %u us for work", sdev->udev.busid, spin);
+}
+
+/*
+ * How long to spin for the next work at now, 0 to park at once, after
+ * parking for doze us if not 0
+ */
+unsigned int stub_wait_window(struct stub_waiter *w, uint64_t now,
+			      unsigned int *doze)
+{
+	unsigned int half = w->max_us / 2;
+	uint64_t due = w->last + w->gap_us;
+
+	*doze = 0;
+	if (!w->max_us)
+		return 0;
+	if (2 * w->gap_us <= w->max_us)
+		return w->gap_us ? 2 * w->gap_us : 1;
+	if (!half || w->gap_us > STUB_WAIT_STEADY_US || now >= due + half)
+		return 0;
+
+	if (now < due - half) {
+		*doze = due - half - now;
+		now = due - half;
+	}
+	return due + half - now;
+}
+
+/* the thread found work at now, after spinning since spun if not 0 */
+void stub_wait_found(struct stub_waiter *w, uint64_t now, uint64_t spun)
+{
+	int64_t avg = w->gap_us;
+
+	avg += ((int64_t)(now - w->last) - avg) / STUB_WAIT_GAPS;
+	w->gap_us = avg;
+	w->last = now;
+
+	if (spun) {
+		usbip_metric_add(USBIP_M_wait_spin_hits, 1);
+		usbip_metric_add(USBIP_M_wait_spin_us, now - spun);
+	}
+}
+
+/* the window passed empty, spun since spun if not 0 */
+void stub_wait_parking(uint64_t now, uint64_t spun)
+{
+	usbip_metric_add(USBIP_M_wait_parks, 1);
+	if (spun)
+		usbip_metric_add(USBIP_M_wait_spin_us, now - spun);
+}
+
+/* a few dozen cycles of doing nothing, kindly to a sibling hyperthread */
+void stub_wait_relax(void)
+{
+	int i;
+
+	for (i = 0; i < 32; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		__asm__ __volatile__("yield");
+#else
+		__asm__ __volatile__("" ::: "memory");
+#endif
+	}
+}
+
+/*
+ * Results were queued for sdev other than by a completion, which already
+ * wakes the thread parked in libusb. The tx thread of a device sharing a
+ * connection is the one of the first device.
+ */
+void stub_wake_tx(struct stub_device *sdev)
+{
+	struct stub_device *tx = sdev;
+
+	if (sdev->ud.lead)
+		tx = container_of(sdev->ud.lead, struct stub_device, ud);
+	if (atomic_load(&tx->tx_wait.parked))
+		libusb_interrupt_event_handler(stub_libusb_ctx);
+}
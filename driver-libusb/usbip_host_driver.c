@@ -17,9 +17,11 @@
  */
 
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 
 #include "stub.h"
+#include "usbip_sockopt.h"
 
 #include <usbip_debug.h>
 
@@ -91,11 +93,138 @@ uint8_t stub_get_transfer_flags(uint32_t in)
 	return flags;
 }
 
+/*
+ * Collect the addresses of the endpoints that take streams and the
+ * number of streams all of them can hold. An endpoint may be listed once
+ * per alternate setting.
+ */
+static int stub_stream_endpoints(struct stub_device *sdev,
+				 unsigned char *eps, uint32_t *max_streams)
+{
+	int i, j, n = 0;
+
+	*max_streams = 0;
+	for (i = 0; i < sdev->num_eps && n < USB_MAXENDPOINTS; i++) {
+		struct stub_endpoint *epp = sdev->eps + i;
+		unsigned char addr = epp->nr | epp->dir;
+
+		if (!epp->max_streams)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (eps[j] == addr)
+				break;
+		}
+		if (j < n)
+			continue;
+		eps[n++] = addr;
+		if (!*max_streams || epp->max_streams < *max_streams)
+			*max_streams = epp->max_streams;
+	}
+	return n;
+}
+
+/*
+ * Allocate streams on every endpoint of sdev that takes them, for a
+ * client that negotiated USBIP_CAP_STREAMS. It fails while one of them is
+ * not part of the active settings; stub_rx calls it again after
+ * SET_INTERFACE.
+ */
+int stub_streams_alloc(struct stub_device *sdev)
+{
+	unsigned char eps[USB_MAXENDPOINTS];
+	uint32_t max_streams;
+	int n, ret;
+
+	sdev->num_streams = 0;
+	if (!(sdev->caps & USBIP_CAP_STREAMS))
+		return 0;
+
+	n = stub_stream_endpoints(sdev, eps, &max_streams);
+	if (n == 0)
+		return 0;
+
+	ret = libusb_alloc_streams(sdev->dev_handle, max_streams, eps, n);
+	if (ret < 0) {
+		dbg("no streams on %s yet: %d", sdev->udev.busid, ret);
+		return ret;
+	}
+	sdev->num_streams = ret;
+	dev_info(sdev->dev, "%d streams on %d endpoints", ret, n);
+	return 0;
+}
+
+void stub_streams_free(struct stub_device *sdev)
+{
+	unsigned char eps[USB_MAXENDPOINTS];
+	uint32_t max_streams;
+	int n;
+
+	if (!sdev->num_streams)
+		return;
+
+	n = stub_stream_endpoints(sdev, eps, &max_streams);
+	libusb_free_streams(sdev->dev_handle, eps, n);
+	sdev->num_streams = 0;
+}
+
+int stub_stream_valid(struct stub_device *sdev, uint8_t ep,
+		      uint32_t stream_id)
+{
+	int i;
+
+	if (stream_id > sdev->num_streams)
+		return 0;
+
+	for (i = 0; i < sdev->num_eps; i++) {
+		struct stub_endpoint *epp = sdev->eps + i;
+
+		if (epp->max_streams && (epp->nr | epp->dir) == ep)
+			return 1;
+	}
+	return 0;
+}
+
+/* what the endpoints of all alternate settings mostly carry */
+static enum usbip_traffic_class stub_traffic_class(struct stub_device *sdev)
+{
+	int i, intr = 0, bulk = 0;
+
+	for (i = 0; i < sdev->num_eps; i++) {
+		switch (sdev->eps[i].type) {
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+			return USBIP_TC_ISO;
+		case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+			intr = 1;
+			break;
+		case LIBUSB_TRANSFER_TYPE_BULK:
+			bulk = 1;
+			break;
+		}
+	}
+	if (bulk)
+		return USBIP_TC_BULK;
+	return intr ? USBIP_TC_INTR : USBIP_TC_DEFAULT;
+}
+
+static int stub_claims_start(void);
+static void stub_claims_stop(void);
+
 int usbip_driver_open(void) {
-	return libusb_init(&stub_libusb_ctx);
+	int ret;
+
+	ret = libusb_init(&stub_libusb_ctx);
+	if (ret)
+		return ret;
+
+	if (usbip_claim_linger > 0 && stub_claims_start()) {
+		libusb_exit(stub_libusb_ctx);
+		return -1;
+	}
+	return 0;
 }
 
 void usbip_driver_close(void) {
+	stub_claims_stop();
 	libusb_exit(stub_libusb_ctx);
 }
 
@@ -199,12 +328,33 @@ static void fill_usb_interfaces(struct usbip_usb_interface *uinf,
 	}
 }
 
+#define STUB_MAX_STREAMS_EXP	16	/* 65536 streams */
+
 static void fill_stub_endpoint(struct stub_endpoint *ep,
 			       const struct libusb_endpoint_descriptor *desc)
 {
+	struct libusb_ss_endpoint_companion_descriptor *comp;
+	int exp;
+
 	ep->nr = desc->bEndpointAddress & LIBUSB_ENDPOINT_ADDRESS_MASK;
 	ep->dir = desc->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK;
 	ep->type = desc->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+	ep->max_packet = desc->wMaxPacketSize & 0x7ff;
+
+	/*
+	 * MaxStreams of a bulk companion is an exponent, 0 is none and 16
+	 * the most the USB 3 spec allows; larger values are reserved.
+	 */
+	if (ep->type == LIBUSB_TRANSFER_TYPE_BULK &&
+	    !libusb_get_ss_endpoint_companion_descriptor(stub_libusb_ctx,
+							  desc, &comp)) {
+		exp = comp->bmAttributes & 0x1f;
+		if (exp > STUB_MAX_STREAMS_EXP)
+			exp = STUB_MAX_STREAMS_EXP;
+		if (exp)
+			ep->max_streams = 1U << exp;
+		libusb_free_ss_endpoint_companion_descriptor(comp);
+	}
 }
 
 static void fill_stub_endpoints(struct stub_endpoint *ep,
@@ -221,6 +371,8 @@ static void fill_stub_endpoints(struct stub_endpoint *ep,
 			for (k = 0; k < idesc->bNumEndpoints; k++) {
 				fill_stub_endpoint(ep + num,
 						   idesc->endpoint + k);
+				ep[num].ifclass = idesc->bInterfaceClass;
+				ep[num].ifnum = idesc->bInterfaceNumber;
 				num++;
 			}
 		}
@@ -400,14 +552,46 @@ struct usbip_exported_device *usbip_get_device(struct usbip_exported_devices *ed
 	return NULL;
 }
 
+/* the events of a shared connection go to all of its devices */
+static void stub_mux_each(struct stub_device *lead,
+			  void (*fn)(struct usbip_device *))
+{
+	struct list_head *pos;
+
+	pthread_mutex_lock(&lead->mux_lock);
+	list_for_each(pos, &lead->mux_devs)
+		fn(&list_entry(pos, struct stub_device, mux_node)->ud);
+	pthread_mutex_unlock(&lead->mux_lock);
+}
+
 static void stub_shutdown(struct usbip_device *ud)
 {
 	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
 
+	int n;
+
+	pthread_mutex_lock(&ud->lock);
+	if (!ud->down_time)
+		ud->down_time = usbip_now_us();
+	pthread_mutex_unlock(&ud->lock);
+
 	sdev->should_stop = 1;
-	usbip_stop_eh(&sdev->ud);
-	pthread_mutex_unlock(&sdev->tx_waitq);
-	/* rx will exit by disconnect */
+	if (!ud->lead) {
+		usbip_stop_eh(&sdev->ud);
+		stub_wake_tx(sdev);
+
+		/* a vanished client never disconnects, so wake rx up ourselves */
+		shutdown(ud->sock_fd, SHUT_RDWR);
+	}
+
+	/* the device stops now, stub_device_cleanup_transfers() frees */
+	n = stub_device_cancel_transfers(sdev);
+	if (n) {
+		dev_info(sdev->dev, "cancelled %d transfers", n);
+		usbip_metric_add(USBIP_M_reclaim_cancelled, n);
+	}
+
+	stub_mux_each(sdev, stub_shutdown);
 }
 
 static void stub_device_reset(struct usbip_device *ud)
@@ -427,13 +611,19 @@ static void stub_device_reset(struct usbip_device *ud)
         ud->status = SDEV_ST_AVAILABLE;
 	}
 	pthread_mutex_unlock(&ud->lock);
+
+	stub_mux_each(sdev, stub_device_reset);
 }
 
 static void stub_device_unusable(struct usbip_device *ud)
 {
+	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+
 	pthread_mutex_lock(&ud->lock);
 	ud->status = SDEV_ST_ERROR;
 	pthread_mutex_unlock(&ud->lock);
+
+	stub_mux_each(sdev, stub_device_unusable);
 }
 
 static void init_usbip_device(struct usbip_device *ud)
@@ -498,12 +688,15 @@ static struct stub_device *stub_device_new(struct usbip_exported_device *edev)
 
 	pthread_mutex_init(&sdev->priv_lock, NULL);
 	INIT_LIST_HEAD(&sdev->priv_init);
-	INIT_LIST_HEAD(&sdev->priv_tx);
+	for (i = 0; i < STUB_TXQ_NUM; i++)
+		INIT_LIST_HEAD(&sdev->priv_tx[i]);
 	INIT_LIST_HEAD(&sdev->priv_free);
 	INIT_LIST_HEAD(&sdev->unlink_tx);
 	INIT_LIST_HEAD(&sdev->unlink_free);
-	pthread_mutex_init(&sdev->tx_waitq, NULL);
-	pthread_mutex_lock(&sdev->tx_waitq);
+	pthread_mutex_init(&sdev->mux_lock, NULL);
+	INIT_LIST_HEAD(&sdev->mux_devs);
+	INIT_LIST_HEAD(&sdev->mux_replies);
+	INIT_LIST_HEAD(&sdev->mux_node);
 
 	return sdev;
 }
@@ -511,8 +704,10 @@ static struct stub_device *stub_device_new(struct usbip_exported_device *edev)
 static void stub_device_delete(struct stub_device *sdev)
 {
 	clear_usbip_device(&sdev->ud);
+	usbip_shm_free(sdev->ud.shm);
+	stub_desc_cache_free(sdev->desc_cache);
 	pthread_mutex_destroy(&sdev->priv_lock);
-	pthread_mutex_destroy(&sdev->tx_waitq);
+	pthread_mutex_destroy(&sdev->mux_lock);
 	free(sdev);
 }
 
@@ -584,7 +779,223 @@ static int claim_interfaces(libusb_device_handle *dev_handle, int num_ifs,
 	}
 	return 0;
 }
-int usbip_export_device(struct usbip_exported_device *edev, int sock_fd) {
+/*
+ * Claim cache
+ *
+ * With a linger period set, a device released at the end of a connection
+ * stays open and claimed for usbip_claim_linger seconds. A re-import of the
+ * same device inside that window takes the cached handle over and skips
+ * libusb_open(), kernel driver detach and interface claiming. Entries are
+ * keyed by busid and only reused for the same libusb device session, so a
+ * replugged device is always opened afresh. Expired entries are released
+ * by a reaper thread, which gives the interfaces back to the kernel.
+ */
+int usbip_claim_linger;
+
+struct stub_claim {
+	struct list_head list;
+	char busid[SYSFS_BUS_ID_SIZE];
+	libusb_device *dev;
+	libusb_device_handle *dev_handle;
+	struct timespec expires;
+	struct stub_desc_cache *desc_cache;
+	int num_ifs;
+	struct stub_interface ifs[];
+};
+
+static LIST_HEAD(stub_claims);
+static pthread_mutex_t stub_claims_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stub_claims_cond;
+static pthread_t stub_claims_reaper;
+static int stub_claims_running;
+static int stub_claims_should_stop;
+
+static void stub_claim_release(struct stub_claim *claim)
+{
+	dbg("release lingering claim of %s", claim->busid);
+	release_interfaces(claim->dev_handle, claim->num_ifs, claim->ifs, 0);
+	libusb_close(claim->dev_handle);
+	libusb_unref_device(claim->dev);
+	stub_desc_cache_free(claim->desc_cache);
+	free(claim);
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+static void *stub_claims_reaper_loop(void *data)
+{
+	struct list_head *pos;
+	struct stub_claim *claim, *expired;
+	struct timespec now, next;
+	int have_next;
+
+	(void)data;
+
+	pthread_mutex_lock(&stub_claims_lock);
+	while (!stub_claims_should_stop) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		expired = NULL;
+		have_next = 0;
+
+		list_for_each(pos, &stub_claims) {
+			claim = list_entry(pos, struct stub_claim, list);
+			if (!timespec_before(&now, &claim->expires)) {
+				expired = claim;
+				break;
+			}
+			if (!have_next || timespec_before(&claim->expires, &next)) {
+				next = claim->expires;
+				have_next = 1;
+			}
+		}
+
+		if (expired) {
+			list_del(&expired->list);
+			pthread_mutex_unlock(&stub_claims_lock);
+			stub_claim_release(expired);
+			pthread_mutex_lock(&stub_claims_lock);
+		} else if (have_next) {
+			pthread_cond_timedwait(&stub_claims_cond,
+					       &stub_claims_lock, &next);
+		} else {
+			pthread_cond_wait(&stub_claims_cond, &stub_claims_lock);
+		}
+	}
+	pthread_mutex_unlock(&stub_claims_lock);
+	return NULL;
+}
+
+static int stub_claims_start(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&stub_claims_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	stub_claims_should_stop = 0;
+	if (pthread_create(&stub_claims_reaper, NULL,
+			   stub_claims_reaper_loop, NULL)) {
+		err("start claim reaper");
+		pthread_cond_destroy(&stub_claims_cond);
+		return -1;
+	}
+	stub_claims_running = 1;
+	info("keeping released devices claimed for %d s", usbip_claim_linger);
+	return 0;
+}
+
+static void stub_claims_stop(void)
+{
+	struct list_head *pos, *tmp;
+
+	if (!stub_claims_running)
+		return;
+
+	pthread_mutex_lock(&stub_claims_lock);
+	stub_claims_should_stop = 1;
+	pthread_cond_signal(&stub_claims_cond);
+	pthread_mutex_unlock(&stub_claims_lock);
+	pthread_join(stub_claims_reaper, NULL);
+	pthread_cond_destroy(&stub_claims_cond);
+	stub_claims_running = 0;
+
+	list_for_each_safe(pos, tmp, &stub_claims) {
+		list_del(pos);
+		stub_claim_release(list_entry(pos, struct stub_claim, list));
+	}
+}
+
+/* hand the open and claimed handle of sdev over to the cache */
+static int stub_claim_put(struct stub_device *sdev)
+{
+	int num_ifs = sdev->udev.bNumInterfaces;
+	struct stub_claim *claim;
+
+	if (!stub_claims_running)
+		return -1;
+
+	pthread_mutex_lock(&sdev->ud.lock);
+	if (sdev->ud.status == SDEV_ST_ERROR) {
+		pthread_mutex_unlock(&sdev->ud.lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&sdev->ud.lock);
+
+	claim = (struct stub_claim *)calloc(1, sizeof(struct stub_claim) +
+			num_ifs * sizeof(struct stub_interface));
+	if (!claim)
+		return -1;
+
+	memcpy(claim->busid, sdev->udev.busid, SYSFS_BUS_ID_SIZE);
+	claim->dev = libusb_ref_device(sdev->dev);
+	claim->dev_handle = sdev->dev_handle;
+	claim->desc_cache = sdev->desc_cache;
+	sdev->desc_cache = NULL;
+	claim->num_ifs = num_ifs;
+	memcpy(claim->ifs, sdev->ifs, num_ifs * sizeof(struct stub_interface));
+	clock_gettime(CLOCK_MONOTONIC, &claim->expires);
+	claim->expires.tv_sec += usbip_claim_linger;
+
+	pthread_mutex_lock(&stub_claims_lock);
+	list_add(&claim->list, &stub_claims);
+	pthread_cond_signal(&stub_claims_cond);
+	pthread_mutex_unlock(&stub_claims_lock);
+
+	dbg("%s lingers for %d s", claim->busid, usbip_claim_linger);
+	return 0;
+}
+
+/* take a cached handle for sdev over, if there is one */
+static int stub_claim_take(struct stub_device *sdev)
+{
+	struct list_head *pos;
+	struct stub_claim *claim = NULL;
+
+	if (!stub_claims_running)
+		return -1;
+
+	pthread_mutex_lock(&stub_claims_lock);
+	list_for_each(pos, &stub_claims) {
+		claim = list_entry(pos, struct stub_claim, list);
+		if (!strncmp(claim->busid, sdev->udev.busid, SYSFS_BUS_ID_SIZE))
+			break;
+	}
+	if (pos == &stub_claims) {
+		pthread_mutex_unlock(&stub_claims_lock);
+		return -1;
+	}
+	list_del(&claim->list);
+	pthread_mutex_unlock(&stub_claims_lock);
+
+	if (claim->dev != sdev->dev ||
+	    claim->num_ifs != sdev->udev.bNumInterfaces) {
+		dbg("%s was re-enumerated, dropping lingering claim",
+		    claim->busid);
+		stub_claim_release(claim);
+		return -1;
+	}
+
+	sdev->dev_handle = claim->dev_handle;
+	sdev->desc_cache = claim->desc_cache;
+	memcpy(sdev->ifs, claim->ifs,
+	       claim->num_ifs * sizeof(struct stub_interface));
+	libusb_unref_device(claim->dev);
+	free(claim);
+
+	dbg("%s taken over from claim cache", sdev->udev.busid);
+	return 0;
+}
+
+static int stub_export(struct usbip_exported_device *edev, int sock_fd,
+		       uint32_t caps)
+{
 	struct stub_device *sdev;
 	struct stub_edev_data *edev_data = edev2edev_data(edev);
 	int ret;
@@ -595,6 +1006,9 @@ int usbip_export_device(struct usbip_exported_device *edev, int sock_fd) {
 
 	edev_data->sdev = sdev;
 
+	if (!stub_claim_take(sdev))
+		goto out;
+
 	ret = libusb_open(sdev->dev, &sdev->dev_handle);
 	if (ret) {
 		if (ret == LIBUSB_ERROR_ACCESS)
@@ -610,8 +1024,17 @@ int usbip_export_device(struct usbip_exported_device *edev, int sock_fd) {
 		goto err_close_lib;
 	}
 
-	sdev->ud.sock_fd = sock_fd;
+out:
+	if (stub_desc_cache_fill(sdev))
+		dev_info(sdev->dev, "descriptors not cached");
 
+	sdev->ud.sock_fd = sock_fd;
+	sdev->caps = caps;
+	stub_streams_alloc(sdev);
+	stub_shape_attach(sdev, stub_traffic_class(sdev));
+	stub_wait_attach(sdev, stub_traffic_class(sdev));
+	stub_capture_attach(sdev);
+	stub_prefetch_attach(sdev);
 	return 0;
 
 err_close_lib:
@@ -623,12 +1046,40 @@ err_out:
 
 void stub_unexport_device(struct stub_device *sdev)
 {
-	release_interfaces(sdev->dev_handle, sdev->udev.bNumInterfaces,
-			   sdev->ifs, 0);
-	libusb_close(sdev->dev_handle);
+	stub_shape_detach(sdev);
+	stub_capture_detach(sdev);
+	stub_prefetch_detach(sdev);
+	stub_streams_free(sdev);
+	if (stub_claim_put(sdev)) {
+		release_interfaces(sdev->dev_handle, sdev->udev.bNumInterfaces,
+				   sdev->ifs, 0);
+		libusb_close(sdev->dev_handle);
+	}
 	sdev->dev_handle = NULL;
 }
 
+int usbip_export_device(struct usbip_exported_device *edev, int sock_fd,
+			uint32_t caps) {
+	struct stub_device *sdev;
+
+	if (stub_export(edev, sock_fd, caps))
+		return -1;
+
+	sdev = edev2sdev(edev);
+	usbip_sockopt_export(sock_fd, sdev->udev.busid,
+			     stub_traffic_class(sdev));
+
+	if (caps & USBIP_CAP_SHM) {
+		sdev->ud.shm = usbip_shm_create(sock_fd);
+		if (!sdev->ud.shm) {
+			stub_unexport_device(sdev);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int stub_start(struct stub_device *sdev)
 {
 	if (sdev == NULL)
@@ -648,6 +1099,7 @@ static int stub_start(struct stub_device *sdev)
 	}
 	pthread_mutex_lock(&sdev->ud.lock);
 	sdev->ud.status = SDEV_ST_USED;
+	sdev->ud.rx_time = sdev->ud.tx_time = usbip_now_us();
 	pthread_mutex_unlock(&sdev->ud.lock);
 	dbg("successfully started libusb transmission");
 	return 0;
@@ -663,17 +1115,170 @@ static void stub_join(struct stub_device *sdev)
 	pthread_join(sdev->rx, NULL);
 }
 
+/* the device can be imported again, account since its connection went down */
+static void stub_reclaimed(struct stub_device *sdev)
+{
+	struct usbip_device *conn = sdev->ud.lead ? sdev->ud.lead : &sdev->ud;
+	uint64_t us;
+
+	if (!sdev->ud.down_time)
+		return;
+	us = usbip_now_us() - sdev->ud.down_time;
+
+	usbip_metric_add(USBIP_M_reclaims, 1);
+	usbip_metric_add(USBIP_M_reclaim_us_total, us);
+	usbip_metric_max(USBIP_M_reclaim_us_max, us);
+	usbip_metric_set(USBIP_M_reclaim_us_last, us);
+	info("%s released %llu us after its connection %s",
+	     sdev->udev.busid, (unsigned long long)us,
+	     conn->dead_peer ? "died" : "closed");
+}
+
+/*
+ * Connection multiplexing
+ *
+ * With USBIP_CAP_MUX, the client may import more devices onto the
+ * connection of its first one with USBIP_CMD_IMPORT. They get no threads
+ * of their own: the rx thread of the first device reads the requests of
+ * all and hands them over by devid, its tx thread sends the results of all
+ * and its event handler takes all their events, see usbip_device.lead.
+ * An import is done by the rx thread, so requests behind it wait for the
+ * device to be opened and claimed.
+ */
+struct stub_device *stub_mux_lookup(struct stub_device *lead, uint32_t devid)
+{
+	struct list_head *pos;
+	struct stub_device *sdev;
+
+	if (lead->devid == devid)
+		return lead;
+
+	pthread_mutex_lock(&lead->mux_lock);
+	list_for_each(pos, &lead->mux_devs) {
+		sdev = list_entry(pos, struct stub_device, mux_node);
+		if (sdev->devid == devid) {
+			pthread_mutex_unlock(&lead->mux_lock);
+			return sdev;
+		}
+	}
+	pthread_mutex_unlock(&lead->mux_lock);
+
+	return NULL;
+}
+
+void stub_mux_import(struct stub_device *lead, struct usbip_header *pdu)
+{
+	struct usbip_exported_devices *edevs;
+	struct usbip_exported_device *edev;
+	struct op_import_request req;
+	struct stub_device *sdev;
+	uint32_t status = ST_NA;
+
+	if (usbip_recv(&lead->ud, &req, sizeof(req)) != sizeof(req)) {
+		usbip_event_add(&lead->ud, SDEV_EVENT_ERROR_TCP);
+		return;
+	}
+	req.busid[SYSFS_BUS_ID_SIZE - 1] = '\0';
+
+	edevs = (struct usbip_exported_devices *)calloc(1, sizeof(*edevs));
+	if (!edevs)
+		goto err_reply;
+	if (usbip_refresh_device_list(edevs) < 0) {
+		free(edevs);
+		goto err_reply;
+	}
+
+	edev = usbip_get_device(edevs, req.busid);
+	if (!edev) {
+		info("requested device not found: %s", req.busid);
+		status = ST_DEVICE_NOT_FOUND;
+		goto err_free_edevs;
+	}
+	if (lead->mux_num + 1 >= STUB_MUX_MAX ||
+	    stub_mux_lookup(lead,
+			    get_devid(edev2edev_data(edev)->dev))) {
+		info("%s cannot join connection of %s", req.busid,
+		     lead->udev.busid);
+		goto err_free_edevs;
+	}
+	if (stub_export(edev, lead->ud.sock_fd, lead->caps))
+		goto err_free_edevs;
+
+	sdev = edev2sdev(edev);
+	sdev->mux_edevs = edevs;
+	sdev->ud.lead = &lead->ud;
+	sdev->ud.status = SDEV_ST_USED;
+
+	pthread_mutex_lock(&lead->mux_lock);
+	if (lead->should_stop) {
+		pthread_mutex_unlock(&lead->mux_lock);
+		stub_unexport_device(sdev);
+		goto err_free_edevs;
+	}
+	list_add(&sdev->mux_node, lead->mux_devs.prev);
+	lead->mux_num++;
+	stub_enqueue_ret_import(lead, pdu->base.seqnum, ST_OK, sdev);
+	pthread_mutex_unlock(&lead->mux_lock);
+	stub_wake_tx(lead);
+
+	usbip_metric_add(USBIP_M_mux_imports, 1);
+	info("%s joined connection of %s, %d devices", req.busid,
+	     lead->udev.busid, lead->mux_num + 1);
+	return;
+
+err_free_edevs:
+	usbip_free_device_list(edevs);
+	free(edevs);
+err_reply:
+	pthread_mutex_lock(&lead->mux_lock);
+	stub_enqueue_ret_import(lead, pdu->base.seqnum, status, NULL);
+	pthread_mutex_unlock(&lead->mux_lock);
+	stub_wake_tx(lead);
+}
+
+/* after the threads of lead are gone, release what joined its connection */
+static void stub_mux_release(struct stub_device *lead)
+{
+	struct list_head *pos, *tmp;
+	struct stub_device *sdev;
+	struct usbip_exported_devices *edevs;
+
+	list_for_each_safe(pos, tmp, &lead->mux_devs) {
+		sdev = list_entry(pos, struct stub_device, mux_node);
+		list_del(pos);
+		stub_device_cleanup_transfers(sdev);
+		stub_device_cleanup_unlinks(sdev);
+		stub_unexport_device(sdev);
+		stub_reclaimed(sdev);
+		edevs = sdev->mux_edevs;
+		usbip_free_device_list(edevs);
+		free(edevs);
+	}
+	lead->mux_num = 0;
+
+	list_for_each_safe(pos, tmp, &lead->mux_replies) {
+		list_del(pos);
+		free(list_entry(pos, struct stub_mux_reply, list));
+	}
+}
+
 int usbip_try_transfer(struct usbip_exported_device *edev, int sock_fd) {
 	struct stub_device *sdev = edev2sdev(edev);
 
+	/* the client reads the rings right after the import reply */
+	if (sdev->ud.shm && usbip_shm_send_fd(sdev->ud.shm) < 0)
+		return -1;
+
 	if (stub_start(sdev)) {
 		err("start driver-libusb");
 		return -1;
 	}
 	stub_join(sdev);
+	stub_mux_release(sdev);
 	stub_device_cleanup_transfers(sdev);
 	stub_device_cleanup_unlinks(sdev);
 	stub_unexport_device(sdev);
+	stub_reclaimed(sdev);
 
 	return 0;
 }
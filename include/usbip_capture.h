@@ -0,0 +1,81 @@
+/*
+ * pcap captures of exported devices
+ */
+
+#ifndef __USBIP_CAPTURE_H
+#define __USBIP_CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * A capture is given as BUSID=FILE[,snaplen=BYTES][,ring=KIB]. Every
+ * transfer of the device while it is exported is appended to FILE as
+ * usbmon events, with at most snaplen bytes of descriptors and data each
+ * (65536 by default), through a ring of ring KiB (4096 by default).
+ */
+int usbip_capture_parse(const char *spec);
+
+/* a packet of LINKTYPE_USB_LINUX_MMAPPED, in host byte order */
+struct usbip_usbmon_packet {
+	uint64_t id;		/* of the transfer, same in S and C */
+	uint8_t type;		/* 'S'ubmit, 'C'omplete or 'E'rror */
+	uint8_t xfer_type;	/* 0 iso, 1 intr, 2 control, 3 bulk */
+	uint8_t epnum;		/* address, with the IN bit */
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;	/* 0 with setup, else '-' */
+	char flag_data;		/* 0 with data, else '<', '>' or '=' */
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;		/* -errno, -EINPROGRESS while submitted */
+	uint32_t length;
+	uint32_t len_cap;
+	union {
+		uint8_t setup[8];
+		struct {
+			int32_t error_count;
+			int32_t numdesc;
+		} iso;
+	} s;
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;		/* captured, each a usbip_usbmon_iso */
+} __attribute__((packed));
+
+struct usbip_usbmon_iso {
+	int32_t status;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t pad;
+} __attribute__((packed));
+
+struct usbip_capture;
+
+/* the capture of busid if one was asked for, else NULL */
+struct usbip_capture *usbip_capture_open(const char *busid);
+void usbip_capture_close(struct usbip_capture *cap);
+
+/*
+ * Queue an event for the writer without blocking. ndesc, len_cap and the
+ * time stamp of pkt are filled in, cutting iso and data to the snaplen;
+ * an event finding the ring full is dropped and counted.
+ */
+void usbip_capture_record(struct usbip_capture *cap,
+			  struct usbip_usbmon_packet *pkt,
+			  const struct usbip_usbmon_iso *iso, uint32_t niso,
+			  const void *data, uint32_t len);
+
+/*
+ * Read a capture back, calling fn for every usbmon event in it with its
+ * captured iso descriptors and data. A non-zero return of fn stops the
+ * walk and is returned; -1 if path is no usbmon capture of this host.
+ */
+typedef int (*usbip_capture_fn)(void *arg,
+				const struct usbip_usbmon_packet *pkt,
+				const struct usbip_usbmon_iso *iso,
+				const unsigned char *data);
+
+int usbip_capture_load(const char *path, usbip_capture_fn fn, void *arg);
+
+#endif /* __USBIP_CAPTURE_H */
@@ -29,6 +29,10 @@
 #define PACKAGE "usbipd"
 
 #define USBIDS_FILE "/usr/share/hwdata/usb.ids"
+/* compiled form of USBIDS_FILE, see names.c */
+#ifndef USBIDS_CACHE_FILE
+#define USBIDS_CACHE_FILE "/var/cache/" PACKAGE "/usb.ids.cache"
+#endif
 #define DEFAULT_PID_FILE "/var/run/" PACKAGE ".pid"
 
 #define USBIP_OS_NO_DAEMON
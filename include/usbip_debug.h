@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <usbip_network.h>
+#include <usbip_log.h>
 
 extern int usbip_use_debug;
 extern unsigned long usbip_stub_debug_flags;
@@ -16,27 +17,31 @@ extern unsigned long usbip_stub_debug_flags;
 #define dbg_fmt(lvl, fmt)	pr_fmt(lvl, "%s:%d/%s: " fmt), __FILENAME__, __LINE__, __func__
 
 #define dbg(fmt, args...) \
-    if (usbip_use_debug) fprintf(stdout, dbg_fmt("<D>", fmt), ##args)
+    usbip_log_at(USBIP_LOG_DEBUG, usbip_use_debug, dbg_fmt("<D>", fmt), ##args)
 
 #define info(fmt, args...) \
-    fprintf(stdout, dbg_fmt("<I>", fmt), ##args)
+    usbip_log_at(USBIP_LOG_INFO, 1, dbg_fmt("<I>", fmt), ##args)
 
 #define warn(fmt, args...) \
-    fprintf(stderr, dbg_fmt("<W>", fmt), ##args)
+    usbip_log_at(USBIP_LOG_WARNING, 1, dbg_fmt("<W>", fmt), ##args)
 
 #define err(fmt, args...) \
-    fprintf(stderr, dbg_fmt("<E>", fmt), ##args)
+    usbip_log_at(USBIP_LOG_ERR, 1, dbg_fmt("<E>", fmt), ##args)
 #endif /* !USBIP_OS_NO_NR_ARGS */
 
 #ifndef USBIP_OS_NO_NR_ARGS
 #define dev_pfmt(dev, lvl, fmt) dbg_fmt(lvl, ": %d-%d: " fmt), libusb_get_bus_number(dev), libusb_get_port_number(dev)
 
+/* device messages come from the data path, errors and infos are rate limited */
 #define dev_dbg(dev, fmt, args...) \
-	fprintf(stdout, dev_pfmt(dev, "<D>", fmt), ##args)
+	usbip_log_at(USBIP_LOG_DEBUG, usbip_use_debug, \
+		     dev_pfmt(dev, "<D>", fmt), ##args)
 #define dev_info(dev, fmt, args...) \
-	fprintf(stdout, dev_pfmt(dev, "<I>", fmt), ##args)
+	usbip_log_ratelimited(USBIP_LOG_INFO, 1, \
+			      dev_pfmt(dev, "<I>", fmt), ##args)
 #define dev_err(dev, fmt, args...) \
-	fprintf(stderr, dev_pfmt(dev, "<E>", fmt), ##args)
+	usbip_log_ratelimited(USBIP_LOG_ERR, 1, \
+			      dev_pfmt(dev, "<E>", fmt), ##args)
 
 enum {
     usbip_debug_xmit	= (1U << 0U),
@@ -79,6 +84,9 @@ void usbip_names_get_product(char *buff, size_t size, uint16_t vendor,
 void usbip_names_get_class(char *buff, size_t size, uint8_t clazz,
                            uint8_t subclass, uint8_t protocol);
 
+#define USBIP_DUMP_LIMIT_DEFAULT 64
+extern int usbip_dump_limit;
+
 void usbip_dump_buffer(void *buf, int size);
 
 #endif //__USBIP_DEBUG_H__
@@ -17,6 +17,9 @@ struct usbip_exported_device {
     struct usbip_usb_interface uinf[];
 };
 
+/* seconds a released device stays open and claimed, 0 disables */
+extern int usbip_claim_linger;
+
 /* API to be implemented by the driver */
 int usbip_refresh_device_list(struct usbip_exported_devices *edevs);
 
@@ -24,7 +27,9 @@ int usbip_free_device_list(struct usbip_exported_devices *edevs);
 
 struct usbip_exported_device *usbip_get_device(struct usbip_exported_devices *edevs, const char *busid);
 
-int usbip_export_device(struct usbip_exported_device *edev, int sock_fd);
+/* caps are the granted protocol extensions, USBIP_CAP_* */
+int usbip_export_device(struct usbip_exported_device *edev, int sock_fd,
+			uint32_t caps);
 
 int usbip_try_transfer(struct usbip_exported_device *edev, int sock_fd);
 
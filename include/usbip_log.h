@@ -0,0 +1,63 @@
+#ifndef __USBIP_LOG_H__
+#define __USBIP_LOG_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* same values as syslog(3) priorities */
+#define USBIP_LOG_ERR		3
+#define USBIP_LOG_WARNING	4
+#define USBIP_LOG_INFO		6
+#define USBIP_LOG_DEBUG		7
+
+/*
+ * Messages above this level are compiled out, e.g. -DUSBIP_LOG_LEVEL=6
+ * removes every debug message from the binary.
+ */
+#ifndef USBIP_LOG_LEVEL
+#define USBIP_LOG_LEVEL		USBIP_LOG_DEBUG
+#endif
+
+/* a call site prints at most BURST messages per INTERVAL ms */
+#define USBIP_RATELIMIT_INTERVAL	5000
+#define USBIP_RATELIMIT_BURST		10
+
+struct usbip_ratelimit {
+	atomic_ullong begin;
+	atomic_int printed;
+	atomic_int missed;
+};
+
+/*
+ * Until usbip_log_start() is called, or if it failed, messages are written
+ * synchronously to stdout and stderr. Afterwards every thread formats into
+ * a ring of its own, which a flusher thread empties to the sink. A full
+ * ring drops messages rather than blocking the caller.
+ */
+int usbip_log_set_sink(const char *spec);
+int usbip_log_start(void);
+void usbip_log_stop(void);
+
+void usbip_log(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void usbip_log_write(int level, const char *msg, int len);
+int usbip_ratelimit(struct usbip_ratelimit *rs, const char *func);
+
+#ifndef USBIP_OS_NO_NR_ARGS
+#define usbip_log_at(lvl, cond, fmt, args...)				\
+	do {								\
+		if ((lvl) <= USBIP_LOG_LEVEL && (cond))			\
+			usbip_log(lvl, fmt, ##args);			\
+	} while (0)
+
+#define usbip_log_ratelimited(lvl, cond, fmt, args...)			\
+	do {								\
+		static struct usbip_ratelimit __rs;			\
+									\
+		if ((lvl) <= USBIP_LOG_LEVEL && (cond) &&		\
+		    usbip_ratelimit(&__rs, __func__))			\
+			usbip_log(lvl, fmt, ##args);			\
+	} while (0)
+#endif /* !USBIP_OS_NO_NR_ARGS */
+
+#endif /* __USBIP_LOG_H__ */
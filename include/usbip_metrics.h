@@ -0,0 +1,87 @@
+/*
+ * Daemon-wide counters
+ */
+
+#ifndef __USBIP_METRICS_H
+#define __USBIP_METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Every metric is a relaxed atomic counter, bumped wherever it happens and
+ * printed as NAME=VALUE lines on SIGUSR1 and at shutdown. Times are in us.
+ */
+#define USBIP_METRICS(X)						\
+	X(dead_peers)		/* connections dropped as dead */	\
+	X(dead_peer_keepalive)	/*  by TCP keepalive or user timeout */	\
+	X(dead_peer_idle)	/*  by the heartbeat watchdog */	\
+	X(reclaims)		/* devices released after a session */	\
+	X(reclaim_us_total)	/* connection down to device released */ \
+	X(reclaim_us_max)						\
+	X(reclaim_us_last)						\
+	X(reclaim_cancelled)	/* transfers cancelled at teardown */	\
+	X(teardowns)							\
+	X(teardown_us_max)	/* cancel to all transfers freed */	\
+	X(teardown_orphans)	/* never given back by the device */	\
+	X(mux_imports)		/* devices joining a shared connection */ \
+	X(mux_tx_merged)	/* sends held back to share segments */	\
+	X(shape_bytes)		/* results sent by shaped devices */	\
+	X(shape_limited)	/* tx rounds waiting on a device's limit */ \
+	X(shape_yielded)	/* tx rounds yielding to other devices */	\
+	X(capture_events)	/* usbmon events queued for captures */	\
+	X(capture_drops)	/* lost to a full capture ring */	\
+	X(compress_raw_bytes)	/* IN payloads compression was tried on */ \
+	X(compress_wire_bytes)	/*  and what of them went out */	\
+	X(wait_spin_hits)	/* tx and rx finding work while spinning */ \
+	X(wait_parks)		/* giving up spinning and parking */	\
+	X(wait_spin_us)		/* spent spinning */			\
+	X(tx_ahead_of_bulk)	/* results sent before waiting bulk ones */ \
+	X(tx_bulk_slices)	/* breaks in bulk results for others */	\
+	X(prefetch_hits)	/* requests answered from a prefetch ring */ \
+	X(prefetch_waits)	/* requests waiting for a prefetch */	\
+	X(prefetch_overflows)	/* prefetches held back by a full ring */
+
+enum usbip_metric {
+#define USBIP_METRIC_ENUM(name)	USBIP_M_##name,
+	USBIP_METRICS(USBIP_METRIC_ENUM)
+#undef USBIP_METRIC_ENUM
+	USBIP_M_NUM
+};
+
+extern atomic_ullong usbip_metrics[USBIP_M_NUM];
+
+static inline void usbip_metric_add(enum usbip_metric m, uint64_t v)
+{
+	atomic_fetch_add_explicit(&usbip_metrics[m], v, memory_order_relaxed);
+}
+
+static inline void usbip_metric_set(enum usbip_metric m, uint64_t v)
+{
+	atomic_store_explicit(&usbip_metrics[m], v, memory_order_relaxed);
+}
+
+static inline void usbip_metric_max(enum usbip_metric m, uint64_t v)
+{
+	unsigned long long cur;
+
+	cur = atomic_load_explicit(&usbip_metrics[m], memory_order_relaxed);
+	while (cur < v &&
+	       !atomic_compare_exchange_weak_explicit(&usbip_metrics[m], &cur,
+			v, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/* the clock of all metric times */
+static inline uint64_t usbip_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void usbip_metrics_dump(void);
+
+#endif /* __USBIP_METRICS_H */
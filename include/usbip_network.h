@@ -15,6 +15,17 @@ extern int usbip_port;
 extern char *usbip_port_string;
 void usbip_setup_port_number(char *arg);
 
+/* deadline for a single usbip_net_recv() in milliseconds, 0 waits forever */
+#define USBIP_NET_TIMEOUT_DEFAULT	5000
+extern int usbip_net_timeout;
+
+/*
+ * seconds after which a silent peer counts as gone, by TCP keepalive and,
+ * with USBIP_CAP_HEARTBEAT, by the absence of USBIP_NOP; 0 never drops it
+ */
+#define USBIP_NET_DEAD_PEER_DEFAULT	5
+extern int usbip_net_dead_peer;
+
 #ifdef __linux__
 #include <linux/usb/ch9.h>
 #elif __APPLE__
@@ -78,6 +89,40 @@ struct op_common {
 #define ST_NO_FREE_PORT		0x02
 #define ST_DEVICE_NOT_FOUND	0x03
 
+/*
+ * Protocol extensions. A client asks for them in the upper half of the
+ * status of OP_REQ_IMPORT; the server grants a subset of them in the upper
+ * half of the status of OP_REP_IMPORT, below which the ST_* code stays.
+ * Servers without extensions reject a request asking for any, so a client
+ * should retry without them.
+ */
+#define USBIP_CAP_SHIFT		16
+#define USBIP_CAP_BATCH		(1 << 0)	/* USBIP_CMD_BATCH, USBIP_RET_BATCH */
+#define USBIP_CAP_COMPRESS	(1 << 1)	/* LZ4 bulk transfer buffers */
+#define USBIP_CAP_SHM		(1 << 2)	/* rings in a memfd, AF_UNIX only */
+#define USBIP_CAP_STREAMS	(1 << 3)	/* USB 3 bulk stream ids */
+#define USBIP_CAP_HEARTBEAT	(1 << 4)	/* USBIP_NOP when idle */
+#define USBIP_CAP_MUX		(1 << 5)	/* more devices, USBIP_CMD_IMPORT */
+#ifdef USBIP_HAVE_LZ4
+#define USBIP_CAPS_SUPPORTED	(USBIP_CAP_BATCH | USBIP_CAP_COMPRESS | \
+				 USBIP_CAP_SHM | USBIP_CAP_STREAMS | \
+				 USBIP_CAP_HEARTBEAT | USBIP_CAP_MUX)
+#else
+#define USBIP_CAPS_SUPPORTED	(USBIP_CAP_BATCH | USBIP_CAP_SHM | \
+				 USBIP_CAP_STREAMS | USBIP_CAP_HEARTBEAT | \
+				 USBIP_CAP_MUX)
+#endif
+
+/*
+ * With USBIP_CAP_HEARTBEAT, either side sends a bare USBIP_NOP header once
+ * it has sent nothing for USBIP_HEARTBEAT_INTERVAL ms, and may drop the
+ * connection after hearing nothing for a few intervals.
+ */
+#define USBIP_HEARTBEAT_INTERVAL	1000
+
+#define ST_CODE(status)		((status) & ((1 << USBIP_CAP_SHIFT) - 1))
+#define ST_CAPS(status)		((status) >> USBIP_CAP_SHIFT)
+
 /* ---------------------------------------------------------------------- */
 /* Dummy Code */
 #define OP_UNSPEC	0x00
@@ -138,9 +183,14 @@ ssize_t usbip_net_recv(int sock_fd, void *buff, size_t bufflen);
 ssize_t usbip_net_send(int sock_fd, void *buff, size_t bufflen);
 int usbip_net_send_op_common(int sock_fd, uint32_t code, uint32_t status);
 int usbip_net_recv_op_common(int sock_fd, uint16_t *code);
+int usbip_net_recv_op_common_caps(int sock_fd, uint16_t *code,
+				  uint32_t *caps);
 int usbip_net_set_reuseaddr(int sockfd);
+int usbip_net_set_reuseport(int sockfd);
 int usbip_net_set_nodelay(int sockfd);
+int usbip_net_is_local(int sockfd);
 int usbip_net_set_keepalive(int sockfd);
+int usbip_net_set_dead_peer(int sockfd, int secs);
 int usbip_net_set_v6only(int sockfd);
 const char *usbip_net_gai_strerror(int errcode);
 
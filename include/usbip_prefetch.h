@@ -0,0 +1,38 @@
+/*
+ * Transfers kept at IN endpoints ahead of the client
+ */
+
+#ifndef __USBIP_PREFETCH_H
+#define __USBIP_PREFETCH_H
+
+#include <stdint.h>
+
+/*
+ * A policy is given as DEVICE,KEY=VALUE[,KEY=VALUE...], where DEVICE is
+ * the bus id of a device, its VENDOR:PRODUCT in hex or class:CLASS, the
+ * endpoints of interfaces of that class on any device. intr=N keeps N
+ * transfers queued at its interrupt IN endpoints all the time, bulk=N
+ * reads ahead with N transfers of size bytes, 4096 by default, at its
+ * bulk IN endpoints without streams. ring=N holds up to N completed
+ * transfers for the client, 16 by default and never less than intr or
+ * bulk. ep=ADDR limits the policy to one endpoint. The first policy
+ * matching an endpoint applies.
+ */
+int usbip_prefetch_parse(const char *spec);
+
+struct usbip_prefetch {
+	unsigned int intr;	/* transfers at an interrupt IN endpoint */
+	unsigned int bulk;	/* transfers at a bulk IN endpoint */
+	unsigned int size;	/* bytes of a bulk transfer */
+	unsigned int ring;	/* completed transfers held */
+};
+
+/*
+ * The policy of endpoint ep of a device, in an interface of ifclass, 0
+ * if there is one, else -1
+ */
+int usbip_prefetch_lookup(const char *busid, uint16_t vendor,
+			  uint16_t product, uint8_t ifclass, uint8_t ep,
+			  struct usbip_prefetch *pf);
+
+#endif /* __USBIP_PREFETCH_H */
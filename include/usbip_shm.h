@@ -0,0 +1,34 @@
+/*
+ * Shared-memory transport for clients on the same host
+ */
+
+#ifndef __USBIP_SHM_H
+#define __USBIP_SHM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* bytes of each of the two rings, a power of 2 */
+#define USBIP_SHM_RING_SIZE	(1 << 20)
+
+/*
+ * With USBIP_CAP_SHM, the server creates a memfd holding one ring per
+ * direction and passes it over the AF_UNIX connection right after
+ * OP_REP_IMPORT and its device. From then on the usual PDU stream flows
+ * through the rings, while the socket only carries wakeups for a reader
+ * that went to sleep, and tells either side when the other one is gone.
+ */
+struct usbip_shm;
+
+struct usbip_shm *usbip_shm_create(int sock_fd);
+int usbip_shm_send_fd(struct usbip_shm *shm);
+struct usbip_shm *usbip_shm_recv_fd(int sock_fd);
+void usbip_shm_free(struct usbip_shm *shm);
+
+/* like writev() and recv(), but through the rings */
+ssize_t usbip_shm_writev(struct usbip_shm *shm, const struct iovec *iov,
+			 int iovcnt);
+ssize_t usbip_shm_read(struct usbip_shm *shm, void *buf, size_t len);
+
+#endif /* __USBIP_SHM_H */
@@ -0,0 +1,50 @@
+/*
+ * Socket profiles of data connections
+ */
+
+#ifndef __USBIP_SOCKOPT_H
+#define __USBIP_SOCKOPT_H
+
+/*
+ * What an exported device mostly moves, to pick its profile. A device
+ * with any isochronous endpoint counts as iso; one with interrupt but no
+ * bulk endpoints as intr.
+ */
+enum usbip_traffic_class {
+	USBIP_TC_DEFAULT,
+	USBIP_TC_ISO,
+	USBIP_TC_INTR,
+	USBIP_TC_BULK,
+	USBIP_TC_NUM
+};
+
+/*
+ * A profile is given as [TARGET:]KEY=VALUE[,KEY=VALUE...], where TARGET
+ * is iso, intr, bulk or the bus id of a device and no TARGET is the
+ * default of all connections. Keys are sndbuf, rcvbuf (bytes or auto),
+ * lowat, busypoll, dscp, prio and rate, limit, burst and weight for
+ * shaping and spin for waiting. Later specs override earlier ones.
+ */
+int usbip_sockopt_parse(const char *spec);
+
+/* the default profile, right after accept() */
+void usbip_sockopt_accept(int sockfd);
+
+/* the profile of a device, once it is exported on sockfd */
+void usbip_sockopt_export(int sockfd, const char *busid,
+			  enum usbip_traffic_class tc);
+
+/* how to shape what a device sends, all 0 for not at all */
+struct usbip_shaping {
+	int limit;	/* Mbit/s */
+	int burst;	/* bytes */
+	int weight;	/* share of the uplink, 0 without fair scheduling */
+};
+
+void usbip_sockopt_shaping(const char *busid, enum usbip_traffic_class tc,
+			   struct usbip_shaping *shaping);
+
+/* us the threads of a device spin for work before they sleep */
+unsigned int usbip_sockopt_spin(const char *busid, enum usbip_traffic_class tc);
+
+#endif /* __USBIP_SOCKOPT_H */
@@ -0,0 +1,64 @@
+/*
+ * USDT probes of the data plane
+ */
+
+#ifndef __USBIP_TRACE_H
+#define __USBIP_TRACE_H
+
+/*
+ * Static probes of provider usbip, for perf, bpftrace or SystemTap on a
+ * running daemon. They cost a nop each and are built in when sys/sdt.h
+ * is found, see USBIP_WITH_SDT; without it they compile to nothing.
+ * tools/bpftrace has sample scripts, and
+ *
+ *   bpftrace -l 'usdt:./usbip_libusb:usbip:*'
+ *
+ * lists what a build has.
+ *
+ * Transfer probes all take the same arguments, in this order:
+ *
+ *   seqnum  of the command, or of the USBIP_CMD_UNLINK once unlinked
+ *   devid   of the device, as the client sent it in pdu_recv
+ *   ep      endpoint number, or address where noted
+ *   length  in bytes
+ *   status  or another value where noted
+ *
+ * pdu_recv	a header was received, status is the command and length
+ *		the transfer_buffer_length of a CMD_SUBMIT
+ * submit	a transfer is about to go to the device, ep is its address
+ *		and status its LIBUSB_TRANSFER_TYPE_*
+ * unlink	a CMD_UNLINK arrived, length is the seqnum to unlink and
+ *		status 1 if it was still at the device
+ * complete	stub_complete() fired, ep is the address, length the
+ *		actual_length and status a LIBUSB_TRANSFER_*
+ * ret_submit	the result went out, classic or batched, same as complete
+ * ret_unlink	the RET_UNLINK went out, status a LIBUSB_TRANSFER_*
+ *
+ * Connection probes take the socket, the OP_REQ_* code and the granted
+ * capabilities or the result of the request:
+ *
+ * conn_open	a request arrived on a new connection
+ * conn_close	it was served; an imported device keeps the socket
+ */
+
+#ifdef USBIP_HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define USBIP_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(usbip, name, a, b, c)
+#define USBIP_PROBE5(name, a, b, c, d, e) \
+	DTRACE_PROBE5(usbip, name, a, b, c, d, e)
+
+#else
+
+#define USBIP_PROBE3(name, a, b, c) \
+	do { (void)(a); (void)(b); (void)(c); } while (0)
+#define USBIP_PROBE5(name, a, b, c, d, e) \
+	do { \
+		(void)(a); (void)(b); (void)(c); (void)(d); (void)(e); \
+	} while (0)
+
+#endif /* USBIP_HAVE_SDT */
+
+#endif /* __USBIP_TRACE_H */
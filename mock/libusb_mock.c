@@ -0,0 +1,1041 @@
+/*
+ * The libusb API over simulated devices, see libusb_mock.h
+ *
+ * Devices are created by libusb_init() from the comma separated profile
+ * names in USBIP_MOCK_DEVICES, "uas" by default, and sit on bus 1 at
+ * ports 1 and up.
+ *
+ * A submitted transfer is handed to its device model, which tells when it
+ * completes. It then waits in a queue ordered by that time until one of
+ * the libusb_handle_events*() calls finds it due and runs its callback,
+ * just like the completions of a real host controller, and like libusb
+ * under an event lock that libusb_lock_events() takes. Threads waiting in
+ * there drop their timer slack and wake up a quarter early from waits
+ * longer than MOCK_EARLY_NS to sleep the rest, as a timer overshoots by
+ * a share of its length on some virtual machines. So completions are on
+ * time, as from the interrupt of a real controller, even for a caller
+ * that sleeps rather than polls.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include "list.h"
+#include "libusb_mock.h"
+
+#define MOCK_MAX_DEVICES	16
+#define MOCK_CONTROL_NS		10000	/* a control transfer takes 10 us */
+#define MOCK_CANCEL_NS		100000	/* and unlinking one 100 us */
+#define MOCK_EARLY_NS		20000	/* waits to split */
+
+struct mock_transfer {
+	struct list_head list;
+	uint64_t due;
+	uint32_t stream_id;
+	int queued;
+	int cancelled;
+	/* struct libusb_transfer and its iso packets follow */
+};
+
+struct libusb_context {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_mutex_t events;		/* held while callbacks run */
+	struct list_head pending;	/* by due */
+	struct list_head unlinked;	/* cancelled, by due as well */
+	int interrupted;		/* until an event handler returns */
+	int num_devs;
+	struct libusb_device *devs[MOCK_MAX_DEVICES];
+};
+
+struct libusb_device {
+	struct libusb_context *ctx;
+	struct mock_device *mdev;
+	int refcnt;
+};
+
+struct libusb_device_handle {
+	struct libusb_device *dev;
+};
+
+static const struct mock_profile {
+	const char *name;
+	struct mock_device *(*create)(void);
+} mock_profiles[] = {
+	{"uas", mock_uas_create},
+	{"replay", mock_replay_create},
+	{"mouse", mock_mouse_create},
+	{"keyboard", mock_keyboard_create},
+	{"acm", mock_acm_create},
+	{"bot", mock_bot_create},
+	{"uvc", mock_uvc_create},
+	{"audio", mock_audio_create},
+	{NULL, NULL}
+};
+
+long mock_env_long(const char *name, long def)
+{
+	const char *s = getenv(name);
+
+	return s && *s ? strtol(s, NULL, 0) : def;
+}
+
+void mock_pipe_init(struct mock_pipe *pipe, long latency_us,
+		    uint64_t bytes_per_sec)
+{
+	pipe->latency_ns = latency_us > 0 ? latency_us * 1000ULL : 0;
+	pipe->ps_per_byte = bytes_per_sec ?
+		1000000000000ULL / bytes_per_sec : 0;
+	pipe->busy = 0;
+}
+
+uint64_t mock_pipe_due(struct mock_pipe *pipe, uint64_t now, uint64_t bytes)
+{
+	uint64_t start = now + pipe->latency_ns;
+
+	if (start < pipe->busy)
+		start = pipe->busy;
+	pipe->busy = start + bytes * pipe->ps_per_byte / 1000;
+	return pipe->busy;
+}
+
+static uint64_t mock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline struct mock_transfer *trx2mt(struct libusb_transfer *trx)
+{
+	return (struct mock_transfer *)trx - 1;
+}
+
+static inline struct libusb_transfer *mt2trx(struct mock_transfer *mt)
+{
+	return (struct libusb_transfer *)(mt + 1);
+}
+
+/* ---------------------------------------------------------------------- */
+/* descriptors */
+
+static void mock_parse_config(struct mock_device *mdev)
+{
+	struct mock_config *cfg = &mdev->cfg;
+	const unsigned char *raw = mdev->config_desc;
+	int total = raw[2] | (raw[3] << 8);
+	struct libusb_interface_descriptor *alt = NULL;
+	struct libusb_endpoint_descriptor *ep = NULL;
+	int pos, num_eps = 0;
+
+	cfg->config.bLength = raw[0];
+	cfg->config.bDescriptorType = raw[1];
+	cfg->config.wTotalLength = total;
+	cfg->config.bNumInterfaces = raw[4];
+	cfg->config.bConfigurationValue = raw[5];
+	cfg->config.iConfiguration = raw[6];
+	cfg->config.bmAttributes = raw[7];
+	cfg->config.MaxPower = raw[8];
+	cfg->config.interface = cfg->intf;
+
+	for (pos = raw[0]; pos + 2 <= total && raw[pos]; pos += raw[pos]) {
+		const unsigned char *d = raw + pos;
+
+		if (d[1] == LIBUSB_DT_INTERFACE && d[2] < MOCK_MAX_IFS &&
+		    cfg->intf[d[2]].num_altsetting < MOCK_MAX_ALTS) {
+			struct libusb_interface *intf = &cfg->intf[d[2]];
+
+			alt = &cfg->alt[d[2]][intf->num_altsetting++];
+			intf->altsetting = cfg->alt[d[2]];
+			alt->bLength = d[0];
+			alt->bDescriptorType = d[1];
+			alt->bInterfaceNumber = d[2];
+			alt->bAlternateSetting = d[3];
+			alt->bInterfaceClass = d[5];
+			alt->bInterfaceSubClass = d[6];
+			alt->bInterfaceProtocol = d[7];
+			alt->iInterface = d[8];
+			alt->endpoint = cfg->ep + num_eps;
+			ep = NULL;
+		} else if (d[1] == LIBUSB_DT_ENDPOINT && alt &&
+			   num_eps < MOCK_MAX_EPS) {
+			ep = &cfg->ep[num_eps++];
+			alt->bNumEndpoints++;
+			ep->bLength = d[0];
+			ep->bDescriptorType = d[1];
+			ep->bEndpointAddress = d[2];
+			ep->bmAttributes = d[3];
+			ep->wMaxPacketSize = d[4] | (d[5] << 8);
+			ep->bInterval = d[6];
+		} else if (ep) {
+			/* companions and class descriptors of the endpoint */
+			if (!ep->extra)
+				ep->extra = d;
+			ep->extra_length += d[0];
+		} else if (alt) {
+			if (!alt->extra)
+				alt->extra = d;
+			alt->extra_length += d[0];
+		}
+	}
+}
+
+static void mock_parse_device(struct mock_device *mdev)
+{
+	const unsigned char *d = mdev->device_desc;
+	struct libusb_device_descriptor *desc = &mdev->desc;
+
+	desc->bLength = d[0];
+	desc->bDescriptorType = d[1];
+	desc->bcdUSB = d[2] | (d[3] << 8);
+	desc->bDeviceClass = d[4];
+	desc->bDeviceSubClass = d[5];
+	desc->bDeviceProtocol = d[6];
+	desc->bMaxPacketSize0 = d[7];
+	desc->idVendor = d[8] | (d[9] << 8);
+	desc->idProduct = d[10] | (d[11] << 8);
+	desc->bcdDevice = d[12] | (d[13] << 8);
+	desc->iManufacturer = d[14];
+	desc->iProduct = d[15];
+	desc->iSerialNumber = d[16];
+	desc->bNumConfigurations = d[17];
+}
+
+/* the endpoint ep in the active settings, or NULL */
+static const struct libusb_endpoint_descriptor *
+mock_active_ep(struct mock_device *mdev, unsigned char ep)
+{
+	struct mock_config *cfg = &mdev->cfg;
+	int i, j, k;
+
+	for (i = 0; i < cfg->config.bNumInterfaces; i++) {
+		const struct libusb_interface *intf = &cfg->intf[i];
+
+		for (j = 0; j < intf->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *alt =
+				intf->altsetting + j;
+
+			if (alt->bAlternateSetting != mdev->alt[i])
+				continue;
+			for (k = 0; k < alt->bNumEndpoints; k++) {
+				if (alt->endpoint[k].bEndpointAddress == ep)
+					return alt->endpoint + k;
+			}
+		}
+	}
+	return NULL;
+}
+
+static uint32_t *mock_streams(struct mock_device *mdev, unsigned char ep)
+{
+	return &mdev->streams[!!(ep & LIBUSB_ENDPOINT_IN)]
+			     [ep & LIBUSB_ENDPOINT_ADDRESS_MASK];
+}
+
+/* drop the streams of every endpoint of an interface */
+static void mock_drop_streams(struct mock_device *mdev, int ifnum)
+{
+	const struct libusb_interface *intf = &mdev->cfg.intf[ifnum];
+	int j, k;
+
+	for (j = 0; j < intf->num_altsetting; j++) {
+		const struct libusb_interface_descriptor *alt =
+			intf->altsetting + j;
+
+		for (k = 0; k < alt->bNumEndpoints; k++)
+			*mock_streams(mdev,
+				      alt->endpoint[k].bEndpointAddress) = 0;
+	}
+}
+
+static int mock_set_alt(struct mock_device *mdev, int ifnum, int alt)
+{
+	const struct libusb_interface *intf;
+	int j;
+
+	if (ifnum < 0 || ifnum >= mdev->cfg.config.bNumInterfaces)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	intf = &mdev->cfg.intf[ifnum];
+	for (j = 0; j < intf->num_altsetting; j++) {
+		if (intf->altsetting[j].bAlternateSetting == alt)
+			break;
+	}
+	if (j == intf->num_altsetting)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	mock_drop_streams(mdev, ifnum);
+	mdev->alt[ifnum] = alt;
+	return 0;
+}
+
+static int mock_string(struct mock_device *mdev, int index,
+		       unsigned char *data)
+{
+	const char *s;
+	int i, len;
+
+	if (index == 0) {
+		data[0] = 4;
+		data[1] = LIBUSB_DT_STRING;
+		data[2] = 0x09;
+		data[3] = 0x04;
+		return 4;
+	}
+	if (index > mdev->num_strings)
+		return LIBUSB_ERROR_PIPE;
+
+	s = mdev->strings[index - 1];
+	len = strlen(s);
+	if (len > 126)
+		len = 126;
+	data[0] = 2 + 2 * len;
+	data[1] = LIBUSB_DT_STRING;
+	for (i = 0; i < len; i++) {
+		data[2 + 2 * i] = s[i];
+		data[3 + 2 * i] = 0;
+	}
+	return data[0];
+}
+
+/* a request on ep0, data has room for wLength bytes, 255 at least */
+static int mock_control(struct mock_device *mdev,
+			const struct libusb_control_setup *setup,
+			unsigned char *data)
+{
+	uint16_t value = libusb_le16_to_cpu(setup->wValue);
+	uint16_t index = libusb_le16_to_cpu(setup->wIndex);
+	uint16_t length = libusb_le16_to_cpu(setup->wLength);
+	const unsigned char *src = NULL;
+	unsigned char buf[256];
+	int len = 0;
+
+	if ((setup->bmRequestType & LIBUSB_REQUEST_TYPE_RESERVED) !=
+	    LIBUSB_REQUEST_TYPE_STANDARD) {
+		if (!mdev->ops->control)
+			return LIBUSB_ERROR_PIPE;
+		return mdev->ops->control(mdev, setup, data);
+	}
+
+	switch (setup->bRequest) {
+	case LIBUSB_REQUEST_GET_DESCRIPTOR:
+		switch (value >> 8) {
+		case LIBUSB_DT_DEVICE:
+			src = mdev->device_desc;
+			len = LIBUSB_DT_DEVICE_SIZE;
+			break;
+		case LIBUSB_DT_CONFIG:
+			src = mdev->config_desc;
+			len = mdev->cfg.config.wTotalLength;
+			break;
+		case LIBUSB_DT_BOS:
+			if (!mdev->bos_desc)
+				return LIBUSB_ERROR_PIPE;
+			src = mdev->bos_desc;
+			len = src[2] | (src[3] << 8);
+			break;
+		case LIBUSB_DT_STRING:
+			len = mock_string(mdev, value & 0xff, buf);
+			if (len < 0)
+				return len;
+			src = buf;
+			break;
+		default:
+			if (!mdev->ops->control)
+				return LIBUSB_ERROR_PIPE;
+			return mdev->ops->control(mdev, setup, data);
+		}
+		break;
+	case LIBUSB_REQUEST_GET_STATUS:
+		buf[0] = buf[1] = 0;
+		src = buf;
+		len = 2;
+		break;
+	case LIBUSB_REQUEST_GET_CONFIGURATION:
+		buf[0] = mdev->configuration;
+		src = buf;
+		len = 1;
+		break;
+	case LIBUSB_REQUEST_GET_INTERFACE:
+		if (index >= MOCK_MAX_IFS)
+			return LIBUSB_ERROR_PIPE;
+		buf[0] = mdev->alt[index];
+		src = buf;
+		len = 1;
+		break;
+	case LIBUSB_REQUEST_SET_CONFIGURATION:
+		mdev->configuration = value;
+		return 0;
+	case LIBUSB_REQUEST_SET_INTERFACE:
+		return mock_set_alt(mdev, index, value) ? LIBUSB_ERROR_PIPE : 0;
+	case LIBUSB_REQUEST_CLEAR_FEATURE:
+	case LIBUSB_REQUEST_SET_FEATURE:
+	case LIBUSB_REQUEST_SET_SEL:
+	case LIBUSB_SET_ISOCH_DELAY:
+		return 0;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if (len > length)
+		len = length;
+	memcpy(data, src, len);
+	return len;
+}
+
+/* ---------------------------------------------------------------------- */
+/* context and devices */
+
+int LIBUSB_CALL libusb_init(libusb_context **ctxp)
+{
+	const struct mock_profile *p;
+	struct libusb_context *ctx;
+	pthread_condattr_t attr;
+	char *names, *name, *save;
+
+	ctx = (struct libusb_context *)calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return LIBUSB_ERROR_NO_MEM;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_mutex_init(&ctx->events, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	INIT_LIST_HEAD(&ctx->pending);
+	INIT_LIST_HEAD(&ctx->unlinked);
+
+	names = strdup(getenv("USBIP_MOCK_DEVICES") ?
+		       getenv("USBIP_MOCK_DEVICES") : "uas");
+	if (!names) {
+		libusb_exit(ctx);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	for (name = strtok_r(names, ",", &save);
+	     name && ctx->num_devs < MOCK_MAX_DEVICES;
+	     name = strtok_r(NULL, ",", &save)) {
+		struct libusb_device *dev;
+		struct mock_device *mdev;
+
+		for (p = mock_profiles; p->name; p++) {
+			if (!strcmp(p->name, name))
+				break;
+		}
+		if (!p->name || !(mdev = p->create()))
+			continue;
+
+		dev = (struct libusb_device *)calloc(1, sizeof(*dev));
+		if (!dev) {
+			if (mdev->ops->free)
+				mdev->ops->free(mdev);
+			continue;
+		}
+		mdev->port = ctx->num_devs + 1;
+		mdev->configuration = 1;
+		mock_parse_device(mdev);
+		mock_parse_config(mdev);
+		dev->ctx = ctx;
+		dev->mdev = mdev;
+		dev->refcnt = 1;
+		ctx->devs[ctx->num_devs++] = dev;
+	}
+	free(names);
+
+	*ctxp = ctx;
+	return 0;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx)
+{
+	int i;
+
+	if (!ctx)
+		return;
+	for (i = 0; i < ctx->num_devs; i++) {
+		struct mock_device *mdev = ctx->devs[i]->mdev;
+
+		if (mdev->ops->free)
+			mdev->ops->free(mdev);
+		free(ctx->devs[i]);
+	}
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+	pthread_mutex_destroy(&ctx->events);
+	free(ctx);
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
+					   libusb_device ***list)
+{
+	libusb_device **devs;
+	int i;
+
+	devs = (libusb_device **)calloc(ctx->num_devs + 1, sizeof(*devs));
+	if (!devs)
+		return LIBUSB_ERROR_NO_MEM;
+	for (i = 0; i < ctx->num_devs; i++)
+		devs[i] = libusb_ref_device(ctx->devs[i]);
+	*list = devs;
+	return ctx->num_devs;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
+					 int unref_devices)
+{
+	libusb_device **dev;
+
+	if (!list)
+		return;
+	if (unref_devices) {
+		for (dev = list; *dev; dev++)
+			libusb_unref_device(*dev);
+	}
+	free(list);
+}
+
+/* devices live as long as the context, counting is for show */
+libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev)
+{
+	__atomic_add_fetch(&dev->refcnt, 1, __ATOMIC_RELAXED);
+	return dev;
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device *dev)
+{
+	if (dev)
+		__atomic_sub_fetch(&dev->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev)
+{
+	(void)dev;
+	return 1;
+}
+
+uint8_t LIBUSB_CALL libusb_get_port_number(libusb_device *dev)
+{
+	return dev->mdev->port;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev)
+{
+	return dev->mdev->port + 1;
+}
+
+libusb_device * LIBUSB_CALL libusb_get_parent(libusb_device *dev)
+{
+	(void)dev;
+	return NULL;
+}
+
+int LIBUSB_CALL libusb_get_device_speed(libusb_device *dev)
+{
+	return dev->mdev->speed;
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev,
+		struct libusb_device_descriptor *desc)
+{
+	memcpy(desc, &dev->mdev->desc, sizeof(*desc));
+	return 0;
+}
+
+int LIBUSB_CALL libusb_get_active_config_descriptor(libusb_device *dev,
+		struct libusb_config_descriptor **config)
+{
+	*config = &dev->mdev->cfg.config;
+	return 0;
+}
+
+/* the parsed configuration belongs to the device */
+void LIBUSB_CALL libusb_free_config_descriptor(
+		struct libusb_config_descriptor *config)
+{
+	(void)config;
+}
+
+int LIBUSB_CALL libusb_get_ss_endpoint_companion_descriptor(
+		libusb_context *ctx,
+		const struct libusb_endpoint_descriptor *endpoint,
+		struct libusb_ss_endpoint_companion_descriptor **ep_comp)
+{
+	const unsigned char *d = endpoint->extra;
+	int pos;
+
+	(void)ctx;
+	for (pos = 0; d && pos + 6 <= endpoint->extra_length;
+	     pos += d[pos]) {
+		if (d[pos + 1] != LIBUSB_DT_SS_ENDPOINT_COMPANION) {
+			if (!d[pos])
+				break;
+			continue;
+		}
+		*ep_comp = (struct libusb_ss_endpoint_companion_descriptor *)
+				calloc(1, sizeof(**ep_comp));
+		if (!*ep_comp)
+			return LIBUSB_ERROR_NO_MEM;
+		(*ep_comp)->bLength = d[pos];
+		(*ep_comp)->bDescriptorType = d[pos + 1];
+		(*ep_comp)->bMaxBurst = d[pos + 2];
+		(*ep_comp)->bmAttributes = d[pos + 3];
+		(*ep_comp)->wBytesPerInterval = d[pos + 4] | (d[pos + 5] << 8);
+		return 0;
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+void LIBUSB_CALL libusb_free_ss_endpoint_companion_descriptor(
+		struct libusb_ss_endpoint_companion_descriptor *ep_comp)
+{
+	free(ep_comp);
+}
+
+/* ---------------------------------------------------------------------- */
+/* handles */
+
+int LIBUSB_CALL libusb_open(libusb_device *dev,
+			    libusb_device_handle **dev_handle)
+{
+	struct libusb_device_handle *h;
+
+	h = (struct libusb_device_handle *)calloc(1, sizeof(*h));
+	if (!h)
+		return LIBUSB_ERROR_NO_MEM;
+	h->dev = libusb_ref_device(dev);
+	*dev_handle = h;
+	return 0;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle)
+{
+	if (!dev_handle)
+		return;
+	libusb_unref_device(dev_handle->dev);
+	free(dev_handle);
+}
+
+libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle)
+{
+	return dev_handle->dev;
+}
+
+int LIBUSB_CALL libusb_get_configuration(libusb_device_handle *dev_handle,
+					 int *config)
+{
+	*config = dev_handle->dev->mdev->configuration;
+	return 0;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev_handle,
+				       int interface_number)
+{
+	struct mock_device *mdev = dev_handle->dev->mdev;
+
+	if (interface_number < 0 ||
+	    interface_number >= mdev->cfg.config.bNumInterfaces)
+		return LIBUSB_ERROR_NOT_FOUND;
+	mdev->claimed |= 1U << interface_number;
+	return 0;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle,
+					 int interface_number)
+{
+	struct mock_device *mdev = dev_handle->dev->mdev;
+
+	if (interface_number < 0 ||
+	    !(mdev->claimed & (1U << interface_number)))
+		return LIBUSB_ERROR_NOT_FOUND;
+	mdev->claimed &= ~(1U << interface_number);
+	return 0;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
+					    int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_attach_kernel_driver(libusb_device_handle *dev_handle,
+					    int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_set_interface_alt_setting(
+		libusb_device_handle *dev_handle,
+		int interface_number, int alternate_setting)
+{
+	struct libusb_context *ctx = dev_handle->dev->ctx;
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+	ret = mock_set_alt(dev_handle->dev->mdev, interface_number,
+			   alternate_setting);
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev_handle,
+				  unsigned char endpoint)
+{
+	(void)dev_handle;
+	(void)endpoint;
+	return 0;
+}
+
+int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = dev_handle->dev->ctx;
+	struct mock_device *mdev = dev_handle->dev->mdev;
+
+	pthread_mutex_lock(&ctx->lock);
+	memset(mdev->alt, 0, sizeof(mdev->alt));
+	memset(mdev->streams, 0, sizeof(mdev->streams));
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+/*
+ * As on Linux, every endpoint must take streams in its active setting,
+ * and the count is cut down to what the poorest one takes.
+ */
+int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev_handle,
+				     uint32_t num_streams,
+				     unsigned char *endpoints,
+				     int num_endpoints)
+{
+	struct libusb_context *ctx = dev_handle->dev->ctx;
+	struct mock_device *mdev = dev_handle->dev->mdev;
+	int i, ret = 0;
+
+	if (num_streams < 2 || num_endpoints <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (i = 0; i < num_endpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep;
+		struct libusb_ss_endpoint_companion_descriptor *comp;
+		uint32_t max;
+
+		ep = mock_active_ep(mdev, endpoints[i]);
+		if (!ep || (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) !=
+				LIBUSB_TRANSFER_TYPE_BULK ||
+		    libusb_get_ss_endpoint_companion_descriptor(ctx, ep,
+								&comp)) {
+			ret = LIBUSB_ERROR_INVALID_PARAM;
+			goto out;
+		}
+		max = comp->bmAttributes & 0x1f ?
+			1U << (comp->bmAttributes & 0x1f) : 0;
+		libusb_free_ss_endpoint_companion_descriptor(comp);
+		if (!max || *mock_streams(mdev, endpoints[i])) {
+			ret = LIBUSB_ERROR_INVALID_PARAM;
+			goto out;
+		}
+		if (num_streams > max)
+			num_streams = max;
+	}
+	for (i = 0; i < num_endpoints; i++)
+		*mock_streams(mdev, endpoints[i]) = num_streams;
+	ret = num_streams;
+out:
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev_handle,
+				    unsigned char *endpoints,
+				    int num_endpoints)
+{
+	struct libusb_context *ctx = dev_handle->dev->ctx;
+	int i;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (i = 0; i < num_endpoints; i++)
+		*mock_streams(dev_handle->dev->mdev, endpoints[i]) = 0;
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
+		uint8_t request_type, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout)
+{
+	struct libusb_context *ctx = dev_handle->dev->ctx;
+	struct libusb_control_setup setup;
+	unsigned char buf[256];
+	unsigned char *p = wLength > sizeof(buf) ? data : buf;
+	int ret;
+
+	(void)timeout;
+	setup.bmRequestType = request_type;
+	setup.bRequest = bRequest;
+	setup.wValue = libusb_cpu_to_le16(wValue);
+	setup.wIndex = libusb_cpu_to_le16(wIndex);
+	setup.wLength = libusb_cpu_to_le16(wLength);
+
+	if (!(request_type & LIBUSB_ENDPOINT_IN) && wLength)
+		memcpy(p, data, wLength);
+
+	pthread_mutex_lock(&ctx->lock);
+	ret = mock_control(dev_handle->dev->mdev, &setup, p);
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (ret > 0 && (request_type & LIBUSB_ENDPOINT_IN) && p != data)
+		memcpy(data, p, ret);
+	return ret;
+}
+
+/* ---------------------------------------------------------------------- */
+/* transfers */
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+	struct mock_transfer *mt;
+	size_t size = sizeof(*mt) + sizeof(struct libusb_transfer) +
+		iso_packets * sizeof(struct libusb_iso_packet_descriptor);
+
+	mt = (struct mock_transfer *)calloc(1, size);
+	if (!mt)
+		return NULL;
+	mt2trx(mt)->num_iso_packets = iso_packets;
+	return mt2trx(mt);
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	if (!transfer)
+		return;
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)
+		free(transfer->buffer);
+	free(trx2mt(transfer));
+}
+
+void LIBUSB_CALL libusb_transfer_set_stream_id(
+		struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	trx2mt(transfer)->stream_id = stream_id;
+}
+
+uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
+		struct libusb_transfer *transfer)
+{
+	return trx2mt(transfer)->stream_id;
+}
+
+static void mock_queue(struct libusb_context *ctx, struct mock_transfer *mt)
+{
+	struct list_head *pos;
+
+	/* most transfers complete after the ones already queued */
+	for (pos = ctx->pending.prev; pos != &ctx->pending; pos = pos->prev) {
+		if (list_entry(pos, struct mock_transfer, list)->due <= mt->due)
+			break;
+	}
+	list_add(&mt->list, pos);
+	mt->queued = 1;
+	if (ctx->pending.next == &mt->list)
+		pthread_cond_signal(&ctx->cond);
+}
+
+static int mock_submit(struct mock_device *mdev, struct libusb_transfer *trx,
+		       struct mock_transfer *mt, uint64_t now)
+{
+	const struct libusb_endpoint_descriptor *ep;
+	uint32_t streams;
+	int ret;
+
+	if (trx->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		struct libusb_control_setup *setup =
+			libusb_control_transfer_get_setup(trx);
+
+		/* as usbfs, which wants room for all of wLength */
+		if (trx->length < LIBUSB_CONTROL_SETUP_SIZE +
+				  libusb_le16_to_cpu(setup->wLength))
+			return LIBUSB_ERROR_INVALID_PARAM;
+		ret = mock_control(mdev, setup,
+				   trx->buffer + LIBUSB_CONTROL_SETUP_SIZE);
+		trx->status = ret < 0 ? LIBUSB_TRANSFER_STALL :
+					LIBUSB_TRANSFER_COMPLETED;
+		trx->actual_length = ret < 0 ? 0 : ret;
+		mt->due = now + MOCK_CONTROL_NS;
+		return 0;
+	}
+
+	ep = mock_active_ep(mdev, trx->endpoint);
+	if (!ep)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* a stream endpoint takes stream transfers only, and vice versa */
+	streams = *mock_streams(mdev, trx->endpoint);
+	if (trx->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM) {
+		if (!mt->stream_id || mt->stream_id > streams)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	} else {
+		if (streams ||
+		    trx->type != (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK))
+			return LIBUSB_ERROR_INVALID_PARAM;
+		mt->stream_id = 0;
+	}
+
+	if (!mdev->ops->transfer)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	mt->due = mdev->ops->transfer(mdev, trx, mt->stream_id, now);
+	return 0;
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct libusb_device *dev = transfer->dev_handle->dev;
+	struct libusb_context *ctx = dev->ctx;
+	struct mock_transfer *mt = trx2mt(transfer);
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (mt->queued) {
+		pthread_mutex_unlock(&ctx->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	mt->cancelled = 0;
+	ret = mock_submit(dev->mdev, transfer, mt, mock_now());
+	if (ret == 0)
+		mock_queue(ctx, mt);
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct libusb_context *ctx = transfer->dev_handle->dev->ctx;
+	struct mock_transfer *mt = trx2mt(transfer);
+
+	pthread_mutex_lock(&ctx->lock);
+	if (!mt->queued || mt->cancelled) {
+		pthread_mutex_unlock(&ctx->lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	/* all unlink alike, so this keeps the order of unlinked for free */
+	list_del(&mt->list);
+	transfer->status = LIBUSB_TRANSFER_CANCELLED;
+	transfer->actual_length = 0;
+	mt->cancelled = 1;
+	mt->due = mock_now() + MOCK_CANCEL_NS;
+	list_add(&mt->list, ctx->unlinked.prev);
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+/* move what is due from a queue sorted by due to done */
+static void mock_due(struct list_head *queue, struct list_head *done,
+		     uint64_t now)
+{
+	struct list_head *pos, *tmp;
+	struct mock_transfer *mt;
+
+	list_for_each_safe(pos, tmp, queue) {
+		mt = list_entry(pos, struct mock_transfer, list);
+		if (mt->due > now)
+			break;
+		list_del(pos);
+		list_add(pos, done->prev);
+		mt->queued = 0;
+	}
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout(libusb_context *ctx,
+					     struct timeval *tv)
+{
+	uint64_t now = mock_now();
+	uint64_t deadline = now + tv->tv_sec * 1000000000ULL +
+		tv->tv_usec * 1000ULL;
+	struct mock_transfer *mt;
+	struct list_head done, *pos, *tmp;
+	struct timespec ts;
+	uint64_t wake;
+	static __thread int exact;	/* no timer slack in this thread */
+
+	INIT_LIST_HEAD(&done);
+	if (!exact && tv->tv_sec + tv->tv_usec) {
+		prctl(PR_SET_TIMERSLACK, 1UL);
+		exact = 1;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		mock_due(&ctx->unlinked, &done, now);
+		mock_due(&ctx->pending, &done, now);
+		if (done.next != &done || now >= deadline ||
+		    ctx->interrupted)
+			break;
+
+		wake = deadline;
+		if (ctx->pending.next != &ctx->pending) {
+			mt = list_entry(ctx->pending.next,
+					struct mock_transfer, list);
+			if (mt->due < wake)
+				wake = mt->due;
+		}
+		if (ctx->unlinked.next != &ctx->unlinked) {
+			mt = list_entry(ctx->unlinked.next,
+					struct mock_transfer, list);
+			if (mt->due < wake)
+				wake = mt->due;
+		}
+		if (wake - now > MOCK_EARLY_NS)
+			wake -= (wake - now) / 4;
+		ts.tv_sec = wake / 1000000000ULL;
+		ts.tv_nsec = wake % 1000000000ULL;
+		pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts);
+		now = mock_now();
+	}
+	ctx->interrupted = 0;
+	pthread_mutex_unlock(&ctx->lock);
+
+	/* a callback may free or resubmit its transfer */
+	pthread_mutex_lock(&ctx->events);
+	list_for_each_safe(pos, tmp, &done) {
+		mt = list_entry(pos, struct mock_transfer, list);
+		list_del(pos);
+		mt2trx(mt)->callback(mt2trx(mt));
+	}
+	pthread_mutex_unlock(&ctx->events);
+	return 0;
+}
+
+/* keeps callbacks from running, as the event lock of libusb does */
+void LIBUSB_CALL libusb_lock_events(libusb_context *ctx)
+{
+	pthread_mutex_lock(&ctx->events);
+}
+
+void LIBUSB_CALL libusb_unlock_events(libusb_context *ctx)
+{
+	pthread_mutex_unlock(&ctx->events);
+}
+
+void LIBUSB_CALL libusb_interrupt_event_handler(libusb_context *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->interrupted = 1;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+int LIBUSB_CALL libusb_handle_events(libusb_context *ctx)
+{
+	struct timeval tv = {60, 0};
+
+	return libusb_handle_events_timeout(ctx, &tv);
+}
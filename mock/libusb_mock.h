@@ -0,0 +1,104 @@
+/*
+ * Simulated USB devices behind the libusb API
+ *
+ * libusb_mock.c implements the part of libusb usbipd uses on top of
+ * devices described here, so that usbipd_mock exports them without any
+ * hardware. It answers the standard requests from the descriptors and
+ * keeps the alternate settings and streams; a device profile only models
+ * its data pipes and class requests.
+ */
+
+#ifndef __LIBUSB_MOCK_H
+#define __LIBUSB_MOCK_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+#define MOCK_MAX_IFS	8
+#define MOCK_MAX_ALTS	4
+#define MOCK_MAX_EPS	32
+
+struct mock_device;
+
+struct mock_device_ops {
+	/*
+	 * A class or vendor request on ep0, or a GET_DESCRIPTOR of a type
+	 * the device descriptors do not cover, e.g. a HID report. Returns
+	 * the bytes of the data stage or LIBUSB_ERROR_PIPE to stall.
+	 * Optional.
+	 */
+	int (*control)(struct mock_device *mdev,
+		       const struct libusb_control_setup *setup,
+		       unsigned char *data);
+
+	/*
+	 * A bulk, interrupt or isochronous transfer submitted at now, in ns
+	 * of CLOCK_MONOTONIC. Sets status and actual_length of trx and
+	 * returns when it completes. Called with the context locked.
+	 */
+	uint64_t (*transfer)(struct mock_device *mdev,
+			     struct libusb_transfer *trx,
+			     uint32_t stream_id, uint64_t now);
+
+	void (*free)(struct mock_device *mdev);
+};
+
+/* descriptors parsed into what libusb_get_*_descriptor() hand out */
+struct mock_config {
+	struct libusb_config_descriptor config;
+	struct libusb_interface intf[MOCK_MAX_IFS];
+	struct libusb_interface_descriptor alt[MOCK_MAX_IFS][MOCK_MAX_ALTS];
+	struct libusb_endpoint_descriptor ep[MOCK_MAX_EPS];
+};
+
+struct mock_device {
+	/* filled by the profile */
+	const struct mock_device_ops *ops;
+	enum libusb_speed speed;
+	const unsigned char *device_desc;	/* LIBUSB_DT_DEVICE_SIZE bytes */
+	const unsigned char *config_desc;	/* wTotalLength bytes */
+	const unsigned char *bos_desc;		/* or NULL */
+	const char *const *strings;		/* string 1 and up */
+	int num_strings;
+	void *priv;
+
+	/* kept by libusb_mock.c */
+	uint8_t port;
+	uint8_t configuration;
+	uint8_t alt[MOCK_MAX_IFS];
+	uint32_t claimed;
+	uint32_t streams[2][16];	/* allocated, by direction and number */
+	struct libusb_device_descriptor desc;
+	struct mock_config cfg;
+};
+
+/* settings from the environment, e.g. USBIP_MOCK_UAS_LATENCY_US */
+long mock_env_long(const char *name, long def);
+
+/*
+ * A pipe moving one transfer at a time: each waits latency, then for the
+ * transfers before it, then takes its bytes at the rate of the pipe.
+ */
+struct mock_pipe {
+	uint64_t latency_ns;
+	uint64_t ps_per_byte;		/* 0 for no limit */
+	uint64_t busy;
+};
+
+void mock_pipe_init(struct mock_pipe *pipe, long latency_us,
+		    uint64_t bytes_per_sec);
+
+/* when bytes submitted at now are through */
+uint64_t mock_pipe_due(struct mock_pipe *pipe, uint64_t now, uint64_t bytes);
+
+/* profiles */
+struct mock_device *mock_uas_create(void);
+struct mock_device *mock_replay_create(void);
+struct mock_device *mock_mouse_create(void);
+struct mock_device *mock_keyboard_create(void);
+struct mock_device *mock_acm_create(void);
+struct mock_device *mock_bot_create(void);
+struct mock_device *mock_uvc_create(void);
+struct mock_device *mock_audio_create(void);
+
+#endif /* __LIBUSB_MOCK_H */
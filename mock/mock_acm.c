@@ -0,0 +1,194 @@
+/*
+ * A high-speed CDC-ACM serial port
+ *
+ * The far end of the line talks all the time, lines of text one after the
+ * other, and takes whatever is written to it. Bytes cross the line at
+ * USBIP_MOCK_ACM_BAUD, 115200 by default with 8N1 framing, 0 for no limit;
+ * the line coding the host sets is kept but does not change the rate. A
+ * bulk IN transfer completes once USBIP_MOCK_ACM_CHUNK bytes, 64 by
+ * default, have arrived or its buffer is full, a bulk OUT transfer once
+ * its bytes have left. Either way the bridge adds its latency timer,
+ * USBIP_MOCK_ACM_LATENCY_US, 1000 by default.
+ *
+ * The notification endpoint stays quiet, its transfers only complete when
+ * cancelled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb_mock.h"
+
+#define MOCK_ACM_SET_LINE_CODING	0x20
+#define MOCK_ACM_GET_LINE_CODING	0x21
+#define MOCK_ACM_SET_CONTROL_LINE_STATE	0x22
+#define MOCK_ACM_SEND_BREAK		0x23
+
+#define MOCK_ACM_LINE_LEN	32	/* "usbip mock serial NNNNNNNNNNNN\r\n" */
+#define MOCK_ACM_QUIET_NS	3600000000000ULL
+
+struct mock_acm {
+	struct mock_pipe rx;	/* line to host */
+	struct mock_pipe tx;	/* host to line */
+	uint32_t chunk;
+	uint64_t received;	/* bytes of the talk handed to the host */
+	unsigned char line_coding[7];
+	uint16_t line_state;
+};
+
+static const unsigned char mock_acm_device_desc[] = {
+	0x12, 0x01, 0x00, 0x02, 0x02, 0x00, 0x00, 0x40,
+	0x25, 0x05, 0xa7, 0xa4, 0x00, 0x01, 0x01, 0x02,
+	0x03, 0x01,
+};
+
+static const unsigned char mock_acm_config_desc[] = {
+	0x09, 0x02, 0x43, 0x00, 0x02, 0x01, 0x00, 0x80, 0x32,
+
+	/* communication class, with its functional descriptors */
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x02, 0x02, 0x01, 0x00,
+	0x05, 0x24, 0x00, 0x10, 0x01,		/* header */
+	0x05, 0x24, 0x01, 0x00, 0x01,		/* call management */
+	0x04, 0x24, 0x02, 0x02,			/* ACM */
+	0x05, 0x24, 0x06, 0x00, 0x01,		/* union */
+	0x07, 0x05, 0x83, 0x03, 0x10, 0x00, 0x09,
+
+	/* data class */
+	0x09, 0x04, 0x01, 0x00, 0x02, 0x0a, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x02, 0x00, 0x02, 0x00,
+	0x07, 0x05, 0x02, 0x02, 0x00, 0x02, 0x00,
+};
+
+static const char *const mock_acm_strings[] = {
+	"usbip", "Mock serial port", "0001",
+};
+
+static int mock_acm_control(struct mock_device *mdev,
+			    const struct libusb_control_setup *setup,
+			    unsigned char *data)
+{
+	struct mock_acm *acm = (struct mock_acm *)mdev->priv;
+	uint16_t length = libusb_le16_to_cpu(setup->wLength);
+	int len;
+
+	if ((setup->bmRequestType & LIBUSB_REQUEST_TYPE_RESERVED) !=
+	    LIBUSB_REQUEST_TYPE_CLASS)
+		return LIBUSB_ERROR_PIPE;
+
+	switch (setup->bRequest) {
+	case MOCK_ACM_SET_LINE_CODING:
+		if (length < sizeof(acm->line_coding))
+			return LIBUSB_ERROR_PIPE;
+		memcpy(acm->line_coding, data, sizeof(acm->line_coding));
+		return sizeof(acm->line_coding);
+	case MOCK_ACM_GET_LINE_CODING:
+		len = length < sizeof(acm->line_coding) ?
+			length : sizeof(acm->line_coding);
+		memcpy(data, acm->line_coding, len);
+		return len;
+	case MOCK_ACM_SET_CONTROL_LINE_STATE:
+		acm->line_state = libusb_le16_to_cpu(setup->wValue);
+		return 0;
+	case MOCK_ACM_SEND_BREAK:
+		return 0;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+/* len bytes of the talk, from where the host left off */
+static void mock_acm_talk(struct mock_acm *acm, unsigned char *buf, int len)
+{
+	char line[MOCK_ACM_LINE_LEN + 1];
+	uint64_t n;
+	int off, i;
+
+	for (i = 0; i < len; ) {
+		n = acm->received / MOCK_ACM_LINE_LEN;
+		off = acm->received % MOCK_ACM_LINE_LEN;
+		snprintf(line, sizeof(line), "usbip mock serial %012llu\r\n",
+			 (unsigned long long)(n % 1000000000000ULL));
+		for (; off < MOCK_ACM_LINE_LEN && i < len; off++, i++) {
+			buf[i] = line[off];
+			acm->received++;
+		}
+	}
+}
+
+static uint64_t mock_acm_transfer(struct mock_device *mdev,
+				  struct libusb_transfer *trx,
+				  uint32_t stream_id, uint64_t now)
+{
+	struct mock_acm *acm = (struct mock_acm *)mdev->priv;
+	int len = trx->length;
+
+	(void)stream_id;
+
+	trx->status = LIBUSB_TRANSFER_COMPLETED;
+	trx->actual_length = 0;
+
+	if (trx->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return now + MOCK_ACM_QUIET_NS;
+
+	if (!(trx->endpoint & LIBUSB_ENDPOINT_IN)) {
+		trx->actual_length = len;
+		return mock_pipe_due(&acm->tx, now, len);
+	}
+
+	if ((uint32_t)len > acm->chunk)
+		len = acm->chunk;
+	mock_acm_talk(acm, trx->buffer, len);
+	trx->actual_length = len;
+	return mock_pipe_due(&acm->rx, now, len);
+}
+
+static void mock_acm_free(struct mock_device *mdev)
+{
+	free(mdev->priv);
+	free(mdev);
+}
+
+static const struct mock_device_ops mock_acm_ops = {
+	.control = mock_acm_control,
+	.transfer = mock_acm_transfer,
+	.free = mock_acm_free,
+};
+
+struct mock_device *mock_acm_create(void)
+{
+	struct mock_device *mdev;
+	struct mock_acm *acm;
+	long baud, latency;
+
+	mdev = (struct mock_device *)calloc(1, sizeof(*mdev));
+	acm = (struct mock_acm *)calloc(1, sizeof(*acm));
+	if (!mdev || !acm) {
+		free(mdev);
+		free(acm);
+		return NULL;
+	}
+
+	baud = mock_env_long("USBIP_MOCK_ACM_BAUD", 115200);
+	latency = mock_env_long("USBIP_MOCK_ACM_LATENCY_US", 1000);
+	mock_pipe_init(&acm->rx, latency, baud > 0 ? baud / 10 : 0);
+	mock_pipe_init(&acm->tx, latency, baud > 0 ? baud / 10 : 0);
+	acm->chunk = mock_env_long("USBIP_MOCK_ACM_CHUNK", 64);
+	if (!acm->chunk)
+		acm->chunk = 1;
+
+	/* 115200 8N1 */
+	acm->line_coding[0] = 0x00;
+	acm->line_coding[1] = 0xc2;
+	acm->line_coding[2] = 0x01;
+	acm->line_coding[6] = 8;
+
+	mdev->ops = &mock_acm_ops;
+	mdev->speed = LIBUSB_SPEED_HIGH;
+	mdev->device_desc = mock_acm_device_desc;
+	mdev->config_desc = mock_acm_config_desc;
+	mdev->strings = mock_acm_strings;
+	mdev->num_strings = 3;
+	mdev->priv = acm;
+	return mdev;
+}
@@ -0,0 +1,259 @@
+/*
+ * A full-speed USB Audio Class 1 headset
+ *
+ * A speaker takes 16 bit PCM on an adaptive isochronous OUT endpoint and a
+ * microphone sends it on an asynchronous isochronous IN endpoint, each in
+ * alternate setting 1 of its streaming interface. Every iso packet is one
+ * frame of 1 ms and carries a fixed number of bytes, rate / 1000 samples
+ * per channel; the microphone hears a 1 kHz sawtooth. Transfers of a
+ * direction follow each other on the bus schedule and complete once their
+ * last frame is through, plus USBIP_MOCK_AUDIO_LATENCY_US, 0 by default.
+ *
+ * USBIP_MOCK_AUDIO_RATE, 48000 by default, and USBIP_MOCK_AUDIO_CHANNELS,
+ * 2 by default, set the bandwidth; the descriptors are made to match.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb_mock.h"
+
+#define MOCK_AUDIO_FRAME_NS	1000000
+#define MOCK_AUDIO_MAX_PACKET	1023
+
+#define MOCK_AUDIO_SET_CUR	0x01
+#define MOCK_AUDIO_GET_CUR	0x81
+
+#define MOCK_AUDIO_CS_INTERFACE	0x24
+#define MOCK_AUDIO_FORMAT_TYPE	0x02
+#define MOCK_AUDIO_INPUT_TERM	0x02
+
+static const unsigned char mock_audio_device_desc[] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x25, 0x05, 0xa9, 0xa4, 0x00, 0x01, 0x01, 0x02,
+	0x03, 0x01,
+};
+
+#define MOCK_AUDIO_STREAMING(intf, link, ep, sync) \
+	0x09, 0x04, (intf), 0x00, 0x00, 0x01, 0x02, 0x00, 0x00, \
+	0x09, 0x04, (intf), 0x01, 0x01, 0x01, 0x02, 0x00, 0x00, \
+	0x07, 0x24, 0x01, (link), 0x01, 0x01, 0x00, \
+	0x0b, 0x24, 0x02, 0x01, 0x02, 0x02, 0x10, 0x01, 0x80, 0xbb, 0x00, \
+	0x09, 0x05, (ep), (sync), 0xc0, 0x00, 0x01, 0x00, 0x00, \
+	0x07, 0x25, 0x01, 0x01, 0x00, 0x00, 0x00
+
+static const unsigned char mock_audio_config_desc[] = {
+	0x09, 0x02, 0xae, 0x00, 0x03, 0x01, 0x00, 0x80, 0x32,
+
+	/* audio control: USB to speaker, microphone to USB */
+	0x09, 0x04, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00,
+	0x0a, 0x24, 0x01, 0x00, 0x01, 0x34, 0x00, 0x02, 0x01, 0x02,
+	0x0c, 0x24, 0x02, 0x01, 0x01, 0x01, 0x00, 0x02,
+	0x03, 0x00, 0x00, 0x00,
+	0x09, 0x24, 0x03, 0x02, 0x01, 0x03, 0x00, 0x01, 0x00,
+	0x0c, 0x24, 0x02, 0x03, 0x01, 0x02, 0x00, 0x02,
+	0x03, 0x00, 0x00, 0x00,
+	0x09, 0x24, 0x03, 0x04, 0x01, 0x01, 0x00, 0x03, 0x00,
+
+	/* 48 kHz 16 bit stereo each way */
+	MOCK_AUDIO_STREAMING(0x01, 0x01, 0x01, 0x09),
+	MOCK_AUDIO_STREAMING(0x02, 0x04, 0x82, 0x05),
+};
+
+static const char *const mock_audio_strings[] = {
+	"usbip", "Mock headset", "0001",
+};
+
+struct mock_audio {
+	uint64_t latency_ns;
+	uint32_t rate;
+	int channels;
+	int packet;		/* bytes per frame */
+	uint64_t sched[2];	/* by direction */
+	uint64_t samples;	/* heard by the microphone */
+	unsigned char config_desc[sizeof(mock_audio_config_desc)];
+	unsigned char freq[2][3];
+};
+
+/* rate and channels into the terminals, formats and endpoints */
+static void mock_audio_patch(struct mock_audio *audio)
+{
+	unsigned char *raw = audio->config_desc;
+	int total = sizeof(audio->config_desc);
+	int pos, subclass = 0;
+	unsigned char *d;
+
+	for (pos = 0; pos + 2 <= total && raw[pos]; pos += raw[pos]) {
+		d = raw + pos;
+		if (d[1] == LIBUSB_DT_INTERFACE) {
+			subclass = d[6];
+		} else if (d[1] == MOCK_AUDIO_CS_INTERFACE && subclass == 1 &&
+			   d[2] == MOCK_AUDIO_INPUT_TERM) {
+			d[7] = audio->channels;
+			d[8] = audio->channels == 2 ? 0x03 : 0x00;
+		} else if (d[1] == MOCK_AUDIO_CS_INTERFACE && subclass == 2 &&
+			   d[2] == MOCK_AUDIO_FORMAT_TYPE) {
+			d[4] = audio->channels;
+			d[8] = audio->rate;
+			d[9] = audio->rate >> 8;
+			d[10] = audio->rate >> 16;
+		} else if (d[1] == LIBUSB_DT_ENDPOINT) {
+			d[4] = audio->packet & 0xff;
+			d[5] = audio->packet >> 8;
+		}
+	}
+}
+
+/* the sampling frequency of the endpoints, all else is accepted */
+static int mock_audio_control(struct mock_device *mdev,
+			      const struct libusb_control_setup *setup,
+			      unsigned char *data)
+{
+	struct mock_audio *audio = (struct mock_audio *)mdev->priv;
+	uint16_t length = libusb_le16_to_cpu(setup->wLength);
+	uint16_t index = libusb_le16_to_cpu(setup->wIndex);
+	unsigned char *freq = NULL;
+	int len;
+
+	if ((setup->bmRequestType & LIBUSB_REQUEST_TYPE_RESERVED) !=
+	    LIBUSB_REQUEST_TYPE_CLASS)
+		return LIBUSB_ERROR_PIPE;
+
+	if ((setup->bmRequestType & 0x1f) == LIBUSB_RECIPIENT_ENDPOINT &&
+	    libusb_le16_to_cpu(setup->wValue) == 0x0100)
+		freq = audio->freq[!!(index & LIBUSB_ENDPOINT_IN)];
+
+	len = length < 3 ? length : 3;
+	switch (setup->bRequest) {
+	case MOCK_AUDIO_SET_CUR:
+		if (freq)
+			memcpy(freq, data, len);
+		return length;
+	case MOCK_AUDIO_GET_CUR:
+		if (freq)
+			memcpy(data, freq, len);
+		else
+			memset(data, 0, length);
+		return freq ? len : length;
+	default:
+		if (setup->bmRequestType & LIBUSB_ENDPOINT_IN)
+			memset(data, 0, length);
+		return length;
+	}
+}
+
+/* a packet of the microphone, a 1 kHz sawtooth on all channels */
+static int mock_audio_listen(struct mock_audio *audio, unsigned char *buf,
+			     int len)
+{
+	int n = audio->packet < len ? audio->packet : len;
+	int period = audio->rate / 1000;
+	int16_t sample;
+	int i, c;
+
+	n -= n % (2 * audio->channels);
+	for (i = 0; i < n; audio->samples++) {
+		sample = (int16_t)((int)(audio->samples % period) * 65535 /
+				   period - 32768);
+		for (c = 0; c < audio->channels; c++, i += 2) {
+			buf[i] = sample & 0xff;
+			buf[i + 1] = (uint16_t)sample >> 8;
+		}
+	}
+	return n;
+}
+
+static uint64_t mock_audio_transfer(struct mock_device *mdev,
+				    struct libusb_transfer *trx,
+				    uint32_t stream_id, uint64_t now)
+{
+	struct mock_audio *audio = (struct mock_audio *)mdev->priv;
+	int in = !!(trx->endpoint & LIBUSB_ENDPOINT_IN);
+	struct libusb_iso_packet_descriptor *desc;
+	uint64_t t;
+	int offset = 0, i;
+
+	(void)stream_id;
+
+	t = now - now % MOCK_AUDIO_FRAME_NS;
+	if (t < audio->sched[in])
+		t = audio->sched[in];
+
+	trx->actual_length = 0;
+	for (i = 0; i < trx->num_iso_packets; i++) {
+		desc = &trx->iso_packet_desc[i];
+		if (in)
+			desc->actual_length = mock_audio_listen(audio,
+					trx->buffer + offset, desc->length);
+		else
+			desc->actual_length = desc->length;
+		desc->status = LIBUSB_TRANSFER_COMPLETED;
+		trx->actual_length += desc->actual_length;
+		offset += desc->length;
+	}
+	t += (uint64_t)trx->num_iso_packets * MOCK_AUDIO_FRAME_NS;
+	audio->sched[in] = t;
+
+	trx->status = LIBUSB_TRANSFER_COMPLETED;
+	return t + audio->latency_ns;
+}
+
+static void mock_audio_free(struct mock_device *mdev)
+{
+	free(mdev->priv);
+	free(mdev);
+}
+
+static const struct mock_device_ops mock_audio_ops = {
+	.control = mock_audio_control,
+	.transfer = mock_audio_transfer,
+	.free = mock_audio_free,
+};
+
+struct mock_device *mock_audio_create(void)
+{
+	struct mock_device *mdev;
+	struct mock_audio *audio;
+	int i;
+
+	mdev = (struct mock_device *)calloc(1, sizeof(*mdev));
+	audio = (struct mock_audio *)calloc(1, sizeof(*audio));
+	if (!mdev || !audio) {
+		free(mdev);
+		free(audio);
+		return NULL;
+	}
+
+	audio->latency_ns = mock_env_long("USBIP_MOCK_AUDIO_LATENCY_US", 0) *
+		1000ULL;
+	audio->rate = mock_env_long("USBIP_MOCK_AUDIO_RATE", 48000);
+	audio->channels = mock_env_long("USBIP_MOCK_AUDIO_CHANNELS", 2);
+	if (audio->rate < 1000 || audio->rate > 192000)
+		audio->rate = 48000;
+	if (audio->channels < 1 || audio->channels > 8)
+		audio->channels = 2;
+	audio->packet = audio->rate / 1000 * audio->channels * 2;
+	if (audio->packet > MOCK_AUDIO_MAX_PACKET) {
+		audio->rate = MOCK_AUDIO_MAX_PACKET / (audio->channels * 2) *
+			1000;
+		audio->packet = audio->rate / 1000 * audio->channels * 2;
+	}
+
+	memcpy(audio->config_desc, mock_audio_config_desc,
+	       sizeof(audio->config_desc));
+	mock_audio_patch(audio);
+	for (i = 0; i < 2; i++) {
+		audio->freq[i][0] = audio->rate;
+		audio->freq[i][1] = audio->rate >> 8;
+		audio->freq[i][2] = audio->rate >> 16;
+	}
+
+	mdev->ops = &mock_audio_ops;
+	mdev->speed = LIBUSB_SPEED_FULL;
+	mdev->device_desc = mock_audio_device_desc;
+	mdev->config_desc = audio->config_desc;
+	mdev->strings = mock_audio_strings;
+	mdev->num_strings = 3;
+	mdev->priv = audio;
+	return mdev;
+}
@@ -0,0 +1,314 @@
+/*
+ * A high-speed mass storage drive with Bulk-Only Transport
+ *
+ * Unlike the UAS drive, this one speaks the protocol: a 31 byte CBW on the
+ * bulk OUT pipe, then the data stage of its SCSI command on either pipe,
+ * then a 13 byte CSW on the bulk IN pipe, one command at a time. It knows
+ * the commands a host needs to mount it and read and write sectors; the
+ * others fail with ILLEGAL REQUEST for REQUEST SENSE to report. Reads
+ * return zeroed sectors, writes go nowhere.
+ *
+ * The medium adds USBIP_MOCK_BOT_LATENCY_US, 200 by default, to the first
+ * data transfer of a READ or WRITE, and moves USBIP_MOCK_BOT_MBPS MB/s,
+ * 35 by default, shared by both directions. The drive has
+ * USBIP_MOCK_BOT_SIZE_MB of 512 byte sectors, 4096 by default.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb_mock.h"
+
+#define MOCK_BOT_CBW_SIG	0x43425355	/* "USBC" */
+#define MOCK_BOT_CSW_SIG	0x53425355	/* "USBS" */
+#define MOCK_BOT_CBW_LEN	31
+#define MOCK_BOT_CSW_LEN	13
+#define MOCK_BOT_BLOCK		512
+
+#define MOCK_BOT_RESET		0xff
+#define MOCK_BOT_GET_MAX_LUN	0xfe
+
+enum mock_bot_stage {
+	MOCK_BOT_COMMAND,
+	MOCK_BOT_DATA_IN,
+	MOCK_BOT_DATA_OUT,
+	MOCK_BOT_STATUS,
+};
+
+struct mock_bot {
+	struct mock_pipe link;	/* the medium behind both pipes */
+	uint64_t latency_ns;
+	uint64_t blocks;
+
+	enum mock_bot_stage stage;
+	uint32_t tag;
+	uint32_t residue;	/* of the data stage */
+	uint8_t status;		/* of the CSW */
+	int seek;		/* the next data transfer pays the latency */
+	int stall;		/* a failed command stalls its data stage */
+	unsigned char reply[36];
+	uint32_t reply_len;
+	uint8_t sense_key;
+	uint8_t asc;
+};
+
+static const unsigned char mock_bot_device_desc[] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x25, 0x05, 0xa6, 0xa4, 0x00, 0x01, 0x01, 0x02,
+	0x03, 0x01,
+};
+
+static const unsigned char mock_bot_config_desc[] = {
+	0x09, 0x02, 0x20, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x02, 0x08, 0x06, 0x50, 0x00,
+	0x07, 0x05, 0x81, 0x02, 0x00, 0x02, 0x00,
+	0x07, 0x05, 0x02, 0x02, 0x00, 0x02, 0x00,
+};
+
+static const char *const mock_bot_strings[] = {
+	"usbip", "Mock BOT drive", "0001",
+};
+
+static const unsigned char mock_bot_inquiry[36] = {
+	0x00, 0x80, 0x06, 0x02, 0x1f, 0x00, 0x00, 0x00,
+	'u', 's', 'b', 'i', 'p', ' ', ' ', ' ',
+	'M', 'o', 'c', 'k', ' ', 'B', 'O', 'T',
+	' ', 'd', 'r', 'i', 'v', 'e', ' ', ' ',
+	'0', '0', '0', '1',
+};
+
+static uint32_t mock_bot_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void mock_bot_put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t mock_bot_le32(const unsigned char *p)
+{
+	return (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static void mock_bot_put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void mock_bot_fail(struct mock_bot *bot, uint8_t key, uint8_t asc)
+{
+	bot->status = 1;
+	bot->sense_key = key;
+	bot->asc = asc;
+}
+
+/* sets up the data stage of the SCSI command in cb */
+static void mock_bot_command(struct mock_bot *bot, const unsigned char *cb,
+			     uint32_t length, int in)
+{
+	uint64_t lba;
+	uint32_t count;
+
+	bot->status = 0;
+	bot->reply_len = 0;
+	bot->seek = 0;
+
+	switch (cb[0]) {
+	case 0x00:	/* TEST UNIT READY */
+	case 0x1e:	/* PREVENT ALLOW MEDIUM REMOVAL */
+	case 0x35:	/* SYNCHRONIZE CACHE */
+		break;
+	case 0x03:	/* REQUEST SENSE */
+		memset(bot->reply, 0, 18);
+		bot->reply[0] = 0x70;
+		bot->reply[2] = bot->sense_key;
+		bot->reply[7] = 10;
+		bot->reply[12] = bot->asc;
+		bot->reply_len = 18;
+		bot->sense_key = 0;
+		bot->asc = 0;
+		break;
+	case 0x12:	/* INQUIRY */
+		memcpy(bot->reply, mock_bot_inquiry, 36);
+		bot->reply_len = 36;
+		break;
+	case 0x1a:	/* MODE SENSE(6) */
+		memset(bot->reply, 0, 4);
+		bot->reply[0] = 3;
+		bot->reply_len = 4;
+		break;
+	case 0x25:	/* READ CAPACITY(10) */
+		mock_bot_put_be32(bot->reply, bot->blocks - 1);
+		mock_bot_put_be32(bot->reply + 4, MOCK_BOT_BLOCK);
+		bot->reply_len = 8;
+		break;
+	case 0x28:	/* READ(10) */
+	case 0x2a:	/* WRITE(10) */
+		lba = mock_bot_be32(cb + 2);
+		count = cb[7] << 8 | cb[8];
+		if (lba + count > bot->blocks) {
+			mock_bot_fail(bot, 0x05, 0x21);
+			break;
+		}
+		bot->seek = 1;
+		break;
+	default:
+		mock_bot_fail(bot, 0x05, 0x20);
+		break;
+	}
+
+	if (bot->reply_len > length)
+		bot->reply_len = length;
+	bot->residue = length;
+	bot->stall = bot->status && length;
+	if (!length)
+		bot->stage = MOCK_BOT_STATUS;
+	else
+		bot->stage = in ? MOCK_BOT_DATA_IN : MOCK_BOT_DATA_OUT;
+}
+
+static int mock_bot_control(struct mock_device *mdev,
+			    const struct libusb_control_setup *setup,
+			    unsigned char *data)
+{
+	struct mock_bot *bot = (struct mock_bot *)mdev->priv;
+
+	if ((setup->bmRequestType & LIBUSB_REQUEST_TYPE_RESERVED) !=
+	    LIBUSB_REQUEST_TYPE_CLASS)
+		return LIBUSB_ERROR_PIPE;
+
+	switch (setup->bRequest) {
+	case MOCK_BOT_RESET:
+		bot->stage = MOCK_BOT_COMMAND;
+		return 0;
+	case MOCK_BOT_GET_MAX_LUN:
+		if (!libusb_le16_to_cpu(setup->wLength))
+			return LIBUSB_ERROR_PIPE;
+		data[0] = 0;
+		return 1;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+static uint64_t mock_bot_transfer(struct mock_device *mdev,
+				  struct libusb_transfer *trx,
+				  uint32_t stream_id, uint64_t now)
+{
+	struct mock_bot *bot = (struct mock_bot *)mdev->priv;
+	int in = !!(trx->endpoint & LIBUSB_ENDPOINT_IN);
+	uint32_t len = trx->length;
+	const unsigned char *cbw = trx->buffer;
+
+	(void)stream_id;
+
+	trx->status = LIBUSB_TRANSFER_COMPLETED;
+	trx->actual_length = 0;
+
+	switch (bot->stage) {
+	case MOCK_BOT_COMMAND:
+		if (in || len != MOCK_BOT_CBW_LEN ||
+		    mock_bot_le32(cbw) != MOCK_BOT_CBW_SIG)
+			break;
+		bot->tag = mock_bot_le32(cbw + 4);
+		mock_bot_command(bot, cbw + 15, mock_bot_le32(cbw + 8),
+				 cbw[12] & LIBUSB_ENDPOINT_IN);
+		trx->actual_length = len;
+		return mock_pipe_due(&bot->link, now, len);
+
+	case MOCK_BOT_DATA_IN:
+	case MOCK_BOT_DATA_OUT:
+		if (in != (bot->stage == MOCK_BOT_DATA_IN))
+			break;
+		if (bot->stall) {
+			bot->stall = 0;
+			bot->stage = MOCK_BOT_STATUS;
+			break;
+		}
+		if (len > bot->residue)
+			len = bot->residue;
+		if (in && bot->reply_len && !bot->seek) {
+			/* the reply of a short command */
+			len = len < bot->reply_len ? len : bot->reply_len;
+			memcpy(trx->buffer, bot->reply, len);
+			bot->reply_len -= len;
+		} else if (in) {
+			memset(trx->buffer, 0, len);
+		}
+		bot->residue -= len;
+		if (!bot->residue || (in && !bot->seek && !bot->reply_len))
+			bot->stage = MOCK_BOT_STATUS;
+		trx->actual_length = len;
+		if (bot->seek == 1) {
+			bot->seek = 2;
+			now += bot->latency_ns;
+		}
+		return mock_pipe_due(&bot->link, now, len);
+
+	case MOCK_BOT_STATUS:
+		if (!in || len < MOCK_BOT_CSW_LEN)
+			break;
+		mock_bot_put_le32(trx->buffer, MOCK_BOT_CSW_SIG);
+		mock_bot_put_le32(trx->buffer + 4, bot->tag);
+		mock_bot_put_le32(trx->buffer + 8, bot->residue);
+		trx->buffer[12] = bot->status;
+		trx->actual_length = MOCK_BOT_CSW_LEN;
+		bot->stage = MOCK_BOT_COMMAND;
+		return mock_pipe_due(&bot->link, now, MOCK_BOT_CSW_LEN);
+	}
+
+	/* failed or out of phase, the host clears the halt or resets */
+	trx->status = LIBUSB_TRANSFER_STALL;
+	return now;
+}
+
+static void mock_bot_free(struct mock_device *mdev)
+{
+	free(mdev->priv);
+	free(mdev);
+}
+
+static const struct mock_device_ops mock_bot_ops = {
+	.control = mock_bot_control,
+	.transfer = mock_bot_transfer,
+	.free = mock_bot_free,
+};
+
+struct mock_device *mock_bot_create(void)
+{
+	struct mock_device *mdev;
+	struct mock_bot *bot;
+	long mbps;
+
+	mdev = (struct mock_device *)calloc(1, sizeof(*mdev));
+	bot = (struct mock_bot *)calloc(1, sizeof(*bot));
+	if (!mdev || !bot) {
+		free(mdev);
+		free(bot);
+		return NULL;
+	}
+
+	mbps = mock_env_long("USBIP_MOCK_BOT_MBPS", 35);
+	mock_pipe_init(&bot->link, 0, mbps > 0 ? mbps * 1000000ULL : 0);
+	bot->latency_ns = mock_env_long("USBIP_MOCK_BOT_LATENCY_US", 200) *
+		1000ULL;
+	bot->blocks = mock_env_long("USBIP_MOCK_BOT_SIZE_MB", 4096) *
+		(1048576 / MOCK_BOT_BLOCK);
+
+	mdev->ops = &mock_bot_ops;
+	mdev->speed = LIBUSB_SPEED_HIGH;
+	mdev->device_desc = mock_bot_device_desc;
+	mdev->config_desc = mock_bot_config_desc;
+	mdev->strings = mock_bot_strings;
+	mdev->num_strings = 3;
+	mdev->priv = bot;
+	return mdev;
+}
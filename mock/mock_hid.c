@@ -0,0 +1,299 @@
+/*
+ * Full-speed HID boot devices: a mouse and a keyboard
+ *
+ * Both report on an interrupt IN endpoint polled every frame, so at up
+ * to 1 kHz, and always have something to say: the mouse runs in circles
+ * and the keyboard presses and releases a through z in turn. A poll
+ * completes with the next report once the one before it is a report
+ * period old and the latency has passed, the way a device answers the
+ * polls of its host controller.
+ *
+ * USBIP_MOCK_HID_HZ, 1000 by default, sets the report rate and with it
+ * the bandwidth; USBIP_MOCK_HID_LATENCY_US, 0 by default, adds to each
+ * report.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb_mock.h"
+
+#define MOCK_HID_DT_HID		0x21
+#define MOCK_HID_DT_REPORT	0x22
+
+#define MOCK_HID_GET_REPORT	0x01
+#define MOCK_HID_GET_IDLE	0x02
+#define MOCK_HID_GET_PROTOCOL	0x03
+#define MOCK_HID_SET_REPORT	0x09
+#define MOCK_HID_SET_IDLE	0x0a
+#define MOCK_HID_SET_PROTOCOL	0x0b
+
+struct mock_hid_kind {
+	const unsigned char *device_desc;
+	const unsigned char *config_desc;
+	const unsigned char *report_desc;
+	int report_desc_len;
+	int report_len;		/* of the report protocol */
+	int boot_len;		/* of the boot protocol */
+	void (*report)(uint64_t n, unsigned char *buf);
+	const char *const *strings;
+};
+
+struct mock_hid {
+	const struct mock_hid_kind *kind;
+	struct mock_pipe pipe;
+	uint64_t reports;
+	uint8_t idle;
+	uint8_t protocol;	/* 0 boot, 1 report */
+	uint8_t leds;
+};
+
+/* ---------------------------------------------------------------------- */
+/* mouse */
+
+static const unsigned char mock_mouse_device_desc[] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x25, 0x05, 0xb0, 0xa4, 0x00, 0x01, 0x01, 0x02,
+	0x03, 0x01,
+};
+
+static const unsigned char mock_mouse_report_desc[] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01,
+	0xa1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+	0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+	0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+	0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38,
+	0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x03,
+	0x81, 0x06, 0xc0, 0xc0,
+};
+
+static const unsigned char mock_mouse_config_desc[] = {
+	0x09, 0x02, 0x22, 0x00, 0x01, 0x01, 0x00, 0xa0, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x01, 0x02, 0x00,
+	0x09, MOCK_HID_DT_HID, 0x11, 0x01, 0x00, 0x01,
+	MOCK_HID_DT_REPORT, sizeof(mock_mouse_report_desc), 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x04, 0x00, 0x01,
+};
+
+static const char *const mock_mouse_strings[] = {
+	"usbip", "Mock mouse", "0001",
+};
+
+/* buttons, x, y and wheel, moving in a circle of 16 steps */
+static void mock_mouse_report(uint64_t n, unsigned char *buf)
+{
+	static const signed char step[16] = {
+		0, 2, 4, 5, 6, 5, 4, 2, 0, -2, -4, -5, -6, -5, -4, -2,
+	};
+
+	buf[0] = 0;
+	buf[1] = step[n % 16];
+	buf[2] = step[(n + 4) % 16];
+	buf[3] = 0;
+}
+
+static const struct mock_hid_kind mock_mouse = {
+	.device_desc = mock_mouse_device_desc,
+	.config_desc = mock_mouse_config_desc,
+	.report_desc = mock_mouse_report_desc,
+	.report_desc_len = sizeof(mock_mouse_report_desc),
+	.report_len = 4,
+	.boot_len = 3,
+	.report = mock_mouse_report,
+	.strings = mock_mouse_strings,
+};
+
+/* ---------------------------------------------------------------------- */
+/* keyboard */
+
+static const unsigned char mock_keyboard_device_desc[] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x25, 0x05, 0xb1, 0xa4, 0x00, 0x01, 0x01, 0x02,
+	0x03, 0x01,
+};
+
+static const unsigned char mock_keyboard_report_desc[] = {
+	0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07,
+	0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01,
+	0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+	0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01,
+	0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02,
+	0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+	0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07,
+	0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xc0,
+};
+
+static const unsigned char mock_keyboard_config_desc[] = {
+	0x09, 0x02, 0x22, 0x00, 0x01, 0x01, 0x00, 0xa0, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x01, 0x01, 0x00,
+	0x09, MOCK_HID_DT_HID, 0x11, 0x01, 0x00, 0x01,
+	MOCK_HID_DT_REPORT, sizeof(mock_keyboard_report_desc), 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x08, 0x00, 0x01,
+};
+
+static const char *const mock_keyboard_strings[] = {
+	"usbip", "Mock keyboard", "0001",
+};
+
+/* modifiers, reserved and six keys: a key down, all keys up, the next */
+static void mock_keyboard_report(uint64_t n, unsigned char *buf)
+{
+	memset(buf, 0, 8);
+	if (!(n & 1))
+		buf[2] = 0x04 + (n / 2) % 26;
+}
+
+static const struct mock_hid_kind mock_keyboard = {
+	.device_desc = mock_keyboard_device_desc,
+	.config_desc = mock_keyboard_config_desc,
+	.report_desc = mock_keyboard_report_desc,
+	.report_desc_len = sizeof(mock_keyboard_report_desc),
+	.report_len = 8,
+	.boot_len = 8,
+	.report = mock_keyboard_report,
+	.strings = mock_keyboard_strings,
+};
+
+/* ---------------------------------------------------------------------- */
+
+static int mock_hid_len(const struct mock_hid *hid)
+{
+	return hid->protocol ? hid->kind->report_len : hid->kind->boot_len;
+}
+
+static int mock_hid_control(struct mock_device *mdev,
+			    const struct libusb_control_setup *setup,
+			    unsigned char *data)
+{
+	struct mock_hid *hid = (struct mock_hid *)mdev->priv;
+	const struct mock_hid_kind *kind = hid->kind;
+	uint16_t value = libusb_le16_to_cpu(setup->wValue);
+	uint16_t length = libusb_le16_to_cpu(setup->wLength);
+	unsigned char buf[8];
+	int len;
+
+	if (setup->bmRequestType == (LIBUSB_ENDPOINT_IN |
+				     LIBUSB_RECIPIENT_INTERFACE) &&
+	    setup->bRequest == LIBUSB_REQUEST_GET_DESCRIPTOR) {
+		switch (value >> 8) {
+		case MOCK_HID_DT_REPORT:
+			len = kind->report_desc_len;
+			memcpy(data, kind->report_desc,
+			       len < length ? len : length);
+			return len < length ? len : length;
+		case MOCK_HID_DT_HID:
+			len = 9 < length ? 9 : length;
+			memcpy(data, kind->config_desc + 18, len);
+			return len;
+		}
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if ((setup->bmRequestType & LIBUSB_REQUEST_TYPE_RESERVED) !=
+	    LIBUSB_REQUEST_TYPE_CLASS)
+		return LIBUSB_ERROR_PIPE;
+
+	switch (setup->bRequest) {
+	case MOCK_HID_GET_REPORT:
+		kind->report(hid->reports, buf);
+		len = mock_hid_len(hid);
+		len = len < length ? len : length;
+		memcpy(data, buf, len);
+		return len;
+	case MOCK_HID_GET_IDLE:
+		if (!length)
+			return LIBUSB_ERROR_PIPE;
+		data[0] = hid->idle;
+		return 1;
+	case MOCK_HID_GET_PROTOCOL:
+		if (!length)
+			return LIBUSB_ERROR_PIPE;
+		data[0] = hid->protocol;
+		return 1;
+	case MOCK_HID_SET_REPORT:
+		if (length)
+			hid->leds = data[0];
+		return length;
+	case MOCK_HID_SET_IDLE:
+		hid->idle = value >> 8;
+		return 0;
+	case MOCK_HID_SET_PROTOCOL:
+		hid->protocol = value & 1;
+		return 0;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+static uint64_t mock_hid_transfer(struct mock_device *mdev,
+				  struct libusb_transfer *trx,
+				  uint32_t stream_id, uint64_t now)
+{
+	struct mock_hid *hid = (struct mock_hid *)mdev->priv;
+	unsigned char buf[8];
+	int len = mock_hid_len(hid);
+
+	(void)stream_id;
+
+	if (len > trx->length)
+		len = trx->length;
+	hid->kind->report(hid->reports++, buf);
+	memcpy(trx->buffer, buf, len);
+
+	trx->status = LIBUSB_TRANSFER_COMPLETED;
+	trx->actual_length = len;
+	return mock_pipe_due(&hid->pipe, now, hid->kind->report_len);
+}
+
+static void mock_hid_free(struct mock_device *mdev)
+{
+	free(mdev->priv);
+	free(mdev);
+}
+
+static const struct mock_device_ops mock_hid_ops = {
+	.control = mock_hid_control,
+	.transfer = mock_hid_transfer,
+	.free = mock_hid_free,
+};
+
+static struct mock_device *mock_hid_create(const struct mock_hid_kind *kind)
+{
+	struct mock_device *mdev;
+	struct mock_hid *hid;
+	long hz;
+
+	mdev = (struct mock_device *)calloc(1, sizeof(*mdev));
+	hid = (struct mock_hid *)calloc(1, sizeof(*hid));
+	if (!mdev || !hid) {
+		free(mdev);
+		free(hid);
+		return NULL;
+	}
+
+	hid->kind = kind;
+	hid->protocol = 1;
+	hz = mock_env_long("USBIP_MOCK_HID_HZ", 1000);
+	mock_pipe_init(&hid->pipe,
+		       mock_env_long("USBIP_MOCK_HID_LATENCY_US", 0),
+		       hz > 0 ? (uint64_t)hz * kind->report_len : 0);
+
+	mdev->ops = &mock_hid_ops;
+	mdev->speed = LIBUSB_SPEED_FULL;
+	mdev->device_desc = kind->device_desc;
+	mdev->config_desc = kind->config_desc;
+	mdev->strings = kind->strings;
+	mdev->num_strings = 3;
+	mdev->priv = hid;
+	return mdev;
+}
+
+struct mock_device *mock_mouse_create(void)
+{
+	return mock_hid_create(&mock_mouse);
+}
+
+struct mock_device *mock_keyboard_create(void)
+{
+	return mock_hid_create(&mock_keyboard);
+}
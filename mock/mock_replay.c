@@ -0,0 +1,512 @@
+/*
+ * A device answering from a capture
+ *
+ * USBIP_MOCK_REPLAY names a usbmon capture, e.g. of usbipd --capture, and
+ * the device answers every transfer with the next recorded completion of
+ * its endpoint: status, length, IN data and per-packet results of iso
+ * transfers. Each completes after the latency it had in the capture,
+ * scaled by USBIP_MOCK_REPLAY_LATENCY_PCT (100 by default), and after the
+ * transfers before it on its endpoint. An endpoint starts over from its
+ * first completion once it runs out of them; one without any completes
+ * OUT transfers whole and IN transfers empty. Class and vendor requests
+ * are answered from recorded ones with the same setup packet.
+ *
+ * The descriptors are the ones the capture read from the device. A capture
+ * started after enumeration has none, so a device with one interface
+ * carrying every endpoint seen is made up, with as many alternate settings
+ * as were selected; only the data pipes have to match for a replay.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb_mock.h"
+#include "usbip_capture.h"
+#include <usbip_debug.h>
+
+#define MOCK_REPLAY_OPEN	1024
+#define MOCK_REPLAY_STRINGS	15
+
+struct mock_replay_result {
+	uint8_t setup[8];	/* of control requests */
+	int32_t status;
+	uint32_t actual;
+	uint64_t latency_ns;
+	uint32_t len_cap;
+	unsigned char *data;	/* IN data, len_cap bytes */
+	uint32_t niso;
+	struct usbip_usbmon_iso *iso;
+};
+
+struct mock_replay_pipe {
+	uint8_t type;		/* usbmon transfer type */
+	uint32_t max_length;
+	struct mock_replay_result *results;
+	size_t n, max, next;
+	uint64_t busy;
+};
+
+struct mock_replay_open {
+	uint64_t id;
+	uint64_t ts_ns;
+	uint8_t setup[8];
+	uint8_t ep;
+	uint8_t type;
+	uint32_t length;
+};
+
+struct mock_replay {
+	uint64_t latency_pct;
+
+	/* by endpoint number, OUT then IN; control requests in 0 */
+	struct mock_replay_pipe pipes[32];
+
+	unsigned char device_desc[LIBUSB_DT_DEVICE_SIZE];
+	int have_device;
+	unsigned char *config_desc;
+	int max_alt;
+	char *strings[MOCK_REPLAY_STRINGS];
+
+	struct mock_replay_open open[MOCK_REPLAY_OPEN];
+	int nopen;
+};
+
+static const unsigned char mock_replay_device_desc[] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x25, 0x05, 0xa0, 0xa4, 0x00, 0x01, 0x01, 0x02,
+	0x03, 0x01,
+};
+
+static const char *const mock_replay_default_strings[] = {
+	"usbip", "Mock replay", "0001",
+};
+
+static struct mock_replay_pipe *mock_replay_pipe(struct mock_replay *rp,
+						 uint8_t ep)
+{
+	return &rp->pipes[(ep & 0x0f) | (ep & LIBUSB_ENDPOINT_IN ? 16 : 0)];
+}
+
+static int mock_replay_add(struct mock_replay_pipe *pipe,
+			   struct mock_replay_result *res)
+{
+	if (pipe->n == pipe->max) {
+		size_t m = pipe->max ? pipe->max * 2 : 64;
+		struct mock_replay_result *p;
+
+		p = realloc(pipe->results, m * sizeof(*p));
+		if (!p)
+			return -1;
+		pipe->results = p;
+		pipe->max = m;
+	}
+	pipe->results[pipe->n++] = *res;
+	return 0;
+}
+
+/* remember what enumeration read, the device as the host saw it */
+static int mock_replay_descriptor(struct mock_replay *rp,
+				  const struct mock_replay_open *o,
+				  const unsigned char *data, uint32_t len)
+{
+	unsigned int i;
+
+	switch (o->setup[3]) {
+	case LIBUSB_DT_DEVICE:
+		if (len < LIBUSB_DT_DEVICE_SIZE)
+			return 0;
+		memcpy(rp->device_desc, data, LIBUSB_DT_DEVICE_SIZE);
+		rp->have_device = 1;
+		return 0;
+	case LIBUSB_DT_CONFIG:
+		if (len < LIBUSB_DT_CONFIG_SIZE || rp->config_desc ||
+		    (uint32_t)(data[2] | (data[3] << 8)) != len)
+			return 0;
+		rp->config_desc = malloc(len);
+		if (!rp->config_desc)
+			return -1;
+		memcpy(rp->config_desc, data, len);
+		return 0;
+	case LIBUSB_DT_STRING:
+		i = o->setup[2];
+		if (i == 0 || i > MOCK_REPLAY_STRINGS || rp->strings[i - 1] ||
+		    len < 2)
+			return 0;
+		rp->strings[i - 1] = calloc(1, len / 2);
+		if (!rp->strings[i - 1])
+			return -1;
+		for (len = len / 2 - 1, i--; len > 0; len--)
+			rp->strings[i][len - 1] = data[2 * len];
+		return 0;
+	}
+	return 0;
+}
+
+static int mock_replay_complete(struct mock_replay *rp,
+				const struct mock_replay_open *o,
+				const struct usbip_usbmon_packet *pkt,
+				const struct usbip_usbmon_iso *iso,
+				const unsigned char *data, uint64_t ts)
+{
+	struct mock_replay_pipe *pipe;
+	struct mock_replay_result res;
+	int in = o->ep & LIBUSB_ENDPOINT_IN;
+
+	memset(&res, 0, sizeof(res));
+	memcpy(res.setup, o->setup, 8);
+	res.status = pkt->status;
+	res.actual = pkt->length;
+	res.latency_ns = ts > o->ts_ns ? ts - o->ts_ns : 0;
+
+	if (o->type == 2) {
+		in = o->setup[0] & LIBUSB_ENDPOINT_IN;
+		if ((o->setup[0] & LIBUSB_REQUEST_TYPE_RESERVED) ==
+		    LIBUSB_REQUEST_TYPE_STANDARD) {
+			if (o->setup[1] != LIBUSB_REQUEST_GET_DESCRIPTOR ||
+			    pkt->status || !in)
+				return 0;
+			return mock_replay_descriptor(rp, o, data,
+						      pkt->len_cap);
+		}
+	}
+
+	if (in && pkt->len_cap) {
+		res.data = malloc(pkt->len_cap);
+		if (!res.data)
+			return -1;
+		memcpy(res.data, data, pkt->len_cap);
+		res.len_cap = pkt->len_cap;
+	}
+	if (pkt->ndesc) {
+		res.iso = malloc(pkt->ndesc * sizeof(*iso));
+		if (!res.iso) {
+			free(res.data);
+			return -1;
+		}
+		memcpy(res.iso, iso, pkt->ndesc * sizeof(*iso));
+		res.niso = pkt->ndesc;
+	}
+
+	pipe = mock_replay_pipe(rp, o->type == 2 ? 0 : o->ep);
+	pipe->type = o->type;
+	if (o->length > pipe->max_length)
+		pipe->max_length = o->length;
+	if (mock_replay_add(pipe, &res) < 0) {
+		free(res.data);
+		free(res.iso);
+		return -1;
+	}
+	return 0;
+}
+
+static int mock_replay_event(void *arg, const struct usbip_usbmon_packet *pkt,
+			     const struct usbip_usbmon_iso *iso,
+			     const unsigned char *data)
+{
+	struct mock_replay *rp = (struct mock_replay *)arg;
+	struct mock_replay_open *o;
+	uint64_t ts = (uint64_t)pkt->ts_sec * 1000000000ULL +
+		(uint64_t)pkt->ts_usec * 1000;
+	int i;
+
+	if (pkt->type == 'S') {
+		if (rp->nopen == MOCK_REPLAY_OPEN)
+			return -1;
+		o = &rp->open[rp->nopen++];
+		o->id = pkt->id;
+		o->ts_ns = ts;
+		o->ep = pkt->epnum;
+		o->type = pkt->xfer_type;
+		o->length = pkt->length;
+		memcpy(o->setup, pkt->s.setup, 8);
+
+		/* SET_INTERFACE */
+		if (o->type == 2 && o->setup[0] == 0x01 &&
+		    o->setup[1] == LIBUSB_REQUEST_SET_INTERFACE &&
+		    o->setup[2] > rp->max_alt)
+			rp->max_alt = o->setup[2];
+		return 0;
+	}
+
+	for (i = rp->nopen - 1; i >= 0; i--) {
+		if (rp->open[i].id == pkt->id)
+			break;
+	}
+	if (i < 0)
+		return 0;
+	o = &rp->open[i];
+	i = pkt->type == 'C' ?
+		mock_replay_complete(rp, o, pkt, iso, data, ts) : 0;
+	*o = rp->open[--rp->nopen];
+	return i;
+}
+
+/* one interface with every endpoint seen in each alternate setting */
+static unsigned char *mock_replay_make_config(struct mock_replay *rp)
+{
+	unsigned char *raw, *p;
+	int alts = rp->max_alt + 1, neps = 0, alt, i;
+	const struct mock_replay_pipe *pipe;
+	int mps;
+
+	for (i = 1; i < 32; i++)
+		neps += rp->pipes[i].n > 0;
+	if (alts > MOCK_MAX_ALTS)
+		alts = MOCK_MAX_ALTS;
+	while (alts > 1 && alts * neps > MOCK_MAX_EPS)
+		alts--;
+
+	raw = calloc(1, LIBUSB_DT_CONFIG_SIZE +
+		     alts * (LIBUSB_DT_INTERFACE_SIZE +
+			     neps * LIBUSB_DT_ENDPOINT_SIZE));
+	if (!raw)
+		return NULL;
+
+	p = raw + LIBUSB_DT_CONFIG_SIZE;
+	for (alt = 0; alt < alts; alt++) {
+		p[0] = LIBUSB_DT_INTERFACE_SIZE;
+		p[1] = LIBUSB_DT_INTERFACE;
+		p[3] = alt;
+		p[4] = neps;
+		p[5] = LIBUSB_CLASS_VENDOR_SPEC;
+		p += p[0];
+
+		for (i = 1; i < 32; i++) {
+			pipe = &rp->pipes[i];
+			if (!pipe->n)
+				continue;
+			mps = pipe->type == 3 ? 512 : 1024;
+			if (pipe->type == 1 && pipe->max_length < 1024)
+				mps = pipe->max_length ? pipe->max_length : 8;
+			p[0] = LIBUSB_DT_ENDPOINT_SIZE;
+			p[1] = LIBUSB_DT_ENDPOINT;
+			p[2] = (i & 0x0f) | (i & 16 ? LIBUSB_ENDPOINT_IN : 0);
+			p[3] = pipe->type == 0 ? LIBUSB_TRANSFER_TYPE_ISOCHRONOUS :
+			       pipe->type == 1 ? LIBUSB_TRANSFER_TYPE_INTERRUPT :
+						 LIBUSB_TRANSFER_TYPE_BULK;
+			p[4] = mps & 0xff;
+			p[5] = mps >> 8;
+			p[6] = pipe->type == 3 ? 0 : 1;
+			p += p[0];
+		}
+	}
+
+	raw[0] = LIBUSB_DT_CONFIG_SIZE;
+	raw[1] = LIBUSB_DT_CONFIG;
+	raw[2] = (p - raw) & 0xff;
+	raw[3] = (p - raw) >> 8;
+	raw[4] = 1;
+	raw[5] = 1;
+	raw[7] = 0x80;
+	raw[8] = 0x32;
+	return raw;
+}
+
+static enum libusb_transfer_status mock_replay_status(int32_t status)
+{
+	switch (status) {
+	case 0:
+		return LIBUSB_TRANSFER_COMPLETED;
+	case -ECONNRESET:
+		return LIBUSB_TRANSFER_CANCELLED;
+	case -ESHUTDOWN:
+	case -ENODEV:
+		return LIBUSB_TRANSFER_NO_DEVICE;
+	case -EPIPE:
+		return LIBUSB_TRANSFER_STALL;
+	case -EOVERFLOW:
+		return LIBUSB_TRANSFER_OVERFLOW;
+	case -ETIMEDOUT:
+		return LIBUSB_TRANSFER_TIMED_OUT;
+	}
+	return LIBUSB_TRANSFER_ERROR;
+}
+
+/* the next recorded control request with this setup, or with its request */
+static int mock_replay_control(struct mock_device *mdev,
+			       const struct libusb_control_setup *setup,
+			       unsigned char *data)
+{
+	struct mock_replay *rp = (struct mock_replay *)mdev->priv;
+	struct mock_replay_pipe *pipe = &rp->pipes[0];
+	const unsigned char *raw = (const unsigned char *)setup;
+	struct mock_replay_result *res = NULL;
+	uint16_t length = libusb_le16_to_cpu(setup->wLength);
+	uint32_t len;
+	size_t i, j;
+
+	for (i = 0; i < pipe->n && !res; i++) {
+		j = (pipe->next + i) % pipe->n;
+		if (!memcmp(pipe->results[j].setup, raw, 8))
+			res = &pipe->results[j];
+	}
+	for (i = 0; i < pipe->n && !res; i++) {
+		j = (pipe->next + i) % pipe->n;
+		if (!memcmp(pipe->results[j].setup, raw, 2))
+			res = &pipe->results[j];
+	}
+	if (!res || res->status)
+		return LIBUSB_ERROR_PIPE;
+	pipe->next = j + 1;
+
+	len = res->actual < length ? res->actual : length;
+	if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+		memset(data, 0, len);
+		memcpy(data, res->data, len < res->len_cap ? len : res->len_cap);
+	}
+	return len;
+}
+
+static uint64_t mock_replay_transfer(struct mock_device *mdev,
+				     struct libusb_transfer *trx,
+				     uint32_t stream_id, uint64_t now)
+{
+	struct mock_replay *rp = (struct mock_replay *)mdev->priv;
+	struct mock_replay_pipe *pipe = mock_replay_pipe(rp, trx->endpoint);
+	int in = trx->endpoint & LIBUSB_ENDPOINT_IN;
+	struct mock_replay_result *res;
+	struct libusb_iso_packet_descriptor *desc;
+	uint32_t offset = 0, len;
+	uint64_t due;
+	int i;
+
+	(void)stream_id;
+
+	if (!pipe->n) {
+		trx->status = LIBUSB_TRANSFER_COMPLETED;
+		trx->actual_length = in ? 0 : trx->length;
+		for (i = 0; i < trx->num_iso_packets; i++) {
+			desc = &trx->iso_packet_desc[i];
+			desc->status = LIBUSB_TRANSFER_COMPLETED;
+			desc->actual_length = in ? 0 : desc->length;
+		}
+		return now;
+	}
+
+	res = &pipe->results[pipe->next++ % pipe->n];
+	trx->status = mock_replay_status(res->status);
+
+	if (trx->num_iso_packets) {
+		trx->actual_length = 0;
+		for (i = 0; i < trx->num_iso_packets; i++) {
+			desc = &trx->iso_packet_desc[i];
+			len = desc->length;
+			desc->status = LIBUSB_TRANSFER_COMPLETED;
+			if ((uint32_t)i < res->niso) {
+				if (res->iso[i].length < len)
+					len = res->iso[i].length;
+				desc->status =
+					mock_replay_status(res->iso[i].status);
+			}
+			desc->actual_length = len;
+			trx->actual_length += len;
+			if (in && (uint32_t)i < res->niso &&
+			    res->iso[i].offset < res->len_cap) {
+				if (len > res->len_cap - res->iso[i].offset)
+					len = res->len_cap - res->iso[i].offset;
+				memcpy(trx->buffer + offset,
+				       res->data + res->iso[i].offset, len);
+			}
+			offset += desc->length;
+		}
+	} else {
+		len = res->actual < (uint32_t)trx->length ?
+			res->actual : (uint32_t)trx->length;
+		trx->actual_length = len;
+		if (in) {
+			memset(trx->buffer, 0, len);
+			memcpy(trx->buffer, res->data,
+			       len < res->len_cap ? len : res->len_cap);
+		}
+	}
+
+	due = now + res->latency_ns * rp->latency_pct / 100;
+	if (due < pipe->busy)
+		due = pipe->busy;
+	pipe->busy = due;
+	return due;
+}
+
+static void mock_replay_free(struct mock_device *mdev)
+{
+	struct mock_replay *rp = (struct mock_replay *)mdev->priv;
+	size_t i, j;
+
+	for (i = 0; i < 32; i++) {
+		for (j = 0; j < rp->pipes[i].n; j++) {
+			free(rp->pipes[i].results[j].data);
+			free(rp->pipes[i].results[j].iso);
+		}
+		free(rp->pipes[i].results);
+	}
+	for (i = 0; i < MOCK_REPLAY_STRINGS; i++)
+		free(rp->strings[i]);
+	free(rp->config_desc);
+	free(rp);
+	free(mdev);
+}
+
+static const struct mock_device_ops mock_replay_ops = {
+	.control = mock_replay_control,
+	.transfer = mock_replay_transfer,
+	.free = mock_replay_free,
+};
+
+struct mock_device *mock_replay_create(void)
+{
+	const char *path = getenv("USBIP_MOCK_REPLAY");
+	struct mock_device *mdev;
+	struct mock_replay *rp;
+	int i;
+
+	if (!path || !*path) {
+		err("mock replay needs USBIP_MOCK_REPLAY");
+		return NULL;
+	}
+
+	mdev = (struct mock_device *)calloc(1, sizeof(*mdev));
+	rp = (struct mock_replay *)calloc(1, sizeof(*rp));
+	if (!mdev || !rp) {
+		free(mdev);
+		free(rp);
+		return NULL;
+	}
+	mdev->priv = rp;
+	rp->latency_pct = mock_env_long("USBIP_MOCK_REPLAY_LATENCY_PCT", 100);
+
+	if (usbip_capture_load(path, mock_replay_event, rp) < 0)
+		goto err;
+	if (!rp->config_desc) {
+		rp->config_desc = mock_replay_make_config(rp);
+		if (!rp->config_desc)
+			goto err;
+	}
+	if (!rp->have_device)
+		memcpy(rp->device_desc, mock_replay_device_desc,
+		       LIBUSB_DT_DEVICE_SIZE);
+
+	mdev->ops = &mock_replay_ops;
+	mdev->speed = rp->device_desc[3] >= 0x03 ?
+		LIBUSB_SPEED_SUPER : LIBUSB_SPEED_HIGH;
+	mdev->device_desc = rp->device_desc;
+	mdev->config_desc = rp->config_desc;
+	for (i = 0; i < MOCK_REPLAY_STRINGS; i++) {
+		if (rp->strings[i])
+			mdev->num_strings = i + 1;
+	}
+	if (mdev->num_strings) {
+		for (i = 0; i < mdev->num_strings; i++) {
+			if (!rp->strings[i] && !(rp->strings[i] = strdup("")))
+				goto err;
+		}
+		mdev->strings = (const char *const *)rp->strings;
+	} else {
+		mdev->strings = mock_replay_default_strings;
+		mdev->num_strings = 3;
+	}
+	return mdev;
+err:
+	mock_replay_free(mdev);
+	return NULL;
+}
@@ -0,0 +1,163 @@
+/*
+ * A SuperSpeed mass storage drive with UAS
+ *
+ * Alternate setting 0 of its only interface is Bulk-Only Transport,
+ * setting 1 is UAS with a command pipe and status, data-in and data-out
+ * pipes that take 32 streams each, as on common USB 3 bridges.
+ *
+ * No SCSI is spoken; the data pipes are a model of a drive's timing:
+ * every transfer first waits latency for the medium, then for its turn on
+ * the link of its direction, then moves at the speed of the link. Without
+ * streams a pipe works on one transfer at a time, so each transfer pays the
+ * full latency. With streams, the latencies of transfers on different
+ * streams overlap and the link stays busy. Reads return zeroed sectors.
+ *
+ * USBIP_MOCK_UAS_LATENCY_US, 100 by default, and USBIP_MOCK_UAS_MBPS,
+ * MB/s per direction and 400 by default, tune the model.
+ */
+
+#include <stdlib.h>
+
+#include "libusb_mock.h"
+
+#define MOCK_UAS_STREAMS	32
+
+struct mock_uas {
+	uint64_t latency_ns;
+	uint64_t ps_per_byte;
+	uint64_t link_busy[2];			/* by direction */
+	uint64_t busy[2][MOCK_UAS_STREAMS + 1];	/* 0 without streams */
+};
+
+static const unsigned char mock_uas_device_desc[] = {
+	0x12, 0x01, 0x20, 0x03, 0x00, 0x00, 0x00, 0x09,
+	0x25, 0x05, 0xa5, 0xa4, 0x00, 0x01, 0x01, 0x02,
+	0x03, 0x01,
+};
+
+#define MOCK_UAS_EP(addr, streams) \
+	0x07, 0x05, (addr), 0x02, 0x00, 0x04, 0x00, \
+	0x06, 0x30, 0x0f, (streams), 0x00, 0x00
+
+static const unsigned char mock_uas_config_desc[] = {
+	0x09, 0x02, 0x79, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+
+	/* Bulk-Only Transport */
+	0x09, 0x04, 0x00, 0x00, 0x02, 0x08, 0x06, 0x50, 0x00,
+	MOCK_UAS_EP(0x81, 0),
+	MOCK_UAS_EP(0x02, 0),
+
+	/* UAS, each endpoint with its pipe usage descriptor */
+	0x09, 0x04, 0x00, 0x01, 0x04, 0x08, 0x06, 0x62, 0x00,
+	MOCK_UAS_EP(0x04, 0),
+	0x04, 0x24, 0x01, 0x00,		/* command */
+	MOCK_UAS_EP(0x83, 5),
+	0x04, 0x24, 0x02, 0x00,		/* status */
+	MOCK_UAS_EP(0x81, 5),
+	0x04, 0x24, 0x03, 0x00,		/* data-in */
+	MOCK_UAS_EP(0x02, 5),
+	0x04, 0x24, 0x04, 0x00,		/* data-out */
+};
+
+static const unsigned char mock_uas_bos_desc[] = {
+	0x05, 0x0f, 0x16, 0x00, 0x02,
+	0x07, 0x10, 0x02, 0x02, 0x00, 0x00, 0x00,
+	0x0a, 0x10, 0x03, 0x00, 0x0e, 0x00, 0x01, 0x0a, 0xff, 0x07,
+};
+
+static const char *const mock_uas_strings[] = {
+	"usbip", "Mock UAS drive", "0001",
+};
+
+/* Bulk-Only Mass Storage Reset and Get Max LUN */
+static int mock_uas_control(struct mock_device *mdev,
+			    const struct libusb_control_setup *setup,
+			    unsigned char *data)
+{
+	(void)mdev;
+
+	if ((setup->bmRequestType & LIBUSB_REQUEST_TYPE_RESERVED) !=
+	    LIBUSB_REQUEST_TYPE_CLASS)
+		return LIBUSB_ERROR_PIPE;
+
+	switch (setup->bRequest) {
+	case 0xff:
+		return 0;
+	case 0xfe:
+		if (!libusb_le16_to_cpu(setup->wLength))
+			return LIBUSB_ERROR_PIPE;
+		data[0] = 0;
+		return 1;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+static uint64_t mock_uas_transfer(struct mock_device *mdev,
+				  struct libusb_transfer *trx,
+				  uint32_t stream_id, uint64_t now)
+{
+	struct mock_uas *uas = (struct mock_uas *)mdev->priv;
+	int dir = !!(trx->endpoint & LIBUSB_ENDPOINT_IN);
+	uint64_t start, done;
+
+	if (stream_id > MOCK_UAS_STREAMS)
+		stream_id = 0;
+
+	start = uas->busy[dir][stream_id];
+	if (start < now)
+		start = now;
+	start += uas->latency_ns;
+	if (start < uas->link_busy[dir])
+		start = uas->link_busy[dir];
+	done = start + (uint64_t)trx->length * uas->ps_per_byte / 1000;
+
+	uas->link_busy[dir] = done;
+	uas->busy[dir][stream_id] = done;
+
+	trx->status = LIBUSB_TRANSFER_COMPLETED;
+	trx->actual_length = trx->length;
+	return done;
+}
+
+static void mock_uas_free(struct mock_device *mdev)
+{
+	free(mdev->priv);
+	free(mdev);
+}
+
+static const struct mock_device_ops mock_uas_ops = {
+	.control = mock_uas_control,
+	.transfer = mock_uas_transfer,
+	.free = mock_uas_free,
+};
+
+struct mock_device *mock_uas_create(void)
+{
+	struct mock_device *mdev;
+	struct mock_uas *uas;
+	long mbps;
+
+	mdev = (struct mock_device *)calloc(1, sizeof(*mdev));
+	uas = (struct mock_uas *)calloc(1, sizeof(*uas));
+	if (!mdev || !uas) {
+		free(mdev);
+		free(uas);
+		return NULL;
+	}
+
+	uas->latency_ns = mock_env_long("USBIP_MOCK_UAS_LATENCY_US", 100) *
+		1000ULL;
+	mbps = mock_env_long("USBIP_MOCK_UAS_MBPS", 400);
+	uas->ps_per_byte = mbps > 0 ? 1000000 / mbps : 0;
+
+	mdev->ops = &mock_uas_ops;
+	mdev->speed = LIBUSB_SPEED_SUPER;
+	mdev->device_desc = mock_uas_device_desc;
+	mdev->config_desc = mock_uas_config_desc;
+	mdev->bos_desc = mock_uas_bos_desc;
+	mdev->strings = mock_uas_strings;
+	mdev->num_strings = 3;
+	mdev->priv = uas;
+	return mdev;
+}
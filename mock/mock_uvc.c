@@ -0,0 +1,262 @@
+/*
+ * A high-speed UVC camera streaming uncompressed video
+ *
+ * Alternate setting 1 of the streaming interface has a high-bandwidth
+ * isochronous IN endpoint of three 1024 byte transactions per microframe.
+ * Each iso packet of a transfer is a microframe: the camera sends a frame
+ * as fast as the endpoint allows from the start of each frame period,
+ * every payload led by a two byte header with the frame and end of frame
+ * bits, and empty packets until the next frame. Transfers of a stream
+ * follow each other on the bus schedule and complete once their last
+ * microframe is through, plus USBIP_MOCK_UVC_LATENCY_US, 0 by default.
+ *
+ * USBIP_MOCK_UVC_MBPS, 18 by default for 640x480 YUY2, sets the video
+ * rate in MB/s and USBIP_MOCK_UVC_FPS, 30 by default, the frames it is
+ * cut into; the frame size is what probing reports as the largest.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb_mock.h"
+
+#define MOCK_UVC_UFRAME_NS	125000
+#define MOCK_UVC_PAYLOAD	3072
+#define MOCK_UVC_HEADER		2
+
+#define MOCK_UVC_SET_CUR	0x01
+#define MOCK_UVC_GET_CUR	0x81
+#define MOCK_UVC_GET_MIN	0x82
+#define MOCK_UVC_GET_MAX	0x83
+#define MOCK_UVC_GET_RES	0x84
+#define MOCK_UVC_GET_LEN	0x85
+#define MOCK_UVC_GET_INFO	0x86
+#define MOCK_UVC_GET_DEF	0x87
+
+#define MOCK_UVC_VS_PROBE	0x01
+#define MOCK_UVC_VS_COMMIT	0x02
+#define MOCK_UVC_PROBE_LEN	26
+
+struct mock_uvc {
+	uint64_t latency_ns;
+	uint64_t period_ns;	/* of a frame */
+	uint32_t frame_size;
+	uint64_t sched;		/* end of the last scheduled microframe */
+	unsigned char probe[MOCK_UVC_PROBE_LEN];
+};
+
+static const unsigned char mock_uvc_device_desc[] = {
+	0x12, 0x01, 0x00, 0x02, 0xef, 0x02, 0x01, 0x40,
+	0x25, 0x05, 0xa8, 0xa4, 0x00, 0x01, 0x01, 0x02,
+	0x03, 0x01,
+};
+
+static const unsigned char mock_uvc_config_desc[] = {
+	0x09, 0x02, 0xa2, 0x00, 0x02, 0x01, 0x00, 0x80, 0xfa,
+	0x08, 0x0b, 0x00, 0x02, 0x0e, 0x03, 0x00, 0x00,
+
+	/* video control: a camera terminal feeding the streaming terminal */
+	0x09, 0x04, 0x00, 0x00, 0x00, 0x0e, 0x01, 0x00, 0x00,
+	0x0d, 0x24, 0x01, 0x00, 0x01, 0x28, 0x00, 0x80,
+	0x8d, 0x5b, 0x00, 0x01, 0x01,
+	0x12, 0x24, 0x02, 0x01, 0x01, 0x02, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x00,
+	0x00, 0x00,
+	0x09, 0x24, 0x03, 0x02, 0x01, 0x01, 0x00, 0x01, 0x00,
+
+	/* video streaming: 640x480 YUY2 at 30 fps */
+	0x09, 0x04, 0x01, 0x00, 0x00, 0x0e, 0x02, 0x00, 0x00,
+	0x0e, 0x24, 0x01, 0x01, 0x47, 0x00, 0x81, 0x00,
+	0x02, 0x00, 0x00, 0x00, 0x01, 0x00,
+	0x1b, 0x24, 0x04, 0x01, 0x01, 0x59, 0x55, 0x59,
+	0x32, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00,
+	0xaa, 0x00, 0x38, 0x9b, 0x71, 0x10, 0x01, 0x00,
+	0x00, 0x00, 0x00,
+	0x1e, 0x24, 0x05, 0x01, 0x00, 0x80, 0x02, 0xe0,
+	0x01, 0x00, 0x00, 0xca, 0x08, 0x00, 0x00, 0xca,
+	0x08, 0x00, 0x60, 0x09, 0x00, 0x15, 0x16, 0x05,
+	0x00, 0x01, 0x15, 0x16, 0x05, 0x00,
+
+	/* the streaming endpoint, 3 x 1024 bytes per microframe */
+	0x09, 0x04, 0x01, 0x01, 0x01, 0x0e, 0x02, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x05, 0x00, 0x14, 0x01,
+};
+
+static const char *const mock_uvc_strings[] = {
+	"usbip", "Mock camera", "0001",
+};
+
+static void mock_uvc_put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* the one format and frame, whatever the host asked for */
+static void mock_uvc_fill_probe(struct mock_uvc *uvc)
+{
+	uvc->probe[2] = 1;
+	uvc->probe[3] = 1;
+	mock_uvc_put_le32(uvc->probe + 4, uvc->period_ns / 100);
+	mock_uvc_put_le32(uvc->probe + 18, uvc->frame_size);
+	mock_uvc_put_le32(uvc->probe + 22, MOCK_UVC_PAYLOAD);
+}
+
+/* probe and commit on the streaming interface, no other controls */
+static int mock_uvc_control(struct mock_device *mdev,
+			    const struct libusb_control_setup *setup,
+			    unsigned char *data)
+{
+	struct mock_uvc *uvc = (struct mock_uvc *)mdev->priv;
+	uint16_t length = libusb_le16_to_cpu(setup->wLength);
+	uint16_t value = libusb_le16_to_cpu(setup->wValue);
+	uint16_t index = libusb_le16_to_cpu(setup->wIndex);
+	int len = length < MOCK_UVC_PROBE_LEN ? length : MOCK_UVC_PROBE_LEN;
+
+	if ((setup->bmRequestType & LIBUSB_REQUEST_TYPE_RESERVED) !=
+	    LIBUSB_REQUEST_TYPE_CLASS || (index & 0xff) != 1 ||
+	    ((value >> 8) != MOCK_UVC_VS_PROBE &&
+	     (value >> 8) != MOCK_UVC_VS_COMMIT))
+		return LIBUSB_ERROR_PIPE;
+
+	switch (setup->bRequest) {
+	case MOCK_UVC_SET_CUR:
+		memcpy(uvc->probe, data, len);
+		mock_uvc_fill_probe(uvc);
+		return length;
+	case MOCK_UVC_GET_CUR:
+	case MOCK_UVC_GET_MIN:
+	case MOCK_UVC_GET_MAX:
+	case MOCK_UVC_GET_DEF:
+		memcpy(data, uvc->probe, len);
+		return len;
+	case MOCK_UVC_GET_RES:
+		memset(data, 0, len);
+		return len;
+	case MOCK_UVC_GET_LEN:
+		if (length < 2)
+			return LIBUSB_ERROR_PIPE;
+		data[0] = MOCK_UVC_PROBE_LEN;
+		data[1] = 0;
+		return 2;
+	case MOCK_UVC_GET_INFO:
+		if (!length)
+			return LIBUSB_ERROR_PIPE;
+		data[0] = 0x03;
+		return 1;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+/* the payload of the microframe at t into buf, with room for len */
+static int mock_uvc_packet(struct mock_uvc *uvc, uint64_t t,
+			   unsigned char *buf, int len)
+{
+	uint64_t frame = t / uvc->period_ns;
+	uint64_t uframe = (t - frame * uvc->period_ns) / MOCK_UVC_UFRAME_NS;
+	uint64_t sent = uframe * (MOCK_UVC_PAYLOAD - MOCK_UVC_HEADER);
+	uint32_t n;
+
+	if (sent >= uvc->frame_size || len <= MOCK_UVC_HEADER)
+		return 0;
+
+	n = uvc->frame_size - sent;
+	if (n > (uint32_t)len - MOCK_UVC_HEADER)
+		n = len - MOCK_UVC_HEADER;
+	buf[0] = MOCK_UVC_HEADER;
+	buf[1] = 0x80 | (frame & 1);
+	if (sent + n >= uvc->frame_size)
+		buf[1] |= 0x02;
+	memset(buf + MOCK_UVC_HEADER, (unsigned char)frame, n);
+	return MOCK_UVC_HEADER + n;
+}
+
+static uint64_t mock_uvc_transfer(struct mock_device *mdev,
+				  struct libusb_transfer *trx,
+				  uint32_t stream_id, uint64_t now)
+{
+	struct mock_uvc *uvc = (struct mock_uvc *)mdev->priv;
+	struct libusb_iso_packet_descriptor *desc;
+	uint64_t t;
+	int offset = 0, i;
+
+	(void)stream_id;
+
+	/* transfers queued in time follow each other on the schedule */
+	t = now - now % MOCK_UVC_UFRAME_NS;
+	if (t < uvc->sched)
+		t = uvc->sched;
+
+	trx->actual_length = 0;
+	for (i = 0; i < trx->num_iso_packets; i++, t += MOCK_UVC_UFRAME_NS) {
+		desc = &trx->iso_packet_desc[i];
+		desc->actual_length = mock_uvc_packet(uvc, t,
+						      trx->buffer + offset,
+						      desc->length);
+		desc->status = LIBUSB_TRANSFER_COMPLETED;
+		trx->actual_length += desc->actual_length;
+		offset += desc->length;
+	}
+	uvc->sched = t;
+
+	trx->status = LIBUSB_TRANSFER_COMPLETED;
+	return t + uvc->latency_ns;
+}
+
+static void mock_uvc_free(struct mock_device *mdev)
+{
+	free(mdev->priv);
+	free(mdev);
+}
+
+static const struct mock_device_ops mock_uvc_ops = {
+	.control = mock_uvc_control,
+	.transfer = mock_uvc_transfer,
+	.free = mock_uvc_free,
+};
+
+struct mock_device *mock_uvc_create(void)
+{
+	struct mock_device *mdev;
+	struct mock_uvc *uvc;
+	uint64_t max;
+	long mbps, fps;
+
+	mdev = (struct mock_device *)calloc(1, sizeof(*mdev));
+	uvc = (struct mock_uvc *)calloc(1, sizeof(*uvc));
+	if (!mdev || !uvc) {
+		free(mdev);
+		free(uvc);
+		return NULL;
+	}
+
+	mbps = mock_env_long("USBIP_MOCK_UVC_MBPS", 18);
+	fps = mock_env_long("USBIP_MOCK_UVC_FPS", 30);
+	if (mbps <= 0)
+		mbps = 18;
+	if (fps <= 0 || fps > 1000)
+		fps = 30;
+	uvc->latency_ns = mock_env_long("USBIP_MOCK_UVC_LATENCY_US", 0) *
+		1000ULL;
+	uvc->period_ns = 1000000000ULL / fps;
+
+	/* at most what the microframes of a period carry */
+	max = uvc->period_ns / MOCK_UVC_UFRAME_NS *
+		(MOCK_UVC_PAYLOAD - MOCK_UVC_HEADER);
+	uvc->frame_size = mbps * 1000000ULL / fps;
+	if (uvc->frame_size > max)
+		uvc->frame_size = max;
+	mock_uvc_fill_probe(uvc);
+
+	mdev->ops = &mock_uvc_ops;
+	mdev->speed = LIBUSB_SPEED_HIGH;
+	mdev->device_desc = mock_uvc_device_desc;
+	mdev->config_desc = mock_uvc_config_desc;
+	mdev->strings = mock_uvc_strings;
+	mdev->num_strings = 3;
+	mdev->priv = uvc;
+	return mdev;
+}
@@ -27,12 +27,18 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <unistd.h>
 
+#include <usbip_config.h>
 #include <usbip_debug.h>
 
 #include "names.h"
@@ -95,10 +101,79 @@ static struct clazz *classes[HASHSZ] = { NULL, };
 static struct subclass *subclasses[HASHSZ] = { NULL, };
 static struct protocol *protocols[HASHSZ] = { NULL, };
 
+/*
+ * Compiled tables
+ *
+ * Parsing usb.ids takes a few megabytes of text and ends in 16-bucket
+ * hash chains. After the first parse the names are compiled into one
+ * image of sorted (key, name) arrays plus a string pool, and written to
+ * USBIDS_CACHE_FILE. Later runs map that file read-only and look names
+ * up by binary search without parsing. The cache is rebuilt when the
+ * size or mtime of usb.ids changes.
+ */
+enum {
+	NAMES_VENDOR,
+	NAMES_PRODUCT,
+	NAMES_CLASS,
+	NAMES_SUBCLASS,
+	NAMES_PROTOCOL,
+	NAMES_NTABLES
+};
+
+#define NAMES_MAGIC "USBIDS\0\1"
+
+struct names_entry {
+	uint32_t key;
+	uint32_t name;		/* offset into the string pool */
+};
+
+struct names_image {
+	char magic[8];
+	uint64_t src_size;
+	int64_t src_mtime;
+	uint32_t size;
+	uint32_t strings;	/* offset of the string pool */
+	struct {
+		uint32_t offset;
+		uint32_t count;
+	} tables[NAMES_NTABLES];
+};
+
+static struct names_image *names_image;
+static int names_image_mapped;
+
+static const char *names_lookup(int table, uint32_t key)
+{
+	const struct names_image *img = names_image;
+	const struct names_entry *e;
+	uint32_t lo = 0, hi, mid;
+
+	e = (const struct names_entry *)
+		((const char *)img + img->tables[table].offset);
+	hi = img->tables[table].count;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (e[mid].key == key) {
+			if (e[mid].name >= img->size - img->strings)
+				return NULL;
+			return (const char *)img + img->strings + e[mid].name;
+		}
+		if (e[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
 const char *names_vendor(u_int16_t vendorid)
 {
 	struct vendor *v;
 
+	if (names_image)
+		return names_lookup(NAMES_VENDOR, vendorid);
+
 	v = vendors[hashnum(vendorid)];
 	for (; v; v = v->next)
 		if (v->vendorid == vendorid)
@@ -110,6 +185,10 @@ const char *names_product(u_int16_t vendorid, u_int16_t productid)
 {
 	struct product *p;
 
+	if (names_image)
+		return names_lookup(NAMES_PRODUCT,
+				    ((uint32_t)vendorid << 16) | productid);
+
 	p = products[hashnum((vendorid << 16) | productid)];
 	for (; p; p = p->next)
 		if (p->vendorid == vendorid && p->productid == productid)
@@ -121,6 +200,9 @@ const char *names_class(u_int8_t classid)
 {
 	struct clazz *c;
 
+	if (names_image)
+		return names_lookup(NAMES_CLASS, classid);
+
 	c = classes[hashnum(classid)];
 	for (; c; c = c->next)
 		if (c->classid == classid)
@@ -132,6 +214,10 @@ const char *names_subclass(u_int8_t classid, u_int8_t subclassid)
 {
 	struct subclass *s;
 
+	if (names_image)
+		return names_lookup(NAMES_SUBCLASS,
+				    (classid << 8) | subclassid);
+
 	s = subclasses[hashnum((classid << 8) | subclassid)];
 	for (; s; s = s->next)
 		if (s->classid == classid && s->subclassid == subclassid)
@@ -144,6 +230,10 @@ const char *names_protocol(u_int8_t classid, u_int8_t subclassid,
 {
 	struct protocol *p;
 
+	if (names_image)
+		return names_lookup(NAMES_PROTOCOL, (classid << 16) |
+				    (subclassid << 8) | protocolid);
+
 	p = protocols[hashnum((classid << 16) | (subclassid << 8)
 			      | protocolid)];
 	for (; p; p = p->next)
@@ -181,7 +271,7 @@ static void *my_malloc(size_t size)
 	return p->mem;
 }
 
-void names_free(void)
+static void names_pool_free(void)
 {
 	struct pool *pool;
 
@@ -198,6 +288,26 @@ void names_free(void)
 		pool = pool->next;
 		free(tmp);
 	}
+	pool_head = NULL;
+
+	memset(vendors, 0, sizeof(vendors));
+	memset(products, 0, sizeof(products));
+	memset(classes, 0, sizeof(classes));
+	memset(subclasses, 0, sizeof(subclasses));
+	memset(protocols, 0, sizeof(protocols));
+}
+
+void names_free(void)
+{
+	names_pool_free();
+
+	if (!names_image)
+		return;
+	if (names_image_mapped)
+		munmap(names_image, names_image->size);
+	else
+		free(names_image);
+	names_image = NULL;
 }
 
 static int new_vendor(const char *name, u_int16_t vendorid)
@@ -487,15 +597,232 @@ static void parse(FILE *f)
 }
 
 
+struct names_builder {
+	struct names_image *img;
+	uint32_t fill[NAMES_NTABLES];
+	uint32_t strlen;
+};
+
+/* first pass counts, second pass (with an image) fills */
+static void names_add(struct names_builder *b, int table, uint32_t key,
+		      const char *name)
+{
+	struct names_image *img = b->img;
+	size_t len = strlen(name) + 1;
+	struct names_entry *e;
+
+	if (!img) {
+		b->fill[table]++;
+		b->strlen += len;
+		return;
+	}
+
+	e = (struct names_entry *)((char *)img + img->tables[table].offset);
+	e += b->fill[table]++;
+	e->key = key;
+	e->name = b->strlen;
+	memcpy((char *)img + img->strings + b->strlen, name, len);
+	b->strlen += len;
+}
+
+static void names_walk(struct names_builder *b)
+{
+	unsigned int h;
+
+	for (h = 0; h < HASHSZ; h++) {
+		struct vendor *v;
+		struct product *p;
+		struct clazz *c;
+		struct subclass *s;
+		struct protocol *r;
+
+		for (v = vendors[h]; v; v = v->next)
+			names_add(b, NAMES_VENDOR, v->vendorid, v->name);
+		for (p = products[h]; p; p = p->next)
+			names_add(b, NAMES_PRODUCT,
+				  ((uint32_t)p->vendorid << 16) | p->productid,
+				  p->name);
+		for (c = classes[h]; c; c = c->next)
+			names_add(b, NAMES_CLASS, c->classid, c->name);
+		for (s = subclasses[h]; s; s = s->next)
+			names_add(b, NAMES_SUBCLASS,
+				  (s->classid << 8) | s->subclassid, s->name);
+		for (r = protocols[h]; r; r = r->next)
+			names_add(b, NAMES_PROTOCOL,
+				  (r->classid << 16) | (r->subclassid << 8) |
+				  r->protocolid, r->name);
+	}
+}
+
+static int names_entry_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const struct names_entry *)a)->key;
+	uint32_t y = ((const struct names_entry *)b)->key;
+
+	return (x > y) - (x < y);
+}
+
+/* compile the parsed hash tables into a names_image */
+static struct names_image *names_compile(const struct stat *src)
+{
+	struct names_builder b;
+	struct names_image *img;
+	uint32_t off = sizeof(struct names_image);
+	size_t size;
+	int t;
+
+	memset(&b, 0, sizeof(b));
+	names_walk(&b);
+
+	size = off + b.strlen;
+	for (t = 0; t < NAMES_NTABLES; t++)
+		size += b.fill[t] * sizeof(struct names_entry);
+
+	img = (struct names_image *)calloc(1, size);
+	if (!img)
+		return NULL;
+
+	memcpy(img->magic, NAMES_MAGIC, sizeof(img->magic));
+	img->src_size = src->st_size;
+	img->src_mtime = src->st_mtime;
+	img->size = size;
+	for (t = 0; t < NAMES_NTABLES; t++) {
+		img->tables[t].offset = off;
+		img->tables[t].count = b.fill[t];
+		off += b.fill[t] * sizeof(struct names_entry);
+	}
+	img->strings = off;
+
+	memset(&b, 0, sizeof(b));
+	b.img = img;
+	names_walk(&b);
+
+	for (t = 0; t < NAMES_NTABLES; t++)
+		qsort((char *)img + img->tables[t].offset,
+		      img->tables[t].count, sizeof(struct names_entry),
+		      names_entry_cmp);
+	return img;
+}
+
+static int names_image_valid(const struct names_image *img, size_t size,
+			     const struct stat *src)
+{
+	int t;
+
+	if (size < sizeof(*img) ||
+	    memcmp(img->magic, NAMES_MAGIC, sizeof(img->magic)) ||
+	    img->size != size || img->strings > size ||
+	    img->src_size != (uint64_t)src->st_size ||
+	    img->src_mtime != (int64_t)src->st_mtime)
+		return 0;
+
+	for (t = 0; t < NAMES_NTABLES; t++) {
+		if (img->tables[t].offset > img->strings ||
+		    img->tables[t].count > (img->strings -
+			img->tables[t].offset) / sizeof(struct names_entry))
+			return 0;
+	}
+	return size == img->strings || ((const char *)img)[size - 1] == 0;
+}
+
+static int names_cache_open(const struct stat *src)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(USBIDS_CACHE_FILE, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct names_image)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (!names_image_valid((struct names_image *)map, st.st_size, src)) {
+		dbg("stale names cache %s", USBIDS_CACHE_FILE);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	names_image = (struct names_image *)map;
+	names_image_mapped = 1;
+	return 0;
+}
+
+static void names_cache_write(const struct names_image *img)
+{
+	static const char tmp[] = USBIDS_CACHE_FILE ".tmp";
+	char dir[sizeof(USBIDS_CACHE_FILE)];
+	char *slash;
+	ssize_t n;
+	int fd;
+
+	strcpy(dir, USBIDS_CACHE_FILE);
+	slash = strrchr(dir, '/');
+	if (slash && slash != dir) {
+		*slash = 0;
+		mkdir(dir, 0755);
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		dbg("names cache %s: %s", tmp, strerror(errno));
+		return;
+	}
+	n = write(fd, img, img->size);
+	if (n != (ssize_t)img->size) {
+		dbg("names cache %s: %s", tmp,
+		    n < 0 ? strerror(errno) : "short write");
+		close(fd);
+		goto err_unlink;
+	}
+	if (close(fd)) {
+		dbg("names cache %s: %s", tmp, strerror(errno));
+		goto err_unlink;
+	}
+	if (rename(tmp, USBIDS_CACHE_FILE)) {
+		dbg("names cache %s: %s", USBIDS_CACHE_FILE, strerror(errno));
+		goto err_unlink;
+	}
+	return;
+
+err_unlink:
+	unlink(tmp);
+}
+
 int names_init(char *n)
 {
+	struct names_image *img;
+	struct stat st;
 	FILE *f;
 
+	if (stat(n, &st))
+		return errno;
+
+	if (!names_cache_open(&st))
+		return 0;
+
 	f = fopen(n, "r");
 	if (!f)
 		return errno;
 
 	parse(f);
 	fclose(f);
+
+	/* on failure the hash tables keep serving lookups */
+	img = names_compile(&st);
+	if (img) {
+		names_cache_write(img);
+		names_pool_free();
+		names_image = img;
+		names_image_mapped = 0;
+	}
 	return 0;
 }
@@ -0,0 +1,408 @@
+/*
+ * pcap captures of exported devices
+ *
+ * Transfers are recorded from whichever thread sees them: the receiver
+ * submits, the thread polling libusb completes. Each of them reserves
+ * room for its event in the ring of the capture with one compare and
+ * swap, copies the event in and marks it committed; the writer thread
+ * of the capture appends committed events to the file in order and
+ * hands the room back. A full ring drops the event rather than waiting.
+ *
+ * Events are usbmon packets as Wireshark and tcpdump read them from
+ * /dev/usbmon, so a capture shows the device as the server sees it.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "usbip_network.h"
+#include "usbip_capture.h"
+#include <usbip_debug.h>
+#include <usbip_metrics.h>
+
+#define USBIP_CAPTURE_MAX_DEVICES	16
+#define USBIP_CAPTURE_SNAPLEN		65536
+#define USBIP_CAPTURE_RING_KIB		4096
+#define USBIP_CAPTURE_IDLE_MS		1
+
+#define USBIP_PCAP_MAGIC		0xa1b2c3d4
+#define USBIP_PCAP_MAGIC_NS		0xa1b23c4d
+#define USBIP_PCAP_USB_LINUX_MMAPPED	220
+
+struct usbip_capture_conf {
+	char busid[SYSFS_BUS_ID_SIZE];
+	char *path;
+	uint32_t snaplen;
+	uint32_t ring;		/* bytes, power of 2 */
+};
+
+static struct usbip_capture_conf usbip_capture_conf[USBIP_CAPTURE_MAX_DEVICES];
+static int usbip_capture_nconf;
+
+struct usbip_pcap_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct usbip_pcap_rec {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* an event in the ring, followed by its pcap record */
+struct usbip_capture_slot {
+	uint32_t size;		/* of the slot, a multiple of 8 */
+	atomic_uint state;
+};
+
+enum {
+	USBIP_CAPTURE_FREE,
+	USBIP_CAPTURE_COMMITTED,
+	USBIP_CAPTURE_PAD,	/* the rest of the ring is skipped */
+};
+
+struct usbip_capture {
+	char *ring;
+	uint64_t mask;
+	atomic_ullong head;	/* reserved by producers */
+	atomic_ullong tail;	/* handed back by the writer */
+	atomic_int should_stop;
+	pthread_t writer;
+	FILE *fp;
+	uint32_t snaplen;
+	atomic_ullong events;
+	atomic_ullong drops;
+	char busid[SYSFS_BUS_ID_SIZE];
+};
+
+int usbip_capture_parse(const char *spec)
+{
+	struct usbip_capture_conf conf;
+	char *buf, *path, *tok, *save, *val, *end;
+	const char *eq = strchr(spec, '=');
+	unsigned long v;
+	int ret = -1;
+
+	if (!eq || eq == spec || eq - spec >= SYSFS_BUS_ID_SIZE ||
+	    usbip_capture_nconf == USBIP_CAPTURE_MAX_DEVICES)
+		return -1;
+
+	memset(&conf, 0, sizeof(conf));
+	memcpy(conf.busid, spec, eq - spec);
+	conf.snaplen = USBIP_CAPTURE_SNAPLEN;
+	conf.ring = USBIP_CAPTURE_RING_KIB << 10;
+
+	buf = strdup(eq + 1);
+	if (!buf)
+		return -1;
+	path = strtok_r(buf, ",", &save);
+	if (!path)
+		goto out;
+
+	while ((tok = strtok_r(NULL, ",", &save))) {
+		val = strchr(tok, '=');
+		if (!val)
+			goto out;
+		*val++ = '\0';
+		errno = 0;
+		v = strtoul(val, &end, 0);
+		if (end == val || *end || errno)
+			goto out;
+		if (!strcmp(tok, "snaplen") && v <= (1 << 24)) {
+			conf.snaplen = v;
+		} else if (!strcmp(tok, "ring") && v >= 64 && v <= (1 << 20)) {
+			/* round up to a power of 2 */
+			conf.ring = 64 << 10;
+			while (conf.ring < (v << 10))
+				conf.ring <<= 1;
+		} else {
+			goto out;
+		}
+	}
+
+	conf.path = strdup(path);
+	if (!conf.path)
+		goto out;
+	usbip_capture_conf[usbip_capture_nconf++] = conf;
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/* append the committed events, return how many */
+static int usbip_capture_drain(struct usbip_capture *cap)
+{
+	uint64_t tail, head;
+	struct usbip_capture_slot *slot;
+	struct usbip_pcap_rec *rec;
+	unsigned int state;
+	int n = 0;
+
+	tail = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&cap->head, memory_order_acquire);
+
+	while (tail != head) {
+		slot = (struct usbip_capture_slot *)
+			(cap->ring + (tail & cap->mask));
+		state = atomic_load_explicit(&slot->state,
+					     memory_order_acquire);
+		if (state == USBIP_CAPTURE_FREE)
+			break;	/* still being written */
+
+		if (state == USBIP_CAPTURE_COMMITTED) {
+			rec = (struct usbip_pcap_rec *)(slot + 1);
+			fwrite(rec, sizeof(*rec) + rec->incl_len, 1, cap->fp);
+			n++;
+		}
+
+		/* a later lap finds only its own slots committed */
+		tail += slot->size;
+		memset(slot, 0, slot->size);
+		atomic_store_explicit(&cap->tail, tail, memory_order_release);
+	}
+
+	if (n)
+		fflush(cap->fp);
+	return n;
+}
+
+static void *usbip_capture_writer(void *data)
+{
+	struct usbip_capture *cap = (struct usbip_capture *)data;
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = USBIP_CAPTURE_IDLE_MS * 1000000L,
+	};
+
+	while (!atomic_load(&cap->should_stop)) {
+		if (!usbip_capture_drain(cap))
+			nanosleep(&ts, NULL);
+	}
+	usbip_capture_drain(cap);
+	return NULL;
+}
+
+struct usbip_capture *usbip_capture_open(const char *busid)
+{
+	struct usbip_capture_conf *conf = NULL;
+	struct usbip_capture *cap;
+	struct usbip_pcap_hdr hdr;
+	int i;
+
+	for (i = 0; i < usbip_capture_nconf; i++) {
+		if (!strcmp(usbip_capture_conf[i].busid, busid))
+			conf = &usbip_capture_conf[i];
+	}
+	if (!conf)
+		return NULL;
+
+	cap = (struct usbip_capture *)calloc(1, sizeof(*cap));
+	if (!cap)
+		goto err;
+	cap->ring = (char *)calloc(1, conf->ring);
+	if (!cap->ring)
+		goto err_free;
+	cap->mask = conf->ring - 1;
+	cap->snaplen = conf->snaplen;
+	strcpy(cap->busid, busid);
+
+	/* a device exported again adds to its capture */
+	cap->fp = fopen(conf->path, "a");
+	if (!cap->fp) {
+		err("open capture %s: %s", conf->path, strerror(errno));
+		goto err_free;
+	}
+	if (ftell(cap->fp) == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = USBIP_PCAP_MAGIC;
+		hdr.version_major = 2;
+		hdr.version_minor = 4;
+		hdr.snaplen = sizeof(struct usbip_usbmon_packet) +
+			conf->snaplen;
+		hdr.linktype = USBIP_PCAP_USB_LINUX_MMAPPED;
+		fwrite(&hdr, sizeof(hdr), 1, cap->fp);
+		fflush(cap->fp);
+	}
+
+	if (pthread_create(&cap->writer, NULL, usbip_capture_writer, cap)) {
+		err("start capture writer");
+		fclose(cap->fp);
+		goto err_free;
+	}
+
+	info("capturing %s to %s", busid, conf->path);
+	return cap;
+
+err_free:
+	free(cap->ring);
+	free(cap);
+err:
+	return NULL;
+}
+
+void usbip_capture_close(struct usbip_capture *cap)
+{
+	if (!cap)
+		return;
+
+	atomic_store(&cap->should_stop, 1);
+	pthread_join(cap->writer, NULL);
+	fclose(cap->fp);
+
+	info("capture of %s: %llu events, %llu dropped", cap->busid,
+	     (unsigned long long)atomic_load(&cap->events),
+	     (unsigned long long)atomic_load(&cap->drops));
+	free(cap->ring);
+	free(cap);
+}
+
+void usbip_capture_record(struct usbip_capture *cap,
+			  struct usbip_usbmon_packet *pkt,
+			  const struct usbip_usbmon_iso *iso, uint32_t niso,
+			  const void *data, uint32_t len)
+{
+	struct usbip_capture_slot *slot;
+	struct usbip_pcap_rec *rec;
+	struct timeval tv;
+	uint64_t head, tail, off, pad, need, size = cap->mask + 1;
+	uint32_t ndesc, cap_len;
+	char *p;
+
+	ndesc = niso;
+	if ((uint64_t)ndesc * sizeof(*iso) > cap->snaplen)
+		ndesc = cap->snaplen / sizeof(*iso);
+	cap_len = cap->snaplen - ndesc * sizeof(*iso);
+	if (cap_len > len)
+		cap_len = len;
+
+	need = sizeof(*slot) + sizeof(*rec) + sizeof(*pkt) +
+		ndesc * sizeof(*iso) + cap_len;
+	need = (need + 7) & ~7ULL;
+	if (need > size / 2)
+		goto drop;
+
+	gettimeofday(&tv, NULL);
+
+	head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+	do {
+		tail = atomic_load_explicit(&cap->tail, memory_order_acquire);
+		off = head & cap->mask;
+		pad = off + need > size ? size - off : 0;
+		if (head + pad + need - tail > size)
+			goto drop;
+	} while (!atomic_compare_exchange_weak_explicit(&cap->head, &head,
+			head + pad + need, memory_order_acq_rel,
+			memory_order_relaxed));
+
+	if (pad) {
+		slot = (struct usbip_capture_slot *)(cap->ring + off);
+		slot->size = pad;
+		atomic_store_explicit(&slot->state, USBIP_CAPTURE_PAD,
+				      memory_order_release);
+		off = 0;
+	}
+
+	pkt->ts_sec = tv.tv_sec;
+	pkt->ts_usec = tv.tv_usec;
+	pkt->ndesc = ndesc;
+	pkt->len_cap = cap_len;
+
+	slot = (struct usbip_capture_slot *)(cap->ring + off);
+	slot->size = need;
+	rec = (struct usbip_pcap_rec *)(slot + 1);
+	rec->ts_sec = tv.tv_sec;
+	rec->ts_usec = tv.tv_usec;
+	rec->incl_len = sizeof(*pkt) + ndesc * sizeof(*iso) + cap_len;
+	rec->orig_len = sizeof(*pkt) + niso * sizeof(*iso) + len;
+
+	p = (char *)(rec + 1);
+	memcpy(p, pkt, sizeof(*pkt));
+	p += sizeof(*pkt);
+	if (ndesc) {
+		memcpy(p, iso, ndesc * sizeof(*iso));
+		p += ndesc * sizeof(*iso);
+	}
+	if (cap_len)
+		memcpy(p, data, cap_len);
+
+	atomic_store_explicit(&slot->state, USBIP_CAPTURE_COMMITTED,
+			      memory_order_release);
+	atomic_fetch_add_explicit(&cap->events, 1, memory_order_relaxed);
+	usbip_metric_add(USBIP_M_capture_events, 1);
+	return;
+
+drop:
+	atomic_fetch_add_explicit(&cap->drops, 1, memory_order_relaxed);
+	usbip_metric_add(USBIP_M_capture_drops, 1);
+}
+
+int usbip_capture_load(const char *path, usbip_capture_fn fn, void *arg)
+{
+	struct usbip_pcap_hdr hdr;
+	struct usbip_pcap_rec rec;
+	struct usbip_usbmon_packet pkt;
+	unsigned char *buf = NULL, *p;
+	size_t desc_len;
+	FILE *fp;
+	int ret = -1;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		err("open capture %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    (hdr.magic != USBIP_PCAP_MAGIC &&
+	     hdr.magic != USBIP_PCAP_MAGIC_NS) ||
+	    hdr.linktype != USBIP_PCAP_USB_LINUX_MMAPPED) {
+		err("%s is no usbmon capture", path);
+		goto out;
+	}
+
+	ret = 0;
+	while (ret == 0 && fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (rec.incl_len < sizeof(pkt) || rec.incl_len > (1 << 26)) {
+			err("%s: bad record", path);
+			ret = -1;
+			break;
+		}
+		p = (unsigned char *)realloc(buf, rec.incl_len);
+		if (!p) {
+			ret = -1;
+			break;
+		}
+		buf = p;
+		if (fread(buf, rec.incl_len, 1, fp) != 1)
+			break;	/* cut short while being written */
+
+		memcpy(&pkt, buf, sizeof(pkt));
+		desc_len = (size_t)pkt.ndesc * sizeof(struct usbip_usbmon_iso);
+		if (sizeof(pkt) + desc_len + pkt.len_cap > rec.incl_len) {
+			err("%s: bad event", path);
+			ret = -1;
+			break;
+		}
+		ret = fn(arg, &pkt,
+			 (const struct usbip_usbmon_iso *)(buf + sizeof(pkt)),
+			 buf + sizeof(pkt) + desc_len);
+	}
+out:
+	free(buf);
+	fclose(fp);
+	return ret;
+}
@@ -137,30 +137,69 @@ void usbip_names_get_class(char *buff, size_t size, uint8_t clazz,
 }
 
 
-void usbip_dump_buffer(void *buf, int size){
-    unsigned i, j, k;
-    unsigned char *pbuf = buf;
-
-    for (i=0; i<size; i+=16) {
-        printf("\n  %08x  ", i);
-        for(j=0,k=0; k<16; j++,k++) {
-            if (i+j < size) {
-                printf("%02x", pbuf[i + j]);
-            } else {
-                printf("  ");
-            }
-            printf(" ");
-        }
-        printf(" ");
-        for(j=0,k=0; k<16; j++,k++) {
-            if (i+j < size) {
-                if ((pbuf[i + j] < 32) || (pbuf[i + j] > 126)) {
-                    printf(".");
-                } else {
-                    printf("%c", pbuf[i + j]);
-                }
-            }
+/* bytes of a buffer dumped by usbip_dump_buffer(), 0 dumps everything */
+int usbip_dump_limit = USBIP_DUMP_LIMIT_DEFAULT;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+#define DUMP_BYTES_PER_LINE 16
+/* "  oooooooo  " + "xx " per byte + " " + ascii + "\n" */
+#define DUMP_LINE_MAX (12 + DUMP_BYTES_PER_LINE * 4 + 2)
+
+static int dump_line(char *out, const unsigned char *p, unsigned offset,
+                     int n)
+{
+    char *o = out;
+    int i;
+
+    *o++ = ' ';
+    *o++ = ' ';
+    for (i = 28; i >= 0; i -= 4)
+        *o++ = hex_digits[(offset >> i) & 0xf];
+    *o++ = ' ';
+    *o++ = ' ';
+
+    for (i = 0; i < DUMP_BYTES_PER_LINE; i++) {
+        if (i < n) {
+            *o++ = hex_digits[p[i] >> 4];
+            *o++ = hex_digits[p[i] & 0xf];
+        } else {
+            *o++ = ' ';
+            *o++ = ' ';
         }
+        *o++ = ' ';
+    }
+    *o++ = ' ';
+
+    for (i = 0; i < n; i++)
+        *o++ = (p[i] < 32 || p[i] > 126) ? '.' : (char) p[i];
+    *o++ = '\n';
+
+    return (int) (o - out);
+}
+
+void usbip_dump_buffer(void *buf, int size)
+{
+    char line[DUMP_LINE_MAX];
+    const unsigned char *pbuf = buf;
+    int len = size;
+    int i, n;
+
+    if (USBIP_LOG_DEBUG > USBIP_LOG_LEVEL || size <= 0)
+        return;
+
+    if (usbip_dump_limit > 0 && len > usbip_dump_limit)
+        len = usbip_dump_limit;
+
+    for (i = 0; i < len; i += DUMP_BYTES_PER_LINE) {
+        n = len - i < DUMP_BYTES_PER_LINE ? len - i : DUMP_BYTES_PER_LINE;
+        usbip_log_write(USBIP_LOG_DEBUG, line,
+                        dump_line(line, pbuf + i, i, n));
     }
-    printf("\n" );
-}
\ No newline at end of file
+
+    if (len < size) {
+        n = snprintf(line, sizeof(line), "  ... %d more bytes\n",
+                     size - len);
+        usbip_log_write(USBIP_LOG_DEBUG, line, n);
+    }
+}
@@ -0,0 +1,393 @@
+/*
+ * Asynchronous logging
+ *
+ * Each thread owns a single-producer ring of fixed size records, created
+ * on its first message. The producer only formats into the next free
+ * record and publishes it; stdio, syslog and file locking all happen in
+ * the flusher thread.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <usbip_config.h>
+#include <usbip_log.h>
+
+#define USBIP_LOG_RING_SIZE	256	/* records, power of 2 */
+#define USBIP_LOG_MSG_MAX	248
+#define USBIP_LOG_FLUSH_INTERVAL 10	/* ms */
+
+enum {
+	USBIP_LOG_SINK_STDOUT,
+	USBIP_LOG_SINK_SYSLOG,
+	USBIP_LOG_SINK_FILE,
+};
+
+struct usbip_log_record {
+	int level;
+	int len;
+	char msg[USBIP_LOG_MSG_MAX];
+};
+
+struct usbip_log_ring {
+	struct usbip_log_ring *next;
+	atomic_uint head;	/* advanced by the owning thread */
+	atomic_uint tail;	/* advanced by the flusher */
+	atomic_uint dropped;
+	atomic_int dead;	/* owner exited, free once drained */
+	struct usbip_log_record rec[USBIP_LOG_RING_SIZE];
+};
+
+static int usbip_log_sink = USBIP_LOG_SINK_STDOUT;
+static char *usbip_log_path;
+static FILE *usbip_log_file;
+
+static struct usbip_log_ring *usbip_log_rings;
+static pthread_mutex_t usbip_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t usbip_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t usbip_log_key;
+static pthread_t usbip_log_flusher;
+static atomic_int usbip_log_running;
+static atomic_int usbip_log_should_stop;
+
+static uint64_t usbip_log_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void usbip_log_ring_exit(void *data)
+{
+	struct usbip_log_ring *ring = (struct usbip_log_ring *)data;
+
+	atomic_store_explicit(&ring->dead, 1, memory_order_release);
+}
+
+static void usbip_log_key_init(void)
+{
+	pthread_key_create(&usbip_log_key, usbip_log_ring_exit);
+}
+
+static struct usbip_log_ring *usbip_log_ring_self(void)
+{
+	struct usbip_log_ring *ring;
+
+	pthread_once(&usbip_log_once, usbip_log_key_init);
+
+	ring = (struct usbip_log_ring *)pthread_getspecific(usbip_log_key);
+	if (ring)
+		return ring;
+
+	ring = (struct usbip_log_ring *)calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	pthread_setspecific(usbip_log_key, ring);
+
+	pthread_mutex_lock(&usbip_log_lock);
+	ring->next = usbip_log_rings;
+	usbip_log_rings = ring;
+	pthread_mutex_unlock(&usbip_log_lock);
+
+	return ring;
+}
+
+static void usbip_log_vprint(int level, const char *fmt, va_list ap)
+{
+	vfprintf(level <= USBIP_LOG_WARNING ? stderr : stdout, fmt, ap);
+}
+
+/* the next free record of the caller's ring, NULL to print directly */
+static struct usbip_log_record *usbip_log_reserve(
+		struct usbip_log_ring **ringp, int *direct)
+{
+	struct usbip_log_ring *ring = NULL;
+	unsigned int head, tail;
+
+	if (atomic_load_explicit(&usbip_log_running, memory_order_relaxed))
+		ring = usbip_log_ring_self();
+	if (!ring) {
+		*direct = 1;
+		return NULL;
+	}
+	*direct = 0;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail >= USBIP_LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1,
+					  memory_order_relaxed);
+		return NULL;
+	}
+
+	*ringp = ring;
+	return ring->rec + (head & (USBIP_LOG_RING_SIZE - 1));
+}
+
+static void usbip_log_commit(struct usbip_log_ring *ring,
+			     struct usbip_log_record *rec, int level, int len)
+{
+	unsigned int head;
+
+	if (len >= (int)sizeof(rec->msg)) {
+		len = sizeof(rec->msg) - 1;
+		rec->msg[len - 1] = '\n';
+	}
+	rec->level = level;
+	rec->len = len;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void usbip_log(int level, const char *fmt, ...)
+{
+	struct usbip_log_ring *ring;
+	struct usbip_log_record *rec;
+	va_list ap;
+	int direct, len;
+
+	va_start(ap, fmt);
+
+	rec = usbip_log_reserve(&ring, &direct);
+	if (!rec) {
+		if (direct)
+			usbip_log_vprint(level, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	len = vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+	va_end(ap);
+	if (len >= 0)
+		usbip_log_commit(ring, rec, level, len);
+}
+
+/* log preformatted text, which should end with a newline */
+void usbip_log_write(int level, const char *msg, int len)
+{
+	struct usbip_log_ring *ring;
+	struct usbip_log_record *rec;
+	int direct;
+
+	rec = usbip_log_reserve(&ring, &direct);
+	if (!rec) {
+		if (direct)
+			fwrite(msg, 1, len, level <= USBIP_LOG_WARNING ?
+			       stderr : stdout);
+		return;
+	}
+
+	if (len >= (int)sizeof(rec->msg))
+		len = sizeof(rec->msg);
+	memcpy(rec->msg, msg, len);
+	usbip_log_commit(ring, rec, level, len);
+}
+
+int usbip_ratelimit(struct usbip_ratelimit *rs, const char *func)
+{
+	unsigned long long now = usbip_log_now_ms();
+	unsigned long long begin;
+	int missed;
+
+	begin = atomic_load_explicit(&rs->begin, memory_order_relaxed);
+	if (!begin || now - begin >= USBIP_RATELIMIT_INTERVAL) {
+		if (atomic_compare_exchange_strong(&rs->begin, &begin, now)) {
+			missed = atomic_exchange(&rs->missed, 0);
+			atomic_store(&rs->printed, 0);
+			if (missed)
+				usbip_log(USBIP_LOG_WARNING,
+					  "<W>: %s: %d messages suppressed\n",
+					  func, missed);
+		}
+	}
+
+	if (atomic_fetch_add(&rs->printed, 1) < USBIP_RATELIMIT_BURST)
+		return 1;
+
+	atomic_fetch_add(&rs->missed, 1);
+	return 0;
+}
+
+static void usbip_log_emit(int level, const char *msg, int len)
+{
+	switch (usbip_log_sink) {
+	case USBIP_LOG_SINK_SYSLOG:
+		if (len > 0 && msg[len - 1] == '\n')
+			len--;
+		syslog(level, "%.*s", len, msg);
+		break;
+	case USBIP_LOG_SINK_FILE:
+		fwrite(msg, 1, len, usbip_log_file);
+		break;
+	default:
+		fwrite(msg, 1, len,
+		       level <= USBIP_LOG_WARNING ? stderr : stdout);
+		break;
+	}
+}
+
+static void usbip_log_flush_sink(void)
+{
+	switch (usbip_log_sink) {
+	case USBIP_LOG_SINK_FILE:
+		fflush(usbip_log_file);
+		break;
+	case USBIP_LOG_SINK_STDOUT:
+		fflush(stdout);
+		fflush(stderr);
+		break;
+	}
+}
+
+static int usbip_log_drain_ring(struct usbip_log_ring *ring)
+{
+	struct usbip_log_record *rec;
+	unsigned int head, tail, dropped;
+	char buf[64];
+	int n = 0;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	for (; tail != head; tail++, n++) {
+		rec = ring->rec + (tail & (USBIP_LOG_RING_SIZE - 1));
+		usbip_log_emit(rec->level, rec->msg, rec->len);
+	}
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+	dropped = atomic_exchange_explicit(&ring->dropped, 0,
+					   memory_order_relaxed);
+	if (dropped) {
+		int len = snprintf(buf, sizeof(buf),
+				   "<W>: log: %u messages dropped\n", dropped);
+
+		usbip_log_emit(USBIP_LOG_WARNING, buf, len);
+		n++;
+	}
+	return n;
+}
+
+static int usbip_log_drain(void)
+{
+	struct usbip_log_ring **pp, *ring;
+	int n = 0;
+
+	pthread_mutex_lock(&usbip_log_lock);
+	for (pp = &usbip_log_rings; (ring = *pp) != NULL;) {
+		int dead = atomic_load_explicit(&ring->dead,
+						memory_order_acquire);
+
+		n += usbip_log_drain_ring(ring);
+		if (dead) {
+			*pp = ring->next;
+			free(ring);
+			continue;
+		}
+		pp = &ring->next;
+	}
+	pthread_mutex_unlock(&usbip_log_lock);
+
+	if (n)
+		usbip_log_flush_sink();
+	return n;
+}
+
+static void *usbip_log_flusher_loop(void *data)
+{
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = USBIP_LOG_FLUSH_INTERVAL * 1000000L,
+	};
+
+	(void)data;
+
+	while (!atomic_load(&usbip_log_should_stop)) {
+		if (!usbip_log_drain())
+			nanosleep(&ts, NULL);
+	}
+	usbip_log_drain();
+	return NULL;
+}
+
+/* "stdout", "syslog" or "file:PATH" */
+int usbip_log_set_sink(const char *spec)
+{
+	if (!strcmp(spec, "stdout")) {
+		usbip_log_sink = USBIP_LOG_SINK_STDOUT;
+	} else if (!strcmp(spec, "syslog")) {
+		usbip_log_sink = USBIP_LOG_SINK_SYSLOG;
+	} else if (!strncmp(spec, "file:", 5) && spec[5]) {
+		free(usbip_log_path);
+		usbip_log_path = strdup(spec + 5);
+		if (!usbip_log_path)
+			return -1;
+		usbip_log_sink = USBIP_LOG_SINK_FILE;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+int usbip_log_start(void)
+{
+	sigset_t all, orig;
+	int ret;
+
+	switch (usbip_log_sink) {
+	case USBIP_LOG_SINK_SYSLOG:
+		openlog(PACKAGE, LOG_PID, LOG_DAEMON);
+		break;
+	case USBIP_LOG_SINK_FILE:
+		usbip_log_file = fopen(usbip_log_path, "a");
+		if (!usbip_log_file) {
+			fprintf(stderr, "<E>: open log %s: %s\n",
+				usbip_log_path, strerror(errno));
+			return -1;
+		}
+		break;
+	}
+
+	/* signals are for the threads of the daemon, not the flusher */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &orig);
+	atomic_store(&usbip_log_should_stop, 0);
+	ret = pthread_create(&usbip_log_flusher, NULL,
+			     usbip_log_flusher_loop, NULL);
+	pthread_sigmask(SIG_SETMASK, &orig, NULL);
+	if (ret) {
+		fprintf(stderr, "<E>: start log flusher\n");
+		return -1;
+	}
+	atomic_store(&usbip_log_running, 1);
+	return 0;
+}
+
+void usbip_log_stop(void)
+{
+	if (!atomic_exchange(&usbip_log_running, 0))
+		return;
+
+	atomic_store(&usbip_log_should_stop, 1);
+	pthread_join(usbip_log_flusher, NULL);
+	/* catch records published while the flusher was finishing */
+	usbip_log_drain();
+
+	switch (usbip_log_sink) {
+	case USBIP_LOG_SINK_SYSLOG:
+		closelog();
+		break;
+	case USBIP_LOG_SINK_FILE:
+		fclose(usbip_log_file);
+		usbip_log_file = NULL;
+		break;
+	}
+}
@@ -0,0 +1,36 @@
+/*
+ * Daemon-wide counters
+ */
+
+#include <stdio.h>
+
+#include <usbip_metrics.h>
+#include <usbip_debug.h>
+
+/* keeps a line below the record size of usbip_log */
+#define USBIP_METRICS_LINE	128
+
+atomic_ullong usbip_metrics[USBIP_M_NUM];
+
+static const char *const usbip_metric_names[USBIP_M_NUM] = {
+#define USBIP_METRIC_NAME(name)	#name,
+	USBIP_METRICS(USBIP_METRIC_NAME)
+#undef USBIP_METRIC_NAME
+};
+
+void usbip_metrics_dump(void)
+{
+	char line[USBIP_METRICS_LINE + 64];
+	int i, len = 0;
+
+	for (i = 0; i < USBIP_M_NUM; i++) {
+		len += snprintf(line + len, sizeof(line) - len, " %s=%llu",
+				usbip_metric_names[i],
+				atomic_load_explicit(&usbip_metrics[i],
+						     memory_order_relaxed));
+		if (len >= USBIP_METRICS_LINE || i == USBIP_M_NUM - 1) {
+			info("metrics:%s", line);
+			len = 0;
+		}
+	}
+}
@@ -18,6 +18,9 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -31,6 +34,8 @@
 
 int usbip_port = 3240;
 char *usbip_port_string = "3240";
+int usbip_net_timeout = USBIP_NET_TIMEOUT_DEFAULT;
+int usbip_net_dead_peer = USBIP_NET_DEAD_PEER_DEFAULT;
 
 void usbip_setup_port_number(char *arg)
 {
@@ -59,11 +64,64 @@ void usbip_setup_port_number(char *arg)
 	info("using port %d (\"%s\")", usbip_port, usbip_port_string);
 }
 
+static int64_t usbip_net_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait until sock_fd is readable or the deadline passes. A client which
+ * trickles bytes cannot extend the deadline, it is fixed per call.
+ */
+static int usbip_net_wait_readable(int sock_fd, int64_t deadline)
+{
+	struct pollfd pfd;
+	int64_t left;
+	int ret;
+
+	pfd.fd = sock_fd;
+	pfd.events = POLLIN;
+
+	do {
+		left = deadline - usbip_net_now_ms();
+		if (left <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		ret = poll(&pfd, 1, (int)left);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return ret < 0 ? -1 : 0;
+}
+
 ssize_t usbip_net_recv(int sock_fd, void *buff, size_t bufflen) {
     size_t recvd  = 0;
+    int64_t deadline = 0;
+    int flags = MSG_WAITALL;
+
+    if (usbip_net_timeout > 0) {
+        deadline = usbip_net_now_ms() + usbip_net_timeout;
+        flags = MSG_DONTWAIT;
+    }
 
     while(recvd != bufflen) {
-        int ret = recv(sock_fd, (char *)buff + recvd, bufflen - recvd, MSG_WAITALL);
+        int ret;
+
+        if (deadline && usbip_net_wait_readable(sock_fd, deadline) < 0) {
+            dbg("recv deadline of %d ms expired on %d", usbip_net_timeout, sock_fd);
+            return -1;
+        }
+
+        ret = recv(sock_fd, (char *)buff + recvd, bufflen - recvd, flags);
+        if (ret < 0 && deadline && (errno == EAGAIN || errno == EINTR))
+            continue;
         if (ret <= 0) {
             return ret;
         }
@@ -137,6 +195,16 @@ static const char *op_common_strerror(uint32_t status)
 }
 
 int usbip_net_recv_op_common(int sock_fd, uint16_t *code)
+{
+	return usbip_net_recv_op_common_caps(sock_fd, code, NULL);
+}
+
+/*
+ * Same as usbip_net_recv_op_common(), but accepts protocol extensions in
+ * the status and returns them in caps.
+ */
+int usbip_net_recv_op_common_caps(int sock_fd, uint16_t *code,
+				  uint32_t *caps)
 {
 	struct op_common op_common;
 	int rc;
@@ -169,15 +237,20 @@ int usbip_net_recv_op_common(int sock_fd, uint16_t *code)
 		}
 	}
 
-	if (op_common.status != ST_OK) {
-		dbg("request failed at peer: %s",
-			op_common_strerror(op_common.status));
-		goto err;
-	}
+	if (caps)
+		*caps = ST_CAPS(op_common.status);
+	else if (ST_CAPS(op_common.status))
+		goto err_status;
+
+	if (ST_CODE(op_common.status) != ST_OK)
+		goto err_status;
 
 	*code = op_common.code;
 
 	return 0;
+err_status:
+	dbg("request failed at peer: %s",
+		op_common_strerror(ST_CODE(op_common.status)));
 err:
 	return -1;
 }
@@ -194,6 +267,24 @@ int usbip_net_set_reuseaddr(int sockfd)
 	return ret;
 }
 
+int usbip_net_set_reuseport(int sockfd)
+{
+#ifdef SO_REUSEPORT
+	const int val = 1;
+	int ret;
+
+	ret = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+	if (ret < 0)
+		dbg("setsockopt: SO_REUSEPORT");
+
+	return ret;
+#else
+	(void)sockfd;
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
 int usbip_net_set_nodelay(int sockfd)
 {
 	const int val = 1;
@@ -206,6 +297,17 @@ int usbip_net_set_nodelay(int sockfd)
 	return ret;
 }
 
+/* an AF_UNIX connection, no TCP options apply */
+int usbip_net_is_local(int sockfd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(sockfd, (struct sockaddr *)&ss, &len) < 0)
+		return 0;
+	return ss.ss_family == AF_UNIX;
+}
+
 int usbip_net_set_keepalive(int sockfd)
 {
 	const int val = 1;
@@ -218,6 +320,49 @@ int usbip_net_set_keepalive(int sockfd)
 	return ret;
 }
 
+/*
+ * Probe an idle connection after secs and give up on it three unanswered
+ * probes later; with data in flight, give up once it went unacknowledged
+ * for as long. Without either, a vanished peer is only noticed by the
+ * retransmission timeout, many minutes later, or never while idle.
+ */
+int usbip_net_set_dead_peer(int sockfd, int secs)
+{
+	int ret;
+
+	if (secs <= 0)
+		return 0;
+
+	ret = usbip_net_set_keepalive(sockfd);
+#ifdef TCP_KEEPIDLE
+	{
+		const int intvl = 1, cnt = 3;
+
+		if (setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &secs,
+			       sizeof(secs)) < 0 ||
+		    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl,
+			       sizeof(intvl)) < 0 ||
+		    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &cnt,
+			       sizeof(cnt)) < 0) {
+			dbg("setsockopt: TCP_KEEPIDLE");
+			ret = -1;
+		}
+	}
+#endif
+#ifdef TCP_USER_TIMEOUT
+	{
+		const unsigned int ms = (secs + 3) * 1000;
+
+		if (setsockopt(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms,
+			       sizeof(ms)) < 0) {
+			dbg("setsockopt: TCP_USER_TIMEOUT");
+			ret = -1;
+		}
+	}
+#endif
+	return ret;
+}
+
 int usbip_net_set_v6only(int sockfd)
 {
 	const int val = 1;
@@ -0,0 +1,164 @@
+/*
+ * Policies of transfers kept at IN endpoints ahead of the client
+ *
+ * The policies only say which endpoints of which devices and how deep;
+ * driver-libusb/stub_prefetch.c keeps the transfers. None is on by
+ * default, nor for a traffic class like the socket profiles, as
+ * answering from what was read before changes the timing a client sees:
+ * a device has to be named, by bus id, id or interface class.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbip_network.h"
+#include "usbip_prefetch.h"
+
+#define USBIP_PREFETCH_MAX_DEVICES	16
+#define USBIP_PREFETCH_MAX_DEPTH	64
+#define USBIP_PREFETCH_MAX_RING		1024
+#define USBIP_PREFETCH_RING		16
+#define USBIP_PREFETCH_SIZE		4096
+#define USBIP_PREFETCH_MAX_SIZE		(1 << 20)
+
+struct usbip_prefetch_conf {
+	char busid[SYSFS_BUS_ID_SIZE];	/* empty to match by id or class */
+	uint16_t vendor;
+	uint16_t product;
+	int ifclass;			/* -1 to match by id */
+	uint8_t ep;			/* 0 for all */
+	struct usbip_prefetch pf;
+};
+
+static struct usbip_prefetch_conf
+	usbip_prefetch_conf[USBIP_PREFETCH_MAX_DEVICES];
+static int usbip_prefetch_nconf;
+
+/* class:CLASS, VENDOR:PRODUCT or a bus id, which has no colon */
+static int usbip_prefetch_device(struct usbip_prefetch_conf *conf,
+				 const char *dev)
+{
+	unsigned long vendor, product, ifclass;
+	char *end;
+
+	conf->ifclass = -1;
+	if (!strncmp(dev, "class:", 6)) {
+		dev += 6;
+		errno = 0;
+		ifclass = strtoul(dev, &end, 16);
+		if (end == dev || *end || errno || ifclass > 0xff)
+			return -1;
+		conf->ifclass = ifclass;
+		return 0;
+	}
+
+	if (!strchr(dev, ':')) {
+		if (!*dev || strlen(dev) >= SYSFS_BUS_ID_SIZE)
+			return -1;
+		strcpy(conf->busid, dev);
+		return 0;
+	}
+
+	errno = 0;
+	vendor = strtoul(dev, &end, 16);
+	if (end == dev || *end != ':' || errno || vendor > 0xffff)
+		return -1;
+	dev = end + 1;
+	product = strtoul(dev, &end, 16);
+	if (end == dev || *end || errno || product > 0xffff)
+		return -1;
+	conf->vendor = vendor;
+	conf->product = product;
+	return 0;
+}
+
+int usbip_prefetch_parse(const char *spec)
+{
+	struct usbip_prefetch_conf conf;
+	char *buf, *dev, *tok, *save, *val, *end;
+	unsigned long v;
+	int ret = -1;
+
+	if (usbip_prefetch_nconf == USBIP_PREFETCH_MAX_DEVICES)
+		return -1;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.pf.ring = USBIP_PREFETCH_RING;
+	conf.pf.size = USBIP_PREFETCH_SIZE;
+
+	buf = strdup(spec);
+	if (!buf)
+		return -1;
+	dev = strtok_r(buf, ",", &save);
+	if (!dev || usbip_prefetch_device(&conf, dev))
+		goto out;
+
+	while ((tok = strtok_r(NULL, ",", &save))) {
+		val = strchr(tok, '=');
+		if (!val)
+			goto out;
+		*val++ = '\0';
+		errno = 0;
+		v = strtoul(val, &end, 0);
+		if (end == val || *end || errno)
+			goto out;
+		if (!strcmp(tok, "intr") && v && v <= USBIP_PREFETCH_MAX_DEPTH)
+			conf.pf.intr = v;
+		else if (!strcmp(tok, "bulk") && v &&
+			 v <= USBIP_PREFETCH_MAX_DEPTH)
+			conf.pf.bulk = v;
+		else if (!strcmp(tok, "size") && v &&
+			 v <= USBIP_PREFETCH_MAX_SIZE)
+			conf.pf.size = v;
+		else if (!strcmp(tok, "ring") && v &&
+			 v <= USBIP_PREFETCH_MAX_RING)
+			conf.pf.ring = v;
+		else if (!strcmp(tok, "ep") && (v & 0x80) && (v & 0x0f) &&
+			 !(v & 0x70))
+			conf.ep = v;
+		else
+			goto out;
+	}
+
+	/* a policy keeping nothing is a typo */
+	if (!conf.pf.intr && !conf.pf.bulk)
+		goto out;
+	if (conf.pf.ring < conf.pf.intr)
+		conf.pf.ring = conf.pf.intr;
+	if (conf.pf.ring < conf.pf.bulk)
+		conf.pf.ring = conf.pf.bulk;
+
+	usbip_prefetch_conf[usbip_prefetch_nconf++] = conf;
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+int usbip_prefetch_lookup(const char *busid, uint16_t vendor,
+			  uint16_t product, uint8_t ifclass, uint8_t ep,
+			  struct usbip_prefetch *pf)
+{
+	struct usbip_prefetch_conf *conf;
+	int i;
+
+	for (i = 0; i < usbip_prefetch_nconf; i++) {
+		conf = &usbip_prefetch_conf[i];
+		if (conf->busid[0]) {
+			if (strcmp(conf->busid, busid))
+				continue;
+		} else if (conf->ifclass >= 0) {
+			if (conf->ifclass != ifclass)
+				continue;
+		} else if (conf->vendor != vendor ||
+			   conf->product != product) {
+			continue;
+		}
+		if (conf->ep && conf->ep != ep)
+			continue;
+		*pf = conf->pf;
+		return 0;
+	}
+	return -1;
+}
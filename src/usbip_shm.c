@@ -0,0 +1,333 @@
+/*
+ * Shared-memory transport
+ *
+ * The memfd starts with struct usbip_shm_area, followed by the data of
+ * ring 0 (client to server) and ring 1 (server to client). Each ring is a
+ * single-producer, single-consumer byte queue with free-running head and
+ * tail counters.
+ *
+ * A reader that finds its ring empty spins for a little while, then sets
+ * waiting and blocks in recv() on the socket. A writer that published
+ * data and finds waiting set clears it and sends one byte. Both sides use
+ * sequentially consistent accesses for head and waiting, so either the
+ * reader sees the data or the writer sees the flag. A writer facing a
+ * full ring naps until the reader makes room.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "usbip_shm.h"
+#include <usbip_debug.h>
+
+#define USBIP_SHM_MAGIC		0x55534d31	/* "USM1" */
+#define USBIP_SHM_SPIN		256
+#define USBIP_SHM_NAP		20000		/* ns */
+
+struct usbip_shm_ring {
+	atomic_uint head;	/* advanced by the writer */
+	char pad0[60];
+	atomic_uint tail;	/* advanced by the reader */
+	atomic_int waiting;	/* reader sleeps in recv() */
+	char pad1[56];
+};
+
+struct usbip_shm_area {
+	uint32_t magic;
+	uint32_t size;		/* of each ring */
+	char pad[56];
+	struct usbip_shm_ring ring[2];
+};
+
+struct usbip_shm {
+	int sock_fd;
+	int mem_fd;
+	struct usbip_shm_area *area;
+	size_t map_size;
+	struct usbip_shm_ring *rx, *tx;
+	unsigned char *rx_data, *tx_data;
+	uint32_t mask;
+};
+
+static struct usbip_shm *usbip_shm_map(int sock_fd, int mem_fd, int server)
+{
+	struct usbip_shm *shm;
+	unsigned char *data;
+
+	shm = (struct usbip_shm *)calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+
+	shm->map_size = sizeof(struct usbip_shm_area) +
+			2 * (size_t)USBIP_SHM_RING_SIZE;
+	shm->area = (struct usbip_shm_area *)mmap(NULL, shm->map_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+	if (shm->area == MAP_FAILED) {
+		err("mmap shm: %s", strerror(errno));
+		free(shm);
+		return NULL;
+	}
+
+	shm->sock_fd = sock_fd;
+	shm->mem_fd = mem_fd;
+	shm->mask = USBIP_SHM_RING_SIZE - 1;
+
+	data = (unsigned char *)(shm->area + 1);
+	shm->rx = &shm->area->ring[server ? 0 : 1];
+	shm->tx = &shm->area->ring[server ? 1 : 0];
+	shm->rx_data = data + (server ? 0 : USBIP_SHM_RING_SIZE);
+	shm->tx_data = data + (server ? USBIP_SHM_RING_SIZE : 0);
+
+	return shm;
+}
+
+/* server side, the rings of a new connection */
+struct usbip_shm *usbip_shm_create(int sock_fd)
+{
+	struct usbip_shm *shm;
+	int mem_fd;
+
+	mem_fd = memfd_create("usbip", MFD_CLOEXEC);
+	if (mem_fd < 0) {
+		err("memfd_create: %s", strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(mem_fd, sizeof(struct usbip_shm_area) +
+			      2 * (off_t)USBIP_SHM_RING_SIZE) < 0) {
+		err("size shm: %s", strerror(errno));
+		close(mem_fd);
+		return NULL;
+	}
+
+	shm = usbip_shm_map(sock_fd, mem_fd, 1);
+	if (!shm) {
+		close(mem_fd);
+		return NULL;
+	}
+	shm->area->magic = USBIP_SHM_MAGIC;
+	shm->area->size = USBIP_SHM_RING_SIZE;
+
+	return shm;
+}
+
+int usbip_shm_send_fd(struct usbip_shm *shm)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char c = 'S';
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shm->mem_fd, sizeof(int));
+
+	if (sendmsg(shm->sock_fd, &msg, MSG_NOSIGNAL) != 1) {
+		err("send shm: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* client side, the rings the server passed after OP_REP_IMPORT */
+struct usbip_shm *usbip_shm_recv_fd(int sock_fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct usbip_shm *shm;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct stat st;
+	int mem_fd = -1;
+	char c;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+		err("recv shm: %s", strerror(errno));
+		return NULL;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&mem_fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	if (mem_fd < 0) {
+		err("recv shm: no descriptor");
+		return NULL;
+	}
+
+	if (fstat(mem_fd, &st) < 0 ||
+	    st.st_size != (off_t)(sizeof(struct usbip_shm_area) +
+				  2 * (off_t)USBIP_SHM_RING_SIZE)) {
+		err("recv shm: unexpected size");
+		close(mem_fd);
+		return NULL;
+	}
+
+	shm = usbip_shm_map(sock_fd, mem_fd, 0);
+	if (!shm) {
+		close(mem_fd);
+		return NULL;
+	}
+	if (shm->area->magic != USBIP_SHM_MAGIC ||
+	    shm->area->size != USBIP_SHM_RING_SIZE) {
+		err("recv shm: bad header");
+		usbip_shm_free(shm);
+		return NULL;
+	}
+	return shm;
+}
+
+void usbip_shm_free(struct usbip_shm *shm)
+{
+	if (!shm)
+		return;
+	munmap(shm->area, shm->map_size);
+	close(shm->mem_fd);
+	free(shm);
+}
+
+/* the peer closed the socket while we wait for room */
+static int usbip_shm_peer_gone(struct usbip_shm *shm)
+{
+	struct pollfd pfd = {
+		.fd = shm->sock_fd,
+		.events = POLLRDHUP,
+	};
+
+	return poll(&pfd, 1, 0) > 0 &&
+		(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+static int usbip_shm_kick(struct usbip_shm *shm)
+{
+	char c = 0;
+
+	if (!atomic_load(&shm->tx->waiting) ||
+	    !atomic_exchange(&shm->tx->waiting, 0))
+		return 0;
+	if (send(shm->sock_fd, &c, 1, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 &&
+	    errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+	return 0;
+}
+
+ssize_t usbip_shm_writev(struct usbip_shm *shm, const struct iovec *iov,
+			 int iovcnt)
+{
+	const struct timespec nap = { 0, USBIP_SHM_NAP };
+	unsigned int head, tail, room, n, off;
+	size_t total = 0;
+	int i;
+
+	head = atomic_load_explicit(&shm->tx->head, memory_order_relaxed);
+
+	for (i = 0; i < iovcnt; i++) {
+		const unsigned char *p = (const unsigned char *)iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		while (len > 0) {
+			tail = atomic_load_explicit(&shm->tx->tail,
+						    memory_order_acquire);
+			room = USBIP_SHM_RING_SIZE - (head - tail);
+			if (room == 0) {
+				/* let the reader drain what we have so far */
+				atomic_store(&shm->tx->head, head);
+				if (usbip_shm_kick(shm) < 0 ||
+				    usbip_shm_peer_gone(shm))
+					return -1;
+				nanosleep(&nap, NULL);
+				continue;
+			}
+
+			n = len < room ? len : room;
+			off = head & shm->mask;
+			if (n > USBIP_SHM_RING_SIZE - off)
+				n = USBIP_SHM_RING_SIZE - off;
+			memcpy(shm->tx_data + off, p, n);
+
+			head += n;
+			p += n;
+			len -= n;
+			total += n;
+		}
+	}
+
+	atomic_store(&shm->tx->head, head);
+	if (usbip_shm_kick(shm) < 0)
+		return -1;
+	return total;
+}
+
+ssize_t usbip_shm_read(struct usbip_shm *shm, void *buf, size_t len)
+{
+	unsigned int head, tail, n, off;
+	char doorbell[64];
+	ssize_t ret;
+	int spin = 0;
+
+	tail = atomic_load_explicit(&shm->rx->tail, memory_order_relaxed);
+
+	for (;;) {
+		head = atomic_load(&shm->rx->head);
+		if (head != tail)
+			break;
+
+		if (spin++ < USBIP_SHM_SPIN)
+			continue;
+
+		atomic_store(&shm->rx->waiting, 1);
+		head = atomic_load(&shm->rx->head);
+		if (head != tail) {
+			atomic_store(&shm->rx->waiting, 0);
+			break;
+		}
+
+		ret = recv(shm->sock_fd, doorbell, sizeof(doorbell), 0);
+		if (ret == 0)
+			return 0;
+		if (ret < 0 && errno != EINTR && errno != EAGAIN)
+			return -1;
+		spin = 0;
+	}
+
+	n = head - tail;
+	if (n > len)
+		n = len;
+	off = tail & shm->mask;
+	if (n > USBIP_SHM_RING_SIZE - off)
+		n = USBIP_SHM_RING_SIZE - off;
+	memcpy(buf, shm->rx_data + off, n);
+
+	atomic_store_explicit(&shm->rx->tail, tail + n, memory_order_release);
+	return n;
+}
@@ -0,0 +1,431 @@
+/*
+ * Socket profiles of data connections
+ *
+ * Every TCP connection gets the default profile when it is accepted. Once
+ * it carries an exported device, the profile of the traffic class of the
+ * device and then the one of its bus id are laid over the default, and
+ * the result is applied:
+ *
+ *  - sndbuf, rcvbuf: SO_SNDBUF/SO_RCVBUF in bytes. auto sizes them to
+ *    twice the bandwidth-delay product of the round trip time TCP_INFO
+ *    measured so far and rate (Mbit/s, 1000 by default). As a fixed size
+ *    turns off autotuning, auto only sets one beyond the most autotuning
+ *    gives (tcp_wmem[2], tcp_rmem[2]), within what the kernel allows
+ *    (wmem_max, rmem_max) and above what the socket has already.
+ *  - lowat: TCP_NOTSENT_LOWAT, bounds what waits unsent in the socket,
+ *    so that a fresh interrupt or iso result does not queue behind
+ *    megabytes of bulk data.
+ *  - busypoll: SO_BUSY_POLL in us, spin in the driver on receive.
+ *  - dscp, prio: the DSCP of IP_TOS/IPV6_TCLASS and SO_PRIORITY.
+ *
+ * Unless overridden, iso devices are marked EF and intr devices AF41, both
+ * with a small lowat. Buffers are left to autotuning unless given.
+ *
+ * The same profiles carry the shaping of what a device sends, which the
+ * driver applies in stub_shape.c:
+ *
+ *  - limit: Mbit/s of results a device may send, with bursts of burst
+ *    bytes, by default 10 ms worth and at least 64 KiB.
+ *  - weight: the share of a device while it competes with others for the
+ *    uplink. Once any profile has a weight, all devices are scheduled
+ *    fairly, with a weight of 1 unless given.
+ *
+ * and how long its threads spin for work before they sleep, in
+ * stub_wait.c:
+ *
+ *  - spin: us at most, USBIP_SO_SPIN_US unless given and more for iso and
+ *    intr devices, 0 to sleep right away.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include "usbip_network.h"
+#include "usbip_sockopt.h"
+#include <usbip_debug.h>
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT	25
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL		46
+#endif
+
+#define USBIP_SO_AUTO		-1
+#define USBIP_SO_BUF_MIN	(64 << 10)
+#define USBIP_SO_BUF_MAX	(32 << 20)
+#define USBIP_SO_MAX_DEVICES	32
+#define USBIP_SO_SPIN_US	50
+
+enum {
+	USBIP_SO_SNDBUF		= 1 << 0,
+	USBIP_SO_RCVBUF		= 1 << 1,
+	USBIP_SO_LOWAT		= 1 << 2,
+	USBIP_SO_BUSY_POLL	= 1 << 3,
+	USBIP_SO_DSCP		= 1 << 4,
+	USBIP_SO_PRIO		= 1 << 5,
+	USBIP_SO_RATE		= 1 << 6,
+	USBIP_SO_LIMIT		= 1 << 7,
+	USBIP_SO_BURST		= 1 << 8,
+	USBIP_SO_WEIGHT		= 1 << 9,
+	USBIP_SO_SPIN		= 1 << 10,
+};
+
+struct usbip_sockopt {
+	unsigned int set;	/* USBIP_SO_*, the fields given */
+	int sndbuf;
+	int rcvbuf;
+	int lowat;
+	int busy_poll;
+	int dscp;
+	int prio;
+	int rate;
+	int limit;
+	int burst;
+	int weight;
+	int spin;
+};
+
+static const char *const usbip_tc_names[USBIP_TC_NUM] = {
+	"default", "iso", "intr", "bulk",
+};
+
+static struct usbip_sockopt usbip_sockopt_class[USBIP_TC_NUM] = {
+	[USBIP_TC_ISO] = {
+		.set = USBIP_SO_DSCP | USBIP_SO_PRIO | USBIP_SO_LOWAT |
+		       USBIP_SO_SPIN,
+		.dscp = 46, .prio = 6, .lowat = 16 << 10, .spin = 250,
+	},
+	[USBIP_TC_INTR] = {
+		.set = USBIP_SO_DSCP | USBIP_SO_PRIO | USBIP_SO_LOWAT |
+		       USBIP_SO_SPIN,
+		.dscp = 34, .prio = 5, .lowat = 16 << 10, .spin = 250,
+	},
+};
+
+static struct {
+	char busid[SYSFS_BUS_ID_SIZE];
+	struct usbip_sockopt so;
+} usbip_sockopt_dev[USBIP_SO_MAX_DEVICES];
+static int usbip_sockopt_ndev;
+static int usbip_sockopt_weighted;
+
+static int usbip_sockopt_key(struct usbip_sockopt *so, const char *key,
+			     const char *val)
+{
+	static const struct {
+		const char *key;
+		unsigned int flag;
+		size_t off;
+	} keys[] = {
+		{"sndbuf", USBIP_SO_SNDBUF, offsetof(struct usbip_sockopt, sndbuf)},
+		{"rcvbuf", USBIP_SO_RCVBUF, offsetof(struct usbip_sockopt, rcvbuf)},
+		{"lowat", USBIP_SO_LOWAT, offsetof(struct usbip_sockopt, lowat)},
+		{"busypoll", USBIP_SO_BUSY_POLL,
+			offsetof(struct usbip_sockopt, busy_poll)},
+		{"dscp", USBIP_SO_DSCP, offsetof(struct usbip_sockopt, dscp)},
+		{"prio", USBIP_SO_PRIO, offsetof(struct usbip_sockopt, prio)},
+		{"rate", USBIP_SO_RATE, offsetof(struct usbip_sockopt, rate)},
+		{"limit", USBIP_SO_LIMIT, offsetof(struct usbip_sockopt, limit)},
+		{"burst", USBIP_SO_BURST, offsetof(struct usbip_sockopt, burst)},
+		{"weight", USBIP_SO_WEIGHT,
+			offsetof(struct usbip_sockopt, weight)},
+		{"spin", USBIP_SO_SPIN, offsetof(struct usbip_sockopt, spin)},
+	};
+	unsigned int i;
+	char *end;
+	long v;
+
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		if (strcmp(keys[i].key, key))
+			continue;
+
+		if ((keys[i].flag & (USBIP_SO_SNDBUF | USBIP_SO_RCVBUF)) &&
+		    !strcmp(val, "auto")) {
+			v = USBIP_SO_AUTO;
+		} else {
+			v = strtol(val, &end, 0);
+			if (end == val || *end || v < 0 || v > INT32_MAX ||
+			    (keys[i].flag == USBIP_SO_DSCP && v > 63) ||
+			    (keys[i].flag == USBIP_SO_WEIGHT && v == 0))
+				return -1;
+		}
+		*(int *)((char *)so + keys[i].off) = v;
+		so->set |= keys[i].flag;
+		return 0;
+	}
+	return -1;
+}
+
+static void usbip_sockopt_merge(struct usbip_sockopt *dst,
+				const struct usbip_sockopt *src)
+{
+	if (src->set & USBIP_SO_SNDBUF)
+		dst->sndbuf = src->sndbuf;
+	if (src->set & USBIP_SO_RCVBUF)
+		dst->rcvbuf = src->rcvbuf;
+	if (src->set & USBIP_SO_LOWAT)
+		dst->lowat = src->lowat;
+	if (src->set & USBIP_SO_BUSY_POLL)
+		dst->busy_poll = src->busy_poll;
+	if (src->set & USBIP_SO_DSCP)
+		dst->dscp = src->dscp;
+	if (src->set & USBIP_SO_PRIO)
+		dst->prio = src->prio;
+	if (src->set & USBIP_SO_RATE)
+		dst->rate = src->rate;
+	if (src->set & USBIP_SO_LIMIT)
+		dst->limit = src->limit;
+	if (src->set & USBIP_SO_BURST)
+		dst->burst = src->burst;
+	if (src->set & USBIP_SO_WEIGHT)
+		dst->weight = src->weight;
+	if (src->set & USBIP_SO_SPIN)
+		dst->spin = src->spin;
+	dst->set |= src->set;
+}
+
+int usbip_sockopt_parse(const char *spec)
+{
+	struct usbip_sockopt so, *dst = &usbip_sockopt_class[USBIP_TC_DEFAULT];
+	char *buf, *opts, *tok, *save, *val;
+	const char *colon = strchr(spec, ':');
+	int i, ret = 0;
+
+	memset(&so, 0, sizeof(so));
+	buf = strdup(spec);
+	if (!buf)
+		return -1;
+	opts = buf;
+
+	if (colon) {
+		buf[colon - spec] = '\0';
+		opts = buf + (colon - spec) + 1;
+
+		for (i = 0; i < USBIP_TC_NUM; i++) {
+			if (!strcmp(buf, usbip_tc_names[i]))
+				break;
+		}
+		if (i < USBIP_TC_NUM) {
+			dst = &usbip_sockopt_class[i];
+		} else {
+			for (i = 0; i < usbip_sockopt_ndev; i++) {
+				if (!strcmp(buf, usbip_sockopt_dev[i].busid))
+					break;
+			}
+			if (i == USBIP_SO_MAX_DEVICES ||
+			    strlen(buf) >= SYSFS_BUS_ID_SIZE) {
+				ret = -1;
+				goto out;
+			}
+			if (i == usbip_sockopt_ndev) {
+				strcpy(usbip_sockopt_dev[i].busid, buf);
+				usbip_sockopt_ndev++;
+			}
+			dst = &usbip_sockopt_dev[i].so;
+		}
+	}
+
+	for (tok = strtok_r(opts, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (!val) {
+			ret = -1;
+			goto out;
+		}
+		*val++ = '\0';
+		if (usbip_sockopt_key(&so, tok, val)) {
+			ret = -1;
+			goto out;
+		}
+	}
+	usbip_sockopt_merge(dst, &so);
+	if (so.set & USBIP_SO_WEIGHT)
+		usbip_sockopt_weighted = 1;
+out:
+	free(buf);
+	return ret;
+}
+
+/* twice the bandwidth-delay product measured so far, or 0 */
+static int usbip_sockopt_bdp(int sockfd, const struct usbip_sockopt *so,
+			     unsigned int *rtt)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	int rate = so->set & USBIP_SO_RATE ? so->rate : 1000;
+	uint64_t bytes;
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return 0;
+	*rtt = ti.tcpi_rtt;
+
+	/* us times Mbit/s is bits */
+	bytes = 2 * (uint64_t)ti.tcpi_rtt * rate / 8;
+	if (bytes < USBIP_SO_BUF_MIN)
+		bytes = USBIP_SO_BUF_MIN;
+	if (bytes > USBIP_SO_BUF_MAX)
+		bytes = USBIP_SO_BUF_MAX;
+	return bytes;
+}
+
+/* the last number of a file in /proc/sys, or 0 */
+static long usbip_sockopt_sysctl(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	long v, last = 0;
+
+	if (!f)
+		return 0;
+	while (fscanf(f, "%ld", &v) == 1)
+		last = v;
+	fclose(f);
+	return last;
+}
+
+static void usbip_sockopt_buf(int sockfd, int opt, const char *name,
+			      int size, int bdp)
+{
+	int snd = opt == SO_SNDBUF;
+	long tune, max;
+	int cur;
+	socklen_t len = sizeof(cur);
+
+	if (size == USBIP_SO_AUTO) {
+		tune = usbip_sockopt_sysctl(snd ?
+			"/proc/sys/net/ipv4/tcp_wmem" :
+			"/proc/sys/net/ipv4/tcp_rmem");
+		max = usbip_sockopt_sysctl(snd ?
+			"/proc/sys/net/core/wmem_max" :
+			"/proc/sys/net/core/rmem_max");
+		if (bdp <= tune || bdp > max)
+			return;
+		/* cur is what the socket has, twice what was asked for */
+		if (getsockopt(sockfd, SOL_SOCKET, opt, &cur, &len) < 0 ||
+		    cur >= bdp)
+			return;
+		size = bdp;
+	}
+	if (setsockopt(sockfd, SOL_SOCKET, opt, &size, sizeof(size)) < 0)
+		dbg("setsockopt: %s %d: %s", name, size, strerror(errno));
+}
+
+static void usbip_sockopt_dscp(int sockfd, int dscp)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	int tos = dscp << 2;
+	int ret;
+
+	if (getsockname(sockfd, (struct sockaddr *)&ss, &len) < 0)
+		return;
+	if (ss.ss_family == AF_INET6)
+		ret = setsockopt(sockfd, IPPROTO_IPV6, IPV6_TCLASS, &tos,
+				 sizeof(tos));
+	else
+		ret = setsockopt(sockfd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+	if (ret < 0)
+		dbg("setsockopt: dscp %d: %s", dscp, strerror(errno));
+}
+
+static void usbip_sockopt_apply(int sockfd, const struct usbip_sockopt *so,
+				const char *what)
+{
+	unsigned int rtt = 0;
+	int bdp = 0;
+
+	if (((so->set & USBIP_SO_SNDBUF) && so->sndbuf == USBIP_SO_AUTO) ||
+	    ((so->set & USBIP_SO_RCVBUF) && so->rcvbuf == USBIP_SO_AUTO))
+		bdp = usbip_sockopt_bdp(sockfd, so, &rtt);
+
+	if (so->set & USBIP_SO_SNDBUF)
+		usbip_sockopt_buf(sockfd, SO_SNDBUF, "SO_SNDBUF",
+				  so->sndbuf, bdp);
+	if (so->set & USBIP_SO_RCVBUF)
+		usbip_sockopt_buf(sockfd, SO_RCVBUF, "SO_RCVBUF",
+				  so->rcvbuf, bdp);
+
+	if ((so->set & USBIP_SO_LOWAT) &&
+	    setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &so->lowat,
+		       sizeof(so->lowat)) < 0)
+		dbg("setsockopt: TCP_NOTSENT_LOWAT: %s", strerror(errno));
+
+	if ((so->set & USBIP_SO_BUSY_POLL) &&
+	    setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &so->busy_poll,
+		       sizeof(so->busy_poll)) < 0)
+		dbg("setsockopt: SO_BUSY_POLL: %s", strerror(errno));
+
+	if (so->set & USBIP_SO_DSCP)
+		usbip_sockopt_dscp(sockfd, so->dscp);
+
+	if ((so->set & USBIP_SO_PRIO) &&
+	    setsockopt(sockfd, SOL_SOCKET, SO_PRIORITY, &so->prio,
+		       sizeof(so->prio)) < 0)
+		dbg("setsockopt: SO_PRIORITY: %s", strerror(errno));
+
+	dbg("socket profile %s on %d: rtt %u us, bdp buffer %d", what,
+	    sockfd, rtt, bdp);
+}
+
+void usbip_sockopt_accept(int sockfd)
+{
+	usbip_sockopt_apply(sockfd, &usbip_sockopt_class[USBIP_TC_DEFAULT],
+			    usbip_tc_names[USBIP_TC_DEFAULT]);
+}
+
+static void usbip_sockopt_get(struct usbip_sockopt *so, const char *busid,
+			      enum usbip_traffic_class tc)
+{
+	int i;
+
+	*so = usbip_sockopt_class[USBIP_TC_DEFAULT];
+	usbip_sockopt_merge(so, &usbip_sockopt_class[tc]);
+	for (i = 0; i < usbip_sockopt_ndev; i++) {
+		if (!strcmp(usbip_sockopt_dev[i].busid, busid))
+			usbip_sockopt_merge(so, &usbip_sockopt_dev[i].so);
+	}
+}
+
+void usbip_sockopt_export(int sockfd, const char *busid,
+			  enum usbip_traffic_class tc)
+{
+	struct usbip_sockopt so;
+
+	if (usbip_net_is_local(sockfd))
+		return;
+
+	usbip_sockopt_get(&so, busid, tc);
+	usbip_sockopt_apply(sockfd, &so, usbip_tc_names[tc]);
+}
+
+void usbip_sockopt_shaping(const char *busid, enum usbip_traffic_class tc,
+			   struct usbip_shaping *shaping)
+{
+	struct usbip_sockopt so;
+
+	usbip_sockopt_get(&so, busid, tc);
+	memset(shaping, 0, sizeof(*shaping));
+	if (so.set & USBIP_SO_LIMIT)
+		shaping->limit = so.limit;
+	if (so.set & USBIP_SO_BURST)
+		shaping->burst = so.burst;
+	if (usbip_sockopt_weighted)
+		shaping->weight = so.set & USBIP_SO_WEIGHT ? so.weight : 1;
+}
+
+unsigned int usbip_sockopt_spin(const char *busid, enum usbip_traffic_class tc)
+{
+	struct usbip_sockopt so;
+
+	usbip_sockopt_get(&so, busid, tc);
+	return so.set & USBIP_SO_SPIN ? so.spin : USBIP_SO_SPIN_US;
+}
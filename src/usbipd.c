@@ -25,11 +25,13 @@
 #define _GNU_SOURCE // Reqired for ppoll(..)
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include <getopt.h>
 #include <signal.h>
@@ -45,11 +47,16 @@
 #include <pthread.h>
 #include <usbip_host_driver.h>
 #include <usbip_debug.h>
+#include <usbip_trace.h>
 #include <stdlib.h>
 
 #endif
 
 #include "usbip_network.h"
+#include "usbip_sockopt.h"
+#include "usbip_capture.h"
+#include "usbip_prefetch.h"
+#include "usbip_metrics.h"
 #include "usbipd_requests.h"
 #include "list.h"
 #include "names.h"
@@ -58,6 +65,9 @@
 
 #define MAIN_LOOP_TIMEOUT 10
 
+/* upper bound for --workers, the default is one per online CPU */
+#define MAX_WORKERS 64
+
 static const char usbipd_help_string[] =
         "usage: " PACKAGE " [options]\n"
         "\n"
@@ -83,6 +93,14 @@ static const char usbipd_help_string[] =
         "       -fHEX, --debug-flags HEX\n"
         "               Print flags for driver-libusb debugging.\n"
         "\n"
+        "	-xBYTES, --dump-limit BYTES\n"
+        "		Dump at most BYTES of each buffer when tracing\n"
+        "		transmissions (-f 1). 0 dumps all. Default is 64.\n"
+        "\n"
+        "	-LSINK, --log SINK\n"
+        "		Write messages to SINK: stdout, syslog or\n"
+        "		file:PATH. Default is stdout.\n"
+        "\n"
         "	-PFILE, --pid FILE\n"
         "		Write process id to FILE.\n"
         "		If no FILE specified, use " DEFAULT_PID_FILE ".\n"
@@ -90,11 +108,61 @@ static const char usbipd_help_string[] =
         "	-tPORT, --tcp-port PORT\n"
         "		Listen on TCP/IP port PORT.\n"
         "\n"
+        "	-uPATH, --unix PATH\n"
+        "		Also listen on the AF_UNIX socket PATH, for\n"
+        "		clients on this host. These may ask for a\n"
+        "		shared-memory transport instead of the socket.\n"
+        "\n"
+        "	-wNUM, --workers NUM\n"
+        "		Serve requests with NUM control-plane workers.\n"
+        "		Default is one per online CPU.\n"
+        "\n"
+        "	-lSEC, --linger SEC\n"
+        "		Keep a released device open and claimed for SEC\n"
+        "		seconds, so that a re-import skips re-claiming it.\n"
+        "\n"
+        "	-TMSEC, --timeout MSEC\n"
+        "		Drop clients which take longer than MSEC to send\n"
+        "		a request. 0 waits forever. Default is 5000.\n"
+        "\n"
+        "	-KSEC, --dead-peer SEC\n"
+        "		Drop a connection and release its device once\n"
+        "		the client was unreachable for about SEC\n"
+        "		seconds. 0 never drops it. Default is 5.\n"
+        "\n"
+        "	-oSPEC, --sockopt SPEC\n"
+        "		Tune the sockets of connections, as\n"
+        "		[TARGET:]KEY=VALUE[,...]. TARGET is iso, intr,\n"
+        "		bulk or a bus id, KEY one of sndbuf, rcvbuf\n"
+        "		(bytes or auto), lowat, busypoll, dscp, prio\n"
+        "		and rate (Mbit/s). limit (Mbit/s), burst and\n"
+        "		weight shape what devices send, spin (us)\n"
+        "		bounds how long their threads spin for work.\n"
+        "		May be given repeatedly.\n"
+        "\n"
+        "	-cSPEC, --capture SPEC\n"
+        "		Append the transfers of a device to a pcap file\n"
+        "		of usbmon events, as BUSID=FILE[,snaplen=BYTES]\n"
+        "		[,ring=KIB]. Defaults are 65536 and 4096. May\n"
+        "		be given for several devices.\n"
+        "\n"
+        "	-pSPEC, --prefetch SPEC\n"
+        "		Keep transfers queued at the IN endpoints of a\n"
+        "		device and answer requests from what completed,\n"
+        "		as DEVICE,KEY=VALUE[,...]. DEVICE is a bus id,\n"
+        "		VENDOR:PRODUCT or class:CLASS of an interface,\n"
+        "		KEY one of intr and bulk (transfers at interrupt\n"
+        "		and bulk endpoints), size (bytes of a bulk one,\n"
+        "		4096), ring (completed ones held, 16) and ep.\n"
+        "		May be given for several devices.\n"
+        "\n"
         "	-h, --help\n"
         "		Print this help.\n"
         "\n"
         "	-v, --version\n"
-        "		Show version.\n";
+        "		Show version.\n"
+        "\n"
+        "	SIGUSR1 prints the metrics of the daemon.\n";
 
 static void usbipd_help(void) {
     printf(usbipd_help_string);
@@ -102,20 +170,22 @@ static void usbipd_help(void) {
 
 int usbipd_recv_pdu(int sock_fd, const char *host, const char *port) {
     uint16_t code = OP_UNSPEC;
+    uint32_t caps = 0;
     int ret;
     struct usbipd_recv_pdu_op *op;
 
-    ret = usbip_net_recv_op_common(sock_fd, &code);
+    ret = usbip_net_recv_op_common_caps(sock_fd, &code, &caps);
     if (ret < 0) {
         dbg("could not receive opcode: %#0x", code);
         return -1;
     }
 
     info("received request: %#0x(%d)", code, sock_fd);
+    USBIP_PROBE3(conn_open, sock_fd, code, caps);
     for (op = usbipd_recv_pdu_ops; op->code != OP_UNSPEC; op++) {
         if (op->code == code) {
             if (op->proc)
-                ret = (*(op->proc))(sock_fd, host, port);
+                ret = (*(op->proc))(sock_fd, host, port, caps);
             else {
                 err("received an unsupported opcode: %#0x",
                     code);
@@ -129,10 +199,11 @@ int usbipd_recv_pdu(int sock_fd, const char *host, const char *port) {
         ret = -1;
     }
 
-    if (ret == 0)
+    if (ret >= 0)
         info("request %#0x(%d): complete", code, sock_fd);
     else
         info("request %#0x(%d): failed", code, sock_fd);
+    USBIP_PROBE3(conn_close, sock_fd, code, ret);
 
     return ret;
 }
@@ -148,10 +219,20 @@ static int do_accept(int listenfd, char *host, int host_len,
 
     connfd = accept(listenfd, (struct sockaddr *) &ss, &len);
     if (connfd < 0) {
+        /* another worker sharing this socket took the connection */
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
         err("failed to accept connection");
         return -1;
     }
 
+    if (ss.ss_family == AF_UNIX) {
+        snprintf(host, host_len, "local");
+        snprintf(port, port_len, "%d", connfd);
+        info("connection from %s:%s", host, port);
+        return connfd;
+    }
+
     rc = getnameinfo((struct sockaddr *) &ss, len, host, host_len,
                      port, port_len, NI_NUMERICHOST | NI_NUMERICSERV);
     if (rc)
@@ -161,44 +242,87 @@ static int do_accept(int listenfd, char *host, int host_len,
 
     /* should set TCP_NODELAY for usbip */
     usbip_net_set_nodelay(connfd);
+    usbip_net_set_dead_peer(connfd, usbip_net_dead_peer);
+    usbip_sockopt_accept(connfd);
 
     return connfd;
 }
 
 #ifdef USBIP_OS_NO_FORK
-struct request_data {
-    int connfd;
-    char host[NI_MAXHOST], port[NI_MAXSERV];
+/*
+ * Control-plane requests are served by a fixed pool of workers. Each worker
+ * owns its listening sockets; with SO_REUSEPORT the kernel spreads incoming
+ * connections across the workers, so there is no shared accept queue and no
+ * thread is created per connection. Imported devices are handed over to a
+ * session thread of their own (see usbipd_requests.c).
+ */
+struct usbipd_worker {
+    pthread_t thread;
+    int id;
+    int nsockfd;
+    int sockfdlist[MAXSOCKFD];
 };
 
-static void *__process_request(void *arg) {
-    struct request_data *data = (struct request_data *) arg;
-
-    usbipd_recv_pdu(data->connfd, data->host, data->port);
-    close(data->connfd);
-    free(data);
-    pthread_exit(NULL);
-}
+static int usbipd_nworkers;
+static int usbipd_reuseport;
+static int usbipd_stop_fds[2] = {-1, -1};
+static const char *usbipd_unix_path;
+static int usbipd_unix_fd = -1;
 
-int process_request(int listenfd) {
-    pthread_t thread;
-    struct request_data *data;
+static int process_request(int listenfd) {
+    int connfd, ret;
+    char host[NI_MAXHOST], port[NI_MAXSERV];
 
-    data = (struct request_data *) calloc(1, sizeof(struct request_data));
-    if (!data)
+    connfd = do_accept(listenfd, host, sizeof(host), port, sizeof(port));
+    if (connfd < 0)
         return -1;
 
-    data->connfd = do_accept(listenfd, data->host, sizeof(data->host),
-                             data->port, sizeof(data->port));
-    if (data->connfd < 0) {
-        free(data);
-        return -1;
+    ret = usbipd_recv_pdu(connfd, host, port);
+    if (ret != USBIPD_REQ_DETACHED)
+        close(connfd);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static void *usbipd_worker_loop(void *arg) {
+    struct usbipd_worker *worker = (struct usbipd_worker *) arg;
+    struct pollfd fds[MAXSOCKFD + 1];
+    int i, r;
+
+    for (i = 0; i < worker->nsockfd; i++) {
+        fds[i].fd = worker->sockfdlist[i];
+        fds[i].events = POLLIN;
     }
-    if (pthread_create(&thread, NULL, __process_request, data)) {
-        free(data);
-        return -1;
+    /* readable once the main thread asks us to stop */
+    fds[worker->nsockfd].fd = usbipd_stop_fds[0];
+    fds[worker->nsockfd].events = POLLIN;
+
+    for (;;) {
+        r = poll(fds, worker->nsockfd + 1, MAIN_LOOP_TIMEOUT * 1000);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            err("worker %d: poll: %s", worker->id, strerror(errno));
+            break;
+        }
+        if (r == 0) {
+            dbg("worker %d: heartbeat timeout on poll()", worker->id);
+            continue;
+        }
+        if (fds[worker->nsockfd].revents)
+            break;
+
+        for (i = 0; i < worker->nsockfd; i++) {
+            if (fds[i].revents & POLLIN) {
+                dbg("worker %d: read event on fd[%d]=%d",
+                    worker->id, i, worker->sockfdlist[i]);
+                process_request(worker->sockfdlist[i]);
+            }
+        }
     }
-    return 0;
+
+    dbg("worker %d: exit", worker->id);
+    return NULL;
 }
 
 #else
@@ -261,6 +385,8 @@ static int listen_all_addrinfo(struct addrinfo *ai_head, int sockfdlist[],
         }
 
         usbip_net_set_reuseaddr(sock);
+        if (usbipd_reuseport && usbip_net_set_reuseport(sock) < 0)
+            usbipd_reuseport = 0;
         usbip_net_set_nodelay(sock);
         /* We use seperate sockets for IPv4 and IPv6
          * (see do_standalone_mode()) */
@@ -276,6 +402,9 @@ static int listen_all_addrinfo(struct addrinfo *ai_head, int sockfdlist[],
             continue;
         }
 
+        /* workers may share listeners, never block in accept() */
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
         ret = listen(sock, SOMAXCONN);
         if (ret < 0) {
             err("listen: %s: %d (%s)",
@@ -291,6 +420,46 @@ static int listen_all_addrinfo(struct addrinfo *ai_head, int sockfdlist[],
     return nsockfd;
 }
 
+/* one AF_UNIX listener, shared by all workers */
+static int listen_unix(const char *path) {
+    struct sockaddr_un sun;
+    int sock;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        err("unix socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        err("socket: %s: %d (%s)", path, errno, strerror(errno));
+        return -1;
+    }
+
+    /* a stale socket of a previous run */
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+        err("bind: %s: %d (%s)", path, errno, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    if (listen(sock, SOMAXCONN) < 0) {
+        err("listen: %s: %d (%s)", path, errno, strerror(errno));
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+
+    info("listening on %s", path);
+    return sock;
+}
+
 static struct addrinfo *do_getaddrinfo(const char *host, int ai_family) {
     struct addrinfo hints, *ai_head;
     int rc;
@@ -352,13 +521,108 @@ static void remove_pid_file(void) {
     }
 }
 
-static int do_standalone_mode(int daemonize, int ipv4, int ipv6) {
+/* the AF_UNIX listener is shared by all workers and closed apart */
+static void close_listeners(struct usbipd_worker *worker) {
+    int i;
+
+    for (i = 0; i < worker->nsockfd; i++) {
+        if (worker->sockfdlist[i] != usbipd_unix_fd)
+            close(worker->sockfdlist[i]);
+    }
+    worker->nsockfd = 0;
+}
+
+static int start_workers(struct usbipd_worker *workers, int family) {
     struct addrinfo *ai_head;
-    int sockfdlist[MAXSOCKFD];
-    int nsockfd, family;
-    int i, terminate;
-    struct pollfd *fds;
+    int i, nsockfd = 0;
+
+    ai_head = do_getaddrinfo(NULL, family);
+    if (!ai_head)
+        return -1;
+
+    if (usbipd_unix_path) {
+        usbipd_unix_fd = listen_unix(usbipd_unix_path);
+        if (usbipd_unix_fd < 0) {
+            freeaddrinfo(ai_head);
+            return -1;
+        }
+    }
+
+    usbipd_reuseport = 1;
+    for (i = 0; i < usbipd_nworkers; i++) {
+        struct usbipd_worker *worker = workers + i;
+
+        worker->id = i;
+        if (i == 0 || usbipd_reuseport) {
+            worker->nsockfd = listen_all_addrinfo(ai_head,
+                                    worker->sockfdlist, MAXSOCKFD);
+        } else {
+            /* no SO_REUSEPORT, all workers accept on the same sockets */
+            worker->nsockfd = workers[0].nsockfd;
+            memcpy(worker->sockfdlist, workers[0].sockfdlist,
+                   sizeof(worker->sockfdlist));
+        }
+        if (worker->nsockfd <= 0) {
+            err("failed to open a listening socket");
+            break;
+        }
+        if (usbipd_unix_fd >= 0 && (i == 0 || usbipd_reuseport) &&
+            worker->nsockfd < MAXSOCKFD)
+            worker->sockfdlist[worker->nsockfd++] = usbipd_unix_fd;
+        nsockfd += worker->nsockfd;
+
+        if (pthread_create(&worker->thread, NULL, usbipd_worker_loop,
+                           worker)) {
+            err("failed to start worker %d", i);
+            /*
+             * The kernel would keep handing its SO_REUSEPORT listeners
+             * a share of the connections, with nobody to accept them.
+             */
+            nsockfd -= worker->nsockfd;
+            if (i == 0 || usbipd_reuseport)
+                close_listeners(worker);
+            break;
+        }
+    }
+    freeaddrinfo(ai_head);
+
+    if (i == 0) {
+        if (usbipd_unix_fd >= 0) {
+            close(usbipd_unix_fd);
+            unlink(usbipd_unix_path);
+            usbipd_unix_fd = -1;
+        }
+        return -1;
+    }
+
+    info("%d worker%s serving %d listener%s", i, (i == 1) ? "" : "s",
+         nsockfd, (nsockfd == 1) ? "" : "s");
+    return i;
+}
+
+static void stop_workers(struct usbipd_worker *workers, int nworkers) {
+    int i;
+    char c = 0;
+
+    if (write(usbipd_stop_fds[1], &c, 1) < 0)
+        err("failed to stop workers: %s", strerror(errno));
 
+    for (i = 0; i < nworkers; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for (i = 0; i < (usbipd_reuseport ? nworkers : 1); i++)
+        close_listeners(workers + i);
+
+    if (usbipd_unix_fd >= 0) {
+        close(usbipd_unix_fd);
+        unlink(usbipd_unix_path);
+        usbipd_unix_fd = -1;
+    }
+}
+
+static int do_standalone_mode(int daemonize, int ipv4, int ipv6) {
+    struct usbipd_worker *workers;
+    int nworkers, family, sig;
     sigset_t sigmask;
     sigset_t origmask;
 
@@ -378,6 +642,9 @@ static int do_standalone_mode(int daemonize, int ipv4, int ipv6) {
     set_signal();
     write_pid_file();
 
+    if (usbip_log_start())
+        err("falling back to synchronous logging");
+
     info("starting %s (%s)", PACKAGE, PACKAGE_STRING);
 
     /*
@@ -392,63 +659,66 @@ static int do_standalone_mode(int daemonize, int ipv4, int ipv6) {
     else
         family = AF_INET6;
 
-    ai_head = do_getaddrinfo(NULL, family);
-    if (!ai_head)
-        goto err_socket_stop;
+    if (usbipd_nworkers <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
-    nsockfd = listen_all_addrinfo(ai_head, sockfdlist,
-                                  sizeof(sockfdlist) / sizeof(*sockfdlist));
-    freeaddrinfo(ai_head);
-    if (nsockfd <= 0) {
-        err("failed to open a listening socket");
-        goto err_socket_stop;
+        usbipd_nworkers = ncpu > 0 ? (int) ncpu : 1;
     }
-
-    dbg("listening on %d address%s", nsockfd, (nsockfd == 1) ? "" : "es");
-
-    fds = (struct pollfd *) calloc(nsockfd, sizeof(struct pollfd));
-    for (i = 0; i < nsockfd; i++) {
-        fds[i].fd = sockfdlist[i];
-        fds[i].events = POLLIN;
+    if (usbipd_nworkers > MAX_WORKERS)
+        usbipd_nworkers = MAX_WORKERS;
+
+    workers = (struct usbipd_worker *) calloc(usbipd_nworkers,
+                                              sizeof(*workers));
+    if (!workers || pipe(usbipd_stop_fds) < 0) {
+        err("failed to set up workers");
+        free(workers);
+        goto err_driver_close;
     }
 
-    sigfillset(&sigmask);
-    sigdelset(&sigmask, SIGTERM);
-    sigdelset(&sigmask, SIGINT);
-
-    terminate = 0;
-    while (!terminate) {
-        int r;
-
-        pthread_sigmask(SIG_SETMASK, &sigmask, &origmask);
-        r = poll(fds, nsockfd, MAIN_LOOP_TIMEOUT * 1000);
+    /*
+     * Termination signals and SIGUSR1 are only taken by this thread, all
+     * workers and the sessions they spawn inherit the blocked mask.
+     */
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGTERM);
+    sigaddset(&sigmask, SIGINT);
+    sigaddset(&sigmask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigmask, &origmask);
+
+    nworkers = start_workers(workers, family);
+    if (nworkers <= 0) {
         pthread_sigmask(SIG_SETMASK, &origmask, NULL);
+        goto err_socket_stop;
+    }
 
-        if (r < 0) {
-            dbg("%s", strerror(errno));
-            terminate = 1;
-        } else if (r) {
-            for (i = 0; i < nsockfd; i++) {
-                if (fds[i].revents & POLLIN) {
-                    dbg("read event on fd[%d]=%d",
-                        i, sockfdlist[i]);
-                    process_request(sockfdlist[i]);
-                }
-            }
-        } else {
-            dbg("heartbeat timeout on ppoll()");
-        }
+    while (sigwait(&sigmask, &sig) == 0) {
+        dbg("received '%s' signal", strsignal(sig));
+        if (sig == SIGUSR1)
+            usbip_metrics_dump();
+        if (sig == SIGTERM || sig == SIGINT)
+            break;
     }
 
     info("shutting down %s", PACKAGE);
-    free(fds);
+    stop_workers(workers, nworkers);
+    usbipd_sessions_stop();
+    usbip_metrics_dump();
+    pthread_sigmask(SIG_SETMASK, &origmask, NULL);
+    close(usbipd_stop_fds[0]);
+    close(usbipd_stop_fds[1]);
+    free(workers);
     usbip_driver_close();
+    usbip_log_stop();
 
     return 0;
 
     err_socket_stop:
+    close(usbipd_stop_fds[0]);
+    close(usbipd_stop_fds[1]);
+    free(workers);
     err_driver_close:
     usbip_driver_close();
+    usbip_log_stop();
     err_out:
     return -1;
 }
@@ -460,11 +730,21 @@ int main(int argc, char *argv[]) {
             {"daemon", no_argument, NULL, 'D'},
             {"debug", no_argument, NULL, 'd'},
             {"debug-flags", required_argument, NULL, 'f'},
+            {"dump-limit", required_argument, NULL, 'x'},
 #ifndef USBIP_DAEMON_APP
             {"device", no_argument, NULL, 'e'},
 #endif
+            {"log", required_argument, NULL, 'L'},
             {"pid", optional_argument, NULL, 'P'},
             {"tcp-port", required_argument, NULL, 't'},
+            {"unix", required_argument, NULL, 'u'},
+            {"workers", required_argument, NULL, 'w'},
+            {"linger", required_argument, NULL, 'l'},
+            {"timeout", required_argument, NULL, 'T'},
+            {"dead-peer", required_argument, NULL, 'K'},
+            {"sockopt", required_argument, NULL, 'o'},
+            {"capture", required_argument, NULL, 'c'},
+            {"prefetch", required_argument, NULL, 'p'},
             {"help", no_argument, NULL, 'h'},
             {"version", no_argument, NULL, 'v'},
             {NULL, 0, NULL, 0}
@@ -486,11 +766,11 @@ int main(int argc, char *argv[]) {
 
     for (;;) {
         opt = getopt_long(argc, argv, "46Dd"
-                                      "f:"
+                                      "f:x:"
                                       #ifndef USBIP_DAEMON_APP
                                       "e"
                                       #endif
-                                      "P::t:hv", longopts, NULL);
+                                      "L:P::t:u:w:l:T:K:o:c:p:hv", longopts, NULL);
 
         if (opt == -1)
             break;
@@ -511,15 +791,57 @@ int main(int argc, char *argv[]) {
             case 'f':
                 usbip_stub_debug_flags = strtoul(optarg, NULL, 0);
                 break;
+            case 'x':
+                usbip_dump_limit = atoi(optarg);
+                break;
             case 'h':
                 cmd = cmd_help;
                 break;
+            case 'L':
+                if (usbip_log_set_sink(optarg)) {
+                    err("invalid log sink %s", optarg);
+                    goto err_out;
+                }
+                break;
             case 'P':
                 pid_file = optarg ? optarg : DEFAULT_PID_FILE;
                 break;
             case 't':
                 usbip_setup_port_number(optarg);
                 break;
+            case 'u':
+                usbipd_unix_path = optarg;
+                break;
+            case 'w':
+                usbipd_nworkers = atoi(optarg);
+                break;
+            case 'l':
+                usbip_claim_linger = atoi(optarg);
+                break;
+            case 'T':
+                usbip_net_timeout = atoi(optarg);
+                break;
+            case 'K':
+                usbip_net_dead_peer = atoi(optarg);
+                break;
+            case 'o':
+                if (usbip_sockopt_parse(optarg)) {
+                    err("invalid socket profile %s", optarg);
+                    goto err_out;
+                }
+                break;
+            case 'c':
+                if (usbip_capture_parse(optarg)) {
+                    err("invalid capture %s", optarg);
+                    goto err_out;
+                }
+                break;
+            case 'p':
+                if (usbip_prefetch_parse(optarg)) {
+                    err("invalid prefetch %s", optarg);
+                    goto err_out;
+                }
+                break;
             case 'v':
                 cmd = cmd_version;
                 break;
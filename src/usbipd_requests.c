@@ -18,6 +18,11 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 
@@ -30,10 +35,99 @@
 #include "usbipd_requests.h"
 
 
+/*
+ * An imported device keeps its connection for as long as the client uses
+ * it. It runs in a thread of its own so that control-plane workers are
+ * only ever busy for the duration of a single request.
+ */
+struct usbipd_session {
+	struct list_head list;
+	struct usbip_exported_devices edevs;
+	struct usbip_exported_device *edev;
+	int sock_fd;
+};
+
+/* seconds to wait at shutdown for sessions to release their devices */
+#define USBIPD_SESSION_STOP_SEC	5
+
+static LIST_HEAD(usbipd_sessions);
+static pthread_mutex_t usbipd_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t usbipd_sessions_done = PTHREAD_COND_INITIALIZER;
+
+static void *usbipd_session_loop(void *arg)
+{
+	struct usbipd_session *session = (struct usbipd_session *)arg;
+
+	if (usbip_try_transfer(session->edev, session->sock_fd) < 0)
+		err("try transfer");
+
+	dbg("session on %d finished", session->sock_fd);
+	usbip_free_device_list(&session->edevs);
+
+	pthread_mutex_lock(&usbipd_sessions_lock);
+	list_del(&session->list);
+	close(session->sock_fd);
+	pthread_cond_signal(&usbipd_sessions_done);
+	pthread_mutex_unlock(&usbipd_sessions_lock);
+
+	free(session);
+	return NULL;
+}
+
+static int usbipd_session_start(struct usbipd_session *session)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	pthread_mutex_lock(&usbipd_sessions_lock);
+	list_add(&session->list, &usbipd_sessions);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, usbipd_session_loop, session);
+	pthread_attr_destroy(&attr);
+	if (rc)
+		list_del(&session->list);
+	pthread_mutex_unlock(&usbipd_sessions_lock);
+
+	return rc ? -1 : 0;
+}
+
+/*
+ * Hang up the connections of all sessions and wait until they released
+ * their devices, which they must have before the driver closes. Workers
+ * are to be stopped already, so that no session starts meanwhile.
+ */
+void usbipd_sessions_stop(void)
+{
+	struct list_head *pos;
+	struct usbipd_session *session;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&usbipd_sessions_lock);
+	list_for_each(pos, &usbipd_sessions) {
+		session = list_entry(pos, struct usbipd_session, list);
+		shutdown(session->sock_fd, SHUT_RDWR);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += USBIPD_SESSION_STOP_SEC;
+	while (usbipd_sessions.next != &usbipd_sessions) {
+		if (pthread_cond_timedwait(&usbipd_sessions_done,
+					   &usbipd_sessions_lock, &deadline)) {
+			err("sessions still running at shutdown");
+			break;
+		}
+	}
+	pthread_mutex_unlock(&usbipd_sessions_lock);
+}
+
 static int recv_request_attach(int sock_fd,
-                               const char *host, const char *port)
+                               const char *host, const char *port,
+                               uint32_t caps)
 {
-	struct usbip_exported_devices edevs;
+	struct usbipd_session *session;
+	struct usbip_exported_devices *edevs;
 	struct usbip_exported_device *edev;
 	struct op_import_request req;
 	struct usbip_usb_device pdu_udev;
@@ -44,10 +138,17 @@ static int recv_request_attach(int sock_fd,
 	(void)host;
 	(void)port;
 
-	rc = usbip_refresh_device_list(&edevs);
+	session = (struct usbipd_session *)calloc(1, sizeof(*session));
+	if (!session) {
+		err("alloc session");
+		goto err_out;
+	}
+	edevs = &session->edevs;
+
+	rc = usbip_refresh_device_list(edevs);
 	if (rc < 0) {
 		dbg("could not refresh device list: %d", rc);
-		goto err_out;
+		goto err_free_session;
 	}
 
 	memset(&req, 0, sizeof(req));
@@ -59,15 +160,22 @@ static int recv_request_attach(int sock_fd,
 	}
 	PACK_OP_IMPORT_REQUEST(0, &req);
 
-	edev = usbip_get_device(&edevs, req.busid);
+	edev = usbip_get_device(edevs, req.busid);
 	if (edev) {
 		info("found requested device: %s", req.busid);
 		found = 1;
 	}
 
+	caps &= USBIP_CAPS_SUPPORTED;
+	if (!usbip_net_is_local(sock_fd))
+		caps &= ~USBIP_CAP_SHM;
+	/* the rings belong to a single device */
+	if (caps & USBIP_CAP_SHM)
+		caps &= ~USBIP_CAP_MUX;
+
 	if (found) {
 		/* export device needs a TCP/IP socket descriptor */
-		rc = usbip_export_device(edev, sock_fd);
+		rc = usbip_export_device(edev, sock_fd, caps);
 		if (rc < 0)
 			error = 1;
 	} else {
@@ -75,7 +183,8 @@ static int recv_request_attach(int sock_fd,
 		error = 1;
 	}
 
-	rc = usbip_net_send_op_common(sock_fd, OP_REP_IMPORT, (!error ? ST_OK : ST_NA));
+	rc = usbip_net_send_op_common(sock_fd, OP_REP_IMPORT,
+			(!error ? ST_OK | (caps << USBIP_CAP_SHIFT) : ST_NA));
 	if (rc < 0) {
 		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_IMPORT);
 		goto err_free_edevs;
@@ -95,25 +204,27 @@ static int recv_request_attach(int sock_fd,
 		goto err_free_edevs;
 	}
 
-	dbg("import request busid %s: complete", req.busid);
+	dbg("import request busid %s: complete, caps %#x", req.busid, caps);
 
-	rc = usbip_try_transfer(edev, sock_fd);
-	if (rc < 0) {
-		err("try transfer");
+	session->edev = edev;
+	session->sock_fd = sock_fd;
+	if (usbipd_session_start(session)) {
+		err("start session thread");
 		goto err_free_edevs;
 	}
 
-	usbip_free_device_list(&edevs);
-
-	return 0;
+	return USBIPD_REQ_DETACHED;
 err_free_edevs:
-	usbip_free_device_list(&edevs);
+	usbip_free_device_list(edevs);
+err_free_session:
+	free(session);
 err_out:
 	return -1;
 }
 
 static int recv_request_devlist(int sock_fd,
-                                const char *host, const char *port)
+                                const char *host, const char *port,
+                                uint32_t caps)
 {
 	struct usbip_exported_devices edevs;
 	struct usbip_exported_device *edev;
@@ -123,6 +234,10 @@ static int recv_request_devlist(int sock_fd,
 	struct list_head *j;
 	int rc, i;
 
+	(void)host;
+	(void)port;
+	(void)caps;
+
 	rc = usbip_refresh_device_list(&edevs);
 	if (rc < 0) {
 		dbg("could not refresh device list: %d", rc);
@@ -21,11 +21,22 @@
 #define __USBIPD_H
 
 
+/*
+ * Returned by a request handler which has handed the connection over to a
+ * thread of its own; the caller must not close the socket then.
+ */
+#define USBIPD_REQ_DETACHED	1
+
 struct usbipd_recv_pdu_op {
 	uint16_t code;
-	int (*proc)(int sock_fd, const char *host, const char *port);
+	/* caps are the protocol extensions asked for, USBIP_CAP_* */
+	int (*proc)(int sock_fd, const char *host, const char *port,
+		    uint32_t caps);
 };
 
 extern struct usbipd_recv_pdu_op usbipd_recv_pdu_ops[];
 
+/* end all sessions, before the driver closes */
+void usbipd_sessions_stop(void);
+
 #endif /* __USBIPD_H */
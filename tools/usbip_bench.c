@@ -0,0 +1,691 @@
+/*
+ * usbip_bench - microbenchmarks of the data-plane primitives of usbipd,
+ * reported as key=value lines of ns and allocations per operation.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "stub.h"
+#include "usbip_shm.h"
+#include "names.h"
+#include <usbip_debug.h>
+
+#define BENCH_MAX_PACKETS	1024
+#define BENCH_MAX_DEPTH		65536
+#define BENCH_BUFLEN		512
+
+struct bench {
+	const char *name;
+	const char *param;	/* printed with its value, if any */
+	const int *value;
+	int (*setup)(void);
+	void (*run)(uint64_t n);
+	void (*teardown)(void);
+};
+
+static double bench_seconds = 0.5;
+static int bench_repeat = 3;
+static int bench_packets = 32;
+static int bench_depth = 1024;
+static int bench_eps = 30;
+static char *bench_names_file = USBIDS_FILE;
+
+static struct stub_device *bench_sdev;
+static volatile unsigned long bench_sink;
+
+/*
+ * Allocations are counted by taking over malloc() and friends in front of
+ * glibc, which also sees those of libusb. free() is left alone.
+ */
+static uint64_t bench_allocs;
+
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t allocs_now(void)
+{
+	return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+}
+
+/* ---------------------------------------------------------------------- */
+/* the device every stub bench works on */
+
+static int sdev_setup(void)
+{
+	struct stub_device *sdev;
+	int i;
+
+	sdev = (struct stub_device *)calloc(1, sizeof(*sdev) +
+			sizeof(struct stub_endpoint) * bench_eps);
+	if (!sdev)
+		return -1;
+
+	/* up to 15 endpoint numbers each way, as get_endpoint() sees them */
+	sdev->num_eps = bench_eps;
+	sdev->eps = (struct stub_endpoint *)(sdev->ifs);
+	for (i = 0; i < bench_eps; i++) {
+		sdev->eps[i].nr = 1 + i / 2;
+		sdev->eps[i].dir = i & 1 ? LIBUSB_ENDPOINT_OUT :
+			LIBUSB_ENDPOINT_IN;
+		sdev->eps[i].type = LIBUSB_TRANSFER_TYPE_BULK;
+	}
+
+	pthread_mutex_init(&sdev->ud.lock, NULL);
+	sdev->ud.status = SDEV_ST_USED;
+	pthread_mutex_init(&sdev->priv_lock, NULL);
+	INIT_LIST_HEAD(&sdev->priv_init);
+	for (i = 0; i < STUB_TXQ_NUM; i++)
+		INIT_LIST_HEAD(&sdev->priv_tx[i]);
+	INIT_LIST_HEAD(&sdev->priv_free);
+	INIT_LIST_HEAD(&sdev->unlink_tx);
+	INIT_LIST_HEAD(&sdev->unlink_free);
+	pthread_mutex_init(&sdev->mux_lock, NULL);
+	INIT_LIST_HEAD(&sdev->mux_devs);
+	INIT_LIST_HEAD(&sdev->mux_replies);
+	INIT_LIST_HEAD(&sdev->mux_node);
+
+	bench_sdev = sdev;
+	return 0;
+}
+
+static void sdev_drain(struct list_head *queue)
+{
+	struct list_head *pos, *tmp;
+
+	pthread_mutex_lock(&bench_sdev->priv_lock);
+	list_for_each_safe(pos, tmp, queue)
+		stub_free_priv_and_trx(list_entry(pos, struct stub_priv, list));
+	pthread_mutex_unlock(&bench_sdev->priv_lock);
+}
+
+static void sdev_teardown(void)
+{
+	int q;
+
+	sdev_drain(&bench_sdev->priv_init);
+	for (q = 0; q < STUB_TXQ_NUM; q++)
+		sdev_drain(&bench_sdev->priv_tx[q]);
+	sdev_drain(&bench_sdev->priv_free);
+	pthread_mutex_destroy(&bench_sdev->priv_lock);
+	pthread_mutex_destroy(&bench_sdev->mux_lock);
+	pthread_mutex_destroy(&bench_sdev->ud.lock);
+	free(bench_sdev);
+	bench_sdev = NULL;
+}
+
+static struct stub_priv *priv_new(uint32_t seqnum, int with_trx)
+{
+	struct usbip_header pdu;
+	struct stub_priv *priv;
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.base.command = USBIP_CMD_SUBMIT;
+	pdu.base.seqnum = seqnum;
+	pdu.base.direction = USBIP_DIR_IN;
+	pdu.base.ep = 1;
+
+	priv = stub_priv_alloc(bench_sdev, &pdu);
+	if (!priv || !with_trx)
+		return priv;
+
+	priv->trx = libusb_alloc_transfer(0);
+	if (!priv->trx)
+		return priv;
+	priv->trx->buffer = (unsigned char *)malloc(BENCH_BUFLEN);
+	priv->trx->length = BENCH_BUFLEN;
+	priv->trx->actual_length = BENCH_BUFLEN;
+	priv->trx->endpoint = 0x81;
+	priv->trx->type = LIBUSB_TRANSFER_TYPE_BULK;
+	priv->trx->status = LIBUSB_TRANSFER_COMPLETED;
+	priv->trx->user_data = priv;
+	return priv;
+}
+
+/* ---------------------------------------------------------------------- */
+/* usbip_header_correct_endian(), a CMD_SUBMIT to the wire and back */
+
+static struct usbip_header bench_pdu;
+
+static int header_setup(void)
+{
+	memset(&bench_pdu, 0, sizeof(bench_pdu));
+	bench_pdu.base.command = USBIP_CMD_SUBMIT;
+	bench_pdu.base.seqnum = 1;
+	bench_pdu.base.direction = USBIP_DIR_IN;
+	bench_pdu.base.ep = 1;
+	bench_pdu.u.cmd_submit.transfer_buffer_length = BENCH_BUFLEN;
+	return 0;
+}
+
+static void header_run(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		usbip_header_correct_endian(&bench_pdu, 1);
+		usbip_header_correct_endian(&bench_pdu, 0);
+	}
+	bench_sink += bench_pdu.base.seqnum;
+}
+
+/* ---------------------------------------------------------------------- */
+/* iso descriptors, packed for a RET_SUBMIT and unpacked from a CMD_SUBMIT */
+
+static struct libusb_transfer *bench_iso;
+static struct usbip_iso_packet_descriptor *bench_iso_wire;
+static ssize_t bench_iso_len;
+static struct usbip_device bench_iso_ud;
+static struct usbip_shm *bench_iso_client;
+static int bench_iso_sv[2] = { -1, -1 };
+
+static int iso_setup(void)
+{
+	int i;
+
+	bench_iso = libusb_alloc_transfer(bench_packets);
+	if (!bench_iso)
+		return -1;
+	bench_iso->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+	bench_iso->num_iso_packets = bench_packets;
+	bench_iso->actual_length = 0;
+	for (i = 0; i < bench_packets; i++) {
+		bench_iso->iso_packet_desc[i].length = 1024;
+		bench_iso->iso_packet_desc[i].actual_length = 1000 - i % 8;
+		bench_iso->iso_packet_desc[i].status =
+			LIBUSB_TRANSFER_COMPLETED;
+		bench_iso->actual_length += 1000 - i % 8;
+	}
+	return 0;
+}
+
+static void iso_teardown(void)
+{
+	libusb_free_transfer(bench_iso);
+	bench_iso = NULL;
+}
+
+static void iso_pack_run(uint64_t n)
+{
+	struct usbip_iso_packet_descriptor *iso;
+	ssize_t len;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		iso = usbip_alloc_iso_desc_pdu(bench_iso, &len);
+		bench_sink += iso->offset;
+		free(iso);
+	}
+}
+
+/*
+ * The descriptors come through the shared-memory rings, as from a local
+ * client, so that the unpacking is measured rather than a syscall.
+ */
+static int iso_recv_setup(void)
+{
+	if (iso_setup() < 0)
+		return -1;
+
+	bench_iso_wire = usbip_alloc_iso_desc_pdu(bench_iso, &bench_iso_len);
+	if (!bench_iso_wire)
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, bench_iso_sv) < 0) {
+		err("socketpair: %s", strerror(errno));
+		return -1;
+	}
+	bench_iso_ud.sock_fd = bench_iso_sv[0];
+	bench_iso_ud.shm = usbip_shm_create(bench_iso_sv[0]);
+	if (!bench_iso_ud.shm || usbip_shm_send_fd(bench_iso_ud.shm) < 0)
+		return -1;
+	bench_iso_client = usbip_shm_recv_fd(bench_iso_sv[1]);
+	if (!bench_iso_client)
+		return -1;
+	pthread_mutex_init(&bench_iso_ud.lock, NULL);
+	return 0;
+}
+
+static void iso_recv_run(uint64_t n)
+{
+	struct iovec iov;
+	uint64_t i;
+
+	iov.iov_base = bench_iso_wire;
+	iov.iov_len = bench_iso_len;
+	for (i = 0; i < n; i++) {
+		usbip_shm_writev(bench_iso_client, &iov, 1);
+		if (usbip_recv_iso(&bench_iso_ud, bench_iso) < 0)
+			break;
+	}
+	bench_sink += bench_iso->iso_packet_desc[0].actual_length;
+}
+
+static void iso_recv_teardown(void)
+{
+	usbip_shm_free(bench_iso_client);
+	usbip_shm_free(bench_iso_ud.shm);
+	close(bench_iso_sv[0]);
+	close(bench_iso_sv[1]);
+	memset(&bench_iso_ud, 0, sizeof(bench_iso_ud));
+	bench_iso_client = NULL;
+	free(bench_iso_wire);
+	bench_iso_wire = NULL;
+	iso_teardown();
+}
+
+/* ---------------------------------------------------------------------- */
+/* get_endpoint(), through stub_get_transfer_type(), over all endpoints */
+
+static void endpoint_run(uint64_t n)
+{
+	struct stub_endpoint *eps = bench_sdev->eps;
+	unsigned long sum = 0;
+	uint64_t i;
+	int j = 0;
+
+	for (i = 0; i < n; i++) {
+		sum += stub_get_transfer_type(bench_sdev,
+					      eps[j].nr | eps[j].dir);
+		if (++j == bench_eps)
+			j = 0;
+	}
+	bench_sink += sum;
+}
+
+/* ---------------------------------------------------------------------- */
+/* a stub_priv with its transfer and buffer, as a CMD_SUBMIT takes them */
+
+static void priv_run(uint64_t n)
+{
+	struct stub_priv *priv;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		priv = priv_new(i, 1);
+		pthread_mutex_lock(&bench_sdev->priv_lock);
+		stub_free_priv_and_trx(priv);
+		pthread_mutex_unlock(&bench_sdev->priv_lock);
+	}
+}
+
+/* ---------------------------------------------------------------------- */
+/*
+ * A transfer from stub_priv_alloc() to stub_complete() on one thread, the
+ * way stub_rx and libusb hand it over, and to stub_dequeue_priv_tx() and
+ * its free on another, polling like stub_tx.
+ */
+
+struct handoff {
+	uint64_t n;
+};
+
+static void *handoff_tx(void *arg)
+{
+	struct handoff *h = (struct handoff *)arg;
+	struct list_head *pos, *tmp;
+	uint64_t done = 0;
+
+	while (done < h->n) {
+		while (stub_dequeue_priv_tx(bench_sdev))
+			done++;
+
+		pthread_mutex_lock(&bench_sdev->priv_lock);
+		list_for_each_safe(pos, tmp, &bench_sdev->priv_free)
+			stub_free_priv_and_trx(list_entry(pos,
+						struct stub_priv, list));
+		pthread_mutex_unlock(&bench_sdev->priv_lock);
+	}
+	return NULL;
+}
+
+static int handoff_setup(void)
+{
+	if (sdev_setup() < 0)
+		return -1;
+	/* only a closed connection drops completions */
+	bench_sdev->ud.sock_fd = -1;
+	return 0;
+}
+
+static void handoff_run(uint64_t n)
+{
+	struct handoff h = { n };
+	struct stub_priv *priv;
+	pthread_t tx;
+	uint64_t i;
+
+	if (pthread_create(&tx, NULL, handoff_tx, &h))
+		return;
+	for (i = 0; i < n; i++) {
+		priv = priv_new(i, 1);
+		stub_complete(priv->trx);
+	}
+	pthread_join(tx, NULL);
+}
+
+/* ---------------------------------------------------------------------- */
+/* stub_priv_lookup() of a CMD_UNLINK with bench_depth transfers queued */
+
+static int unlink_setup(void)
+{
+	int i;
+
+	if (sdev_setup() < 0)
+		return -1;
+	for (i = 1; i <= bench_depth; i++)
+		if (!priv_new(i, 0))
+			return -1;
+	return 0;
+}
+
+static void unlink_hit_run(uint64_t n)
+{
+	struct stub_priv *priv;
+	unsigned long sum = 0;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&bench_sdev->priv_lock);
+		priv = stub_priv_lookup(bench_sdev, 1 + i % bench_depth);
+		sum += priv->seqnum;
+		pthread_mutex_unlock(&bench_sdev->priv_lock);
+	}
+	bench_sink += sum;
+}
+
+/* the usual case: the transfer completed before its unlink came */
+static void unlink_miss_run(uint64_t n)
+{
+	unsigned long sum = 0;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&bench_sdev->priv_lock);
+		sum += !stub_priv_lookup(bench_sdev, 0);
+		pthread_mutex_unlock(&bench_sdev->priv_lock);
+	}
+	bench_sink += sum;
+}
+
+/* ---------------------------------------------------------------------- */
+/* names.c, a vendor and product of well known and unknown devices */
+
+static const uint16_t bench_ids[][2] = {
+	{ 0x1d6b, 0x0002 }, { 0x046d, 0xc52b }, { 0x8087, 0x0024 },
+	{ 0x0781, 0x5581 }, { 0x0bda, 0x8153 }, { 0x05ac, 0x12a8 },
+	{ 0x1234, 0x5678 }, { 0xffff, 0xffff },
+};
+
+#define BENCH_NIDS	(sizeof(bench_ids) / sizeof(bench_ids[0]))
+
+static int names_setup(void)
+{
+	if (names_init(bench_names_file)) {
+		err("unable to open names file %s", bench_names_file);
+		return -1;
+	}
+	return 0;
+}
+
+static void names_run(uint64_t n)
+{
+	unsigned long sum = 0;
+	const char *s;
+	uint64_t i;
+	size_t j = 0;
+
+	for (i = 0; i < n; i++) {
+		s = names_vendor(bench_ids[j][0]);
+		sum += s ? s[0] : 0;
+		s = names_product(bench_ids[j][0], bench_ids[j][1]);
+		sum += s ? s[0] : 0;
+		if (++j == BENCH_NIDS)
+			j = 0;
+	}
+	bench_sink += sum;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static const struct bench benches[] = {
+	{ "header_endian", NULL, NULL, header_setup, header_run, NULL },
+	{ "iso_pack", "packets", &bench_packets,
+	  iso_setup, iso_pack_run, iso_teardown },
+	{ "iso_recv", "packets", &bench_packets,
+	  iso_recv_setup, iso_recv_run, iso_recv_teardown },
+	{ "get_endpoint", "endpoints", &bench_eps,
+	  sdev_setup, endpoint_run, sdev_teardown },
+	{ "priv_alloc", NULL, NULL, sdev_setup, priv_run, sdev_teardown },
+	{ "priv_handoff", NULL, NULL,
+	  handoff_setup, handoff_run, sdev_teardown },
+	{ "unlink_hit", "depth", &bench_depth,
+	  unlink_setup, unlink_hit_run, sdev_teardown },
+	{ "unlink_miss", "depth", &bench_depth,
+	  unlink_setup, unlink_miss_run, sdev_teardown },
+	{ "names", NULL, NULL, names_setup, names_run, names_free },
+	{ NULL, NULL, NULL, NULL, NULL, NULL },
+};
+
+/*
+ * Grows the iteration count until a run takes bench_seconds, then keeps
+ * the best of bench_repeat runs of that count.
+ */
+static void bench_one(const struct bench *b)
+{
+	uint64_t target = bench_seconds * 1e9;
+	uint64_t n = 1, start, ns, allocs, best = 0;
+	double best_allocs = 0;
+	int r;
+
+	if (b->setup && b->setup() < 0) {
+		err("%s: setup failed", b->name);
+		if (b->teardown)
+			b->teardown();
+		return;
+	}
+
+	for (;;) {
+		start = now_ns();
+		b->run(n);
+		ns = now_ns() - start;
+		if (ns >= target / 2 || n >= (1ULL << 40))
+			break;
+		if (ns < 1000)
+			n *= 100;
+		else if (ns * 100 < target)
+			n *= 10;
+		else
+			n = n * target / ns + 1;
+	}
+
+	for (r = 0; r < bench_repeat; r++) {
+		allocs = allocs_now();
+		start = now_ns();
+		b->run(n);
+		ns = now_ns() - start;
+		allocs = allocs_now() - allocs;
+		if (!r || ns < best) {
+			best = ns;
+			best_allocs = (double)allocs / n;
+		}
+	}
+
+	printf("bench=%s", b->name);
+	if (b->param)
+		printf(" %s=%d", b->param, *b->value);
+	printf(" ops=%llu ns_per_op=%.1f", (unsigned long long)n,
+	       (double)best / n);
+#ifdef BENCH_COUNT_ALLOCS
+	printf(" allocs_per_op=%.2f", best_allocs);
+#else
+	(void)best_allocs;
+#endif
+	printf("\n");
+	fflush(stdout);
+
+	if (b->teardown)
+		b->teardown();
+}
+
+static const char bench_help_string[] =
+	"usage: usbip_bench [options] [BENCH...]\n"
+	"\n"
+	"	Runs the named benchmarks, or all of them, and prints\n"
+	"	one line each: bench=NAME ops= ns_per_op= allocs_per_op=\n"
+	"\n"
+	"	-sSEC, --seconds SEC\n"
+	"		Length of each timed run. Default is 0.5.\n"
+	"\n"
+	"	-rNUM, --repeat NUM\n"
+	"		Timed runs per benchmark, the fastest is reported.\n"
+	"		Default is 3.\n"
+	"\n"
+	"	-pNUM, --packets NUM\n"
+	"		Iso packets per transfer of iso_pack and iso_recv.\n"
+	"		Default is 32.\n"
+	"\n"
+	"	-qNUM, --depth NUM\n"
+	"		Transfers queued at the device for unlink_hit and\n"
+	"		unlink_miss. Default is 1024.\n"
+	"\n"
+	"	-iFILE, --ids FILE\n"
+	"		usb.ids for the names benchmark. Default is\n"
+	"		" USBIDS_FILE ".\n"
+	"\n"
+	"	-l, --list\n"
+	"		Print the names of the benchmarks.\n"
+	"\n"
+	"	-d, --debug\n"
+	"		Print debugging information.\n"
+	"\n"
+	"	-h, --help\n"
+	"		Print this help.\n";
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{"seconds", required_argument, NULL, 's'},
+		{"repeat", required_argument, NULL, 'r'},
+		{"packets", required_argument, NULL, 'p'},
+		{"depth", required_argument, NULL, 'q'},
+		{"ids", required_argument, NULL, 'i'},
+		{"list", no_argument, NULL, 'l'},
+		{"debug", no_argument, NULL, 'd'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	const struct bench *b;
+	int opt, i;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "s:r:p:q:i:ldh", longopts, NULL);
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 's':
+			bench_seconds = atof(optarg);
+			break;
+		case 'r':
+			bench_repeat = atoi(optarg);
+			break;
+		case 'p':
+			bench_packets = atoi(optarg);
+			break;
+		case 'q':
+			bench_depth = atoi(optarg);
+			break;
+		case 'i':
+			bench_names_file = optarg;
+			break;
+		case 'l':
+			for (b = benches; b->name; b++)
+				printf("%s\n", b->name);
+			return EXIT_SUCCESS;
+		case 'd':
+			usbip_use_debug = 1;
+			break;
+		case 'h':
+		default:
+			printf("%s", bench_help_string);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (bench_seconds <= 0 || bench_repeat <= 0) {
+		err("--seconds and --repeat must be positive");
+		return EXIT_FAILURE;
+	}
+
+	if (bench_packets <= 0 || bench_packets > BENCH_MAX_PACKETS) {
+		err("packets must be within 1..%d", BENCH_MAX_PACKETS);
+		return EXIT_FAILURE;
+	}
+
+	if (bench_depth <= 0 || bench_depth > BENCH_MAX_DEPTH) {
+		err("depth must be within 1..%d", BENCH_MAX_DEPTH);
+		return EXIT_FAILURE;
+	}
+
+	for (i = optind; i < argc; i++) {
+		for (b = benches; b->name; b++)
+			if (!strcmp(b->name, argv[i]))
+				break;
+		if (!b->name) {
+			err("unknown benchmark %s", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (b = benches; b->name; b++) {
+		if (optind < argc) {
+			for (i = optind; i < argc; i++)
+				if (!strcmp(b->name, argv[i]))
+					break;
+			if (i == argc)
+				continue;
+		}
+		bench_one(b);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1215 @@
+/*
+ * usbip_loadgen - drives a running usbipd with client-side load and
+ * reports rates and latencies as key=value lines.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "usbip_network.h"
+#include "usbip_shm.h"
+#include <usbip_debug.h>
+#include "stub_common.h"
+
+/* GET_DESCRIPTOR(DEVICE), answered by any device */
+#define LG_URB_SETUP	{0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00}
+#define LG_URB_LENGTH	18
+#define LG_MAX_DEPTH	64
+#define LG_MAX_LENGTH	(1 << 20)
+#define LG_MAX_DEVS	32
+#define LG_MAX_PACKETS	1024
+
+struct loadgen_stats {
+	uint64_t *lat_ns;
+	size_t nlat;
+	size_t maxlat;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t wire_bytes;	/* of the payloads, as framed */
+	uint64_t iso_errors;	/* packets failed in transfers that did not */
+};
+
+struct loadgen_thread {
+	pthread_t thread;
+	struct loadgen_stats stats;
+
+	const char *busid;
+
+	/* imported devices, several only with --mux, urb mode only */
+	int sockfd;
+	struct usbip_shm *shm;
+	uint32_t devids[LG_MAX_DEVS];
+	int ndevs;
+	uint32_t seqnum;
+	unsigned char *buf;	/* bulk payloads */
+	unsigned char *txbuf;	/* a batch */
+	struct usbip_iso_packet_descriptor *iso;
+};
+
+struct loadgen_mode {
+	const char *name;
+	int (*run_one)(struct loadgen_thread *t);
+};
+
+static const char *lg_host = "localhost";
+static const char *lg_unix;
+static char *lg_busids[LG_MAX_DEVS];
+static int lg_nbusids;
+static int lg_mux;
+static int lg_interval;
+static int lg_threads = 1;
+static int lg_depth = 1;
+static int lg_batch;
+static int lg_compress;
+static int lg_shm;
+static int lg_ep = -1;
+static int lg_length = LG_URB_LENGTH;
+static int lg_wlength = -1;
+static int lg_streams;
+static int lg_alt = -1;
+static int lg_alt_if;
+static int lg_packets;
+static int lg_heartbeat;
+static int lg_unlink;
+static long lg_count = 1000;
+static double lg_duration;
+static volatile int lg_stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stats_add(struct loadgen_stats *stats, uint64_t ns)
+{
+	if (stats->nlat == stats->maxlat) {
+		size_t n = stats->maxlat ? stats->maxlat * 2 : 4096;
+		uint64_t *p = realloc(stats->lat_ns, n * sizeof(*p));
+
+		if (!p)
+			return -1;
+		stats->lat_ns = p;
+		stats->maxlat = n;
+	}
+	stats->lat_ns[stats->nlat++] = ns;
+	return 0;
+}
+
+static int connect_unix(void)
+{
+	struct sockaddr_un sun;
+	int sockfd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, lg_unix, sizeof(sun.sun_path) - 1);
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return -1;
+	if (connect(sockfd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		dbg("connect: %s", strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+static int connect_server(void)
+{
+	struct addrinfo hints, *res, *ai;
+	int sockfd = -1;
+	int rc;
+
+	if (lg_unix)
+		return connect_unix();
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(lg_host, usbip_port_string, &hints, &res);
+	if (rc) {
+		err("getaddrinfo: %s: %s", lg_host, usbip_net_gai_strerror(rc));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		sockfd = socket(ai->ai_family, ai->ai_socktype,
+				ai->ai_protocol);
+		if (sockfd < 0)
+			continue;
+		if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (sockfd < 0) {
+		dbg("connect: %s", strerror(errno));
+		return -1;
+	}
+	usbip_net_set_nodelay(sockfd);
+	return sockfd;
+}
+
+/* one OP_REQ_DEVLIST round trip on a fresh connection */
+static int run_devlist(struct loadgen_thread *t)
+{
+	struct loadgen_stats *stats = &t->stats;
+	struct usbip_usb_device udev;
+	struct usbip_usb_interface uinf;
+	struct op_devlist_reply reply;
+	uint16_t code = OP_REP_DEVLIST;
+	uint64_t start = now_ns();
+	uint32_t i, j;
+	int sockfd;
+
+	sockfd = connect_server();
+	if (sockfd < 0)
+		return -1;
+
+	if (usbip_net_send_op_common(sockfd, OP_REQ_DEVLIST, 0) < 0)
+		goto err_close;
+	if (usbip_net_recv_op_common(sockfd, &code) < 0)
+		goto err_close;
+	if (usbip_net_recv(sockfd, &reply, sizeof(reply)) != sizeof(reply))
+		goto err_close;
+
+	reply.ndev = ntohl(reply.ndev);
+	for (i = 0; i < reply.ndev; i++) {
+		if (usbip_net_recv(sockfd, &udev, sizeof(udev)) != sizeof(udev))
+			goto err_close;
+		for (j = 0; j < udev.bNumInterfaces; j++) {
+			if (usbip_net_recv(sockfd, &uinf, sizeof(uinf)) !=
+			    sizeof(uinf))
+				goto err_close;
+		}
+	}
+	close(sockfd);
+
+	return stats_add(stats, now_ns() - start);
+
+err_close:
+	close(sockfd);
+	return -1;
+}
+
+/*
+ * Send OP_REQ_IMPORT for busid and wait for the reply on sockfd. The
+ * elapsed time is the attach latency seen by a client. caps are the
+ * protocol extensions to ask for, all of them must be granted.
+ */
+static int import_device(int sockfd, const char *busid, uint32_t caps,
+			 struct usbip_usb_device *udev)
+{
+	struct op_import_request req;
+	uint16_t code = OP_REP_IMPORT;
+	uint32_t granted;
+
+	memset(&req, 0, sizeof(req));
+	strncpy(req.busid, busid, SYSFS_BUS_ID_SIZE - 1);
+
+	if (usbip_net_send_op_common(sockfd, OP_REQ_IMPORT,
+				     caps << USBIP_CAP_SHIFT) < 0)
+		return -1;
+	if (usbip_net_send(sockfd, &req, sizeof(req)) < 0)
+		return -1;
+	if (usbip_net_recv_op_common_caps(sockfd, &code, &granted) < 0)
+		return -1;
+	if (usbip_net_recv(sockfd, udev, sizeof(*udev)) != sizeof(*udev))
+		return -1;
+	PACK_OP_IMPORT_REPLY(0, (*udev));
+
+	if ((granted & caps) != caps) {
+		err("server granted caps %#x of %#x", granted, caps);
+		return -1;
+	}
+	return 0;
+}
+
+/* attach and immediately detach busid */
+static int run_import(struct loadgen_thread *t)
+{
+	struct usbip_usb_device udev;
+	uint64_t start = now_ns();
+	int sockfd, ret;
+
+	sockfd = connect_server();
+	if (sockfd < 0)
+		return -1;
+
+	ret = import_device(sockfd, t->busid, 0, &udev);
+	close(sockfd);
+	if (ret < 0)
+		return -1;
+
+	return stats_add(&t->stats, now_ns() - start);
+}
+
+/*
+ * The submit, result and batch headers loadgen deals with are all made of
+ * 32-bit words up to the setup packet, so they swap alike.
+ */
+static void urb_header_endian(struct usbip_header *pdu, int send)
+{
+	unsigned char *p = (unsigned char *)pdu;
+	size_t off;
+	uint32_t w;
+
+	for (off = 0; off < offsetof(struct usbip_header, u.cmd_submit.setup);
+	     off += 4) {
+		memcpy(&w, p + off, 4);
+		w = send ? htonl(w) : ntohl(w);
+		memcpy(p + off, &w, 4);
+	}
+}
+
+static void urb_entry_endian(struct usbip_batch_entry *ent, int send)
+{
+	if (send) {
+		ent->seqnum = htonl(ent->seqnum);
+		ent->stream_id = htons(ent->stream_id);
+		ent->length = (int32_t)htonl(ent->length);
+		ent->value = (int32_t)htonl(ent->value);
+	} else {
+		ent->seqnum = ntohl(ent->seqnum);
+		ent->stream_id = ntohs(ent->stream_id);
+		ent->length = (int32_t)ntohl(ent->length);
+		ent->value = (int32_t)ntohl(ent->value);
+	}
+}
+
+/* transfers go to ep0 unless --endpoint says otherwise */
+static int urb_dir_in(void)
+{
+	return lg_ep < 0 || (lg_ep & USB_DIR_IN);
+}
+
+static void urb_detach(struct loadgen_thread *t)
+{
+	usbip_shm_free(t->shm);
+	t->shm = NULL;
+	close(t->sockfd);
+	t->sockfd = -1;
+}
+
+static int urb_send(struct loadgen_thread *t, void *buf, size_t len);
+static int urb_recvn(struct loadgen_thread *t, void *buf, size_t len);
+
+/* SET_INTERFACE(lg_alt_if, lg_alt), e.g. to switch a drive over to UAS */
+static int urb_set_alt(struct loadgen_thread *t, uint32_t devid)
+{
+	struct usbip_header pdu;
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.base.command = USBIP_CMD_SUBMIT;
+	pdu.base.seqnum = ++t->seqnum;
+	pdu.base.devid = devid;
+	pdu.base.direction = USBIP_DIR_OUT;
+	pdu.u.cmd_submit.setup[0] = 0x01;
+	pdu.u.cmd_submit.setup[1] = 0x0b;
+	pdu.u.cmd_submit.setup[2] = lg_alt;
+	pdu.u.cmd_submit.setup[4] = lg_alt_if;
+	urb_header_endian(&pdu, 1);
+
+	if (urb_send(t, &pdu, sizeof(pdu)) < 0 ||
+	    urb_recvn(t, &pdu, sizeof(pdu)) < 0)
+		return -1;
+	urb_header_endian(&pdu, 0);
+	if (pdu.base.command != USBIP_RET_SUBMIT || pdu.u.ret_submit.status) {
+		err("set alternate setting %d failed", lg_alt);
+		return -1;
+	}
+	return 0;
+}
+
+/* USBIP_CMD_IMPORT busid onto the connection of the first device */
+static int urb_join(struct loadgen_thread *t, const char *busid)
+{
+	struct usbip_header pdu;
+	struct op_import_request req;
+	struct usbip_usb_device udev;
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.base.command = USBIP_CMD_IMPORT;
+	pdu.base.seqnum = ++t->seqnum;
+	urb_header_endian(&pdu, 1);
+	memset(&req, 0, sizeof(req));
+	strncpy(req.busid, busid, SYSFS_BUS_ID_SIZE - 1);
+
+	if (urb_send(t, &pdu, sizeof(pdu)) < 0 ||
+	    urb_send(t, &req, sizeof(req)) < 0)
+		return -1;
+	do {
+		if (urb_recvn(t, &pdu, sizeof(pdu)) < 0)
+			return -1;
+		urb_header_endian(&pdu, 0);
+	} while (pdu.base.command == USBIP_NOP);
+
+	if (pdu.base.command != USBIP_RET_IMPORT ||
+	    pdu.u.ret_import.status != ST_OK) {
+		err("import of %s onto the connection failed: %u", busid,
+		    pdu.u.ret_import.status);
+		return -1;
+	}
+	if (urb_recvn(t, &udev, sizeof(udev)) < 0)
+		return -1;
+	t->devids[t->ndevs++] = pdu.base.devid;
+	return 0;
+}
+
+static int urb_attach(struct loadgen_thread *t)
+{
+	struct usbip_usb_device udev;
+	uint32_t caps = 0;
+	int i;
+
+	if (!t->buf) {
+		t->buf = calloc(1, lg_length);
+		t->txbuf = malloc(sizeof(struct usbip_header) + LG_MAX_DEPTH *
+			(sizeof(struct usbip_batch_entry) + 8 + 4 + lg_length));
+		if (!t->buf || !t->txbuf)
+			return -1;
+	}
+	if (lg_packets && !t->iso) {
+		t->iso = malloc(lg_packets * sizeof(*t->iso));
+		if (!t->iso)
+			return -1;
+	}
+
+	t->sockfd = connect_server();
+	if (t->sockfd < 0)
+		return -1;
+
+	if (lg_batch)
+		caps |= USBIP_CAP_BATCH;
+	if (lg_compress)
+		caps |= USBIP_CAP_COMPRESS;
+	if (lg_shm)
+		caps |= USBIP_CAP_SHM;
+	if (lg_streams)
+		caps |= USBIP_CAP_STREAMS;
+	if (lg_heartbeat)
+		caps |= USBIP_CAP_HEARTBEAT;
+	if (lg_mux)
+		caps |= USBIP_CAP_MUX;
+
+	t->ndevs = 0;
+	if (import_device(t->sockfd, lg_mux ? lg_busids[0] : t->busid, caps,
+			  &udev) < 0)
+		goto err;
+	if (lg_shm) {
+		t->shm = usbip_shm_recv_fd(t->sockfd);
+		if (!t->shm)
+			goto err;
+	}
+	t->devids[t->ndevs++] = (udev.busnum << 16) | udev.devnum;
+	for (i = 1; lg_mux && i < lg_nbusids; i++) {
+		if (urb_join(t, lg_busids[i]) < 0)
+			goto err;
+	}
+	for (i = 0; lg_alt >= 0 && i < t->ndevs; i++) {
+		if (urb_set_alt(t, t->devids[i]) < 0)
+			goto err;
+	}
+	return 0;
+err:
+	urb_detach(t);
+	return -1;
+}
+
+static int urb_send(struct loadgen_thread *t, void *buf, size_t len)
+{
+	struct iovec iov = { buf, len };
+
+	if (t->shm)
+		return usbip_shm_writev(t->shm, &iov, 1) == (ssize_t)len ?
+			0 : -1;
+	return usbip_net_send(t->sockfd, buf, len) < 0 ? -1 : 0;
+}
+
+static int urb_recvn(struct loadgen_thread *t, void *buf, size_t len)
+{
+	unsigned char *p = (unsigned char *)buf;
+	ssize_t n;
+
+	if (!t->shm)
+		return usbip_net_recv(t->sockfd, buf, len) == (ssize_t)len ?
+			0 : -1;
+
+	while (len > 0) {
+		n = usbip_shm_read(t->shm, p, len);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* the descriptors of an iso transfer, lg_length cut into lg_packets */
+static void urb_iso_fill(struct loadgen_thread *t)
+{
+	uint32_t len = lg_length / lg_packets;
+	int i;
+
+	for (i = 0; i < lg_packets; i++) {
+		t->iso[i].offset = htonl(i * len);
+		t->iso[i].length = htonl(len);
+		t->iso[i].actual_length = 0;
+		t->iso[i].status = 0;
+	}
+}
+
+/*
+ * The ep0 request: GET_DESCRIPTOR(DEVICE), or with --wlength the
+ * configuration descriptor for that many bytes, whatever room --length
+ * leaves for them.
+ */
+static void urb_setup(unsigned char *setup)
+{
+	static const unsigned char dev[8] = LG_URB_SETUP;
+
+	memcpy(setup, dev, 8);
+	if (lg_wlength >= 0) {
+		setup[3] = 0x02;
+		setup[6] = lg_wlength & 0xff;
+		setup[7] = lg_wlength >> 8;
+	}
+}
+
+/* one CMD_SUBMIT per send, as a classic client does */
+static int urb_send_classic(struct loadgen_thread *t, uint32_t devid, int n)
+{
+	struct usbip_header pdu;
+	size_t isolen = lg_packets * sizeof(*t->iso);
+	uint32_t zhdr = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		memset(&pdu, 0, sizeof(pdu));
+		pdu.base.command = USBIP_CMD_SUBMIT;
+		pdu.base.seqnum = ++t->seqnum;
+		pdu.base.devid = devid;
+		pdu.base.direction = urb_dir_in() ? USBIP_DIR_IN : USBIP_DIR_OUT;
+		pdu.u.cmd_submit.transfer_buffer_length = lg_length;
+		if (lg_ep < 0)
+			urb_setup(pdu.u.cmd_submit.setup);
+		else
+			pdu.base.ep = lg_ep & USB_ENDPOINT_NUMBER_MASK;
+		if (lg_streams)
+			pdu.u.cmd_submit.start_frame = i % lg_streams + 1;
+		pdu.u.cmd_submit.number_of_packets = lg_packets;
+		urb_header_endian(&pdu, 1);
+
+		if (urb_send(t, &pdu, sizeof(pdu)) < 0)
+			return -1;
+		if (!urb_dir_in() && lg_compress && lg_length &&
+		    urb_send(t, &zhdr, sizeof(zhdr)) < 0)
+			return -1;
+		if (!urb_dir_in() && urb_send(t, t->buf, lg_length) < 0)
+			return -1;
+		if (lg_packets) {
+			urb_iso_fill(t);
+			if (urb_send(t, t->iso, isolen) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* all n CMD_SUBMITs in one USBIP_CMD_BATCH */
+static int urb_send_batch(struct loadgen_thread *t, uint32_t devid, int n)
+{
+	unsigned char *buf = t->txbuf;
+	struct usbip_header *pdu = (struct usbip_header *)buf;
+	unsigned char *p = buf + sizeof(*pdu);
+	struct usbip_batch_entry ent;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		memset(&ent, 0, sizeof(ent));
+		ent.seqnum = ++t->seqnum;
+		ent.flags = urb_dir_in() ? USBIP_BATCH_IN : 0;
+		ent.length = lg_length;
+		if (lg_ep < 0)
+			ent.flags |= USBIP_BATCH_SETUP;
+		else
+			ent.ep = lg_ep & USB_ENDPOINT_NUMBER_MASK;
+		if (lg_streams)
+			ent.stream_id = i % lg_streams + 1;
+		urb_entry_endian(&ent, 1);
+		memcpy(p, &ent, sizeof(ent));
+		p += sizeof(ent);
+		if (lg_ep < 0) {
+			urb_setup(p);
+			p += 8;
+		}
+		if (!urb_dir_in() && lg_compress && lg_length) {
+			/* sent as is */
+			memset(p, 0, 4);
+			p += 4;
+		}
+		if (!urb_dir_in()) {
+			memcpy(p, t->buf, lg_length);
+			p += lg_length;
+		}
+	}
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->base.command = USBIP_CMD_BATCH;
+	pdu->base.devid = devid;
+	pdu->u.batch.count = n;
+	pdu->u.batch.length = p - buf - sizeof(*pdu);
+	urb_header_endian(pdu, 1);
+
+	return urb_send(t, buf, p - buf);
+}
+
+/*
+ * With --compress, a bulk payload is framed by its compressed length, 0
+ * for as is. loadgen reads what comes without inflating it, as only the
+ * bytes on the wire matter to the load.
+ */
+static int urb_recv_payload(struct loadgen_thread *t, int32_t len)
+{
+	uint32_t zlen = 0;
+
+	if (len < 0 || len > lg_length)
+		return -1;
+	t->stats.bytes += len;
+	if (lg_compress && len)
+		t->stats.wire_bytes += sizeof(zlen);
+	if (!urb_dir_in()) {
+		t->stats.wire_bytes += len;
+		return 0;
+	}
+	if (lg_compress && len) {
+		if (urb_recvn(t, &zlen, sizeof(zlen)) < 0)
+			return -1;
+		/* the server only compresses what gets smaller */
+		zlen = ntohl(zlen);
+		if (zlen >= (uint32_t)len)
+			return -1;
+	}
+	if (zlen)
+		len = zlen;
+	t->stats.wire_bytes += len;
+	if (len && urb_recvn(t, t->buf, len) < 0)
+		return -1;
+	return 0;
+}
+
+/* the descriptors after an iso result, failed packets count apart */
+static int urb_recv_iso(struct loadgen_thread *t, struct usbip_header *pdu)
+{
+	int np = pdu->u.ret_submit.number_of_packets;
+
+	if (!lg_packets || np <= 0)
+		return 0;
+	if (np > lg_packets ||
+	    urb_recvn(t, t->iso, np * sizeof(*t->iso)) < 0)
+		return -1;
+	if (!pdu->u.ret_submit.status)
+		t->stats.iso_errors += pdu->u.ret_submit.error_count;
+	return 0;
+}
+
+/* read results until n submits are answered, classic or batched */
+static int urb_recv(struct loadgen_thread *t, int n, uint64_t start)
+{
+	struct usbip_header pdu;
+	struct usbip_batch_entry ent;
+	uint32_t i;
+
+	while (n > 0) {
+		if (urb_recvn(t, &pdu, sizeof(pdu)) < 0)
+			return -1;
+		urb_header_endian(&pdu, 0);
+
+		switch (pdu.base.command) {
+		case USBIP_RET_SUBMIT:
+			if (urb_recv_payload(t,
+					pdu.u.ret_submit.actual_length) < 0)
+				return -1;
+			if (urb_recv_iso(t, &pdu) < 0)
+				return -1;
+			if (pdu.u.ret_submit.status)
+				t->stats.errors++;
+			stats_add(&t->stats, now_ns() - start);
+			n--;
+			break;
+		case USBIP_RET_BATCH:
+			for (i = 0; i < pdu.u.batch.count; i++) {
+				if (urb_recvn(t, &ent, sizeof(ent)) < 0)
+					return -1;
+				urb_entry_endian(&ent, 0);
+				if (urb_recv_payload(t, ent.length) < 0)
+					return -1;
+				if (ent.value)
+					t->stats.errors++;
+				stats_add(&t->stats, now_ns() - start);
+				n--;
+			}
+			break;
+		case USBIP_NOP:
+			break;
+		default:
+			err("unexpected pdu %u", pdu.base.command);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* a USBIP_CMD_UNLINK for each of the n transfers from seqnum first on */
+static int urb_send_unlinks(struct loadgen_thread *t, uint32_t first, int n)
+{
+	struct usbip_header pdu;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		memset(&pdu, 0, sizeof(pdu));
+		pdu.base.command = USBIP_CMD_UNLINK;
+		pdu.base.seqnum = ++t->seqnum;
+		pdu.base.devid = t->devids[i / lg_depth];
+		pdu.u.cmd_unlink.seqnum = first + i;
+		urb_header_endian(&pdu, 1);
+
+		if (urb_send(t, &pdu, sizeof(pdu)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the answers to a window sent with --unlink. Each transfer ends with
+ * the RET_UNLINK of its unlink, which follows its RET_SUBMIT if the unlink
+ * came too late. A RET_SUBMIT after that is one vhci no longer knows and
+ * drops the connection for, so it counts as an error here.
+ */
+static int urb_recv_unlinked(struct loadgen_thread *t, uint32_t first,
+			     int n, uint64_t start)
+{
+	unsigned char state[LG_MAX_DEPTH * LG_MAX_DEVS];	/* 1 done, 2 gone */
+	struct usbip_header pdu;
+	uint32_t i;
+	int left = n;
+
+	memset(state, 0, n);
+	while (left > 0) {
+		if (urb_recvn(t, &pdu, sizeof(pdu)) < 0)
+			return -1;
+		urb_header_endian(&pdu, 0);
+
+		switch (pdu.base.command) {
+		case USBIP_RET_SUBMIT:
+			i = pdu.base.seqnum - first;
+			if (i >= (uint32_t)n || state[i]) {
+				err("result of seq %u after its unlink",
+				    pdu.base.seqnum);
+				t->stats.errors++;
+				return -1;
+			}
+			if (urb_recv_payload(t,
+					pdu.u.ret_submit.actual_length) < 0)
+				return -1;
+			if (urb_recv_iso(t, &pdu) < 0)
+				return -1;
+			if (pdu.u.ret_submit.status)
+				t->stats.errors++;
+			stats_add(&t->stats, now_ns() - start);
+			state[i] = 1;
+			break;
+		case USBIP_RET_UNLINK:
+			i = pdu.base.seqnum - first - n;
+			if (i >= (uint32_t)n || state[i] == 2) {
+				err("unexpected unlink seq %u",
+				    pdu.base.seqnum);
+				return -1;
+			}
+			/* cancelled before it completed */
+			if (!state[i])
+				stats_add(&t->stats, now_ns() - start);
+			state[i] = 2;
+			left--;
+			break;
+		case USBIP_NOP:
+			break;
+		default:
+			err("unexpected pdu %u", pdu.base.command);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* a window of lg_depth transfers on each imported device */
+static int run_urb(struct loadgen_thread *t)
+{
+	uint32_t first;
+	uint64_t start;
+	int i, ret = 0;
+
+	if (t->sockfd < 0 && urb_attach(t) < 0)
+		return -1;
+
+	start = now_ns();
+	first = t->seqnum + 1;
+	for (i = 0; i < t->ndevs && ret == 0; i++) {
+		if (lg_batch)
+			ret = urb_send_batch(t, t->devids[i], lg_depth);
+		else
+			ret = urb_send_classic(t, t->devids[i], lg_depth);
+	}
+	if (ret == 0 && lg_unlink) {
+		ret = urb_send_unlinks(t, first, lg_depth * t->ndevs);
+		if (ret == 0)
+			ret = urb_recv_unlinked(t, first, lg_depth * t->ndevs,
+						start);
+	} else if (ret == 0) {
+		ret = urb_recv(t, lg_depth * t->ndevs, start);
+	}
+
+	if (ret < 0)
+		urb_detach(t);
+	return ret;
+}
+
+/* the pause between operations, with a USBIP_NOP now and then */
+static void urb_idle(struct loadgen_thread *t)
+{
+	struct usbip_header pdu;
+	int left, nap;
+
+	for (left = lg_interval; left > 0; left -= nap) {
+		nap = left < USBIP_HEARTBEAT_INTERVAL ?
+			left : USBIP_HEARTBEAT_INTERVAL;
+		usleep(nap * 1000);
+
+		if (!lg_heartbeat || t->sockfd < 0)
+			continue;
+		memset(&pdu, 0, sizeof(pdu));
+		pdu.base.command = USBIP_NOP;
+		if (urb_send(t, &pdu, sizeof(pdu)) < 0)
+			urb_detach(t);
+	}
+}
+
+static const struct loadgen_mode loadgen_modes[] = {
+	{"devlist", run_devlist},
+	{"import", run_import},
+	{"urb", run_urb},
+	{NULL, NULL}
+};
+
+static const struct loadgen_mode *lg_mode = loadgen_modes;
+
+static void *loadgen_thread_loop(void *arg)
+{
+	struct loadgen_thread *t = (struct loadgen_thread *)arg;
+	long n;
+
+	t->sockfd = -1;
+	for (n = 0; !lg_stop && (lg_duration > 0 || n < lg_count); n++) {
+		if (lg_mode->run_one(t) < 0)
+			t->stats.errors++;
+		if (lg_interval > 0)
+			urb_idle(t);
+	}
+	if (t->sockfd >= 0)
+		urb_detach(t);
+	free(t->buf);
+	free(t->txbuf);
+	free(t->iso);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(struct loadgen_thread *threads, double seconds)
+{
+	struct loadgen_stats all;
+	uint64_t errors = 0, bytes = 0, wire_bytes = 0, iso_errors = 0;
+	int i;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < lg_threads; i++) {
+		struct loadgen_stats *s = &threads[i].stats;
+		size_t j;
+
+		for (j = 0; j < s->nlat; j++)
+			stats_add(&all, s->lat_ns[j]);
+		errors += s->errors;
+		bytes += s->bytes;
+		wire_bytes += s->wire_bytes;
+		iso_errors += s->iso_errors;
+		free(s->lat_ns);
+	}
+	qsort(all.lat_ns, all.nlat, sizeof(*all.lat_ns), cmp_u64);
+
+	printf("mode=%s transport=%s threads=%d devices=%d depth=%d batch=%d "
+	       "ops=%zu errors=%llu seconds=%.3f ops_per_sec=%.1f",
+	       lg_mode->name, lg_shm ? "shm" : lg_unix ? "unix" : "tcp",
+	       lg_threads, lg_mux ? lg_nbusids : 1, lg_depth, lg_batch,
+	       all.nlat,
+	       (unsigned long long)errors, seconds,
+	       seconds > 0 ? all.nlat / seconds : 0.0);
+	if (lg_mode->run_one == run_urb)
+		printf(" length=%d streams=%d mb_per_sec=%.1f", lg_length,
+		       lg_streams, seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+	if (lg_compress)
+		printf(" wire_mb_per_sec=%.1f",
+		       seconds > 0 ? wire_bytes / seconds / 1e6 : 0.0);
+	if (lg_packets)
+		printf(" packets=%d iso_errors=%llu", lg_packets,
+		       (unsigned long long)iso_errors);
+	if (all.nlat) {
+		printf(" lat_p50_us=%.1f lat_p99_us=%.1f lat_max_us=%.1f",
+		       all.lat_ns[all.nlat / 2] / 1000.0,
+		       all.lat_ns[(all.nlat * 99) / 100] / 1000.0,
+		       all.lat_ns[all.nlat - 1] / 1000.0);
+	}
+	printf("\n");
+	free(all.lat_ns);
+}
+
+static const char loadgen_help_string[] =
+	"usage: usbip_loadgen [options]\n"
+	"\n"
+	"	-mMODE, --mode MODE\n"
+	"		Workload to run: devlist, import, urb.\n"
+	"		Default is devlist. urb keeps a device imported\n"
+	"		and reads its device descriptor over and over,\n"
+	"		or moves data on --endpoint.\n"
+	"\n"
+	"	-bBUSID[,BUSID...], --busid BUSID[,BUSID...]\n"
+	"		Device to import in the import and urb modes.\n"
+	"		Thread N takes the Nth of several, round robin.\n"
+	"\n"
+	"	-M, --mux\n"
+	"		Import all devices of --busid onto one connection\n"
+	"		per thread and run each window on every device.\n"
+	"\n"
+	"	-qNUM, --depth NUM\n"
+	"		Keep NUM transfers in flight in the urb mode.\n"
+	"		Default is 1.\n"
+	"\n"
+	"	-eEP, --endpoint EP\n"
+	"		Submit bulk transfers to endpoint address EP,\n"
+	"		e.g. 0x81, in the urb mode.\n"
+	"\n"
+	"	-lLEN, --length LEN\n"
+	"		Bytes per bulk transfer. Default is 18.\n"
+	"\n"
+	"	-wLEN, --wlength LEN\n"
+	"		Read the configuration descriptor on ep0 with a\n"
+	"		wLength of LEN, into a buffer of --length bytes\n"
+	"		which need not match it.\n"
+	"\n"
+	"	-kNUM, --streams NUM\n"
+	"		Negotiate bulk streams and spread each window\n"
+	"		over streams 1 to NUM.\n"
+	"\n"
+	"	-a[IF:]ALT, --alt [IF:]ALT\n"
+	"		Select alternate setting ALT of interface IF, 0 by\n"
+	"		default, after import, e.g. 1 for the UAS setting\n"
+	"		of a drive or 1:1 for the stream of a camera.\n"
+	"\n"
+	"	-PNUM, --packets NUM\n"
+	"		Submit isochronous transfers of NUM packets, each\n"
+	"		of --length / NUM bytes, to --endpoint.\n"
+	"\n"
+	"	-B, --batch\n"
+	"		Negotiate the batch extension and submit each\n"
+	"		window of transfers as one batch.\n"
+	"\n"
+	"	-z, --compress\n"
+	"		Negotiate compression, for a bulk --endpoint. OUT\n"
+	"		payloads go as is, wire_mb_per_sec tells what IN\n"
+	"		payloads took on the wire.\n"
+	"\n"
+	"	-u, --unlink\n"
+	"		Unlink each transfer of a window right after\n"
+	"		submitting it, and count a result that comes\n"
+	"		after the answer to its unlink as an error.\n"
+	"\n"
+	"	-K, --heartbeat\n"
+	"		Negotiate heartbeats, send USBIP_NOP during the\n"
+	"		pauses of --interval in the urb mode.\n"
+	"\n"
+	"	-iMSEC, --interval MSEC\n"
+	"		Pause MSEC between operations of a thread, e.g. to\n"
+	"		let usbipd release a device between imports.\n"
+	"\n"
+	"	-HHOST, --host HOST\n"
+	"		Connect to usbipd on HOST. Default is localhost.\n"
+	"\n"
+	"	-tPORT, --tcp-port PORT\n"
+	"		Connect to TCP/IP port PORT.\n"
+	"\n"
+	"	-UPATH, --unix PATH\n"
+	"		Connect to usbipd on the AF_UNIX socket PATH.\n"
+	"\n"
+	"	-S, --shm\n"
+	"		With --unix, move the urb mode traffic to the\n"
+	"		shared-memory rings of usbipd.\n"
+	"\n"
+	"	-cNUM, --concurrency NUM\n"
+	"		Run NUM client threads. Default is 1.\n"
+	"\n"
+	"	-nNUM, --count NUM\n"
+	"		Operations per thread, windows in the urb mode.\n"
+	"		Default is 1000.\n"
+	"\n"
+	"	-sSEC, --seconds SEC\n"
+	"		Run for SEC seconds instead of a fixed count.\n"
+	"\n"
+	"	-d, --debug\n"
+	"		Print debugging information.\n"
+	"\n"
+	"	-h, --help\n"
+	"		Print this help.\n";
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{"mode", required_argument, NULL, 'm'},
+		{"host", required_argument, NULL, 'H'},
+		{"busid", required_argument, NULL, 'b'},
+		{"mux", no_argument, NULL, 'M'},
+		{"depth", required_argument, NULL, 'q'},
+		{"batch", no_argument, NULL, 'B'},
+		{"compress", no_argument, NULL, 'z'},
+		{"endpoint", required_argument, NULL, 'e'},
+		{"length", required_argument, NULL, 'l'},
+		{"wlength", required_argument, NULL, 'w'},
+		{"streams", required_argument, NULL, 'k'},
+		{"alt", required_argument, NULL, 'a'},
+		{"packets", required_argument, NULL, 'P'},
+		{"heartbeat", no_argument, NULL, 'K'},
+		{"unlink", no_argument, NULL, 'u'},
+		{"interval", required_argument, NULL, 'i'},
+		{"tcp-port", required_argument, NULL, 't'},
+		{"unix", required_argument, NULL, 'U'},
+		{"shm", no_argument, NULL, 'S'},
+		{"concurrency", required_argument, NULL, 'c'},
+		{"count", required_argument, NULL, 'n'},
+		{"seconds", required_argument, NULL, 's'},
+		{"debug", no_argument, NULL, 'd'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	struct loadgen_thread *threads;
+	uint64_t start;
+	double seconds;
+	char *p;
+	int opt, i;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "m:H:b:Mq:Bze:l:w:k:a:P:Kui:t:U:Sc:n:s:dh", longopts, NULL);
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'm':
+			for (lg_mode = loadgen_modes; lg_mode->name; lg_mode++)
+				if (!strcmp(lg_mode->name, optarg))
+					break;
+			if (!lg_mode->name) {
+				err("unknown mode %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			lg_host = optarg;
+			break;
+		case 'U':
+			lg_unix = optarg;
+			break;
+		case 'S':
+			lg_shm = 1;
+			break;
+		case 'b':
+			for (p = strtok(optarg, ","); p && lg_nbusids < LG_MAX_DEVS;
+			     p = strtok(NULL, ","))
+				lg_busids[lg_nbusids++] = p;
+			break;
+		case 'M':
+			lg_mux = 1;
+			break;
+		case 'q':
+			lg_depth = atoi(optarg);
+			break;
+		case 'B':
+			lg_batch = 1;
+			break;
+		case 'z':
+			lg_compress = 1;
+			break;
+		case 'e':
+			lg_ep = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			lg_length = atoi(optarg);
+			break;
+		case 'w':
+			lg_wlength = atoi(optarg);
+			break;
+		case 'k':
+			lg_streams = atoi(optarg);
+			break;
+		case 'a':
+			p = strchr(optarg, ':');
+			if (p)
+				lg_alt_if = atoi(optarg);
+			lg_alt = atoi(p ? p + 1 : optarg);
+			break;
+		case 'P':
+			lg_packets = atoi(optarg);
+			break;
+		case 'K':
+			lg_heartbeat = 1;
+			break;
+		case 'u':
+			lg_unlink = 1;
+			break;
+		case 'i':
+			lg_interval = atoi(optarg);
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'c':
+			lg_threads = atoi(optarg);
+			break;
+		case 'n':
+			lg_count = atol(optarg);
+			break;
+		case 's':
+			lg_duration = atof(optarg);
+			break;
+		case 'd':
+			usbip_use_debug = 1;
+			break;
+		case 'h':
+		default:
+			printf("%s", loadgen_help_string);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (lg_threads <= 0)
+		lg_threads = 1;
+
+	if (lg_depth <= 0 || lg_depth > LG_MAX_DEPTH) {
+		err("depth must be within 1..%d", LG_MAX_DEPTH);
+		return EXIT_FAILURE;
+	}
+
+	if (lg_length < 0 || lg_length > LG_MAX_LENGTH) {
+		err("length must be within 0..%d", LG_MAX_LENGTH);
+		return EXIT_FAILURE;
+	}
+
+	if (lg_ep < 0 && (lg_streams || lg_packets ||
+			  (lg_length != LG_URB_LENGTH && lg_wlength < 0))) {
+		err("--streams, --packets and --length need --endpoint");
+		return EXIT_FAILURE;
+	}
+
+	if (lg_wlength > 0xffff || (lg_wlength >= 0 && lg_ep >= 0)) {
+		err("--wlength must be within 0..65535, without --endpoint");
+		return EXIT_FAILURE;
+	}
+
+	if (lg_packets < 0 || lg_packets > LG_MAX_PACKETS ||
+	    (lg_packets && lg_length % lg_packets)) {
+		err("packets must be within 0..%d and divide --length",
+		    LG_MAX_PACKETS);
+		return EXIT_FAILURE;
+	}
+
+	if (lg_unlink && lg_batch) {
+		err("--unlink takes no --batch");
+		return EXIT_FAILURE;
+	}
+
+	if (lg_packets && (lg_batch || lg_streams)) {
+		err("--packets takes neither --batch nor --streams");
+		return EXIT_FAILURE;
+	}
+
+	/* only bulk payloads are framed */
+	if (lg_compress && (lg_ep < 0 || lg_packets)) {
+		err("--compress needs a bulk --endpoint");
+		return EXIT_FAILURE;
+	}
+
+	if (lg_shm && !lg_unix) {
+		err("--shm needs --unix");
+		return EXIT_FAILURE;
+	}
+
+	if (lg_mode->run_one != run_devlist && !lg_nbusids) {
+		err("%s mode needs --busid", lg_mode->name);
+		return EXIT_FAILURE;
+	}
+
+	if (lg_mux && (lg_shm || lg_mode->run_one != run_urb)) {
+		err("--mux needs the urb mode and no --shm");
+		return EXIT_FAILURE;
+	}
+
+	threads = calloc(lg_threads, sizeof(*threads));
+	if (!threads)
+		return EXIT_FAILURE;
+
+	start = now_ns();
+	for (i = 0; i < lg_threads; i++) {
+		threads[i].busid = lg_busids[i % (lg_nbusids ? lg_nbusids : 1)];
+		if (pthread_create(&threads[i].thread, NULL,
+				   loadgen_thread_loop, threads + i)) {
+			err("start thread %d", i);
+			lg_threads = i;
+			break;
+		}
+	}
+
+	if (lg_duration > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t)lg_duration;
+		ts.tv_nsec = (long)((lg_duration - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+		lg_stop = 1;
+	}
+
+	for (i = 0; i < lg_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	seconds = (now_ns() - start) / 1e9;
+
+	report(threads, seconds);
+	free(threads);
+
+	return EXIT_SUCCESS;
+}
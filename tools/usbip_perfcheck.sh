@@ -0,0 +1,162 @@
+#!/bin/sh
+#
+# usbip_perfcheck.sh - runs fixed usbip_loadgen workloads against
+# usbipd_mock and compares the results with a checked-in baseline, so
+# that changes slowing down the data path are caught before they ship.
+#
+# Exits 1 when a result is worse than its baseline by more than its
+# tolerance, 2 when a workload could not run at all.
+#
+
+BUILD=build
+BASELINE=$(dirname "$0")/perf_baseline.txt
+PORT=3340
+UPDATE=0
+ONLY=
+
+usage() {
+	cat <<EOF
+usage: usbip_perfcheck.sh [options] [WORKLOAD...]
+
+	Runs the workloads, or all of them: hid_latency, bulk_throughput,
+	iso_stability, devlist_rate, attach_latency, ctrl_overrun and
+	unlink_shaped. Prints one line per result:
+	perf=WORKLOAD key= value= baseline= limit= result=
+
+	-B DIR	Directory with usbipd_mock and usbip_loadgen.
+		Default is ./build.
+	-f FILE	Baseline to compare with. Default is
+		tools/perf_baseline.txt.
+	-u	Write the results into the baseline instead, keeping
+		its tolerances; for a new reference machine.
+	-t PORT	TCP port for usbipd_mock. Default is 3340.
+	-h	Print this help.
+EOF
+}
+
+while getopts B:f:ut:h opt; do
+	case $opt in
+	B) BUILD=$OPTARG ;;
+	f) BASELINE=$OPTARG ;;
+	u) UPDATE=1 ;;
+	t) PORT=$OPTARG ;;
+	h) usage; exit 0 ;;
+	*) usage; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+ONLY="$*"
+
+USBIPD=$BUILD/usbipd_mock
+LOADGEN=$BUILD/usbip_loadgen
+for bin in "$USBIPD" "$LOADGEN"; do
+	if [ ! -x "$bin" ]; then
+		echo "usbip_perfcheck: $bin not found, see -B" >&2
+		exit 2
+	fi
+done
+if [ ! -r "$BASELINE" ]; then
+	echo "usbip_perfcheck: no baseline $BASELINE" >&2
+	exit 2
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/usbip_perfcheck.XXXXXX") || exit 2
+PID=
+
+cleanup() {
+	[ -n "$PID" ] && kill "$PID" 2>/dev/null && wait "$PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+# busids 1-1 to 1-5, in this order, the last one shaped to 1 Mbit/s
+USBIP_MOCK_DEVICES=mouse,uas,uvc,keyboard,acm "$USBIPD" -t "$PORT" \
+	-o 1-5:limit=1 > "$WORK/usbipd.log" 2>&1 &
+PID=$!
+
+# usbip_loadgen counts a refused connection as an error, not a failure
+tries=0
+until "$LOADGEN" -t "$PORT" -m devlist -n 1 2> /dev/null | grep -q ' ops=1 '; do
+	tries=$((tries + 1))
+	if [ $tries -ge 50 ] || ! kill -0 "$PID" 2>/dev/null; then
+		echo "usbip_perfcheck: usbipd_mock did not come up" >&2
+		cat "$WORK/usbipd.log" >&2
+		exit 2
+	fi
+	sleep 0.1
+done
+
+lg() {
+	"$LOADGEN" -t "$PORT" "$@" 2> /dev/null | grep '^mode='
+}
+
+# the key=value results of one workload, as "workload key value" lines
+run() {
+	case $1 in
+	hid_latency)
+		# a mouse reporting at 1 kHz, one poll at a time
+		lg -m urb -b 1-1 -e 0x81 -l 4 -n 1000 ;;
+	bulk_throughput)
+		# a UAS drive reading 64 KiB over 16 streams
+		lg -m urb -b 1-2 -a 1 -e 0x81 -l 65536 -q 16 -k 16 -s 3 ;;
+	iso_stability)
+		# a camera streaming 1 ms transfers, four queued
+		lg -m urb -b 1-3 -a 1:1 -e 0x81 -P 8 -l 24576 -q 4 -s 3 ;;
+	devlist_rate)
+		lg -m devlist -s 2 ;;
+	attach_latency)
+		lg -m import -b 1-4 -n 500 ;;
+	ctrl_overrun)
+		# descriptor reads with a wLength far beyond their buffer
+		lg -m urb -b 1-4 -w 4096 -l 9 -n 500 ;;
+	unlink_shaped)
+		# unlinks of results shaping still holds back
+		lg -m urb -b 1-5 -q 16 -u -n 200 ;;
+	esac | tr ' ' '\n' | sed -n "s/^\([a-z_0-9]*\)=\(.*\)$/$1 \1 \2/p"
+}
+
+workloads="hid_latency bulk_throughput iso_stability devlist_rate attach_latency
+	ctrl_overrun unlink_shaped"
+: > "$WORK/results"
+for w in $workloads; do
+	if [ -n "$ONLY" ] && ! echo " $ONLY " | grep -q " $w "; then
+		continue
+	fi
+	run "$w" > "$WORK/$w"
+	if [ ! -s "$WORK/$w" ]; then
+		echo "usbip_perfcheck: $w did not run" >&2
+		exit 2
+	fi
+	cat "$WORK/$w" >> "$WORK/results"
+done
+
+if [ $UPDATE = 1 ]; then
+	awk 'NR == FNR { v[$1 " " $2] = $3; next }
+	     /^#/ || NF < 5 || !(($1 " " $2) in v) { print; next }
+	     { printf "%-16s %-14s %-12s %-4s %s\n",
+		      $1, $2, v[$1 " " $2], $4, $5 }' \
+		"$WORK/results" "$BASELINE" > "$WORK/baseline" &&
+		cp "$WORK/baseline" "$BASELINE"
+	echo "usbip_perfcheck: updated $BASELINE"
+	exit 0
+fi
+
+# baseline lines: workload key value tolerance-% better (lower or higher)
+awk 'NR == FNR { v[$1 " " $2] = $3; next }
+     /^#/ || NF < 5 { next }
+     !(($1 " " $2) in v) { next }
+     {
+	value = v[$1 " " $2]
+	if ($5 == "higher") {
+		limit = $3 * (1 - $4 / 100)
+		bad = value < limit
+	} else {
+		limit = $3 * (1 + $4 / 100)
+		bad = value > limit
+	}
+	printf "perf=%s key=%s value=%s baseline=%s limit=%.1f result=%s\n",
+	       $1, $2, value, $3, limit, bad ? "REGRESSED" : "ok"
+	failed += bad
+     }
+     END { exit failed ? 1 : 0 }' "$WORK/results" "$BASELINE"
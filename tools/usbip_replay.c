@@ -0,0 +1,737 @@
+/*
+ * usbip_replay - plays the client side of a capture against a running
+ * usbipd and reports rates and latencies as key=value lines, compared
+ * with the capture and optionally with the report of an earlier run.
+ *
+ * Captures are the usbmon pcap files of usbipd --capture or of usbmon
+ * itself. Every transfer submitted in the capture is submitted again to
+ * the imported device, in order, at its original time scaled by --speed,
+ * and its result is checked against the recorded one.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "usbip_network.h"
+#include "usbip_capture.h"
+#include <usbip_debug.h>
+#include "stub_common.h"
+
+#define RP_MAX_LENGTH	(1 << 24)
+#define RP_MAX_ISO	1024
+#define RP_MAX_OPEN	1024
+
+struct replay_xfer {
+	uint64_t ts_ns;		/* submitted, since the first submit */
+	uint8_t ep;		/* address, with the IN bit */
+	uint8_t xfer_type;	/* as in usbmon */
+	uint8_t setup[8];
+	uint32_t length;
+	uint32_t flags;
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t niso;
+	uint32_t *iso_len;
+	unsigned char *out;	/* OUT data, zero-filled past the snaplen */
+
+	/* recorded result, if the capture has one */
+	int done;
+	int32_t status;
+	uint32_t actual;
+	uint64_t lat_ns;
+
+	/* of the current round */
+	uint64_t sent_ns;
+};
+
+struct replay_load {
+	struct replay_xfer *xfers;
+	size_t n, max;
+	uint64_t first_ns;
+	struct {
+		uint64_t id;
+		size_t idx;
+	} open[RP_MAX_OPEN];
+	int nopen;
+	int depth;		/* the most transfers open at once */
+};
+
+struct replay_stats {
+	uint64_t *lat_ns;
+	size_t nlat, maxlat;
+	uint64_t *lag_ns;	/* how late each submit went out */
+	size_t nlag, maxlag;
+	uint64_t errors;
+	uint64_t mismatches;
+	uint64_t bytes;
+};
+
+static const char *rp_host = "localhost";
+static const char *rp_busid;
+static const char *rp_file;
+static const char *rp_baseline;
+static double rp_speed = 1.0;
+static int rp_depth;
+static int rp_rounds = 1;
+
+static struct replay_load rp_load;
+static struct replay_stats rp_stats;
+static int rp_sockfd = -1;
+static uint32_t rp_devid;
+static int rp_inflight;
+static int rp_failed;
+static pthread_mutex_t rp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rp_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int u64_add(uint64_t **v, size_t *n, size_t *max, uint64_t x)
+{
+	if (*n == *max) {
+		size_t m = *max ? *max * 2 : 4096;
+		uint64_t *p = realloc(*v, m * sizeof(*p));
+
+		if (!p)
+			return -1;
+		*v = p;
+		*max = m;
+	}
+	(*v)[(*n)++] = x;
+	return 0;
+}
+
+static int xfer_in(const struct replay_xfer *x)
+{
+	if (x->xfer_type == 2)
+		return x->setup[0] & USB_DIR_IN;
+	return x->ep & USB_DIR_IN;
+}
+
+static int load_submit(struct replay_load *ld,
+		       const struct usbip_usbmon_packet *pkt,
+		       const struct usbip_usbmon_iso *iso,
+		       const unsigned char *data)
+{
+	uint64_t ts = (uint64_t)pkt->ts_sec * 1000000000ULL +
+		(uint64_t)pkt->ts_usec * 1000;
+	struct replay_xfer *x;
+	uint32_t i;
+
+	if (pkt->length > RP_MAX_LENGTH || (pkt->xfer_type == 0 &&
+	    (uint32_t)pkt->s.iso.numdesc > RP_MAX_ISO)) {
+		err("transfer of %u bytes too large to replay", pkt->length);
+		return -1;
+	}
+	if (ld->nopen == RP_MAX_OPEN) {
+		err("more than %d transfers open in the capture", RP_MAX_OPEN);
+		return -1;
+	}
+
+	if (ld->n == ld->max) {
+		size_t m = ld->max ? ld->max * 2 : 1024;
+		struct replay_xfer *p = realloc(ld->xfers, m * sizeof(*p));
+
+		if (!p)
+			return -1;
+		ld->xfers = p;
+		ld->max = m;
+	}
+	if (!ld->n)
+		ld->first_ns = ts;
+
+	x = &ld->xfers[ld->n];
+	memset(x, 0, sizeof(*x));
+	x->ts_ns = ts >= ld->first_ns ? ts - ld->first_ns : 0;
+	x->ep = pkt->epnum;
+	x->xfer_type = pkt->xfer_type;
+	x->length = pkt->length;
+	x->flags = pkt->xfer_flags;
+	x->interval = pkt->interval;
+	x->start_frame = pkt->start_frame;
+	if (x->xfer_type == 2)
+		memcpy(x->setup, pkt->s.setup, 8);
+
+	if (x->xfer_type == 0) {
+		x->niso = pkt->s.iso.numdesc;
+		x->iso_len = calloc(x->niso + 1, sizeof(*x->iso_len));
+		if (!x->iso_len)
+			return -1;
+		for (i = 0; i < x->niso && i < pkt->ndesc; i++)
+			x->iso_len[i] = iso[i].length;
+		/* packets past the snaplen share out what is left */
+		for (; i < x->niso; i++)
+			x->iso_len[i] = x->length / x->niso;
+	}
+
+	if (!xfer_in(x) && x->length) {
+		x->out = calloc(1, x->length);
+		if (!x->out)
+			return -1;
+		memcpy(x->out, data, pkt->len_cap < x->length ?
+		       pkt->len_cap : x->length);
+	}
+
+	ld->open[ld->nopen].id = pkt->id;
+	ld->open[ld->nopen].idx = ld->n;
+	ld->nopen++;
+	if (ld->nopen > ld->depth)
+		ld->depth = ld->nopen;
+	ld->n++;
+	return 0;
+}
+
+static int load_event(void *arg, const struct usbip_usbmon_packet *pkt,
+		      const struct usbip_usbmon_iso *iso,
+		      const unsigned char *data)
+{
+	struct replay_load *ld = (struct replay_load *)arg;
+	struct replay_xfer *x;
+	uint64_t ts;
+	int i;
+
+	if (pkt->type == 'S')
+		return load_submit(ld, pkt, iso, data);
+
+	/* C or E closes the latest open transfer of that id */
+	for (i = ld->nopen - 1; i >= 0; i--) {
+		if (ld->open[i].id == pkt->id)
+			break;
+	}
+	if (i < 0)
+		return 0;
+
+	x = &ld->xfers[ld->open[i].idx];
+	ld->open[i] = ld->open[--ld->nopen];
+	if (pkt->type != 'C')
+		return 0;
+
+	ts = (uint64_t)pkt->ts_sec * 1000000000ULL +
+		(uint64_t)pkt->ts_usec * 1000 - ld->first_ns;
+	x->done = 1;
+	x->status = pkt->status;
+	x->actual = pkt->length;
+	if (x->niso && pkt->ndesc == x->niso) {
+		/* usbmon counts the extent of the packets, usbip their sum */
+		for (x->actual = 0, i = 0; i < (int)x->niso; i++)
+			x->actual += iso[i].length;
+	}
+	x->lat_ns = ts > x->ts_ns ? ts - x->ts_ns : 0;
+	return 0;
+}
+
+static int connect_server(void)
+{
+	struct addrinfo hints, *res, *ai;
+	int sockfd = -1;
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(rp_host, usbip_port_string, &hints, &res);
+	if (rc) {
+		err("getaddrinfo: %s: %s", rp_host, usbip_net_gai_strerror(rc));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		sockfd = socket(ai->ai_family, ai->ai_socktype,
+				ai->ai_protocol);
+		if (sockfd < 0)
+			continue;
+		if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (sockfd < 0) {
+		err("connect to %s: %s", rp_host, strerror(errno));
+		return -1;
+	}
+	usbip_net_set_nodelay(sockfd);
+	return sockfd;
+}
+
+static int import_device(int sockfd, const char *busid,
+			 struct usbip_usb_device *udev)
+{
+	struct op_import_request req;
+	uint16_t code = OP_REP_IMPORT;
+
+	memset(&req, 0, sizeof(req));
+	strncpy(req.busid, busid, SYSFS_BUS_ID_SIZE - 1);
+
+	if (usbip_net_send_op_common(sockfd, OP_REQ_IMPORT, 0) < 0)
+		return -1;
+	if (usbip_net_send(sockfd, &req, sizeof(req)) < 0)
+		return -1;
+	if (usbip_net_recv_op_common(sockfd, &code) < 0) {
+		err("import of %s failed", busid);
+		return -1;
+	}
+	if (usbip_net_recv(sockfd, udev, sizeof(*udev)) != sizeof(*udev))
+		return -1;
+	PACK_OP_IMPORT_REPLY(0, (*udev));
+	return 0;
+}
+
+/* the submit and result headers are 32-bit words up to the setup packet */
+static void urb_header_endian(struct usbip_header *pdu, int send)
+{
+	unsigned char *p = (unsigned char *)pdu;
+	size_t off;
+	uint32_t w;
+
+	for (off = 0; off < offsetof(struct usbip_header, u.cmd_submit.setup);
+	     off += 4) {
+		memcpy(&w, p + off, 4);
+		w = send ? htonl(w) : ntohl(w);
+		memcpy(p + off, &w, 4);
+	}
+}
+
+static int send_xfer(const struct replay_xfer *x, uint32_t seqnum)
+{
+	struct usbip_header pdu;
+	struct usbip_iso_packet_descriptor desc;
+	uint32_t i, offset = 0;
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.base.command = USBIP_CMD_SUBMIT;
+	pdu.base.seqnum = seqnum;
+	pdu.base.devid = rp_devid;
+	pdu.base.direction = xfer_in(x) ? USBIP_DIR_IN : USBIP_DIR_OUT;
+	pdu.base.ep = x->ep & USB_ENDPOINT_NUMBER_MASK;
+	pdu.u.cmd_submit.transfer_flags = x->flags;
+	pdu.u.cmd_submit.transfer_buffer_length = x->length;
+	pdu.u.cmd_submit.start_frame = x->start_frame;
+	pdu.u.cmd_submit.number_of_packets = x->niso;
+	pdu.u.cmd_submit.interval = x->interval;
+	memcpy(pdu.u.cmd_submit.setup, x->setup, 8);
+	urb_header_endian(&pdu, 1);
+
+	if (usbip_net_send(rp_sockfd, &pdu, sizeof(pdu)) < 0)
+		return -1;
+	if (x->out && usbip_net_send(rp_sockfd, x->out, x->length) < 0)
+		return -1;
+
+	for (i = 0; i < x->niso; i++) {
+		desc.offset = htonl(offset);
+		desc.length = htonl(x->iso_len[i]);
+		desc.actual_length = 0;
+		desc.status = 0;
+		offset += x->iso_len[i];
+		if (usbip_net_send(rp_sockfd, &desc, sizeof(desc)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int recv_discard(size_t len)
+{
+	unsigned char buf[4096];
+	size_t n;
+
+	while (len > 0) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if (usbip_net_recv(rp_sockfd, buf, n) != (ssize_t)n)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/* reads the results of the round until all n of them are in */
+static void *replay_receiver(void *arg)
+{
+	struct usbip_header pdu;
+	struct replay_xfer *x;
+	uint64_t now;
+	size_t n = rp_load.n;
+	int32_t actual;
+
+	(void)arg;
+	for (;;) {
+		if (usbip_net_recv(rp_sockfd, &pdu, sizeof(pdu)) !=
+		    sizeof(pdu))
+			break;
+		now = now_ns();
+		urb_header_endian(&pdu, 0);
+		if (pdu.base.command == USBIP_NOP)
+			continue;
+		if (pdu.base.command != USBIP_RET_SUBMIT || !pdu.base.seqnum) {
+			err("unexpected pdu %u", pdu.base.command);
+			break;
+		}
+
+		x = &rp_load.xfers[(pdu.base.seqnum - 1) % n];
+		actual = pdu.u.ret_submit.actual_length;
+		if (actual < 0 || (uint32_t)actual > x->length)
+			break;
+		if (xfer_in(x) && recv_discard(actual) < 0)
+			break;
+		if (x->niso && recv_discard(x->niso *
+				sizeof(struct usbip_iso_packet_descriptor)) < 0)
+			break;
+
+		pthread_mutex_lock(&rp_lock);
+		u64_add(&rp_stats.lat_ns, &rp_stats.nlat, &rp_stats.maxlat,
+			now - x->sent_ns);
+		rp_stats.bytes += actual;
+		if (pdu.u.ret_submit.status)
+			rp_stats.errors++;
+		if (x->done && (pdu.u.ret_submit.status != x->status ||
+				(uint32_t)actual != x->actual)) {
+			rp_stats.mismatches++;
+			dbg("seqnum %u ep %#x: status %d length %d, "
+			    "recorded %d %u", pdu.base.seqnum, x->ep,
+			    pdu.u.ret_submit.status, actual, x->status,
+			    x->actual);
+		}
+		rp_inflight--;
+		pthread_cond_signal(&rp_cond);
+		pthread_mutex_unlock(&rp_lock);
+	}
+
+	pthread_mutex_lock(&rp_lock);
+	rp_failed = 1;
+	pthread_cond_signal(&rp_cond);
+	pthread_mutex_unlock(&rp_lock);
+	return NULL;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+/* submit every transfer of every round, then wait for the last result */
+static int replay_run(uint64_t start)
+{
+	struct replay_xfer *x;
+	uint64_t span, due, now;
+	uint32_t seqnum = 0;
+	size_t i;
+	int r;
+
+	/* rounds follow each other a millisecond apart */
+	span = rp_load.xfers[rp_load.n - 1].ts_ns + 1000000;
+
+	for (r = 0; r < rp_rounds; r++) {
+		for (i = 0; i < rp_load.n; i++) {
+			x = &rp_load.xfers[i];
+			due = start;
+			if (rp_speed > 0) {
+				due += (uint64_t)((r * span + x->ts_ns) /
+						  rp_speed);
+				sleep_until(due);
+			}
+
+			pthread_mutex_lock(&rp_lock);
+			while (rp_inflight >= rp_depth && !rp_failed)
+				pthread_cond_wait(&rp_cond, &rp_lock);
+			if (rp_failed) {
+				pthread_mutex_unlock(&rp_lock);
+				return -1;
+			}
+			rp_inflight++;
+			now = now_ns();
+			x->sent_ns = now;
+			if (rp_speed > 0)
+				u64_add(&rp_stats.lag_ns, &rp_stats.nlag,
+					&rp_stats.maxlag, now - due);
+			pthread_mutex_unlock(&rp_lock);
+
+			if (send_xfer(x, ++seqnum) < 0)
+				return -1;
+		}
+	}
+
+	pthread_mutex_lock(&rp_lock);
+	while (rp_inflight > 0 && !rp_failed)
+		pthread_cond_wait(&rp_cond, &rp_lock);
+	pthread_mutex_unlock(&rp_lock);
+	return rp_inflight ? -1 : 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+#define RP_P(v, n, pct)	((v)[((n) * (pct)) / 100] / 1000.0)
+
+/* the figures compared with a baseline, lower or higher is better */
+static const struct {
+	const char *key;
+	int higher;
+} replay_figures[] = {
+	{"ops_per_sec", 1},
+	{"mb_per_sec", 1},
+	{"lat_p50_us", 0},
+	{"lat_p99_us", 0},
+	{"lat_max_us", 0},
+	{NULL, 0}
+};
+
+static int report_value(const char *line, const char *key, double *value)
+{
+	size_t len = strlen(key);
+	const char *p;
+
+	for (p = line; (p = strstr(p, key)); p += len) {
+		if ((p == line || p[-1] == ' ') && p[len] == '=') {
+			*value = atof(p + len + 1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* percent changes of this run from the report line in rp_baseline */
+static void report_baseline(const char *line)
+{
+	char base[1024];
+	double was, now;
+	FILE *fp;
+	int i;
+
+	fp = fopen(rp_baseline, "r");
+	if (!fp) {
+		err("open baseline %s: %s", rp_baseline, strerror(errno));
+		return;
+	}
+	while (fgets(base, sizeof(base), fp) &&
+	       strncmp(base, "mode=replay ", 12))
+		;
+	fclose(fp);
+	if (strncmp(base, "mode=replay ", 12)) {
+		err("no replay report in %s", rp_baseline);
+		return;
+	}
+
+	printf("mode=delta");
+	for (i = 0; replay_figures[i].key; i++) {
+		if (report_value(base, replay_figures[i].key, &was) < 0 ||
+		    report_value(line, replay_figures[i].key, &now) < 0 ||
+		    was == 0)
+			continue;
+		printf(" %s=%+.1f%%", replay_figures[i].key,
+		       (now - was) * 100 / was);
+	}
+	printf("\n");
+}
+
+static void report(double seconds)
+{
+	struct replay_stats *s = &rp_stats;
+	uint64_t *rec = NULL;
+	size_t nrec = 0, maxrec = 0, i;
+	char line[1024];
+	int len;
+
+	for (i = 0; i < rp_load.n; i++) {
+		if (rp_load.xfers[i].done)
+			u64_add(&rec, &nrec, &maxrec, rp_load.xfers[i].lat_ns);
+	}
+	qsort(s->lat_ns, s->nlat, sizeof(*s->lat_ns), cmp_u64);
+	qsort(s->lag_ns, s->nlag, sizeof(*s->lag_ns), cmp_u64);
+	qsort(rec, nrec, sizeof(*rec), cmp_u64);
+
+	len = snprintf(line, sizeof(line),
+		"mode=replay transfers=%zu rounds=%d depth=%d speed=%g "
+		"ops=%zu errors=%llu mismatches=%llu seconds=%.3f "
+		"ops_per_sec=%.1f mb_per_sec=%.1f",
+		rp_load.n, rp_rounds, rp_depth, rp_speed, s->nlat,
+		(unsigned long long)s->errors,
+		(unsigned long long)s->mismatches, seconds,
+		seconds > 0 ? s->nlat / seconds : 0.0,
+		seconds > 0 ? s->bytes / seconds / 1e6 : 0.0);
+	if (s->nlat)
+		len += snprintf(line + len, sizeof(line) - len,
+			" lat_p50_us=%.1f lat_p99_us=%.1f lat_max_us=%.1f",
+			RP_P(s->lat_ns, s->nlat, 50),
+			RP_P(s->lat_ns, s->nlat, 99),
+			s->lat_ns[s->nlat - 1] / 1000.0);
+	if (nrec)
+		len += snprintf(line + len, sizeof(line) - len,
+			" rec_lat_p50_us=%.1f rec_lat_p99_us=%.1f"
+			" rec_lat_max_us=%.1f",
+			RP_P(rec, nrec, 50), RP_P(rec, nrec, 99),
+			rec[nrec - 1] / 1000.0);
+	if (s->nlag)
+		snprintf(line + len, sizeof(line) - len,
+			 " lag_p99_us=%.1f", RP_P(s->lag_ns, s->nlag, 99));
+	printf("%s\n", line);
+
+	if (rp_baseline)
+		report_baseline(line);
+	free(rec);
+}
+
+static const char replay_help_string[] =
+	"usage: usbip_replay [options] -f FILE -b BUSID\n"
+	"\n"
+	"	-fFILE, --file FILE\n"
+	"		usbmon capture to replay, e.g. of usbipd --capture.\n"
+	"\n"
+	"	-bBUSID, --busid BUSID\n"
+	"		Device to import and replay the capture on.\n"
+	"\n"
+	"	-xFACTOR, --speed FACTOR\n"
+	"		Submit at the original times sped up by FACTOR,\n"
+	"		0 for as fast as --depth allows. Default is 1.\n"
+	"\n"
+	"	-qNUM, --depth NUM\n"
+	"		Keep at most NUM transfers in flight. Default is\n"
+	"		the most the capture had in flight.\n"
+	"\n"
+	"	-nNUM, --rounds NUM\n"
+	"		Replay the capture NUM times. Default is 1.\n"
+	"\n"
+	"	-rFILE, --baseline FILE\n"
+	"		Also print the change of rates and latencies from\n"
+	"		the report of an earlier run saved in FILE.\n"
+	"\n"
+	"	-HHOST, --host HOST\n"
+	"		Connect to usbipd on HOST. Default is localhost.\n"
+	"\n"
+	"	-tPORT, --tcp-port PORT\n"
+	"		Connect to TCP/IP port PORT.\n"
+	"\n"
+	"	-d, --debug\n"
+	"		Print debugging information, e.g. each result\n"
+	"		that differs from the capture.\n"
+	"\n"
+	"	-h, --help\n"
+	"		Print this help.\n";
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{"file", required_argument, NULL, 'f'},
+		{"busid", required_argument, NULL, 'b'},
+		{"speed", required_argument, NULL, 'x'},
+		{"depth", required_argument, NULL, 'q'},
+		{"rounds", required_argument, NULL, 'n'},
+		{"baseline", required_argument, NULL, 'r'},
+		{"host", required_argument, NULL, 'H'},
+		{"tcp-port", required_argument, NULL, 't'},
+		{"debug", no_argument, NULL, 'd'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	struct usbip_usb_device udev;
+	pthread_t receiver;
+	uint64_t start;
+	int opt, ret;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "f:b:x:q:n:r:H:t:dh", longopts,
+				  NULL);
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'f':
+			rp_file = optarg;
+			break;
+		case 'b':
+			rp_busid = optarg;
+			break;
+		case 'x':
+			rp_speed = atof(optarg);
+			break;
+		case 'q':
+			rp_depth = atoi(optarg);
+			break;
+		case 'n':
+			rp_rounds = atoi(optarg);
+			break;
+		case 'r':
+			rp_baseline = optarg;
+			break;
+		case 'H':
+			rp_host = optarg;
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'd':
+			usbip_use_debug = 1;
+			break;
+		case 'h':
+		default:
+			printf("%s", replay_help_string);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (!rp_file || !rp_busid) {
+		err("--file and --busid are needed");
+		return EXIT_FAILURE;
+	}
+	if (rp_speed < 0 || rp_rounds <= 0) {
+		err("--speed must not be negative, --rounds positive");
+		return EXIT_FAILURE;
+	}
+
+	if (usbip_capture_load(rp_file, load_event, &rp_load) < 0)
+		return EXIT_FAILURE;
+	if (!rp_load.n) {
+		err("no transfers in %s", rp_file);
+		return EXIT_FAILURE;
+	}
+	if (rp_depth <= 0)
+		rp_depth = rp_load.depth;
+	info("%zu transfers over %.3f s, up to %d in flight", rp_load.n,
+	     rp_load.xfers[rp_load.n - 1].ts_ns / 1e9, rp_load.depth);
+
+	rp_sockfd = connect_server();
+	if (rp_sockfd < 0)
+		return EXIT_FAILURE;
+	if (import_device(rp_sockfd, rp_busid, &udev) < 0)
+		return EXIT_FAILURE;
+	rp_devid = (udev.busnum << 16) | udev.devnum;
+
+	if (pthread_create(&receiver, NULL, replay_receiver, NULL)) {
+		err("start receiver");
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	ret = replay_run(start);
+	report((now_ns() - start) / 1e9);
+
+	shutdown(rp_sockfd, SHUT_RDWR);
+	pthread_join(receiver, NULL);
+	close(rp_sockfd);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}